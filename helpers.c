@@ -202,6 +202,19 @@ mdict_delete_s(struct mobject *dict, const char *key)
 	return r;
 }
 
+int
+mdict_delete_i(struct mobject *dict, int64_t key)
+{
+	struct mobject *tmp;
+	int r;
+
+	if ((tmp = mint_new(key)) == NULL)
+		return -1;
+	r = mdict_delete(dict, tmp);
+	mobject_free(tmp);
+	return r;
+}
+
 struct mobject *
 mdict_insert_s(struct mobject *dict, const char *key, struct mobject *value)
 {
@@ -216,6 +229,20 @@ mdict_insert_s(struct mobject *dict, const char *key, struct mobject *value)
 	return tmp;
 }
 
+struct mobject *
+mdict_insert_i(struct mobject *dict, int64_t key, struct mobject *value)
+{
+	struct mobject *tmp;
+
+	if ((tmp = mint_new(key)) == NULL)
+		return NULL;
+	if (mdict_insert(dict, tmp, value) == -1) {
+		mobject_free(tmp);
+		return NULL;
+	}
+	return tmp;
+}
+
 struct mobject *
 mdict_insert_ss(struct mobject *dict, const char *key, const char *value)
 {
@@ -300,6 +327,20 @@ mdict_replace_s(struct mobject *dict, const char *key, struct mobject *value)
 	return tmp;
 }
 
+struct mobject *
+mdict_replace_i(struct mobject *dict, int64_t key, struct mobject *value)
+{
+	struct mobject *tmp;
+
+	if ((tmp = mint_new(key)) == NULL)
+		return NULL;
+	if (mdict_replace(dict, tmp, value) == -1) {
+		mobject_free(tmp);
+		return NULL;
+	}
+	return tmp;
+}
+
 struct mobject *
 mdict_replace_ss(struct mobject *dict, const char *key, const char *value)
 {
@@ -0,0 +1,740 @@
+/*
+ * Copyright (c) 2007 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* $Id$ */
+
+/* Columnar loading of CSV and TSV data */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mobject.h"
+
+/* Inputs smaller than this per thread are not worth splitting */
+#define MCSV_MIN_CHUNK		(1024 * 1024)
+
+/* Upper limit on the number of parsing threads */
+#define MCSV_MAX_THREADS	64
+
+/* Maximum input size */
+#define MCSV_MAX_LEN		((size_t)16 * 1024 * 1024 * 1024)
+
+/*
+ * A column as it is being built: integers for as long as every value is
+ * an integer in canonical form (so it could be turned back into exactly
+ * the original text), strings after that.
+ */
+struct csv_column {
+	struct mobject *ints;
+	struct mobject *strs;
+};
+
+/* A run of whole records, parsed by a single thread */
+struct csv_chunk {
+	const char *start, *end;
+	int flags;
+	size_t ncols;
+	struct csv_column *cols;
+	size_t nrecords;
+	char *scratch;			/* For unescaping quoted fields */
+	size_t scratch_len;
+	char err[256];			/* Set on failure */
+};
+
+static void
+format_err(char *ebuf, size_t elen, const char *fmt, ...)
+{
+	va_list args;
+
+	if (ebuf == NULL || elen == 0)
+		return;
+	va_start(args, fmt);
+	vsnprintf(ebuf, elen, fmt, args);
+	va_end(args);
+}
+
+/* Parse a canonically formatted integer, i.e. as "%lld" would print it */
+static int
+parse_int(const char *p, size_t len, int64_t *vp)
+{
+	u_int64_t v = 0, lim = INT64_MAX;
+	size_t i = 0;
+	u_int d;
+
+	if (len > 0 && p[0] == '-') {
+		lim = (u_int64_t)INT64_MAX + 1;
+		i = 1;
+	}
+	if (i >= len || len - i > 19 || (p[i] == '0' && (len > 1)))
+		return -1;
+	for (; i < len; i++) {
+		if (p[i] < '0' || p[i] > '9')
+			return -1;
+		d = p[i] - '0';
+		if (v > (lim - d) / 10)
+			return -1;
+		v = v * 10 + d;
+	}
+	*vp = p[0] == '-' ? -(int64_t)(v - 1) - 1 : (int64_t)v;
+	return 0;
+}
+
+/* Give up on a column being integers, reformatting the values so far */
+static int
+column_to_strings(struct csv_column *col)
+{
+	char buf[32];
+	size_t i, n;
+	int64_t v;
+	int l;
+
+	if ((col->strs = marray_new_strings()) == NULL)
+		return -1;
+	if (col->ints == NULL)
+		return 0;
+	n = marray_len(col->ints);
+	for (i = 0; i < n; i++) {
+		if (marray_get_int64(col->ints, i, &v) != 0)
+			return -1;
+		l = snprintf(buf, sizeof(buf), "%lld", (long long)v);
+		if (marray_append_str(col->strs, buf, l) != 0)
+			return -1;
+	}
+	mobject_free(col->ints);
+	col->ints = NULL;
+	return 0;
+}
+
+static int
+column_append(struct csv_column *col, const char *p, size_t len)
+{
+	int64_t v;
+
+	if (col->strs == NULL) {
+		if (parse_int(p, len, &v) == 0) {
+			if (col->ints == NULL &&
+			    (col->ints = marray_new_int64()) == NULL)
+				return -1;
+			return marray_append_int64(col->ints, v);
+		}
+		if (column_to_strings(col) != 0)
+			return -1;
+	}
+	return marray_append_str(col->strs, p, len);
+}
+
+static void
+column_free(struct csv_column *col)
+{
+	if (col->ints != NULL)
+		mobject_free(col->ints);
+	if (col->strs != NULL)
+		mobject_free(col->strs);
+	col->ints = col->strs = NULL;
+}
+
+/* Find the first of two characters in a range, or "end" */
+static const char *
+find2(const char *p, const char *end, char a, char b)
+{
+	const char *pa, *pb;
+
+	pa = memchr(p, a, end - p);
+	pb = memchr(p, b, (pa == NULL ? end : pa) - p);
+	if (pb != NULL)
+		return pb;
+	return pa == NULL ? end : pa;
+}
+
+/*
+ * Parse a field starting at "*pp", returning it via "fp" and "lenp" and
+ * leaving "*pp" at the separator or newline that ended it (or "end").
+ */
+static int
+parse_field(struct csv_chunk *c, const char **pp, const char *end,
+    const char **fp, size_t *lenp)
+{
+	const char *p = *pp, *q;
+	char sep = (c->flags & MCSV_TSV) ? '\t' : ',';
+	size_t n;
+	char *tmp;
+
+	if ((c->flags & MCSV_TSV) || p >= end || *p != '"') {
+		q = find2(p, end, sep, '\n');
+		*fp = p;
+		*lenp = q - p;
+		/* Tolerate CRLF line endings */
+		if (q < end && *q == '\n' && q > p && q[-1] == '\r')
+			(*lenp)--;
+		*pp = q;
+		return 0;
+	}
+	/* Quoted field; doubled quotes within it stand for one quote */
+	p++;
+	if ((q = memchr(p, '"', end - p)) == NULL) {
+		snprintf(c->err, sizeof(c->err), "Unterminated quoted field");
+		return -1;
+	}
+	if (q + 1 >= end || q[1] != '"') {
+		*fp = p;
+		*lenp = q - p;
+	} else {
+		for (n = 0;;) {
+			if (n + (q - p) + 1 > c->scratch_len) {
+				if ((tmp = realloc(c->scratch,
+				    (n + (q - p) + 1) * 2)) == NULL) {
+					snprintf(c->err, sizeof(c->err),
+					    "Out of memory");
+					return -1;
+				}
+				c->scratch = tmp;
+				c->scratch_len = (n + (q - p) + 1) * 2;
+			}
+			memcpy(c->scratch + n, p, q - p);
+			n += q - p;
+			if (q + 1 >= end || q[1] != '"')
+				break;
+			c->scratch[n++] = '"';
+			p = q + 2;
+			if ((q = memchr(p, '"', end - p)) == NULL) {
+				snprintf(c->err, sizeof(c->err),
+				    "Unterminated quoted field");
+				return -1;
+			}
+		}
+		*fp = c->scratch;
+		*lenp = n;
+	}
+	p = q + 1;
+	if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n')
+		p++;
+	if (p < end && *p != sep && *p != '\n') {
+		snprintf(c->err, sizeof(c->err),
+		    "Garbage after quoted field");
+		return -1;
+	}
+	*pp = p;
+	return 0;
+}
+
+/*
+ * Parse one record, passing each field to column_append(). If "cols" is
+ * NULL, fields are appended to the single column "*cols" regardless of
+ * their number (for the header). Returns the number of fields or -1.
+ */
+static ssize_t
+parse_record(struct csv_chunk *c, const char **pp, const char *end,
+    struct csv_column *cols, size_t ncols)
+{
+	const char *f;
+	size_t flen, n;
+
+	for (n = 0;; n++) {
+		if (parse_field(c, pp, end, &f, &flen) != 0)
+			return -1;
+		if (ncols == 0) {
+			if (marray_append_str(cols->strs, f, flen) != 0)
+				goto oom;
+		} else if (n < ncols && column_append(&cols[n], f, flen) != 0)
+			goto oom;
+		if (*pp >= end || **pp == '\n')
+			break;
+		(*pp)++;
+	}
+	if (*pp < end)
+		(*pp)++;
+	return n + 1;
+ oom:
+	snprintf(c->err, sizeof(c->err), "Out of memory");
+	return -1;
+}
+
+static void *
+parse_chunk(void *arg)
+{
+	struct csv_chunk *c = (struct csv_chunk *)arg;
+	const char *p = c->start;
+	ssize_t n;
+
+	while (p < c->end) {
+		/* Skip blank lines */
+		if (*p == '\n' || (*p == '\r' && p + 1 < c->end &&
+		    p[1] == '\n')) {
+			p += *p == '\n' ? 1 : 2;
+			continue;
+		}
+		if ((n = parse_record(c, &p, c->end, c->cols, c->ncols)) < 0)
+			return NULL;
+		if ((size_t)n != c->ncols) {
+			snprintf(c->err, sizeof(c->err),
+			    "Record has %zd fields, expected %zu",
+			    n, c->ncols);
+			return NULL;
+		}
+		c->nrecords++;
+	}
+	return NULL;
+}
+
+/*
+ * Update "*quotedp" for the quote at "q", in the same way as parse_field()
+ * would: a quote opens a quoted field only at the start of a field, and
+ * within one, doubled quotes stand for a quote rather than ending it.
+ * Returns the last byte that was used.
+ */
+static const char *
+quote_state(const char *from, const char *q, const char *end, u_int *quotedp)
+{
+	if (*quotedp) {
+		if (q + 1 < end && q[1] == '"')
+			return q + 1;
+		*quotedp = 0;
+	} else if (q == from || q[-1] == ',' || q[-1] == '\n')
+		*quotedp = 1;
+	return q;
+}
+
+/*
+ * Find the start of the first record at or after "p", tracking whether
+ * we are within a quoted field from "from" (which is known to be at the
+ * start of a record).
+ */
+static const char *
+record_boundary(const char *from, const char *p, const char *end,
+    int flags)
+{
+	const char *q, *s = p;
+	u_int quoted = 0;
+
+	if (flags & MCSV_TSV) {
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			return end;
+		return q + 1;
+	}
+	/* Only the quotes need be looked at to tell if "p" is quoted */
+	for (q = from; q < p && (q = memchr(q, '"', p - q)) != NULL; q++) {
+		if ((q = quote_state(from, q, end, &quoted)) >= p)
+			s = q + 1;
+	}
+	for (q = s; (q = find2(q, end, '"', '\n')) < end; q++) {
+		if (*q == '"')
+			q = quote_state(from, q, end, &quoted);
+		else if (!quoted)
+			return q + 1;
+	}
+	return end;
+}
+
+static void
+chunk_free(struct csv_chunk *c)
+{
+	size_t i;
+
+	if (c->cols != NULL) {
+		for (i = 0; i < c->ncols; i++)
+			column_free(&c->cols[i]);
+		free(c->cols);
+	}
+	free(c->scratch);
+	c->cols = NULL;
+	c->scratch = NULL;
+}
+
+/* Append the values of column "src" to "dst", freeing "src" */
+static int
+column_merge(struct csv_column *dst, struct csv_column *src)
+{
+	const u_int8_t *s;
+	size_t i, n, len;
+	int64_t v;
+
+	if (dst->strs != NULL && src->strs == NULL &&
+	    column_to_strings(src) != 0)
+		return -1;
+	if (dst->strs == NULL && src->strs != NULL &&
+	    column_to_strings(dst) != 0)
+		return -1;
+	if (dst->strs != NULL) {
+		n = marray_len(src->strs);
+		for (i = 0; i < n; i++) {
+			if (marray_get_str(src->strs, i, &s, &len) != 0 ||
+			    marray_append_str(dst->strs, s, len) != 0)
+				return -1;
+		}
+	} else if (src->ints != NULL) {
+		if (dst->ints == NULL) {
+			dst->ints = src->ints;
+			src->ints = NULL;
+			return 0;
+		}
+		n = marray_len(src->ints);
+		for (i = 0; i < n; i++) {
+			if (marray_get_int64(src->ints, i, &v) != 0 ||
+			    marray_append_int64(dst->ints, v) != 0)
+				return -1;
+		}
+	}
+	column_free(src);
+	return 0;
+}
+
+struct mobject *
+mcsv_parse(const char *data, size_t len, int flags, u_int nthreads,
+    char *ebuf, size_t elen)
+{
+	struct csv_chunk hdr, *chunks = NULL;
+	struct csv_column header;
+	struct mobject *ret = NULL, *k;
+	pthread_t *tids = NULL;
+	u_int8_t *started = NULL;
+	const char *p = data, *end = data + len, *q;
+	const u_int8_t *name;
+	size_t i, j, ncols, nlen, nrecords;
+	long ncpu;
+
+	bzero(&hdr, sizeof(hdr));
+	bzero(&header, sizeof(header));
+	hdr.flags = flags;
+	if (len > MCSV_MAX_LEN) {
+		format_err(ebuf, elen, "Input too large");
+		return NULL;
+	}
+	/* The first record names the columns */
+	if ((header.strs = marray_new_strings()) == NULL) {
+		format_err(ebuf, elen, "Out of memory");
+		return NULL;
+	}
+	if (len == 0 || parse_record(&hdr, &p, end, &header, 0) < 0) {
+		format_err(ebuf, elen, "Invalid header: %s",
+		    len == 0 ? "No data" : hdr.err);
+		goto out;
+	}
+	free(hdr.scratch);
+	ncols = marray_len(header.strs);
+
+	if (nthreads == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu < 1 ? 1 : (u_int)ncpu;
+	}
+	nthreads = MIN(nthreads, MCSV_MAX_THREADS);
+	nthreads = MAX(1, MIN(nthreads, (end - p) / MCSV_MIN_CHUNK));
+	if ((chunks = calloc(nthreads, sizeof(*chunks))) == NULL ||
+	    (tids = calloc(nthreads, sizeof(*tids))) == NULL ||
+	    (started = calloc(nthreads, sizeof(*started))) == NULL) {
+		format_err(ebuf, elen, "Out of memory");
+		goto out;
+	}
+	/* Split the data at record boundaries near equal offsets */
+	for (i = 0; i < nthreads; i++) {
+		chunks[i].flags = flags;
+		chunks[i].ncols = ncols;
+		chunks[i].start = i == 0 ? p : chunks[i - 1].end;
+		q = p + ((end - p) / nthreads) * (i + 1);
+		if (i == nthreads - 1 || q <= chunks[i].start)
+			chunks[i].end = i == nthreads - 1 ? end :
+			    chunks[i].start;
+		else {
+			chunks[i].end = record_boundary(chunks[i].start,
+			    q, end, flags);
+		}
+		if ((chunks[i].cols = calloc(MAX(ncols, 1),
+		    sizeof(*chunks[i].cols))) == NULL) {
+			format_err(ebuf, elen, "Out of memory");
+			goto out;
+		}
+	}
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, parse_chunk,
+		    &chunks[i]) == 0)
+			started[i] = 1;
+	}
+	parse_chunk(&chunks[0]);
+	for (i = 1; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+		else
+			parse_chunk(&chunks[i]);
+	}
+
+	/* Report the first error, counting records across chunks */
+	for (i = nrecords = 0; i < nthreads; i++) {
+		if (chunks[i].err[0] != '\0') {
+			format_err(ebuf, elen, "%s at record %zu",
+			    chunks[i].err, nrecords + chunks[i].nrecords + 1);
+			goto out;
+		}
+		nrecords += chunks[i].nrecords;
+	}
+
+	/* Concatenate the chunks' columns and add them to the result */
+	if ((ret = mdict_new()) == NULL) {
+		format_err(ebuf, elen, "Out of memory");
+		goto out;
+	}
+	for (j = 0; j < ncols; j++) {
+		for (i = 1; i < nthreads; i++) {
+			if (column_merge(&chunks[0].cols[j],
+			    &chunks[i].cols[j]) != 0) {
+				format_err(ebuf, elen, "Out of memory");
+				goto fail;
+			}
+		}
+		/* Columns without data are empty string columns */
+		if (chunks[0].cols[j].strs == NULL &&
+		    chunks[0].cols[j].ints == NULL &&
+		    column_to_strings(&chunks[0].cols[j]) != 0) {
+			format_err(ebuf, elen, "Out of memory");
+			goto fail;
+		}
+		if (marray_get_str(header.strs, j, &name, &nlen) != 0 ||
+		    (k = mstring_new2(name, nlen)) == NULL) {
+			format_err(ebuf, elen, "Out of memory");
+			goto fail;
+		}
+		if (mdict_item(ret, k) != NULL) {
+			format_err(ebuf, elen, "Duplicate column \"%s\"",
+			    mstring_ptr(k));
+			mobject_free(k);
+			goto fail;
+		}
+		if (mdict_insert(ret, k, chunks[0].cols[j].strs != NULL ?
+		    chunks[0].cols[j].strs : chunks[0].cols[j].ints) != 0) {
+			mobject_free(k);
+			format_err(ebuf, elen, "Out of memory");
+			goto fail;
+		}
+		chunks[0].cols[j].strs = chunks[0].cols[j].ints = NULL;
+	}
+	goto out;
+ fail:
+	mobject_free(ret);
+	ret = NULL;
+ out:
+	if (chunks != NULL) {
+		for (i = 0; i < nthreads; i++)
+			chunk_free(&chunks[i]);
+	}
+	free(chunks);
+	free(tids);
+	free(started);
+	column_free(&header);
+	return ret;
+}
+
+struct mobject *
+mcsv_load(const char *path, int flags, u_int nthreads, char *ebuf,
+    size_t elen)
+{
+	struct stat st;
+	struct mobject *ret;
+	char *data = NULL, *tmp;
+	size_t len = 0, alloc = 0;
+	ssize_t r;
+	int fd, mapped = 0;
+
+	if (strcmp(path, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(path, O_RDONLY)) == -1) {
+		format_err(ebuf, elen, "open(\"%s\"): %s",
+		    path, strerror(errno));
+		return NULL;
+	}
+	/* Map regular files; read anything else */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (u_int64_t)st.st_size <= MCSV_MAX_LEN &&
+	    (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+	    fd, 0)) != MAP_FAILED) {
+		len = st.st_size;
+		mapped = 1;
+	} else {
+		for (data = NULL;;) {
+			if (len + 65536 > alloc) {
+				alloc = (len + 65536) * 2;
+				if (alloc > MCSV_MAX_LEN ||
+				    (tmp = realloc(data, alloc)) == NULL) {
+					format_err(ebuf, elen,
+					    "Input too large");
+					goto fail;
+				}
+				data = tmp;
+			}
+			if ((r = read(fd, data + len, alloc - len)) == -1) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				format_err(ebuf, elen, "read: %s",
+				    strerror(errno));
+				goto fail;
+			}
+			if (r == 0)
+				break;
+			len += r;
+		}
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+	ret = mcsv_parse(data, len, flags, nthreads, ebuf, elen);
+	if (mapped)
+		munmap(data, len);
+	else
+		free(data);
+	return ret;
+ fail:
+	if (fd != STDIN_FILENO)
+		close(fd);
+	free(data);
+	return NULL;
+}
+
+/* Row view: a virtual array of shaped dictionaries over a column table */
+struct csv_rows {
+	struct mobject *table;
+	struct mshape *shape;
+	struct mobject **cols;
+	size_t ncols;
+	size_t nrows;
+};
+
+static size_t
+rows_len(void *ctx)
+{
+	return ((struct csv_rows *)ctx)->nrows;
+}
+
+static struct mobject *
+rows_item(void *_ctx, size_t ndx)
+{
+	struct csv_rows *ctx = (struct csv_rows *)_ctx;
+	struct mobject *ret, *v;
+	const u_int8_t *s;
+	size_t i, len;
+	int64_t iv;
+
+	if (ndx >= ctx->nrows || (ret = mdict_new_shaped(ctx->shape)) == NULL)
+		return NULL;
+	for (i = 0; i < ctx->ncols; i++) {
+		/* Strings borrow from the column */
+		if (marray_get_int64(ctx->cols[i], ndx, &iv) == 0)
+			v = mint_new(iv);
+		else if (marray_get_str(ctx->cols[i], ndx, &s, &len) == 0)
+			v = mstring_new_ref(s, len, NULL, NULL);
+		else if ((v = marray_item(ctx->cols[i], ndx)) != NULL)
+			v = mobject_deepcopy(v);
+		else
+			v = mnone_new();
+		if (v == NULL || mdict_set_slot(ret, i, v) != 0) {
+			if (v != NULL)
+				mobject_free(v);
+			mobject_free(ret);
+			return NULL;
+		}
+	}
+	return ret;
+}
+
+static int
+rows_next(void *ctx, size_t *pos, struct mobject **keyp,
+    struct mobject **valuep)
+{
+	if ((*valuep = rows_item(ctx, *pos)) == NULL)
+		return -1;
+	(*pos)++;
+	return 0;
+}
+
+static void
+rows_free(void *_ctx)
+{
+	struct csv_rows *ctx = (struct csv_rows *)_ctx;
+
+	if (ctx->table != NULL)
+		mobject_free(ctx->table);
+	if (ctx->shape != NULL)
+		mshape_free(ctx->shape);
+	free(ctx->cols);
+	free(ctx);
+}
+
+static const struct mvirtual_ops rows_ops = {
+	rows_len, rows_item, NULL, rows_next, rows_free
+};
+
+struct mobject *
+mcsv_rows(struct mobject *table)
+{
+	struct csv_rows *ctx;
+	struct miterator *iter = NULL;
+	struct miteritem *item;
+	struct mobject *ret;
+	char **names = NULL;
+	size_t i;
+
+	if (mobject_type(table) != TYPE_MDICT ||
+	    (ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+	ctx->ncols = mdict_len(table);
+	if ((ctx->cols = calloc(MAX(ctx->ncols, 1),
+	    sizeof(*ctx->cols))) == NULL ||
+	    (names = calloc(MAX(ctx->ncols, 1), sizeof(*names))) == NULL ||
+	    (iter = mobject_getiter(table)) == NULL)
+		goto fail;
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		if (i >= ctx->ncols ||
+		    mobject_type(item->key) != TYPE_MSTRING ||
+		    mobject_type(item->value) != TYPE_MARRAY)
+			goto fail;
+		if (i == 0)
+			ctx->nrows = marray_len(item->value);
+		else if (marray_len(item->value) != ctx->nrows)
+			goto fail;
+		ctx->cols[i] = item->value;
+		if ((names[i] = strndup((const char *)mstring_ptr(item->key),
+		    mstring_len(item->key))) == NULL)
+			goto fail;
+	}
+	if (i != ctx->ncols ||
+	    (ctx->shape = mshape_new((const char * const *)names,
+	    ctx->ncols)) == NULL ||
+	    (ret = mvirtual_new(TYPE_MARRAY, &rows_ops, ctx)) == NULL)
+		goto fail;
+	ctx->table = table;
+	for (i = 0; i < ctx->ncols; i++)
+		free(names[i]);
+	free(names);
+	miterator_free(iter);
+	return ret;
+ fail:
+	if (names != NULL) {
+		for (i = 0; i < ctx->ncols; i++)
+			free(names[i]);
+		free(names);
+	}
+	if (iter != NULL)
+		miterator_free(iter);
+	rows_free(ctx);
+	return NULL;
+}
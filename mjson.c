@@ -0,0 +1,1018 @@
+/*
+ * Copyright (c) 2007 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* $Id$ */
+
+/* JSON serialisation of mobject trees */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "mobject.h"
+
+/* Size of the output buffer; output is passed to the callback in chunks */
+#define MJSON_BUF_SIZE		(64 * 1024)
+
+/* Maximum nesting depth. NB. there is no cycle protection in mobject */
+#define MJSON_MAX_DEPTH		(64 * 1024)
+
+/* Maximum output size for mjson_write_mbuf() */
+#define MJSON_MBUF_MAX		(1024 * 1024 * 1024)
+
+/* An array or dictionary whose members are being written */
+struct mjson_frame {
+	struct mobject *obj;
+	struct miterator *iter;	/* Only valid for dicts and sets, kept for
+				 * reuse */
+	size_t ndx;		/* Only valid for arrays */
+	size_t nitems;		/* Members written so far */
+};
+
+struct mjson_writer {
+	int (*write_cb)(const void *, size_t, void *);
+	void *ctx;
+	u_char *buf;
+	size_t len;
+	struct mjson_frame *stack;
+	size_t depth;
+	size_t nalloc;
+};
+
+/*
+ * Characters that may be copied into a JSON string verbatim are marked
+ * with zero, others with the character following the backslash in their
+ * escape sequence ('u' for those that need a \u00XX escape).
+ */
+static const u_char json_escapes[256] = {
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+	/* Remainder are zero */
+};
+
+struct mjson_writer *
+mjson_writer_new(int (*write_cb)(const void *, size_t, void *), void *ctx)
+{
+	struct mjson_writer *ret;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	if ((ret->buf = malloc(MJSON_BUF_SIZE)) == NULL) {
+		free(ret);
+		return NULL;
+	}
+	ret->write_cb = write_cb;
+	ret->ctx = ctx;
+	return ret;
+}
+
+void
+mjson_writer_free(struct mjson_writer *w)
+{
+	size_t i;
+
+	for (i = 0; i < w->nalloc; i++) {
+		if (w->stack[i].iter != NULL)
+			miterator_free(w->stack[i].iter);
+	}
+	free(w->stack);
+	free(w->buf);
+	bzero(w, sizeof(*w));
+	free(w);
+}
+
+static int
+mjson_flush(struct mjson_writer *w)
+{
+	size_t len = w->len;
+
+	w->len = 0;
+	if (len == 0)
+		return 0;
+	return w->write_cb(w->buf, len, w->ctx) == 0 ? 0 : -1;
+}
+
+static int
+mjson_put(struct mjson_writer *w, const void *p, size_t len)
+{
+	if (w->len + len > MJSON_BUF_SIZE) {
+		if (mjson_flush(w) != 0)
+			return -1;
+		/* Pass large runs straight through rather than copying */
+		if (len >= MJSON_BUF_SIZE)
+			return w->write_cb(p, len, w->ctx) == 0 ? 0 : -1;
+	}
+	memcpy(w->buf + w->len, p, len);
+	w->len += len;
+	return 0;
+}
+
+static int
+mjson_putc(struct mjson_writer *w, u_char c)
+{
+	if (w->len >= MJSON_BUF_SIZE && mjson_flush(w) != 0)
+		return -1;
+	w->buf[w->len++] = c;
+	return 0;
+}
+
+static int
+mjson_put_int(struct mjson_writer *w, int64_t v)
+{
+	char tmp[24], *cp = tmp + sizeof(tmp);
+	uint64_t u;
+
+	/* Negate in unsigned arithmetic so INT64_MIN works */
+	u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	do {
+		*--cp = '0' + (u % 10);
+		u /= 10;
+	} while (u != 0);
+	if (v < 0)
+		*--cp = '-';
+	return mjson_put(w, cp, (tmp + sizeof(tmp)) - cp);
+}
+
+static int
+mjson_put_string(struct mjson_writer *w, const u_char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6];
+	size_t i, run;
+	u_char e;
+
+	if (mjson_putc(w, '"') != 0)
+		return -1;
+	for (i = 0; i < len;) {
+		/* Copy runs of characters that need no escaping in bulk */
+		for (run = i; run < len && json_escapes[s[run]] == 0; run++)
+			;
+		if (run > i && mjson_put(w, s + i, run - i) != 0)
+			return -1;
+		if ((i = run) >= len)
+			break;
+		esc[0] = '\\';
+		if ((e = json_escapes[s[i]]) == 'u') {
+			esc[1] = 'u';
+			esc[2] = esc[3] = '0';
+			esc[4] = hex[s[i] >> 4];
+			esc[5] = hex[s[i] & 0xf];
+			if (mjson_put(w, esc, 6) != 0)
+				return -1;
+		} else {
+			esc[1] = e;
+			if (mjson_put(w, esc, 2) != 0)
+				return -1;
+		}
+		i++;
+	}
+	return mjson_putc(w, '"');
+}
+
+static int
+mjson_push(struct mjson_writer *w, struct mobject *o)
+{
+	struct mjson_frame *tmp, *f;
+	size_t n;
+
+	if (w->depth >= MJSON_MAX_DEPTH)
+		return -1;
+	if (w->depth >= w->nalloc) {
+		n = w->nalloc == 0 ? 16 : w->nalloc * 2;
+		if ((tmp = realloc(w->stack, n * sizeof(*tmp))) == NULL)
+			return -1;
+		bzero(tmp + w->nalloc, (n - w->nalloc) * sizeof(*tmp));
+		w->stack = tmp;
+		w->nalloc = n;
+	}
+	f = &w->stack[w->depth];
+	f->obj = o;
+	f->ndx = f->nitems = 0;
+	if (mobject_type(o) == TYPE_MDICT || mobject_type(o) == TYPE_MSET) {
+		if (f->iter == NULL) {
+			if ((f->iter = mobject_getiter(o)) == NULL)
+				return -1;
+		} else if (miterator_reset(f->iter, o) != 0)
+			return -1;
+	}
+	w->depth++;
+	return 0;
+}
+
+/*
+ * Write a value. Scalars are written in full, arrays and dictionaries
+ * have their opening bracket written and are pushed onto the stack for
+ * their members to be written by mjson_write().
+ */
+static int
+mjson_put_value(struct mjson_writer *w, struct mobject *o)
+{
+	if (o == NULL)
+		return mjson_put(w, "null", 4);
+	switch (mobject_type(o)) {
+	case TYPE_MNONE:
+		return mjson_put(w, "null", 4);
+	case TYPE_MINT:
+		return mjson_put_int(w, mint_value(o));
+	case TYPE_MSTRING:
+		return mjson_put_string(w, mstring_ptr(o), mstring_len(o));
+	case TYPE_MARRAY:
+	case TYPE_MSET:
+		if (mjson_push(w, o) != 0)
+			return -1;
+		return mjson_putc(w, '[');
+	case TYPE_MDICT:
+		if (mjson_push(w, o) != 0)
+			return -1;
+		return mjson_putc(w, '{');
+	default:
+		return -1;
+	}
+}
+
+int
+mjson_write(struct mjson_writer *w, struct mobject *o)
+{
+	struct mjson_frame *f;
+	struct miteritem *item;
+	const u_int8_t *s;
+	size_t len;
+	int64_t v;
+
+	w->depth = 0;
+	w->len = 0;
+	if (mjson_put_value(w, o) != 0)
+		return -1;
+	while (w->depth > 0) {
+		f = &w->stack[w->depth - 1];
+		if (mobject_type(f->obj) == TYPE_MARRAY) {
+			if (f->ndx >= marray_len(f->obj)) {
+				w->depth--;
+				if (mjson_putc(w, ']') != 0)
+					return -1;
+				continue;
+			}
+			if (f->nitems++ > 0 && mjson_putc(w, ',') != 0)
+				return -1;
+			/* Items of typed arrays are written without proxies */
+			if (marray_get_int64(f->obj, f->ndx, &v) == 0) {
+				f->ndx++;
+				if (mjson_put_int(w, v) != 0)
+					return -1;
+				continue;
+			}
+			if (marray_get_str(f->obj, f->ndx, &s, &len) == 0) {
+				f->ndx++;
+				if (mjson_put_string(w, s, len) != 0)
+					return -1;
+				continue;
+			}
+			/* NB. may push a new frame, invalidating "f" */
+			if (mjson_put_value(w,
+			    marray_item(f->obj, f->ndx++)) != 0)
+				return -1;
+			continue;
+		}
+		if ((item = miterator_next(f->iter)) == NULL) {
+			w->depth--;
+			if (mjson_putc(w, mobject_type(f->obj) == TYPE_MSET ?
+			    ']' : '}') != 0)
+				return -1;
+			continue;
+		}
+		if (f->nitems++ > 0 && mjson_putc(w, ',') != 0)
+			return -1;
+		/* Sets are written as arrays of their members */
+		if (mobject_type(f->obj) == TYPE_MSET) {
+			if (mjson_put_value(w, item->value) != 0)
+				return -1;
+			continue;
+		}
+		/* JSON keys are strings, so integer keys are quoted */
+		if (mobject_type(item->key) == TYPE_MINT) {
+			if (mjson_putc(w, '"') != 0 ||
+			    mjson_put_int(w, mint_value(item->key)) != 0 ||
+			    mjson_putc(w, '"') != 0)
+				return -1;
+		} else if (mobject_type(item->key) != TYPE_MSTRING ||
+		    mjson_put_string(w, mstring_ptr(item->key),
+		    mstring_len(item->key)) != 0)
+			return -1;
+		if (mjson_putc(w, ':') != 0 ||
+		    mjson_put_value(w, item->value) != 0)
+			return -1;
+	}
+	return mjson_flush(w);
+}
+
+static int
+write_fd_cb(const void *buf, size_t len, void *ctx)
+{
+	int fd = *(int *)ctx;
+	const u_char *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = write(fd, p, len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int
+mjson_write_fd(struct mobject *o, int fd)
+{
+	struct mjson_writer *w;
+	int r;
+
+	if ((w = mjson_writer_new(write_fd_cb, &fd)) == NULL)
+		return -1;
+	r = mjson_write(w, o);
+	mjson_writer_free(w);
+	return r;
+}
+
+/* Callback structure for memory buffer output */
+struct mbuf_cb_ctx {
+	char *s;
+	size_t len;
+	size_t alloc;
+};
+
+static int
+write_mbuf_cb(const void *buf, size_t len, void *_ctx)
+{
+	struct mbuf_cb_ctx *ctx = (struct mbuf_cb_ctx *)_ctx;
+	size_t n;
+	char *tmp;
+
+	if (len >= MJSON_MBUF_MAX || ctx->len + len >= MJSON_MBUF_MAX)
+		return -1;
+	if (ctx->len + len + 1 > ctx->alloc) {
+		for (n = MAX(ctx->alloc, 256); n < ctx->len + len + 1; n <<= 1)
+			;
+		if ((tmp = realloc(ctx->s, n)) == NULL)
+			return -1;
+		ctx->s = tmp;
+		ctx->alloc = n;
+	}
+	memcpy(ctx->s + ctx->len, buf, len);
+	ctx->len += len;
+	ctx->s[ctx->len] = '\0';
+	return 0;
+}
+
+int
+mjson_write_mbuf(struct mobject *o, char **outp, size_t *lenp)
+{
+	struct mbuf_cb_ctx ctx = { NULL, 0, 0 };
+	struct mjson_writer *w;
+	int r;
+
+	*outp = NULL;
+	if ((w = mjson_writer_new(write_mbuf_cb, &ctx)) == NULL)
+		return -1;
+	r = mjson_write(w, o);
+	mjson_writer_free(w);
+	if (r != 0) {
+		free(ctx.s);
+		return -1;
+	}
+	*outp = ctx.s;
+	if (lenp != NULL)
+		*lenp = ctx.len;
+	return 0;
+}
+
+/* Maximum length of a record read by an mjson_reader */
+#define MJSON_MAX_RECORD	(64 * 1024 * 1024)
+
+/* Initial size of an mjson_reader's input buffer */
+#define MJSON_READ_SIZE		(64 * 1024)
+
+/* A container whose members are being parsed */
+struct mjson_pframe {
+	struct mobject *obj;
+	struct mobject *key;	/* Key of next member, only valid for dicts */
+};
+
+struct mjson_parser {
+	const u_char *s;
+	size_t len;
+	size_t pos;
+	int borrow;		/* Reference strings in the input, not copy */
+	struct mjson_pframe *stack;
+	size_t depth;
+	size_t nalloc;
+	u_char *scratch;	/* For unescaping strings */
+	size_t scratch_len;
+	const char *err;
+};
+
+struct mjson_reader {
+	int fd;
+	u_char *buf;
+	size_t alloc;
+	size_t off;		/* Start of unconsumed data */
+	size_t scanned;		/* Data after "off" known not to hold '\n' */
+	size_t len;
+	int eof;
+	size_t lineno;
+	size_t nrecords;
+	struct mjson_parser parser;
+	char err[256];
+};
+
+static void
+mjson_skip_ws(struct mjson_parser *p)
+{
+	while (p->pos < p->len && (p->s[p->pos] == ' ' ||
+	    p->s[p->pos] == '\t' || p->s[p->pos] == '\n' ||
+	    p->s[p->pos] == '\r'))
+		p->pos++;
+}
+
+static int
+mjson_scratch_reserve(struct mjson_parser *p, size_t need)
+{
+	u_char *tmp;
+	size_t n;
+
+	if (need <= p->scratch_len)
+		return 0;
+	for (n = MAX(p->scratch_len, 256); n < need; n <<= 1)
+		;
+	if ((tmp = realloc(p->scratch, n)) == NULL)
+		return -1;
+	p->scratch = tmp;
+	p->scratch_len = n;
+	return 0;
+}
+
+static int
+mjson_hex4(const u_char *s, u_int *vp)
+{
+	u_int i, v = 0;
+
+	for (i = 0; i < 4; i++) {
+		v <<= 4;
+		if (s[i] >= '0' && s[i] <= '9')
+			v |= s[i] - '0';
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			v |= s[i] - 'a' + 10;
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			v |= s[i] - 'A' + 10;
+		else
+			return -1;
+	}
+	*vp = v;
+	return 0;
+}
+
+/* Decode the escape sequence at "s" into "out", returning its length */
+static int
+mjson_unescape(const u_char *s, size_t len, u_char *out, size_t *outlen,
+    size_t *inlen)
+{
+	u_int c, c2;
+
+	if (len < 2)
+		return -1;
+	*inlen = 2;
+	*outlen = 1;
+	switch (s[1]) {
+	case '"':
+	case '\\':
+	case '/':
+		*out = s[1];
+		return 0;
+	case 'b':
+		*out = '\b';
+		return 0;
+	case 'f':
+		*out = '\f';
+		return 0;
+	case 'n':
+		*out = '\n';
+		return 0;
+	case 'r':
+		*out = '\r';
+		return 0;
+	case 't':
+		*out = '\t';
+		return 0;
+	case 'u':
+		break;
+	default:
+		return -1;
+	}
+	if (len < 6 || mjson_hex4(s + 2, &c) != 0)
+		return -1;
+	*inlen = 6;
+	/* Surrogate pairs encode characters outside the BMP */
+	if (c >= 0xd800 && c < 0xdc00) {
+		if (len < 12 || s[6] != '\\' || s[7] != 'u' ||
+		    mjson_hex4(s + 8, &c2) != 0 || c2 < 0xdc00 || c2 >= 0xe000)
+			return -1;
+		c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+		*inlen = 12;
+	} else if (c >= 0xdc00 && c < 0xe000)
+		return -1;
+	if (c < 0x80) {
+		out[0] = c;
+	} else if (c < 0x800) {
+		out[0] = 0xc0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3f);
+		*outlen = 2;
+	} else if (c < 0x10000) {
+		out[0] = 0xe0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3f);
+		out[2] = 0x80 | (c & 0x3f);
+		*outlen = 3;
+	} else {
+		out[0] = 0xf0 | (c >> 18);
+		out[1] = 0x80 | ((c >> 12) & 0x3f);
+		out[2] = 0x80 | ((c >> 6) & 0x3f);
+		out[3] = 0x80 | (c & 0x3f);
+		*outlen = 4;
+	}
+	return 0;
+}
+
+static struct mobject *
+mjson_parse_string(struct mjson_parser *p)
+{
+	const u_char *s = p->s + p->pos + 1, *end = p->s + p->len, *q;
+	size_t n = 0, olen, ilen;
+
+	/* Fast path: no escapes */
+	for (q = s; q < end && *q != '"' && *q != '\\' && *q >= 0x20; q++)
+		;
+	if (q < end && *q == '"') {
+		p->pos = (q + 1) - p->s;
+		if (p->borrow)
+			return mstring_new_ref(s, q - s, NULL, NULL);
+		return mstring_new2(s, q - s);
+	}
+	for (q = s; q < end && *q != '"';) {
+		if (mjson_scratch_reserve(p, n + 4) != 0) {
+			p->err = "Out of memory";
+			return NULL;
+		}
+		if (*q < 0x20) {
+			p->err = "Control character in string";
+			return NULL;
+		}
+		if (*q != '\\') {
+			p->scratch[n++] = *q++;
+			continue;
+		}
+		if (mjson_unescape(q, end - q, p->scratch + n,
+		    &olen, &ilen) != 0) {
+			p->err = "Invalid escape sequence";
+			return NULL;
+		}
+		n += olen;
+		q += ilen;
+	}
+	if (q >= end) {
+		p->err = "Unterminated string";
+		return NULL;
+	}
+	p->pos = (q + 1) - p->s;
+	return mstring_new2(n == 0 ? (const u_char *)"" : p->scratch, n);
+}
+
+/*
+ * Integers are returned as mint objects. Numbers with fractions or
+ * exponents, or too large for an mint, are returned as strings of
+ * their text since mobject has no floating point type.
+ */
+static struct mobject *
+mjson_parse_number(struct mjson_parser *p)
+{
+	const u_char *s = p->s + p->pos, *end = p->s + p->len, *q = s;
+	u_int64_t v = 0, lim = INT64_MAX;
+	int isint = 1, neg = 0;
+
+	if (q < end && *q == '-') {
+		neg = 1;
+		lim = (u_int64_t)INT64_MAX + 1;
+		q++;
+	}
+	if (q >= end || *q < '0' || *q > '9')
+		goto bad;
+	if (*q == '0')
+		q++;
+	else {
+		for (; q < end && *q >= '0' && *q <= '9'; q++) {
+			if (v > (lim - (*q - '0')) / 10)
+				isint = 0;
+			else
+				v = v * 10 + (*q - '0');
+		}
+	}
+	if (q < end && *q == '.') {
+		isint = 0;
+		if (++q >= end || *q < '0' || *q > '9')
+			goto bad;
+		while (q < end && *q >= '0' && *q <= '9')
+			q++;
+	}
+	if (q < end && (*q == 'e' || *q == 'E')) {
+		isint = 0;
+		if (++q < end && (*q == '+' || *q == '-'))
+			q++;
+		if (q >= end || *q < '0' || *q > '9')
+			goto bad;
+		while (q < end && *q >= '0' && *q <= '9')
+			q++;
+	}
+	p->pos = q - p->s;
+	if (isint)
+		return mint_new(!neg || v == 0 ? (int64_t)v :
+		    -(int64_t)(v - 1) - 1);
+	if (p->borrow)
+		return mstring_new_ref(s, q - s, NULL, NULL);
+	return mstring_new2(s, q - s);
+ bad:
+	p->err = "Invalid number";
+	return NULL;
+}
+
+static struct mobject *
+mjson_parse_literal(struct mjson_parser *p)
+{
+	static const struct {
+		const char *text;
+		size_t len;
+		int value;
+	} lits[] = {
+		{ "null", 4, -1 }, { "true", 4, 1 }, { "false", 5, 0 },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(lits) / sizeof(*lits); i++) {
+		if (p->len - p->pos < lits[i].len ||
+		    memcmp(p->s + p->pos, lits[i].text, lits[i].len) != 0)
+			continue;
+		p->pos += lits[i].len;
+		/* Booleans become integers */
+		return lits[i].value == -1 ? mnone_new() :
+		    mint_new(lits[i].value);
+	}
+	p->err = "Invalid value";
+	return NULL;
+}
+
+static int
+mjson_ppush(struct mjson_parser *p, struct mobject *o)
+{
+	struct mjson_pframe *tmp;
+	size_t n;
+
+	if (p->depth >= MJSON_MAX_DEPTH) {
+		p->err = "Nesting too deep";
+		return -1;
+	}
+	if (p->depth >= p->nalloc) {
+		n = p->nalloc == 0 ? 16 : p->nalloc * 2;
+		if ((tmp = realloc(p->stack, n * sizeof(*tmp))) == NULL) {
+			p->err = "Out of memory";
+			return -1;
+		}
+		p->stack = tmp;
+		p->nalloc = n;
+	}
+	p->stack[p->depth].obj = o;
+	p->stack[p->depth].key = NULL;
+	p->depth++;
+	return 0;
+}
+
+/* Parse a dictionary key and the following ':' */
+static int
+mjson_parse_key(struct mjson_parser *p, struct mjson_pframe *f)
+{
+	mjson_skip_ws(p);
+	if (p->pos >= p->len || p->s[p->pos] != '"') {
+		p->err = "Expected dictionary key";
+		return -1;
+	}
+	if ((f->key = mjson_parse_string(p)) == NULL)
+		return -1;
+	mjson_skip_ws(p);
+	if (p->pos >= p->len || p->s[p->pos] != ':') {
+		p->err = "Expected ':'";
+		return -1;
+	}
+	p->pos++;
+	return 0;
+}
+
+/*
+ * Parse a single JSON value that spans the whole input. This doesn't
+ * recurse; containers being parsed are kept on the parser's stack.
+ */
+static struct mobject *
+mjson_parse_value(struct mjson_parser *p, const u_char *s, size_t len)
+{
+	struct mjson_pframe *f;
+	struct mobject *v = NULL, *ret = NULL;
+	u_char c;
+
+	p->s = s;
+	p->len = len;
+	p->pos = 0;
+	p->depth = 0;
+	p->err = NULL;
+ value:
+	mjson_skip_ws(p);
+	if (p->pos >= p->len) {
+		p->err = "Unexpected end of input";
+		goto fail;
+	}
+	switch ((c = p->s[p->pos])) {
+	case '{':
+	case '[':
+		p->pos++;
+		if ((v = c == '{' ? mdict_new() : marray_new()) == NULL) {
+			p->err = "Out of memory";
+			goto fail;
+		}
+		if (mjson_ppush(p, v) != 0)
+			goto fail;
+		v = NULL;
+		mjson_skip_ws(p);
+		if (p->pos < p->len && p->s[p->pos] == (c == '{' ? '}' : ']')) {
+			p->pos++;
+			v = p->stack[--p->depth].obj;
+			break;
+		}
+		if (c == '{' &&
+		    mjson_parse_key(p, &p->stack[p->depth - 1]) != 0)
+			goto fail;
+		goto value;
+	case '"':
+		v = mjson_parse_string(p);
+		break;
+	case '-':
+	case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+		v = mjson_parse_number(p);
+		break;
+	default:
+		v = mjson_parse_literal(p);
+		break;
+	}
+	if (v == NULL) {
+		if (p->err == NULL)
+			p->err = "Out of memory";
+		goto fail;
+	}
+	/* Add the completed value to its container, closing any finished */
+	while (p->depth > 0) {
+		f = &p->stack[p->depth - 1];
+		if (mobject_type(f->obj) == TYPE_MARRAY) {
+			if (marray_append(f->obj, v) != 0) {
+				p->err = "Out of memory";
+				goto fail;
+			}
+		} else {
+			/* Later duplicate keys override earlier ones */
+			if (mdict_replace(f->obj, f->key, v) != 0) {
+				p->err = "Out of memory";
+				goto fail;
+			}
+			f->key = NULL;
+		}
+		v = NULL;
+		mjson_skip_ws(p);
+		if (p->pos >= p->len) {
+			p->err = "Unexpected end of input";
+			goto fail;
+		}
+		c = p->s[p->pos++];
+		if (c == ',') {
+			if (mobject_type(f->obj) == TYPE_MDICT &&
+			    mjson_parse_key(p, f) != 0)
+				goto fail;
+			goto value;
+		}
+		if (c != (mobject_type(f->obj) == TYPE_MDICT ? '}' : ']')) {
+			p->err = "Expected ',' or end of container";
+			goto fail;
+		}
+		v = f->obj;
+		p->depth--;
+	}
+	mjson_skip_ws(p);
+	if (p->pos < p->len) {
+		p->err = "Trailing garbage";
+		goto fail;
+	}
+	ret = v;
+	v = NULL;
+ fail:
+	if (v != NULL)
+		mobject_free(v);
+	while (p->depth > 0) {
+		f = &p->stack[--p->depth];
+		if (f->key != NULL)
+			mobject_free(f->key);
+		mobject_free(f->obj);
+	}
+	return ret;
+}
+
+struct mobject *
+mjson_parse(const void *s, size_t len, char *ebuf, size_t elen)
+{
+	struct mjson_parser p;
+	struct mobject *ret;
+
+	bzero(&p, sizeof(p));
+	if ((ret = mjson_parse_value(&p, s, len)) == NULL && ebuf != NULL)
+		snprintf(ebuf, elen, "%s at offset %zu", p.err, p.pos);
+	free(p.stack);
+	free(p.scratch);
+	return ret;
+}
+
+struct mjson_reader *
+mjson_reader_new(int fd)
+{
+	struct mjson_reader *ret;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	if ((ret->buf = malloc(MJSON_READ_SIZE)) == NULL) {
+		free(ret);
+		return NULL;
+	}
+	ret->alloc = MJSON_READ_SIZE;
+	ret->fd = fd;
+	ret->parser.borrow = 1;
+	return ret;
+}
+
+void
+mjson_reader_free(struct mjson_reader *r)
+{
+	free(r->parser.stack);
+	free(r->parser.scratch);
+	free(r->buf);
+	bzero(r, sizeof(*r));
+	free(r);
+}
+
+/* Fetch more input, making room for it first */
+static int
+mjson_reader_fill(struct mjson_reader *r)
+{
+	u_char *tmp;
+	ssize_t n;
+
+	if (r->off > 0) {
+		memmove(r->buf, r->buf + r->off, r->len - r->off);
+		r->len -= r->off;
+		r->off = 0;
+	}
+	if (r->len == r->alloc) {
+		if (r->alloc >= MJSON_MAX_RECORD) {
+			snprintf(r->err, sizeof(r->err),
+			    "line %zu: Record too long", r->lineno + 1);
+			return -1;
+		}
+		if ((tmp = realloc(r->buf, r->alloc * 2)) == NULL) {
+			snprintf(r->err, sizeof(r->err), "Out of memory");
+			return -1;
+		}
+		r->buf = tmp;
+		r->alloc *= 2;
+	}
+	for (;;) {
+		if ((n = read(r->fd, r->buf + r->len,
+		    r->alloc - r->len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			snprintf(r->err, sizeof(r->err), "read: %s",
+			    strerror(errno));
+			return -1;
+		}
+		break;
+	}
+	if (n == 0)
+		r->eof = 1;
+	r->len += n;
+	return 0;
+}
+
+struct mobject *
+mjson_reader_next(struct mjson_reader *r)
+{
+	struct mobject *ret;
+	u_char *line, *nl;
+	size_t llen, i;
+
+	if (r->err[0] != '\0')
+		return NULL;
+	for (;;) {
+		nl = memchr(r->buf + r->off + r->scanned, '\n',
+		    r->len - r->off - r->scanned);
+		if (nl == NULL && !r->eof) {
+			r->scanned = r->len - r->off;
+			if (mjson_reader_fill(r) != 0)
+				return NULL;
+			continue;
+		}
+		if (nl == NULL && r->off == r->len)
+			return NULL;
+		line = r->buf + r->off;
+		llen = nl == NULL ? r->len - r->off : (size_t)(nl - line);
+		r->off += llen + (nl == NULL ? 0 : 1);
+		r->scanned = 0;
+		r->lineno++;
+		/* Skip blank lines */
+		for (i = 0; i < llen && (line[i] == ' ' || line[i] == '\t' ||
+		    line[i] == '\r'); i++)
+			;
+		if (i < llen)
+			break;
+	}
+	if ((ret = mjson_parse_value(&r->parser, line, llen)) == NULL) {
+		snprintf(r->err, sizeof(r->err), "line %zu: %s at offset %zu",
+		    r->lineno, r->parser.err, r->parser.pos);
+		return NULL;
+	}
+	r->nrecords++;
+	return ret;
+}
+
+const char *
+mjson_reader_error(struct mjson_reader *r)
+{
+	return r->err[0] == '\0' ? NULL : r->err;
+}
+
+static size_t
+reader_len(void *ctx)
+{
+	return ((struct mjson_reader *)ctx)->nrecords;
+}
+
+static int
+reader_next(void *ctx, size_t *pos, struct mobject **keyp,
+    struct mobject **valuep)
+{
+	if ((*valuep = mjson_reader_next((struct mjson_reader *)ctx)) == NULL)
+		return -1;
+	(*pos)++;
+	return 0;
+}
+
+static const char *
+reader_error(void *ctx)
+{
+	return mjson_reader_error((struct mjson_reader *)ctx);
+}
+
+static const struct mvirtual_ops reader_ops = {
+	reader_len, NULL, NULL, reader_next, NULL, reader_error
+};
+
+struct mobject *
+mjson_reader_records(struct mjson_reader *r)
+{
+	return mvirtual_new(TYPE_MARRAY, &reader_ops, r);
+}
@@ -90,50 +90,20 @@ array_ndx(char *s, size_t *alen, size_t *skip, char **errp)
 	return 0;
 }
 
-/* XXX this really needs meaningful return codes */
-int
-mnamespace_lookup(struct mobject *ns, char *location, struct mobject **obj,
-    char *ebuf, size_t elen)
+/*
+ * Resolve the dictionary and array accessors in "location", starting at
+ * offset "o", relative to the object "next". "name" contains the name of
+ * "next" and is used for error messages.
+ */
+static int
+lookup_accessors(struct mobject *next, char *name, char *location, size_t o,
+    struct mobject **obj, char *ebuf, size_t elen)
 {
-	struct mobject *current = ns;
-	struct mobject *next;
-	char name[MNAMESPACE_MAX_ID_LENGTH];
+	struct mobject *current;
 	char type, *cp;
-	size_t l, o = 0, ndx;
-
-	if (mobject_type(ns) != TYPE_MDICT) {
-		format_err(o, location, ebuf, elen,
-		    "Namespace is not of dictionary type");
-		return -1;
-	}
-
-	if (obj != NULL)
-		*obj = NULL;
-	if (*location == '\0') {
-		format_err(o, location, ebuf, elen,
-		    "Empty location specified");
-		return -1;
-	}
+	size_t l, ndx;
 
 	for (;;) {
-		l = strstcpy(name, location + o, sizeof(name), ".[");
-		if (l == 0) {
-			format_err(o, location, ebuf, elen, "Empty name");
-			return -1;
-		}
-		if (l >= sizeof(name)) {
-			format_err(o, location, ebuf, elen,
-			    "Name \"%.8s...\" too long", name);
-			return -1;
-		}
-
-		if ((next = mdict_item_s(current, name)) == NULL) {
-			format_err(o, location, ebuf, elen,
-			    "Name \"%s\" not found", name);
-			return -1;
-		}
-		o += l;
- resolve_next:
 		type = *(location + o++);
 		if (type == '\0') {
 			break;
@@ -144,8 +114,27 @@ mnamespace_lookup(struct mobject *ns, char *location, struct mobject **obj,
 				return -1;
 			}
 			current = next;
+			l = strstcpy(name, location + o,
+			    MNAMESPACE_MAX_ID_LENGTH, ".[");
+			if (l == 0) {
+				format_err(o, location, ebuf, elen,
+				    "Empty name");
+				return -1;
+			}
+			if (l >= MNAMESPACE_MAX_ID_LENGTH) {
+				format_err(o, location, ebuf, elen,
+				    "Name \"%.8s...\" too long", name);
+				return -1;
+			}
+			if ((next = mdict_item_s(current, name)) == NULL) {
+				format_err(o, location, ebuf, elen,
+				    "Name \"%s\" not found", name);
+				return -1;
+			}
+			o += l;
 		} else if (type == '[') {
-			if (mobject_type(next) != TYPE_MARRAY) {
+			if (mobject_type(next) != TYPE_MARRAY &&
+			    mobject_type(next) != TYPE_MDICT) {
 				format_err(o, location, ebuf, elen,
 				    "Name \"%s\" is not an array", name);
 				return -1;
@@ -157,13 +146,33 @@ mnamespace_lookup(struct mobject *ns, char *location, struct mobject **obj,
 				return -1;
 			}
 			o += l;
+			/* Dictionaries may be subscripted by integer key */
+			if (mobject_type(next) == TYPE_MDICT) {
+				if ((next = mdict_item_i(next,
+				    (int64_t)ndx)) == NULL) {
+					format_err(o, location, ebuf, elen,
+					    "Key %zu not found", ndx);
+					return -1;
+				}
+				continue;
+			}
+			/* Streams are read in order, so can't be indexed */
+			if (marray_is_stream(next)) {
+				format_err(o, location, ebuf, elen,
+				    "Name \"%s\" is a stream and can't be "
+				    "indexed", name);
+				return -1;
+			}
 			if (ndx >= marray_len(next)) {
 				format_err(o, location, ebuf, elen,
 				    "Array index is out of bounds");
 				return -1;
 			}			
-			next = marray_item(next, ndx);
-			goto resolve_next;
+			if ((next = marray_item(next, ndx)) == NULL) {
+				format_err(o, location, ebuf, elen,
+				    "Array item %zu not found", ndx);
+				return -1;
+			}
 		} else {
 			format_err(o, location, ebuf, elen, "Parse error");
 			return -1;
@@ -175,6 +184,64 @@ mnamespace_lookup(struct mobject *ns, char *location, struct mobject **obj,
 	return 0;
 }
 
+/* XXX this really needs meaningful return codes */
+int
+mnamespace_lookup(struct mobject *ns, char *location, struct mobject **obj,
+    char *ebuf, size_t elen)
+{
+	struct mobject *next;
+	char name[MNAMESPACE_MAX_ID_LENGTH];
+	size_t l, o = 0;
+
+	if (mobject_type(ns) != TYPE_MDICT) {
+		format_err(o, location, ebuf, elen,
+		    "Namespace is not of dictionary type");
+		return -1;
+	}
+
+	if (obj != NULL)
+		*obj = NULL;
+	if (*location == '\0') {
+		format_err(o, location, ebuf, elen,
+		    "Empty location specified");
+		return -1;
+	}
+
+	l = strstcpy(name, location + o, sizeof(name), ".[");
+	if (l == 0) {
+		format_err(o, location, ebuf, elen, "Empty name");
+		return -1;
+	}
+	if (l >= sizeof(name)) {
+		format_err(o, location, ebuf, elen,
+		    "Name \"%.8s...\" too long", name);
+		return -1;
+	}
+	if ((next = mdict_item_s(ns, name)) == NULL) {
+		format_err(o, location, ebuf, elen,
+		    "Name \"%s\" not found", name);
+		return -1;
+	}
+	o += l;
+	return lookup_accessors(next, name, location, o, obj, ebuf, elen);
+}
+
+int
+mnamespace_lookup_from(struct mobject *base, char *location, size_t offset,
+    struct mobject **obj, char *ebuf, size_t elen)
+{
+	char name[MNAMESPACE_MAX_ID_LENGTH];
+
+	if (obj != NULL)
+		*obj = NULL;
+	if (offset > strlen(location)) {
+		format_err(0, location, ebuf, elen, "Invalid offset");
+		return -1;
+	}
+	snprintf(name, sizeof(name), "%.*s", (int)offset, location);
+	return lookup_accessors(base, name, location, offset, obj, ebuf, elen);
+}
+
 static int
 xalloc_by_typechar(int typechar, struct mobject **xop, char **namep)
 {
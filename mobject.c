@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -58,6 +59,9 @@ struct mstring {
 	enum mobject_type type; /* TYPE_MSTRING */
 	u_char *value;
 	size_t len;
+	u_int borrowed;		/* "value" is not owned by the string */
+	void (*release_cb)(const u_int8_t *, size_t, void *);
+	void *release_ctx;
 };
 
 /* Integer (signed, 64 bit) type */
@@ -66,9 +70,35 @@ struct mint {
 	int64_t value;
 };
 
+/*
+ * Arrays and dictionaries may have one of several internal representations.
+ * All of them start with the same header, so mobject_type() reports them
+ * as ordinary arrays or dictionaries and the marray_* and mdict_*
+ * functions dispatch on the representation.
+ */
+enum mcontainer_repr {
+	REPR_GENERIC = 0,	/* struct marray or struct mdict */
+	REPR_VIRTUAL,		/* struct mvirtual */
+	REPR_SHAPED,		/* struct mshaped */
+	REPR_INT64,		/* struct mtyped, unboxed integers */
+	REPR_STRINGS,		/* struct mtyped, strings packed in a blob */
+	REPR_RANGE,		/* struct mrange */
+	REPR_SLICE,		/* struct mslice */
+	REPR_SELECT,		/* struct mselect */
+	REPR_ORDERED,		/* struct mordered */
+};
+
+/* Common header of array and dictionary representations */
+struct mcontainer {
+	enum mobject_type type; /* TYPE_MARRAY or TYPE_MDICT */
+	enum mcontainer_repr repr;
+};
+#define MCONTAINER_REPR(o)	(((const struct mcontainer *)(o))->repr)
+
 /* Array type */
 struct marray {
 	enum mobject_type type; /* TYPE_MARRAY */
+	enum mcontainer_repr repr; /* REPR_GENERIC */
 	struct mobject **entries;
 	size_t nalloc;
 	size_t nused;
@@ -79,26 +109,205 @@ struct marray {
 struct mdict_entry {
 	struct mobject *key;
 	struct mobject *value;
+	u_int32_t hash;			/* mobject_hash() of key */
+	struct mdict_entry *hnext;	/* Next in the same index bucket */
 	TAILQ_ENTRY(mdict_entry) entry;
 };
 TAILQ_HEAD(mdict_entries, mdict_entry);
-/* XXX: better data structure for dicts here (hash or RB tree) */
 
-/* Dictionary type */
+/*
+ * Dictionary type. Entries are kept in insertion order for iteration and
+ * chained from a hash index on their keys for lookup.
+ */
 struct mdict {
 	enum mobject_type type; /* TYPE_MDICT */
+	enum mcontainer_repr repr; /* REPR_GENERIC */
 	size_t num_entries;
 	struct mdict_entries entries;
+	struct mdict_entry **index;	/* Allocated on first insertion */
+	size_t index_size;		/* Power of two */
+};
+#define MDICT_MIN_INDEX	8
+
+/* Array or dictionary whose contents are supplied by callbacks */
+struct mvirtual {
+	enum mobject_type type; /* TYPE_MARRAY or TYPE_MDICT */
+	enum mcontainer_repr repr; /* REPR_VIRTUAL */
+	const struct mvirtual_ops *ops;
+	void *ctx;
+	struct mobject *dict_cache;	/* Items fetched so far (dicts) */
+	struct mobject **array_cache;	/* Items fetched so far (arrays) */
+	size_t array_cache_len;
+};
+
+/* Shared, immutable key layout of shaped dictionaries */
+struct mshape {
+	u_int64_t id;			/* Unique, never reused */
+	u_int refcount;
+	size_t nkeys;
+	struct mobject **keys;		/* mstrings, in slot order */
+	u_int32_t *hash;		/* Slot + 1 for each key, 0 if unused */
+	size_t hash_size;		/* Power of two */
+};
+
+/*
+ * Dictionary whose keys are described by a shape, with a value for each
+ * key. These are allocated large enough to be converted to a struct mdict
+ * in place when they are modified.
+ */
+struct mshaped {
+	enum mobject_type type; /* TYPE_MDICT */
+	enum mcontainer_repr repr; /* REPR_SHAPED */
+	struct mshape *shape;
+	struct mobject *values[];
+};
+#define MSHAPED_SIZE(n) \
+	MAX(sizeof(struct mdict), \
+	    offsetof(struct mshaped, values) + (n) * sizeof(struct mobject *))
+
+/* struct mdict_cache packs a shape identifier above a slot number */
+#define MDICT_CACHE_SLOT_BITS	24
+#define MDICT_CACHE_SLOT_MASK \
+	(((u_int64_t)1 << MDICT_CACHE_SLOT_BITS) - 1)
+
+/*
+ * Array of integers or strings stored unboxed. Items are presented as
+ * proxy objects that are made on demand and kept until the array is
+ * freed; iterators instead reuse a single proxy of their own. Typed arrays
+ * are allocated large enough to be converted to a struct marray in place.
+ */
+struct mtyped {
+	enum mobject_type type; /* TYPE_MARRAY */
+	enum mcontainer_repr repr; /* REPR_INT64 or REPR_STRINGS */
+	size_t len;
+	size_t nalloc;
+	int64_t *ints;			/* REPR_INT64 only */
+	u_int8_t *blob;			/* REPR_STRINGS only */
+	size_t blob_len;
+	size_t blob_alloc;
+	size_t *offsets;		/* REPR_STRINGS only, len + 1 used */
+	struct mobject **proxies;	/* nalloc entries, allocated lazily */
+};
+#define MTYPED_STRLEN(t, i)	((t)->offsets[(i) + 1] - (t)->offsets[i])
+
+static struct mobject *mtyped_copy(struct mtyped *t);
+
+/*
+ * Read-only array of the integers start, start + step, ... up to (but not
+ * including) a limit. Items are computed rather than stored; they are
+ * presented through proxies in the same way as typed arrays.
+ */
+struct mrange {
+	enum mobject_type type; /* TYPE_MARRAY */
+	enum mcontainer_repr repr; /* REPR_RANGE */
+	int64_t start;
+	int64_t stop;
+	int64_t step;
+	size_t len;
+	struct mobject *proxies;	/* Items fetched so far, by index */
+};
+#define MRANGE_VALUE(r, i) \
+	((int64_t)((u_int64_t)(r)->start + (u_int64_t)(i) * (r)->step))
+
+/*
+ * Read-only view of the items [start, end) of another array, which it
+ * does not own. The window is clipped to the array's current length
+ * whenever it is used.
+ */
+struct mslice {
+	enum mobject_type type; /* TYPE_MARRAY */
+	enum mcontainer_repr repr; /* REPR_SLICE */
+	struct mobject *array;
+	size_t start;
+	size_t end;
+};
+
+/*
+ * Read-only view of chosen items of another array, which it does not own,
+ * in the order of "ndx". Items past the array's current end are missing.
+ */
+struct mselect {
+	enum mobject_type type; /* TYPE_MARRAY */
+	enum mcontainer_repr repr; /* REPR_SELECT */
+	struct mobject *array;
+	size_t n;
+	size_t ndx[];
+};
+
+/*
+ * Node of the B-tree behind an ordered dictionary. Every node but the root
+ * holds between MBTREE_T - 1 and 2 * MBTREE_T - 1 keys. Leaves are plain
+ * nodes; internal nodes are allocated as struct mbtree_inner, which adds
+ * the child pointers that leaves never use.
+ */
+#define MBTREE_T		16
+#define MBTREE_MAX_KEYS		(2 * MBTREE_T - 1)
+#define MBTREE_MAX_DEPTH	16	/* Far more than MARRAY_MAX keys need */
+struct mbtree_node {
+	u_int nkeys;
+	u_int leaf;
+	struct mobject *keys[MBTREE_MAX_KEYS];
+	struct mobject *values[MBTREE_MAX_KEYS];
+};
+struct mbtree_inner {
+	struct mbtree_node node;
+	struct mbtree_node *child[MBTREE_MAX_KEYS + 1];
+};
+/* Child pointers of an internal node */
+#define MBTREE_CHILD(n)		(((struct mbtree_inner *)(n))->child)
+
+/* Dictionary kept in mobject_cmp() order of its keys */
+struct mordered {
+	enum mobject_type type; /* TYPE_MDICT */
+	enum mcontainer_repr repr; /* REPR_ORDERED */
+	size_t len;
+	struct mbtree_node *root;	/* NULL when empty */
+};
+
+static void mordered_free(struct mordered *o);
+
+/* Member of a set, in insertion order */
+struct mset_entry {
+	struct mobject *member;		/* NULL once removed */
+	u_int32_t hash;
+};
+
+/*
+ * Set of hashable objects. Members are kept in insertion order in
+ * "entries"; "index" is an open-addressed hash table of entry numbers.
+ */
+struct mset {
+	enum mobject_type type; /* TYPE_MSET */
+	size_t len;			/* Members present */
+	size_t nused;			/* Entries used, including removed */
+	size_t nalloc;
+	struct mset_entry *entries;
+	size_t *index;			/* Entry + 1, 0 if free */
+	size_t index_size;		/* Power of two */
 };
+#define MSET_REMOVED	((size_t)-1)	/* Index slot of a removed member */
+#define MSET_MIN_INDEX	16
 
 /* Generic iterator */
 struct miterator {
 	struct mobject *object;
 	u_int started;
 	struct miteritem iteritem;
-	size_t array_ndx;		/* Only valid for TYPE_MARRAY */
-	struct mobject *array_last_key;	/* Only valid for TYPE_MARRAY */
+	size_t array_ndx;		/* Only valid for TYPE_MARRAY, _MSET */
+	struct mobject *array_last_key;	/* Only valid for TYPE_MARRAY, _MSET */
+	size_t set_pos;			/* Only valid for TYPE_MSET */
 	struct mdict_entry *dict_ptr;	/* Only valid for TYPE_MDICT */
+	size_t virt_pos;		/* Only valid for REPR_VIRTUAL */
+	struct mobject *virt_key;	/* Only valid for REPR_VIRTUAL dicts */
+	struct mobject *virt_value;	/* Only valid for REPR_VIRTUAL */
+	size_t shape_ndx;		/* Only valid for REPR_SHAPED */
+	struct mobject *proxy;		/* Only valid for typed arrays, ranges */
+	/* Path to the next item, only valid for REPR_ORDERED */
+	struct mbtree_node *tree_node[MBTREE_MAX_DEPTH];
+	u_int tree_pos[MBTREE_MAX_DEPTH];
+	u_int tree_depth;
+	struct mobject *range_lo;	/* Only valid for REPR_ORDERED */
+	struct mobject *range_hi;	/* Only valid for REPR_ORDERED */
 };
 
 /* Single instance of mnone */
@@ -159,6 +368,37 @@ mstring_new(const char *value)
 	return mstring_new2((u_int8_t *)value, strlen(value));
 }
 
+struct mobject *
+mstring_new_ref(const u_int8_t *value, size_t len,
+    void (*release_cb)(const u_int8_t *, size_t, void *), void *ctx)
+{
+	struct mstring *ret;
+
+	if (len > MSTRING_MAX - 1)
+		return NULL;
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	ret->type = TYPE_MSTRING;
+	ret->value = (u_char *)value;
+	ret->len = len;
+	ret->borrowed = 1;
+	ret->release_cb = release_cb;
+	ret->release_ctx = ctx;
+	return (struct mobject *)ret;
+}
+
+struct mobject *
+mstring_slice(const struct mobject *_s, size_t offset, size_t len)
+{
+	struct mstring *s = (struct mstring *)_s;
+
+	if (s->type != TYPE_MSTRING)
+		return NULL;
+	if (offset > s->len || len > s->len - offset)
+		return NULL;
+	return mstring_new_ref(s->value + offset, len, NULL, NULL);
+}
+
 struct mobject *
 marray_new(void)
 {
@@ -183,6 +423,320 @@ mdict_new(void)
 	return (struct mobject *)ret;
 }
 
+struct mobject *
+mvirtual_new(enum mobject_type type, const struct mvirtual_ops *ops,
+    void *ctx)
+{
+	struct mvirtual *ret;
+
+	switch (type) {
+	case TYPE_MARRAY:
+		if (ops->array_item == NULL && ops->next == NULL)
+			return NULL;
+		break;
+	case TYPE_MDICT:
+		if (ops->dict_item == NULL || ops->next == NULL)
+			return NULL;
+		break;
+	default:
+		return NULL;
+	}
+	if (ops->len == NULL)
+		return NULL;
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	ret->type = type;
+	ret->repr = REPR_VIRTUAL;
+	ret->ops = ops;
+	ret->ctx = ctx;
+	return (struct mobject *)ret;
+}
+
+const char *
+mvirtual_error(struct mobject *o)
+{
+	struct mvirtual *v = (struct mvirtual *)o;
+
+	if ((o->type != TYPE_MARRAY && o->type != TYPE_MDICT) ||
+	    MCONTAINER_REPR(o) != REPR_VIRTUAL || v->ops->error == NULL)
+		return NULL;
+	return v->ops->error(v->ctx);
+}
+
+/* Identifier for the next shape allocated; zero is never used */
+static u_int64_t mshape_next_id = 1;
+
+/* FNV-1a */
+static u_int32_t
+mshape_hash(const u_int8_t *p, size_t len)
+{
+	u_int32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+/* Find the slot for "key" in a shape */
+static int
+mshape_lookup(const struct mshape *shape, const struct mobject *key,
+    size_t *slotp)
+{
+	const u_int8_t *k = mstring_ptr(key);
+	size_t klen = mstring_len(key);
+	size_t i, mask = shape->hash_size - 1;
+	u_int32_t slot;
+
+	for (i = mshape_hash(k, klen) & mask;
+	    (slot = shape->hash[i]) != 0; i = (i + 1) & mask) {
+		if (mstring_len(shape->keys[slot - 1]) == klen &&
+		    memcmp(mstring_ptr(shape->keys[slot - 1]), k, klen) == 0) {
+			*slotp = slot - 1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void
+mshape_unref(struct mshape *shape)
+{
+	size_t i;
+
+	if (--shape->refcount > 0)
+		return;
+	for (i = 0; i < shape->nkeys; i++) {
+		if (shape->keys[i] != NULL)
+			mobject_free(shape->keys[i]);
+	}
+	free(shape->keys);
+	free(shape->hash);
+	bzero(shape, sizeof(*shape));
+	free(shape);
+}
+
+struct mshape *
+mshape_new(const char * const *keys, size_t nkeys)
+{
+	struct mshape *ret;
+	size_t i, j, slot;
+
+	if (nkeys > MARRAY_MAX)
+		return NULL;
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	/* Shapes may be made in several threads, and ids must be unique */
+	ret->id = __atomic_fetch_add(&mshape_next_id, 1, __ATOMIC_RELAXED);
+	ret->refcount = 1;
+	for (ret->hash_size = 8; ret->hash_size < nkeys * 2;
+	    ret->hash_size <<= 1)
+		;
+	if ((ret->keys = calloc(MAX(nkeys, 1), sizeof(*ret->keys))) == NULL ||
+	    (ret->hash = calloc(ret->hash_size, sizeof(*ret->hash))) == NULL)
+		goto fail;
+	for (i = 0; i < nkeys; i++) {
+		if ((ret->keys[i] = mstring_new(keys[i])) == NULL)
+			goto fail;
+		ret->nkeys = i + 1;
+		/* Duplicate keys are not allowed */
+		if (mshape_lookup(ret, ret->keys[i], &slot) == 0)
+			goto fail;
+		for (j = mshape_hash(mstring_ptr(ret->keys[i]),
+		    mstring_len(ret->keys[i])) & (ret->hash_size - 1);
+		    ret->hash[j] != 0; j = (j + 1) & (ret->hash_size - 1))
+			;
+		ret->hash[j] = i + 1;
+	}
+	return ret;
+ fail:
+	mshape_unref(ret);
+	return NULL;
+}
+
+void
+mshape_free(struct mshape *shape)
+{
+	mshape_unref(shape);
+}
+
+size_t
+mshape_len(const struct mshape *shape)
+{
+	return shape->nkeys;
+}
+
+struct mobject *
+mdict_new_shaped(struct mshape *shape)
+{
+	struct mshaped *ret;
+	size_t i;
+
+	if ((ret = calloc(1, MSHAPED_SIZE(shape->nkeys))) == NULL)
+		return NULL;
+	ret->type = TYPE_MDICT;
+	ret->repr = REPR_SHAPED;
+	ret->shape = shape;
+	for (i = 0; i < shape->nkeys; i++) {
+		if ((ret->values[i] = mnone_new()) == NULL) {
+			free(ret);
+			return NULL;
+		}
+	}
+	shape->refcount++;
+	return (struct mobject *)ret;
+}
+
+static struct mobject *
+mtyped_new(enum mcontainer_repr repr)
+{
+	struct mtyped *ret;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	ret->type = TYPE_MARRAY;
+	ret->repr = repr;
+	if (repr == REPR_STRINGS) {
+		/* Never leave the blob NULL, so empty strings have a pointer */
+		ret->blob_alloc = 64;
+		if ((ret->blob = malloc(ret->blob_alloc)) == NULL ||
+		    (ret->offsets = calloc(1, sizeof(*ret->offsets))) == NULL) {
+			free(ret->blob);
+			free(ret);
+			return NULL;
+		}
+	}
+	return (struct mobject *)ret;
+}
+
+struct mobject *
+marray_new_int64(void)
+{
+	return mtyped_new(REPR_INT64);
+}
+
+struct mobject *
+marray_new_strings(void)
+{
+	return mtyped_new(REPR_STRINGS);
+}
+
+struct mobject *
+marray_new_range(int64_t start, int64_t stop, int64_t step)
+{
+	struct mrange *ret;
+	u_int64_t n = 0;
+
+	if (step == 0)
+		return NULL;
+	/* Count in unsigned arithmetic so extreme limits don't overflow */
+	if (step > 0 && start < stop) {
+		n = ((u_int64_t)stop - (u_int64_t)start - 1) /
+		    (u_int64_t)step + 1;
+	} else if (step < 0 && start > stop) {
+		n = ((u_int64_t)start - (u_int64_t)stop - 1) /
+		    -(u_int64_t)step + 1;
+	}
+	if (n > SIZE_MAX || (ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	ret->type = TYPE_MARRAY;
+	ret->repr = REPR_RANGE;
+	ret->start = start;
+	ret->stop = stop;
+	ret->step = step;
+	ret->len = n;
+	return (struct mobject *)ret;
+}
+
+struct mobject *
+marray_slice(struct mobject *array, size_t start, size_t end)
+{
+	struct mslice *ret, *s = (struct mslice *)array;
+
+	if (array->type != TYPE_MARRAY)
+		return NULL;
+	/* Streams can't be read out of order */
+	if (marray_is_stream(array))
+		return NULL;
+	if (end < start)
+		end = start;
+	/* Slices of slices view the original array */
+	if (MCONTAINER_REPR(array) == REPR_SLICE) {
+		start = MIN(start, s->end - s->start) + s->start;
+		end = MIN(end, s->end - s->start) + s->start;
+		array = s->array;
+	}
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	ret->type = TYPE_MARRAY;
+	ret->repr = REPR_SLICE;
+	ret->array = array;
+	ret->start = start;
+	ret->end = end;
+	return (struct mobject *)ret;
+}
+
+struct mobject *
+marray_select(struct mobject *array, const size_t *ndx, size_t n)
+{
+	struct mselect *ret, *sel = (struct mselect *)array;
+	struct mslice *s = (struct mslice *)array;
+	size_t i;
+
+	if (array->type != TYPE_MARRAY || n > MARRAY_MAX)
+		return NULL;
+	if (marray_is_stream(array))
+		return NULL;
+	if ((ret = calloc(1, sizeof(*ret) + n * sizeof(*ret->ndx))) == NULL)
+		return NULL;
+	ret->type = TYPE_MARRAY;
+	ret->repr = REPR_SELECT;
+	ret->array = array;
+	ret->n = n;
+	/* Selections from slices and selections view the original array */
+	for (i = 0; i < n; i++) {
+		ret->ndx[i] = ndx[i];
+		if (MCONTAINER_REPR(array) == REPR_SLICE) {
+			if (ndx[i] >= s->end - s->start)
+				goto fail;
+			ret->ndx[i] += s->start;
+			ret->array = s->array;
+		} else if (MCONTAINER_REPR(array) == REPR_SELECT) {
+			if (ndx[i] >= sel->n)
+				goto fail;
+			ret->ndx[i] = sel->ndx[ndx[i]];
+			ret->array = sel->array;
+		}
+	}
+	return (struct mobject *)ret;
+ fail:
+	free(ret);
+	return NULL;
+}
+
+/* Find the index in the viewed array of item "ndx" of a selection */
+static int
+mselect_ndx(struct mselect *s, size_t ndx, size_t *ndxp)
+{
+	if (ndx >= s->n || s->ndx[ndx] >= marray_len(s->array))
+		return -1;
+	*ndxp = s->ndx[ndx];
+	return 0;
+}
+
+/* Find the index in the viewed array of item "ndx" of a slice */
+static int
+mslice_ndx(struct mslice *s, size_t ndx, size_t *ndxp)
+{
+	size_t len = marray_len(s->array);
+
+	if (ndx >= MIN(s->end, len) - MIN(s->start, len))
+		return -1;
+	*ndxp = s->start + ndx;
+	return 0;
+}
+
 enum mobject_type
 mobject_type(const struct mobject *obj)
 {
@@ -198,7 +752,11 @@ mnone_free(const struct mnone *o)
 static void
 mstring_free(struct mstring *o)
 {
-	if (o->value != NULL && o->len > 0) {
+	if (o->borrowed) {
+		/* Borrowed memory may be read-only, so don't scrub it */
+		if (o->release_cb != NULL)
+			o->release_cb(o->value, o->len, o->release_ctx);
+	} else if (o->value != NULL) {
 		bzero(o->value, o->len);
 		free(o->value);
 	}
@@ -243,43 +801,152 @@ mdict_free(struct mdict *o)
 		bzero(oe, sizeof(*oe));
 		free(oe);
 	}
+	free(o->index);
 	bzero(o, sizeof(*o));
 	free(o);
 }
 
-void
-mobject_free(struct mobject *o)
+static void
+mvirtual_free(struct mvirtual *o)
 {
-	switch (o->type) {
-	case TYPE_MNONE:
-		mnone_free((struct mnone *)o);
-		break;
-	case TYPE_MSTRING:
-		mstring_free((struct mstring *)o);
-		break;
-	case TYPE_MINT:
-		mint_free((struct mint *)o);
-		break;
-	case TYPE_MARRAY:
-		marray_free((struct marray *)o);
-		break;
-	case TYPE_MDICT:
-		mdict_free((struct mdict *)o);
-		break;
+	size_t i;
+
+	if (o->dict_cache != NULL)
+		mobject_free(o->dict_cache);
+	for (i = 0; i < o->array_cache_len; i++) {
+		if (o->array_cache[i] != NULL)
+			mobject_free(o->array_cache[i]);
 	}
+	free(o->array_cache);
+	if (o->ops->free != NULL)
+		o->ops->free(o->ctx);
+	bzero(o, sizeof(*o));
+	free(o);
 }
 
-static size_t
-mstring_to_string(const struct mstring *o, char *s, size_t len)
+static void
+mshaped_free(struct mshaped *o)
 {
-	char vbuf[5], *ve;
-	size_t i, j, l, done = 0;
+	size_t i, n = o->shape->nkeys;
 
-	/* This is basically strnvis + strvisx */
-	for (i = j = 0; i < o->len; i++) {
-		ve = vis(vbuf, o->value[i], VIS_OCTAL,
-		    (i + 1) < o->len ? 0 : o->value[i + 1]);
-		l = ve - vbuf;
+	for (i = 0; i < n; i++)
+		mobject_free(o->values[i]);
+	mshape_unref(o->shape);
+	bzero(o, MSHAPED_SIZE(n));
+	free(o);
+}
+
+static void
+mtyped_free(struct mtyped *o)
+{
+	size_t i;
+
+	if (o->proxies != NULL) {
+		for (i = 0; i < o->len; i++) {
+			if (o->proxies[i] != NULL)
+				mobject_free(o->proxies[i]);
+		}
+		free(o->proxies);
+	}
+	free(o->ints);
+	free(o->blob);
+	free(o->offsets);
+	bzero(o, sizeof(*o));
+	free(o);
+}
+
+static void
+mset_free(struct mset *o)
+{
+	size_t i;
+
+	for (i = 0; i < o->nused; i++) {
+		if (o->entries[i].member != NULL)
+			mobject_free(o->entries[i].member);
+	}
+	free(o->entries);
+	free(o->index);
+	bzero(o, sizeof(*o));
+	free(o);
+}
+
+static void
+mrange_free(struct mrange *o)
+{
+	if (o->proxies != NULL)
+		mobject_free(o->proxies);
+	bzero(o, sizeof(*o));
+	free(o);
+}
+
+void
+mobject_free(struct mobject *o)
+{
+	if (o->type == TYPE_MARRAY || o->type == TYPE_MDICT) {
+		switch (MCONTAINER_REPR(o)) {
+		case REPR_VIRTUAL:
+			mvirtual_free((struct mvirtual *)o);
+			return;
+		case REPR_SHAPED:
+			mshaped_free((struct mshaped *)o);
+			return;
+		case REPR_INT64:
+		case REPR_STRINGS:
+			mtyped_free((struct mtyped *)o);
+			return;
+		case REPR_RANGE:
+			mrange_free((struct mrange *)o);
+			return;
+		case REPR_SLICE:
+			bzero(o, sizeof(struct mslice));
+			free(o);
+			return;
+		case REPR_SELECT:
+			bzero(o, sizeof(struct mselect) +
+			    ((struct mselect *)o)->n * sizeof(size_t));
+			free(o);
+			return;
+		case REPR_ORDERED:
+			mordered_free((struct mordered *)o);
+			return;
+		default:
+			break;
+		}
+	}
+	switch (o->type) {
+	case TYPE_MNONE:
+		mnone_free((struct mnone *)o);
+		break;
+	case TYPE_MSTRING:
+		mstring_free((struct mstring *)o);
+		break;
+	case TYPE_MINT:
+		mint_free((struct mint *)o);
+		break;
+	case TYPE_MARRAY:
+		marray_free((struct marray *)o);
+		break;
+	case TYPE_MDICT:
+		mdict_free((struct mdict *)o);
+		break;
+	case TYPE_MSET:
+		mset_free((struct mset *)o);
+		break;
+	}
+}
+
+static size_t
+mstring_to_string(const struct mstring *o, char *s, size_t len)
+{
+	char vbuf[5], *ve;
+	size_t i, j, l, done = 0;
+
+	/* This is basically strnvis + strvisx */
+	for (i = j = 0; i < o->len; i++) {
+		/* NB. borrowed strings are not nul-terminated */
+		ve = vis(vbuf, o->value[i], VIS_OCTAL,
+		    (i + 1) < o->len ? o->value[i + 1] : 0);
+		l = ve - vbuf;
 		if (!done && j + l + 1 <= len)
 			memcpy(s + j, vbuf, l + 1);
 		else
@@ -304,9 +971,12 @@ mobject_to_string(const struct mobject *o, char *s, size_t len)
 		    (unsigned long long)((struct mint *)o)->value);
 	case TYPE_MARRAY:
 		return snprintf(s, len, "marray(%p, %llu)", o,
-		    (unsigned long long)((struct marray *)o)->nused);
+		    (unsigned long long)marray_len((struct mobject *)o));
 	case TYPE_MDICT:
 		return snprintf(s, len, "mdict(%p)", o);
+	case TYPE_MSET:
+		return snprintf(s, len, "mset(%p, %llu)", o,
+		    (unsigned long long)mset_len(o));
 	default:
 		return strlcpy(s, "Unsupported object type %d", o->type);
 	}
@@ -329,18 +999,48 @@ mobject_deepcopy(struct mobject *o)
 	case TYPE_MINT:
 		return mint_new(mint_value(o));
 	case TYPE_MARRAY:
-		if ((new_obj = marray_new()) == NULL)
+		if (MCONTAINER_REPR(o) == REPR_INT64 ||
+		    MCONTAINER_REPR(o) == REPR_STRINGS)
+			return mtyped_copy((struct mtyped *)o);
+		if (MCONTAINER_REPR(o) == REPR_RANGE) {
+			struct mrange *r = (struct mrange *)o;
+
+			return marray_new_range(r->start, r->stop, r->step);
+		}
+		/* Streams can only be read once */
+		if (marray_is_stream(o) || (new_obj = marray_new()) == NULL)
 			return NULL;
 		for (n = 0; n < marray_len(o); n++) {
-			if ((v = mobject_deepcopy(marray_item(o, n))) == NULL) {
+			/* Virtual arrays may fail to supply an item */
+			if ((v = marray_item(o, n)) == NULL ||
+			    (v = mobject_deepcopy(v)) == NULL) {
 				mobject_free(new_obj);
 				return NULL;
 			}
 			marray_set(new_obj, n, v);
 		}
 		return new_obj;
+	case TYPE_MSET:
+		return mset_union(o, NULL);
 	case TYPE_MDICT:
-		if ((new_obj = mdict_new()) == NULL)
+		if (MCONTAINER_REPR(o) == REPR_SHAPED) {
+			struct mshaped *sd = (struct mshaped *)o;
+
+			/* Copies share the shape */
+			if ((new_obj = mdict_new_shaped(sd->shape)) == NULL)
+				return NULL;
+			for (n = 0; n < sd->shape->nkeys; n++) {
+				if ((v = mobject_deepcopy(sd->values[n])) ==
+				    NULL) {
+					mobject_free(new_obj);
+					return NULL;
+				}
+				mdict_set_slot(new_obj, n, v);
+			}
+			return new_obj;
+		}
+		if ((new_obj = MCONTAINER_REPR(o) == REPR_ORDERED ?
+		    mdict_new_ordered() : mdict_new()) == NULL)
 			return NULL;
 		if ((iter = mobject_getiter(o)) == NULL) {
 			mobject_free(new_obj);
@@ -411,194 +1111,817 @@ mstring_ptr(const struct mobject *_s)
 	return s->value;
 }
 
-static int
-marray_resize(struct marray *array, size_t want)
+static size_t
+mvirtual_len(struct mvirtual *v)
 {
-	struct mobject **tmp;
-	size_t n, i;
-
-	if (want < array->nalloc)
-		return 0;
-	/*
-	 * Allocate the next power of two up.
-	 * NB. MARRAY_MAX must be sized to avoid integer overflow
-	 */
-	for (n = MAX(array->nalloc, 4); n < MARRAY_MAX && n <= want; n <<= 1)
-		;
-	if (n >= MARRAY_MAX || n <= array->nused || n <= want)
-		return -1;	
-	if ((tmp = realloc(array->entries, n * sizeof(*array->entries))) == NULL)
-		return -1;
-	array->entries = tmp;
-	array->nalloc = n;
-	/* Zero just-allocated entries */
-	for (i = array->nused; i < array->nalloc; i++)
-		array->entries[i] = NULL;
-	return 0;
+	return v->ops->len(v->ctx);
 }
 
-int
-marray_prepend(struct mobject *_array, struct mobject *object)
+/* Items fetched from virtual objects are kept until the object is freed */
+static struct mobject *
+mvirtual_array_item(struct mvirtual *v, size_t ndx)
 {
-	struct marray *array = (struct marray *)_array;
+	struct mobject **tmp, *ret;
+	size_t n;
 
-	if (array->type != TYPE_MARRAY)
-		return -1;
-	if (marray_resize(array, array->nused + 1) == -1)
-		return -1;
-	memmove(array->entries + 1, array->entries,
-	    sizeof(*array->entries) * array->nused);
-	array->entries[0] = object;
-	array->nused++;
-	return 0;
+	if (v->ops->array_item == NULL || ndx >= mvirtual_len(v))
+		return NULL;
+	if (ndx < v->array_cache_len && v->array_cache[ndx] != NULL)
+		return v->array_cache[ndx];
+	if (ndx >= v->array_cache_len) {
+		for (n = MAX(v->array_cache_len, 16); n <= ndx; n <<= 1)
+			;
+		if (n > MARRAY_MAX || (tmp = realloc(v->array_cache,
+		    n * sizeof(*tmp))) == NULL)
+			return NULL;
+		bzero(tmp + v->array_cache_len,
+		    (n - v->array_cache_len) * sizeof(*tmp));
+		v->array_cache = tmp;
+		v->array_cache_len = n;
+	}
+	if ((ret = v->ops->array_item(v->ctx, ndx)) == NULL)
+		return NULL;
+	v->array_cache[ndx] = ret;
+	return ret;
 }
 
-int
-marray_append(struct mobject *_array, struct mobject *object)
+static struct mobject *
+mvirtual_dict_item(struct mvirtual *v, const struct mobject *key)
 {
-	struct marray *array = (struct marray *)_array;
+	struct mobject *ret, *k;
 
-	if (array->type != TYPE_MARRAY)
-		return -1;
-	if (marray_resize(array, array->nused + 1) == -1)
-		return -1;
-	array->entries[array->nused++] = object;
-	return 0;
+	if (v->dict_cache == NULL &&
+	    (v->dict_cache = mdict_new()) == NULL)
+		return NULL;
+	if ((ret = mdict_item(v->dict_cache, key)) != NULL)
+		return ret;
+	if ((ret = v->ops->dict_item(v->ctx, key)) == NULL)
+		return NULL;
+	if ((k = mobject_deepcopy((struct mobject *)key)) == NULL ||
+	    mdict_insert(v->dict_cache, k, ret) != 0) {
+		if (k != NULL)
+			mobject_free(k);
+		mobject_free(ret);
+		return NULL;
+	}
+	return ret;
 }
 
-int
-marray_set(struct mobject *_array, size_t ndx, struct mobject *object)
+/* Make room for at least "want" items in a typed array */
+static int
+mtyped_resize(struct mtyped *t, size_t want)
 {
-	struct marray *array = (struct marray *)_array;
-	size_t i;
+	struct mobject **proxies;
+	int64_t *ints;
+	size_t n, *offsets;
 
-	if (array->type != TYPE_MARRAY)
-		return -1;
-	if (ndx >= MARRAY_MAX)
-		return -1;
-	if (marray_resize(array, ndx + 1) == -1)
+	if (want <= t->nalloc)
+		return 0;
+	for (n = MAX(t->nalloc, 16); n < MARRAY_MAX && n < want; n <<= 1)
+		;
+	if (n >= MARRAY_MAX || n < want)
 		return -1;
-	/* Fill unallocated entries with None */
-	for (i = array->nused; i < ndx; i++)
-		array->entries[i] = (struct mobject *)mnone_new();
-	if (array->entries[ndx] != NULL)
-		mobject_free(array->entries[ndx]);
-	array->entries[ndx] = object;
-	array->nused = MAX(array->nused, ndx + 1);
+	if (t->repr == REPR_INT64) {
+		if ((ints = realloc(t->ints, n * sizeof(*ints))) == NULL)
+			return -1;
+		t->ints = ints;
+	} else {
+		if ((offsets = realloc(t->offsets,
+		    (n + 1) * sizeof(*offsets))) == NULL)
+			return -1;
+		t->offsets = offsets;
+	}
+	if (t->proxies != NULL) {
+		if ((proxies = realloc(t->proxies,
+		    n * sizeof(*proxies))) == NULL)
+			return -1;
+		bzero(proxies + t->nalloc, (n - t->nalloc) * sizeof(*proxies));
+		t->proxies = proxies;
+	}
+	t->nalloc = n;
 	return 0;
 }
 
-size_t
-marray_len(struct mobject *_array)
+/* Make room for "len" more bytes in a typed string array's blob */
+static int
+mtyped_blob_reserve(struct mtyped *t, size_t len)
 {
-	struct marray *array = (struct marray *)_array;
+	u_int8_t *blob;
+	size_t n, i;
 
-	if (array->type != TYPE_MARRAY)
+	if (len > MSTRING_MAX || t->blob_len + len > SIZE_MAX / 4)
+		return -1;
+	if (t->blob_len + len <= t->blob_alloc)
 		return 0;
-	return array->nused;
+	for (n = t->blob_alloc; n < t->blob_len + len; n <<= 1)
+		;
+	if ((blob = realloc(t->blob, n)) == NULL)
+		return -1;
+	/* Proxies borrow from the blob, so point them at its new home */
+	if (blob != t->blob && t->proxies != NULL) {
+		for (i = 0; i < t->len; i++) {
+			if (t->proxies[i] != NULL) {
+				((struct mstring *)t->proxies[i])->value =
+				    blob + t->offsets[i];
+			}
+		}
+	}
+	t->blob = blob;
+	t->blob_alloc = n;
+	return 0;
 }
 
-struct mobject *
-marray_last(struct mobject *_array)
+/* Make an object for an item of a typed array, reusing "proxy" if set */
+static struct mobject *
+mtyped_make_proxy(struct mtyped *t, size_t ndx, struct mobject *proxy)
 {
-	struct marray *array = (struct marray *)_array;
+	struct mstring *ps = (struct mstring *)proxy;
 
-	if (array->type != TYPE_MARRAY)
-		return NULL;
-	return array->nused == 0 ? NULL : array->entries[array->nused - 1];
+	if (t->repr == REPR_INT64) {
+		if (proxy == NULL)
+			return mint_new(t->ints[ndx]);
+		((struct mint *)proxy)->value = t->ints[ndx];
+		return proxy;
+	}
+	if (proxy == NULL) {
+		return mstring_new_ref(t->blob + t->offsets[ndx],
+		    MTYPED_STRLEN(t, ndx), NULL, NULL);
+	}
+	ps->value = t->blob + t->offsets[ndx];
+	ps->len = MTYPED_STRLEN(t, ndx);
+	return proxy;
 }
 
-struct mobject *
-marray_first(struct mobject *_array)
+static struct mobject *
+mtyped_item(struct mtyped *t, size_t ndx)
 {
-	struct marray *array = (struct marray *)_array;
-
-	if (array->type != TYPE_MARRAY)
+	if (ndx >= t->len)
+		return NULL;
+	if (t->proxies == NULL &&
+	    (t->proxies = calloc(t->nalloc, sizeof(*t->proxies))) == NULL)
 		return NULL;
-	return array->nused == 0 ? NULL : array->entries[0];
+	if (t->proxies[ndx] == NULL)
+		t->proxies[ndx] = mtyped_make_proxy(t, ndx, NULL);
+	return t->proxies[ndx];
 }
 
-struct mobject *
-marray_pop(struct mobject *_array)
+/*
+ * Items are kept in a dictionary keyed by index rather than a table, so
+ * that fetching one far into a long range costs only that item.
+ */
+static struct mobject *
+mrange_item(struct mrange *r, size_t ndx)
 {
-	struct marray *array = (struct marray *)_array;
 	struct mobject *ret;
 
-	if (array->type != TYPE_MARRAY)
+	if (ndx >= r->len || ndx >= MARRAY_MAX)
 		return NULL;
-	if (array->nused == 0)
+	if (r->proxies == NULL && (r->proxies = mdict_new()) == NULL)
 		return NULL;
-	ret = array->entries[--array->nused];
-	array->entries[array->nused] = NULL;
+	if ((ret = mdict_item_i(r->proxies, (int64_t)ndx)) != NULL)
+		return ret;
+	if ((ret = mint_new(MRANGE_VALUE(r, ndx))) == NULL)
+		return NULL;
+	if (mdict_insert_i(r->proxies, (int64_t)ndx, ret) == NULL) {
+		mobject_free(ret);
+		return NULL;
+	}
 	return ret;
 }
 
-struct mobject *
-marray_pull(struct mobject *_array)
+static struct mobject *
+mtyped_copy(struct mtyped *t)
 {
-	struct marray *array = (struct marray *)_array;
-	struct mobject *ret;
+	struct mtyped *ret;
 
-	if (array->type != TYPE_MARRAY)
-		return NULL;
-	if (array->nused == 0)
+	if ((ret = (struct mtyped *)mtyped_new(t->repr)) == NULL)
 		return NULL;
-	ret = array->entries[0];
-	array->nused--;
-	if (array->nused == 0)
-		array->entries[0] = NULL;
+	if (mtyped_resize(ret, t->len) != 0)
+		goto fail;
+	if (t->repr == REPR_INT64)
+		memcpy(ret->ints, t->ints, t->len * sizeof(*t->ints));
 	else {
-		memmove(array->entries, array->entries + 1,
-		    sizeof(*array->entries) * array->nused);
+		if (mtyped_blob_reserve(ret, t->blob_len) != 0)
+			goto fail;
+		memcpy(ret->blob, t->blob, t->blob_len);
+		memcpy(ret->offsets, t->offsets,
+		    (t->len + 1) * sizeof(*t->offsets));
+		ret->blob_len = t->blob_len;
 	}
-	return ret;
+	ret->len = t->len;
+	return (struct mobject *)ret;
+ fail:
+	mtyped_free(ret);
+	return NULL;
 }
 
-struct mobject *
-marray_item(struct mobject *_array, size_t ndx)
+/*
+ * Convert a typed array to the generic representation in place, before
+ * it is modified in a way other than appending a value of its type.
+ * Proxies that have already been handed out become the array's entries.
+ */
+static int
+mtyped_to_generic(struct mobject *_array)
 {
+	struct mtyped *t = (struct mtyped *)_array;
 	struct marray *array = (struct marray *)_array;
+	struct mobject **entries, **proxies = t->proxies;
+	u_int8_t **copies = NULL;
+	size_t i, n = t->len, nalloc = MAX(t->nalloc, 4);
+	struct mstring *ps;
 
-	if (array->type != TYPE_MARRAY)
-		return NULL;
-	if (ndx >= array->nused)
-		return NULL;
-	return array->entries[ndx];
+	if ((entries = calloc(nalloc, sizeof(*entries))) == NULL)
+		return -1;
+	if (t->repr == REPR_STRINGS && proxies != NULL &&
+	    (copies = calloc(MAX(n, 1), sizeof(*copies))) == NULL) {
+		free(entries);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (proxies == NULL || proxies[i] == NULL) {
+			if (t->repr == REPR_INT64)
+				entries[i] = mint_new(t->ints[i]);
+			else {
+				entries[i] = mstring_new2(
+				    t->blob + t->offsets[i],
+				    MTYPED_STRLEN(t, i));
+			}
+			if (entries[i] == NULL)
+				goto fail;
+		} else if (copies != NULL) {
+			/* Borrowed proxies need their own copy of the data */
+			if ((copies[i] = malloc(MTYPED_STRLEN(t, i) + 1)) ==
+			    NULL)
+				goto fail;
+			memcpy(copies[i], t->blob + t->offsets[i],
+			    MTYPED_STRLEN(t, i));
+			copies[i][MTYPED_STRLEN(t, i)] = '\0';
+		}
+	}
+	/* Nothing can fail from here on */
+	for (i = 0; proxies != NULL && i < n; i++) {
+		if (proxies[i] == NULL)
+			continue;
+		entries[i] = proxies[i];
+		if (copies != NULL) {
+			ps = (struct mstring *)entries[i];
+			ps->value = copies[i];
+			ps->borrowed = 0;
+		}
+	}
+	free(copies);
+	free(proxies);
+	free(t->ints);
+	free(t->blob);
+	free(t->offsets);
+	/* NB. the generic header overlays the typed one */
+	bzero(t, sizeof(*t));
+	array->type = TYPE_MARRAY;
+	array->repr = REPR_GENERIC;
+	array->entries = entries;
+	array->nalloc = nalloc;
+	array->nused = n;
+	return 0;
+ fail:
+	for (i = 0; i < n; i++) {
+		if (proxies == NULL || proxies[i] == NULL) {
+			if (entries[i] != NULL)
+				mobject_free(entries[i]);
+		} else if (copies != NULL)
+			free(copies[i]);
+	}
+	free(entries);
+	free(copies);
+	return -1;
 }
 
+/* Convert typed arrays to the generic representation before modification */
 static int
-mobject_cmp_byaddr(const struct mobject *a, const struct mobject *b)
+marray_make_generic(struct marray *array)
 {
-	if (a == b)
+	switch (array->repr) {
+	case REPR_GENERIC:
 		return 0;
-	return a < b ? -1 : 1;
+	case REPR_INT64:
+	case REPR_STRINGS:
+		return mtyped_to_generic((struct mobject *)array);
+	default:
+		return -1;
+	}
 }
 
-static int
-marray_cmp(const struct mobject *_a, const struct mobject *_b)
+int
+marray_append_int64(struct mobject *_array, int64_t v)
 {
-	struct marray *a = (struct marray *)_a;
-	struct marray *b = (struct marray *)_b;
-	size_t i;
-	int r;
+	struct mtyped *t = (struct mtyped *)_array;
+	struct mobject *o;
 
-	if (a->nused != b->nused)
-		return a->nused < b->nused ? -1 : 1;
-	for (i = 0; i < a->nused; i++) {
-		if (a->entries[i] == NULL) {
-			if (b->entries[i] == NULL)
-				continue;
+	if (t->type != TYPE_MARRAY)
+		return -1;
+	if (t->repr == REPR_INT64) {
+		if (mtyped_resize(t, t->len + 1) != 0)
 			return -1;
-		}
-		if (b->entries[i] == NULL)
-			return 1;
-		if ((r = mobject_cmp(a->entries[i], b->entries[i])) != 0)
-			return r;
+		t->ints[t->len++] = v;
+		return 0;
+	}
+	if ((o = mint_new(v)) == NULL)
+		return -1;
+	if (marray_append(_array, o) != 0) {
+		mobject_free(o);
+		return -1;
 	}
 	return 0;
 }
 
-static int
+int
+marray_append_str(struct mobject *_array, const void *s, size_t len)
+{
+	struct mtyped *t = (struct mtyped *)_array;
+	struct mobject *o;
+
+	if (t->type != TYPE_MARRAY)
+		return -1;
+	if (t->repr == REPR_STRINGS) {
+		if (mtyped_resize(t, t->len + 1) != 0 ||
+		    mtyped_blob_reserve(t, len) != 0)
+			return -1;
+		memcpy(t->blob + t->blob_len, s, len);
+		t->blob_len += len;
+		t->offsets[++t->len] = t->blob_len;
+		return 0;
+	}
+	if ((o = mstring_new2(s, len)) == NULL)
+		return -1;
+	if (marray_append(_array, o) != 0) {
+		mobject_free(o);
+		return -1;
+	}
+	return 0;
+}
+
+int
+marray_get_int64(struct mobject *array, size_t ndx, int64_t *vp)
+{
+	struct mtyped *t = (struct mtyped *)array;
+	struct mobject *o;
+
+	if (t->type != TYPE_MARRAY)
+		return -1;
+	if (t->repr == REPR_INT64) {
+		if (ndx >= t->len)
+			return -1;
+		*vp = t->ints[ndx];
+		return 0;
+	}
+	if (t->repr == REPR_RANGE) {
+		if (ndx >= ((struct mrange *)t)->len)
+			return -1;
+		*vp = MRANGE_VALUE((struct mrange *)t, ndx);
+		return 0;
+	}
+	if (t->repr == REPR_SLICE) {
+		if (mslice_ndx((struct mslice *)t, ndx, &ndx) != 0)
+			return -1;
+		return marray_get_int64(((struct mslice *)t)->array, ndx, vp);
+	}
+	if (t->repr == REPR_SELECT) {
+		if (mselect_ndx((struct mselect *)t, ndx, &ndx) != 0)
+			return -1;
+		return marray_get_int64(((struct mselect *)t)->array, ndx, vp);
+	}
+	if (t->repr == REPR_STRINGS || (o = marray_item(array, ndx)) == NULL ||
+	    o->type != TYPE_MINT)
+		return -1;
+	*vp = ((struct mint *)o)->value;
+	return 0;
+}
+
+int
+marray_get_str(struct mobject *array, size_t ndx, const u_int8_t **sp,
+    size_t *lenp)
+{
+	struct mtyped *t = (struct mtyped *)array;
+	struct mobject *o;
+
+	if (t->type != TYPE_MARRAY)
+		return -1;
+	if (t->repr == REPR_STRINGS) {
+		if (ndx >= t->len)
+			return -1;
+		*sp = t->blob + t->offsets[ndx];
+		*lenp = MTYPED_STRLEN(t, ndx);
+		return 0;
+	}
+	if (t->repr == REPR_SLICE) {
+		if (mslice_ndx((struct mslice *)t, ndx, &ndx) != 0)
+			return -1;
+		return marray_get_str(((struct mslice *)t)->array, ndx,
+		    sp, lenp);
+	}
+	if (t->repr == REPR_SELECT) {
+		if (mselect_ndx((struct mselect *)t, ndx, &ndx) != 0)
+			return -1;
+		return marray_get_str(((struct mselect *)t)->array, ndx,
+		    sp, lenp);
+	}
+	if (t->repr == REPR_INT64 || t->repr == REPR_RANGE ||
+	    (o = marray_item(array, ndx)) == NULL || o->type != TYPE_MSTRING)
+		return -1;
+	*sp = ((struct mstring *)o)->value;
+	*lenp = ((struct mstring *)o)->len;
+	return 0;
+}
+
+int
+marray_permute(struct mobject *array, const size_t *perm)
+{
+	struct marray *a = (struct marray *)array;
+	struct mtyped *t = (struct mtyped *)array;
+	struct mobject **entries = NULL, **proxies = NULL;
+	u_int8_t *seen, *blob = NULL;
+	int64_t *ints = NULL;
+	size_t i, n, o, l, *offsets = NULL;
+
+	if (a->type != TYPE_MARRAY)
+		return -1;
+	switch (a->repr) {
+	case REPR_GENERIC:
+		n = a->nused;
+		break;
+	case REPR_INT64:
+	case REPR_STRINGS:
+		n = t->len;
+		break;
+	default:
+		return -1;
+	}
+	/* Check that "perm" is a permutation before changing anything */
+	if ((seen = calloc(MAX(n, 1), 1)) == NULL)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (perm[i] >= n || seen[perm[i]]) {
+			free(seen);
+			return -1;
+		}
+		seen[perm[i]] = 1;
+	}
+	free(seen);
+
+	if (a->repr == REPR_GENERIC) {
+		if ((entries = calloc(MAX(n, 1), sizeof(*entries))) == NULL)
+			return -1;
+		for (i = 0; i < n; i++)
+			entries[i] = a->entries[perm[i]];
+		memcpy(a->entries, entries, n * sizeof(*entries));
+		free(entries);
+		return 0;
+	}
+	if ((t->proxies != NULL && (proxies = calloc(MAX(t->nalloc, 1),
+	    sizeof(*proxies))) == NULL) ||
+	    (t->repr == REPR_INT64 && (ints = calloc(MAX(t->nalloc, 1),
+	    sizeof(*ints))) == NULL) ||
+	    (t->repr == REPR_STRINGS && ((offsets = calloc(t->nalloc + 1,
+	    sizeof(*offsets))) == NULL || (blob = malloc(MAX(t->blob_alloc,
+	    1))) == NULL))) {
+		free(proxies);
+		free(ints);
+		free(offsets);
+		free(blob);
+		return -1;
+	}
+	for (i = o = 0; i < n; i++) {
+		if (ints != NULL)
+			ints[i] = t->ints[perm[i]];
+		else {
+			l = MTYPED_STRLEN(t, perm[i]);
+			memcpy(blob + o, t->blob + t->offsets[perm[i]], l);
+			offsets[i] = o;
+			o += l;
+		}
+		/* Proxies move with their items */
+		if (proxies != NULL)
+			proxies[i] = t->proxies[perm[i]];
+	}
+	if (ints != NULL) {
+		free(t->ints);
+		t->ints = ints;
+	} else {
+		offsets[n] = o;
+		free(t->offsets);
+		free(t->blob);
+		t->offsets = offsets;
+		t->blob = blob;
+	}
+	if (proxies != NULL) {
+		free(t->proxies);
+		t->proxies = proxies;
+		/* String proxies borrow from the blob, which has moved */
+		for (i = 0; i < n && blob != NULL; i++) {
+			if (proxies[i] != NULL)
+				mtyped_make_proxy(t, i, proxies[i]);
+		}
+	}
+	return 0;
+}
+
+static int
+marray_resize(struct marray *array, size_t want)
+{
+	struct mobject **tmp;
+	size_t n, i;
+
+	if (want < array->nalloc)
+		return 0;
+	/*
+	 * Allocate the next power of two up.
+	 * NB. MARRAY_MAX must be sized to avoid integer overflow
+	 */
+	for (n = MAX(array->nalloc, 4); n < MARRAY_MAX && n <= want; n <<= 1)
+		;
+	if (n >= MARRAY_MAX || n <= array->nused || n <= want)
+		return -1;	
+	if ((tmp = realloc(array->entries, n * sizeof(*array->entries))) == NULL)
+		return -1;
+	array->entries = tmp;
+	array->nalloc = n;
+	/* Zero just-allocated entries */
+	for (i = array->nused; i < array->nalloc; i++)
+		array->entries[i] = NULL;
+	return 0;
+}
+
+int
+marray_prepend(struct mobject *_array, struct mobject *object)
+{
+	struct marray *array = (struct marray *)_array;
+
+	if (array->type != TYPE_MARRAY || marray_make_generic(array) != 0)
+		return -1;
+	if (marray_resize(array, array->nused + 1) == -1)
+		return -1;
+	memmove(array->entries + 1, array->entries,
+	    sizeof(*array->entries) * array->nused);
+	array->entries[0] = object;
+	array->nused++;
+	return 0;
+}
+
+int
+marray_append(struct mobject *_array, struct mobject *object)
+{
+	struct marray *array = (struct marray *)_array;
+
+	if (array->type != TYPE_MARRAY || marray_make_generic(array) != 0)
+		return -1;
+	if (marray_resize(array, array->nused + 1) == -1)
+		return -1;
+	array->entries[array->nused++] = object;
+	return 0;
+}
+
+int
+marray_set(struct mobject *_array, size_t ndx, struct mobject *object)
+{
+	struct marray *array = (struct marray *)_array;
+	size_t i;
+
+	if (array->type != TYPE_MARRAY || marray_make_generic(array) != 0)
+		return -1;
+	if (ndx >= MARRAY_MAX)
+		return -1;
+	if (marray_resize(array, ndx + 1) == -1)
+		return -1;
+	/* Fill unallocated entries with None */
+	for (i = array->nused; i < ndx; i++)
+		array->entries[i] = (struct mobject *)mnone_new();
+	if (array->entries[ndx] != NULL)
+		mobject_free(array->entries[ndx]);
+	array->entries[ndx] = object;
+	array->nused = MAX(array->nused, ndx + 1);
+	return 0;
+}
+
+size_t
+marray_len(struct mobject *_array)
+{
+	struct marray *array = (struct marray *)_array;
+	struct mslice *slice = (struct mslice *)_array;
+	size_t len;
+
+	if (array->type != TYPE_MARRAY)
+		return 0;
+	switch (array->repr) {
+	case REPR_VIRTUAL:
+		return mvirtual_len((struct mvirtual *)array);
+	case REPR_INT64:
+	case REPR_STRINGS:
+		return ((struct mtyped *)array)->len;
+	case REPR_RANGE:
+		return ((struct mrange *)array)->len;
+	case REPR_SLICE:
+		len = marray_len(slice->array);
+		return MIN(slice->end, len) - MIN(slice->start, len);
+	case REPR_SELECT:
+		return ((struct mselect *)array)->n;
+	default:
+		return array->nused;
+	}
+}
+
+int
+marray_is_stream(struct mobject *array)
+{
+	return array->type == TYPE_MARRAY &&
+	    MCONTAINER_REPR(array) == REPR_VIRTUAL &&
+	    ((struct mvirtual *)array)->ops->next != NULL &&
+	    ((struct mvirtual *)array)->ops->array_item == NULL;
+}
+
+struct mobject *
+marray_last(struct mobject *array)
+{
+	size_t len = marray_len(array);
+
+	return len == 0 ? NULL : marray_item(array, len - 1);
+}
+
+struct mobject *
+marray_first(struct mobject *array)
+{
+	return marray_item(array, 0);
+}
+
+struct mobject *
+marray_pop(struct mobject *_array)
+{
+	struct marray *array = (struct marray *)_array;
+	struct mobject *ret;
+
+	if (array->type != TYPE_MARRAY || marray_make_generic(array) != 0)
+		return NULL;
+	if (array->nused == 0)
+		return NULL;
+	ret = array->entries[--array->nused];
+	array->entries[array->nused] = NULL;
+	return ret;
+}
+
+struct mobject *
+marray_pull(struct mobject *_array)
+{
+	struct marray *array = (struct marray *)_array;
+	struct mobject *ret;
+
+	if (array->type != TYPE_MARRAY || marray_make_generic(array) != 0)
+		return NULL;
+	if (array->nused == 0)
+		return NULL;
+	ret = array->entries[0];
+	array->nused--;
+	if (array->nused == 0)
+		array->entries[0] = NULL;
+	else {
+		memmove(array->entries, array->entries + 1,
+		    sizeof(*array->entries) * array->nused);
+	}
+	return ret;
+}
+
+struct mobject *
+marray_item(struct mobject *_array, size_t ndx)
+{
+	struct marray *array = (struct marray *)_array;
+
+	if (array->type != TYPE_MARRAY)
+		return NULL;
+	switch (array->repr) {
+	case REPR_VIRTUAL:
+		return mvirtual_array_item((struct mvirtual *)array, ndx);
+	case REPR_INT64:
+	case REPR_STRINGS:
+		return mtyped_item((struct mtyped *)array, ndx);
+	case REPR_RANGE:
+		return mrange_item((struct mrange *)array, ndx);
+	case REPR_SLICE:
+		if (mslice_ndx((struct mslice *)array, ndx, &ndx) != 0)
+			return NULL;
+		return marray_item(((struct mslice *)array)->array, ndx);
+	case REPR_SELECT:
+		if (mselect_ndx((struct mselect *)array, ndx, &ndx) != 0)
+			return NULL;
+		return marray_item(((struct mselect *)array)->array, ndx);
+	default:
+		if (ndx >= array->nused)
+			return NULL;
+		return array->entries[ndx];
+	}
+}
+
+static int
+mobject_cmp_byaddr(const struct mobject *a, const struct mobject *b)
+{
+	if (a == b)
+		return 0;
+	return a < b ? -1 : 1;
+}
+
+static int
+marray_cmp_slow(struct mobject *a, struct mobject *b)
+{
+	struct mobject *ai, *bi;
+	size_t i, alen = marray_len(a), blen = marray_len(b);
+	int r;
+
+	if (alen != blen)
+		return alen < blen ? -1 : 1;
+	for (i = 0; i < alen; i++) {
+		ai = marray_item(a, i);
+		bi = marray_item(b, i);
+		if (ai == NULL || bi == NULL) {
+			if (ai == bi)
+				continue;
+			return ai == NULL ? -1 : 1;
+		}
+		if ((r = mobject_cmp(ai, bi)) != 0)
+			return r;
+	}
+	return 0;
+}
+
+static int
+bytes_cmp(const u_int8_t *a, size_t alen, const u_int8_t *b, size_t blen)
+{
+	int r;
+
+	if (alen == 0 && blen == 0)
+		return 0;
+	if (alen == 0)
+		return -1;
+	if (blen == 0)
+		return 1;
+	if ((r = memcmp(a, b, MIN(alen, blen))) != 0)
+		return r < 0 ? -1 : (r > 0 ? 1 : 0);
+	if (alen > blen)
+		return 1;
+	if (blen > alen)
+		return -1;
+	return 0;
+}
+
+/* Compare typed arrays of the same type without making proxies */
+static int
+mtyped_cmp(const struct mtyped *a, const struct mtyped *b)
+{
+	size_t i;
+	int r;
+
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+	for (i = 0; i < a->len; i++) {
+		if (a->repr == REPR_INT64) {
+			if (a->ints[i] != b->ints[i])
+				return a->ints[i] < b->ints[i] ? -1 : 1;
+			continue;
+		}
+		if ((r = bytes_cmp(a->blob + a->offsets[i],
+		    MTYPED_STRLEN(a, i), b->blob + b->offsets[i],
+		    MTYPED_STRLEN(b, i))) != 0)
+			return r;
+	}
+	return 0;
+}
+
+static int
+marray_cmp(const struct mobject *_a, const struct mobject *_b)
+{
+	struct marray *a = (struct marray *)_a;
+	struct marray *b = (struct marray *)_b;
+	size_t i;
+	int r;
+
+	if (a->repr == b->repr &&
+	    (a->repr == REPR_INT64 || a->repr == REPR_STRINGS))
+		return mtyped_cmp((struct mtyped *)a, (struct mtyped *)b);
+	if (a->repr != REPR_GENERIC || b->repr != REPR_GENERIC)
+		return marray_cmp_slow((struct mobject *)_a,
+		    (struct mobject *)_b);
+	if (a->nused != b->nused)
+		return a->nused < b->nused ? -1 : 1;
+	for (i = 0; i < a->nused; i++) {
+		if (a->entries[i] == NULL) {
+			if (b->entries[i] == NULL)
+				continue;
+			return -1;
+		}
+		if (b->entries[i] == NULL)
+			return 1;
+		if ((r = mobject_cmp(a->entries[i], b->entries[i])) != 0)
+			return r;
+	}
+	return 0;
+}
+
+static int
 mint_cmp(const struct mobject *_a, const struct mobject *_b)
 {
 	struct mint *a = (struct mint *)_a;
@@ -614,21 +1937,8 @@ mstring_cmp(const struct mobject *_a, const struct mobject *_b)
 {
 	struct mstring *a = (struct mstring *)_a;
 	struct mstring *b = (struct mstring *)_b;
-	int r;
 
-	if (a->len == 0 && b->len == 0)
-		return 0;
-	if (a->len == 0)
-		return -1;
-	if (b->len == 0)
-		return 1;
-	if ((r = memcmp(a->value, b->value, MIN(a->len, b->len))) != 0)
-		return r < 0 ? -1 : (r > 0 ? 1 : 0);
-	if (a->len > b->len)
-		return 1;
-	if (b->len > a->len)
-		return -1;
-	return 0;
+	return bytes_cmp(a->value, a->len, b->value, b->len);
 }
 
 int
@@ -647,6 +1957,7 @@ mobject_cmp(const struct mobject *a, const struct mobject *b)
 		case TYPE_MARRAY:
 			return marray_cmp(a, b);
 		case TYPE_MDICT:
+		case TYPE_MSET:
 			return mobject_cmp_byaddr(a, b);
 		default:
 			return 0;
@@ -655,42 +1966,630 @@ mobject_cmp(const struct mobject *a, const struct mobject *b)
 	return a->type < b->type ? -1 : 1;
 }
 
+/*
+ * Hash a set member or dictionary key. Only None, integers and strings
+ * are hashable; returns -1 for anything else.
+ */
+static int
+mobject_hash(const struct mobject *o, u_int32_t *hp)
+{
+	u_int64_t v;
+
+	switch (o->type) {
+	case TYPE_MNONE:
+		*hp = 0;
+		return 0;
+	case TYPE_MINT:
+		/* Mix the bits so that sequential integers spread out */
+		v = (u_int64_t)((struct mint *)o)->value;
+		v ^= v >> 33;
+		v *= 0xff51afd7ed558ccdULL;
+		v ^= v >> 33;
+		*hp = (u_int32_t)v;
+		return 0;
+	case TYPE_MSTRING:
+		*hp = mshape_hash(((struct mstring *)o)->value,
+		    ((struct mstring *)o)->len);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int
+mobject_hash_equal(const struct mobject *a, const struct mobject *b)
+{
+	return a->type == b->type && mobject_cmp(a, b) == 0;
+}
+
+struct mobject *
+mdict_new_ordered(void)
+{
+	struct mordered *ret;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	ret->type = TYPE_MDICT;
+	ret->repr = REPR_ORDERED;
+	return (struct mobject *)ret;
+}
+
+static struct mbtree_node *
+mbtree_node_new(int leaf)
+{
+	struct mbtree_node *ret;
+
+	if ((ret = calloc(1, leaf ? sizeof(struct mbtree_node) :
+	    sizeof(struct mbtree_inner))) == NULL)
+		return NULL;
+	ret->leaf = leaf;
+	return ret;
+}
+
+static void
+mbtree_free(struct mbtree_node *n)
+{
+	u_int i;
+
+	for (i = 0; i < n->nkeys; i++) {
+		mobject_free(n->keys[i]);
+		mobject_free(n->values[i]);
+	}
+	if (!n->leaf) {
+		for (i = 0; i <= n->nkeys; i++)
+			mbtree_free(MBTREE_CHILD(n)[i]);
+	}
+	free(n);
+}
+
+static void
+mordered_free(struct mordered *o)
+{
+	if (o->root != NULL)
+		mbtree_free(o->root);
+	bzero(o, sizeof(*o));
+	free(o);
+}
+
+/*
+ * Binary search a node for "key". Returns 1 and its position in "*ip" if
+ * it is present, otherwise 0 and the position of the first greater key.
+ */
+static int
+mbtree_search(const struct mbtree_node *n, const struct mobject *key,
+    u_int *ip)
+{
+	u_int lo = 0, hi = n->nkeys, mid;
+	int r;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((r = mobject_cmp(n->keys[mid], key)) == 0) {
+			*ip = mid;
+			return 1;
+		}
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*ip = lo;
+	return 0;
+}
+
+/* Find the node holding "key" and its position in the node */
+static struct mbtree_node *
+mordered_find(const struct mordered *od, const struct mobject *key,
+    u_int *ip)
+{
+	struct mbtree_node *n;
+
+	for (n = od->root; n != NULL; n = MBTREE_CHILD(n)[*ip]) {
+		if (mbtree_search(n, key, ip))
+			return n;
+		if (n->leaf)
+			break;
+	}
+	return NULL;
+}
+
+/* Split the full child "i" of "n" around its median key */
+static int
+mbtree_split(struct mbtree_node *n, u_int i)
+{
+	struct mbtree_node *y = MBTREE_CHILD(n)[i], *z;
+	u_int j;
+
+	if ((z = mbtree_node_new(y->leaf)) == NULL)
+		return -1;
+	z->nkeys = MBTREE_T - 1;
+	memcpy(z->keys, y->keys + MBTREE_T, z->nkeys * sizeof(*z->keys));
+	memcpy(z->values, y->values + MBTREE_T,
+	    z->nkeys * sizeof(*z->values));
+	if (!y->leaf) {
+		memcpy(MBTREE_CHILD(z), MBTREE_CHILD(y) + MBTREE_T,
+		    MBTREE_T * sizeof(*MBTREE_CHILD(z)));
+	}
+	y->nkeys = MBTREE_T - 1;
+	for (j = n->nkeys; j > i; j--) {
+		n->keys[j] = n->keys[j - 1];
+		n->values[j] = n->values[j - 1];
+		MBTREE_CHILD(n)[j + 1] = MBTREE_CHILD(n)[j];
+	}
+	n->keys[i] = y->keys[MBTREE_T - 1];
+	n->values[i] = y->values[MBTREE_T - 1];
+	MBTREE_CHILD(n)[i + 1] = z;
+	n->nkeys++;
+	return 0;
+}
+
+/* Insert a key that is known to be absent, splitting full nodes on the way */
+static int
+mordered_insert(struct mordered *od, struct mobject *key,
+    struct mobject *value)
+{
+	struct mbtree_node *n, *s;
+	u_int i;
+
+	if (od->root == NULL && (od->root = mbtree_node_new(1)) == NULL)
+		return -1;
+	if (od->root->nkeys == MBTREE_MAX_KEYS) {
+		if ((s = mbtree_node_new(0)) == NULL)
+			return -1;
+		MBTREE_CHILD(s)[0] = od->root;
+		if (mbtree_split(s, 0) != 0) {
+			free(s);
+			return -1;
+		}
+		od->root = s;
+	}
+	for (n = od->root; !n->leaf; n = MBTREE_CHILD(n)[i]) {
+		mbtree_search(n, key, &i);
+		if (MBTREE_CHILD(n)[i]->nkeys == MBTREE_MAX_KEYS) {
+			/* NB. a failed split leaves the tree valid */
+			if (mbtree_split(n, i) != 0)
+				return -1;
+			if (mobject_cmp(key, n->keys[i]) > 0)
+				i++;
+		}
+	}
+	mbtree_search(n, key, &i);
+	memmove(n->keys + i + 1, n->keys + i,
+	    (n->nkeys - i) * sizeof(*n->keys));
+	memmove(n->values + i + 1, n->values + i,
+	    (n->nkeys - i) * sizeof(*n->values));
+	n->keys[i] = key;
+	n->values[i] = value;
+	n->nkeys++;
+	od->len++;
+	return 0;
+}
+
+/* Merge child "i + 1" of "n" and the key between them into child "i" */
+static void
+mbtree_merge(struct mbtree_node *n, u_int i)
+{
+	struct mbtree_node *y = MBTREE_CHILD(n)[i], *z = MBTREE_CHILD(n)[i + 1];
+
+	y->keys[y->nkeys] = n->keys[i];
+	y->values[y->nkeys] = n->values[i];
+	memcpy(y->keys + y->nkeys + 1, z->keys, z->nkeys * sizeof(*z->keys));
+	memcpy(y->values + y->nkeys + 1, z->values,
+	    z->nkeys * sizeof(*z->values));
+	if (!y->leaf) {
+		memcpy(MBTREE_CHILD(y) + y->nkeys + 1, MBTREE_CHILD(z),
+		    (z->nkeys + 1) * sizeof(*MBTREE_CHILD(z)));
+	}
+	y->nkeys += z->nkeys + 1;
+	memmove(n->keys + i, n->keys + i + 1,
+	    (n->nkeys - i - 1) * sizeof(*n->keys));
+	memmove(n->values + i, n->values + i + 1,
+	    (n->nkeys - i - 1) * sizeof(*n->values));
+	memmove(MBTREE_CHILD(n) + i + 1, MBTREE_CHILD(n) + i + 2,
+	    (n->nkeys - i - 1) * sizeof(*MBTREE_CHILD(n)));
+	n->nkeys--;
+	free(z);
+}
+
+/*
+ * Make sure that child "i" of "n" has at least MBTREE_T keys before
+ * descending into it, by taking a key from a sibling or merging with one.
+ * Returns the index of the child that now covers the same keys.
+ */
+static u_int
+mbtree_fill(struct mbtree_node *n, u_int i)
+{
+	struct mbtree_node *c = MBTREE_CHILD(n)[i], *sib;
+
+	if (i > 0 && (sib = MBTREE_CHILD(n)[i - 1])->nkeys >= MBTREE_T) {
+		/* Rotate the last key of the left sibling through "n" */
+		memmove(c->keys + 1, c->keys, c->nkeys * sizeof(*c->keys));
+		memmove(c->values + 1, c->values,
+		    c->nkeys * sizeof(*c->values));
+		if (!c->leaf) {
+			memmove(MBTREE_CHILD(c) + 1, MBTREE_CHILD(c),
+			    (c->nkeys + 1) * sizeof(*MBTREE_CHILD(c)));
+			MBTREE_CHILD(c)[0] = MBTREE_CHILD(sib)[sib->nkeys];
+		}
+		c->keys[0] = n->keys[i - 1];
+		c->values[0] = n->values[i - 1];
+		c->nkeys++;
+		n->keys[i - 1] = sib->keys[sib->nkeys - 1];
+		n->values[i - 1] = sib->values[sib->nkeys - 1];
+		sib->nkeys--;
+		return i;
+	}
+	if (i < n->nkeys && (sib = MBTREE_CHILD(n)[i + 1])->nkeys >= MBTREE_T) {
+		/* Rotate the first key of the right sibling through "n" */
+		c->keys[c->nkeys] = n->keys[i];
+		c->values[c->nkeys] = n->values[i];
+		if (!c->leaf)
+			MBTREE_CHILD(c)[c->nkeys + 1] = MBTREE_CHILD(sib)[0];
+		c->nkeys++;
+		n->keys[i] = sib->keys[0];
+		n->values[i] = sib->values[0];
+		memmove(sib->keys, sib->keys + 1,
+		    (sib->nkeys - 1) * sizeof(*sib->keys));
+		memmove(sib->values, sib->values + 1,
+		    (sib->nkeys - 1) * sizeof(*sib->values));
+		if (!sib->leaf) {
+			memmove(MBTREE_CHILD(sib), MBTREE_CHILD(sib) + 1,
+			    sib->nkeys * sizeof(*MBTREE_CHILD(sib)));
+		}
+		sib->nkeys--;
+		return i;
+	}
+	if (i < n->nkeys) {
+		mbtree_merge(n, i);
+		return i;
+	}
+	mbtree_merge(n, i - 1);
+	return i - 1;
+}
+
+/*
+ * Remove "key", which must be present, from the subtree at "n", whose
+ * root has at least MBTREE_T keys unless it is the root of the tree.
+ */
+static void
+mbtree_delete(struct mbtree_node *n, const struct mobject *key,
+    struct mobject **keyp, struct mobject **valuep)
+{
+	struct mbtree_node *c;
+	u_int i;
+
+	for (;;) {
+		if (!mbtree_search(n, key, &i)) {
+			if (MBTREE_CHILD(n)[i]->nkeys < MBTREE_T)
+				i = mbtree_fill(n, i);
+			n = MBTREE_CHILD(n)[i];
+			continue;
+		}
+		if (n->leaf) {
+			*keyp = n->keys[i];
+			*valuep = n->values[i];
+			memmove(n->keys + i, n->keys + i + 1,
+			    (n->nkeys - i - 1) * sizeof(*n->keys));
+			memmove(n->values + i, n->values + i + 1,
+			    (n->nkeys - i - 1) * sizeof(*n->values));
+			n->nkeys--;
+			return;
+		}
+		if (MBTREE_CHILD(n)[i]->nkeys >= MBTREE_T) {
+			/* Replace with the predecessor from the left subtree */
+			*keyp = n->keys[i];
+			*valuep = n->values[i];
+			for (c = MBTREE_CHILD(n)[i]; !c->leaf;
+			    c = MBTREE_CHILD(c)[c->nkeys])
+				;
+			mbtree_delete(MBTREE_CHILD(n)[i], c->keys[c->nkeys - 1],
+			    &n->keys[i], &n->values[i]);
+			return;
+		}
+		if (MBTREE_CHILD(n)[i + 1]->nkeys >= MBTREE_T) {
+			/* Replace with the successor from the right subtree */
+			*keyp = n->keys[i];
+			*valuep = n->values[i];
+			for (c = MBTREE_CHILD(n)[i + 1]; !c->leaf;
+			    c = MBTREE_CHILD(c)[0])
+				;
+			mbtree_delete(MBTREE_CHILD(n)[i + 1], c->keys[0],
+			    &n->keys[i], &n->values[i]);
+			return;
+		}
+		mbtree_merge(n, i);
+		n = MBTREE_CHILD(n)[i];
+	}
+}
+
+/* Remove "key", which must be present, from an ordered dictionary */
+static struct mobject *
+mordered_remove(struct mordered *od, const struct mobject *key)
+{
+	struct mbtree_node *root;
+	struct mobject *k, *v;
+
+	mbtree_delete(od->root, key, &k, &v);
+	od->len--;
+	/* The tree shrinks when the root loses its last key */
+	if ((root = od->root)->nkeys == 0) {
+		od->root = root->leaf ? NULL : MBTREE_CHILD(root)[0];
+		free(root);
+	}
+	mobject_free(k);
+	return v;
+}
+
+struct miterator *
+mdict_range(struct mobject *dict, const struct mobject *lo,
+    const struct mobject *hi)
+{
+	struct miterator *ret;
+
+	if (dict->type != TYPE_MDICT || MCONTAINER_REPR(dict) != REPR_ORDERED)
+		return NULL;
+	if ((ret = mobject_getiter(dict)) == NULL)
+		return NULL;
+	if ((lo != NULL && (ret->range_lo =
+	    mobject_deepcopy((struct mobject *)lo)) == NULL) ||
+	    (hi != NULL && (ret->range_hi =
+	    mobject_deepcopy((struct mobject *)hi)) == NULL)) {
+		miterator_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/* Find the entry for "key" and the link that points to it in its bucket */
+static struct mdict_entry *
+mdict_find(const struct mdict *dict, const struct mobject *key,
+    u_int32_t hash, struct mdict_entry ***linkp)
+{
+	struct mdict_entry **link;
+
+	if (dict->index_size == 0)
+		return NULL;
+	for (link = &dict->index[hash & (dict->index_size - 1)];
+	    *link != NULL; link = &(*link)->hnext) {
+		if ((*link)->hash == hash &&
+		    mobject_hash_equal((*link)->key, key)) {
+			if (linkp != NULL)
+				*linkp = link;
+			return *link;
+		}
+	}
+	return NULL;
+}
+
+/* Rebuild the index with at least "want" buckets */
+static int
+mdict_rehash(struct mdict *dict, size_t want)
+{
+	struct mdict_entry **index, *e;
+	size_t n, mask;
+
+	for (n = MDICT_MIN_INDEX; n < want; n <<= 1) {
+		if (n > MARRAY_MAX)
+			return -1;
+	}
+	if ((index = calloc(n, sizeof(*index))) == NULL)
+		return -1;
+	mask = n - 1;
+	TAILQ_FOREACH(e, &dict->entries, entry) {
+		e->hnext = index[e->hash & mask];
+		index[e->hash & mask] = e;
+	}
+	free(dict->index);
+	dict->index = index;
+	dict->index_size = n;
+	return 0;
+}
+
+/* Add a hashed entry at the end of a generic dictionary */
+static int
+mdict_link(struct mdict *dict, struct mdict_entry *e)
+{
+	struct mdict_entry **bucket;
+
+	/* Keep the chains short by growing once there is an entry per bucket */
+	if (dict->num_entries >= dict->index_size &&
+	    mdict_rehash(dict, (dict->num_entries + 1) * 2) != 0)
+		return -1;
+	bucket = &dict->index[e->hash & (dict->index_size - 1)];
+	e->hnext = *bucket;
+	*bucket = e;
+	TAILQ_INSERT_TAIL(&dict->entries, e, entry);
+	dict->num_entries++;
+	return 0;
+}
+
+/* Remove an entry found by mdict_find() from a generic dictionary */
+static void
+mdict_unlink(struct mdict *dict, struct mdict_entry *e,
+    struct mdict_entry **link)
+{
+	*link = e->hnext;
+	TAILQ_REMOVE(&dict->entries, e, entry);
+	dict->num_entries--;
+}
+
+/*
+ * Convert a shaped dictionary to the generic representation in place,
+ * before it is modified in a way that its shape cannot describe.
+ */
+static int
+mshaped_to_generic(struct mobject *_dict)
+{
+	struct mshaped *sd = (struct mshaped *)_dict;
+	struct mdict *dict = (struct mdict *)_dict;
+	struct mshape *shape = sd->shape;
+	struct mdict_entries entries;
+	struct mdict_entry *e, **index = NULL;
+	size_t i, n = shape->nkeys, index_size;
+
+	for (index_size = MDICT_MIN_INDEX; index_size < n * 2;
+	    index_size <<= 1)
+		;
+	TAILQ_INIT(&entries);
+	if ((index = calloc(index_size, sizeof(*index))) == NULL)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		if ((e = calloc(1, sizeof(*e))) == NULL)
+			goto fail;
+		if ((e->key = mobject_deepcopy(shape->keys[i])) == NULL) {
+			free(e);
+			goto fail;
+		}
+		mobject_hash(e->key, &e->hash);
+		e->value = sd->values[i];
+		TAILQ_INSERT_TAIL(&entries, e, entry);
+	}
+	/* NB. the generic header overlays the shape pointer and values */
+	dict->repr = REPR_GENERIC;
+	dict->num_entries = 0;
+	TAILQ_INIT(&dict->entries);
+	dict->index = index;
+	dict->index_size = index_size;
+	while ((e = TAILQ_FIRST(&entries)) != NULL) {
+		TAILQ_REMOVE(&entries, e, entry);
+		/* Can't fail: the index is already large enough */
+		mdict_link(dict, e);
+	}
+	mshape_unref(shape);
+	return 0;
+ fail:
+	while ((e = TAILQ_FIRST(&entries)) != NULL) {
+		TAILQ_REMOVE(&entries, e, entry);
+		mobject_free(e->key);
+		free(e);
+	}
+	free(index);
+	return -1;
+}
+
+int
+mdict_set_slot(struct mobject *dict, size_t slot, struct mobject *value)
+{
+	struct mshaped *sd = (struct mshaped *)dict;
+
+	if (sd->type != TYPE_MDICT || sd->repr != REPR_SHAPED ||
+	    slot >= sd->shape->nkeys)
+		return -1;
+	mobject_free(sd->values[slot]);
+	sd->values[slot] = value;
+	return 0;
+}
+
 struct mobject *
 mdict_item(const struct mobject *_dict, const struct mobject *key)
 {
 	struct mdict *dict = (struct mdict *)_dict;
 	struct mdict_entry *e;
+	u_int32_t hash;
 
-	if (dict->type != TYPE_MDICT || key->type != TYPE_MSTRING)
+	if (dict->type != TYPE_MDICT)
 		return NULL;
-	TAILQ_FOREACH(e, &dict->entries, entry) {
-		if (mstring_cmp(e->key, key) == 0)
-			return e->value;
+	/* Shapes and virtual dictionaries are keyed by strings only */
+	if (dict->repr == REPR_VIRTUAL) {
+		if (key->type != TYPE_MSTRING)
+			return NULL;
+		return mvirtual_dict_item((struct mvirtual *)dict, key);
 	}
-	return NULL;
+	if (dict->repr == REPR_SHAPED) {
+		struct mshaped *sd = (struct mshaped *)dict;
+		size_t slot;
+
+		if (key->type != TYPE_MSTRING ||
+		    mshape_lookup(sd->shape, key, &slot) != 0)
+			return NULL;
+		return sd->values[slot];
+	}
+	if (mobject_hash(key, &hash) != 0)
+		return NULL;
+	if (dict->repr == REPR_ORDERED) {
+		struct mbtree_node *n;
+		u_int i;
+
+		if ((n = mordered_find((struct mordered *)dict, key,
+		    &i)) == NULL)
+			return NULL;
+		return n->values[i];
+	}
+	if ((e = mdict_find(dict, key, hash, NULL)) == NULL)
+		return NULL;
+	return e->value;
+}
+
+struct mobject *
+mdict_item_i(const struct mobject *dict, int64_t key)
+{
+	struct mint k;
+
+	/* Look up using a temporary integer, so nothing is allocated */
+	bzero(&k, sizeof(k));
+	k.type = TYPE_MINT;
+	k.value = key;
+	return mdict_item(dict, (struct mobject *)&k);
+}
+
+struct mobject *
+mdict_item_cached(const struct mobject *dict, const struct mobject *key,
+    struct mdict_cache *cache)
+{
+	const struct mshaped *sd = (const struct mshaped *)dict;
+	u_int64_t word;
+	size_t slot;
+
+	if (sd->type != TYPE_MDICT || sd->repr != REPR_SHAPED)
+		return mdict_item(dict, key);
+	/*
+	 * Shape identifiers are not reused, so this is a sufficient guard.
+	 * The word is loaded and stored atomically, as caches may be shared
+	 * between threads, so the slot always belongs to the shape it was
+	 * checked against.
+	 */
+	word = __atomic_load_n(&cache->word, __ATOMIC_RELAXED);
+	if (word >> MDICT_CACHE_SLOT_BITS == sd->shape->id)
+		return sd->values[word & MDICT_CACHE_SLOT_MASK];
+	if (key->type != TYPE_MSTRING ||
+	    mshape_lookup(sd->shape, key, &slot) != 0)
+		return NULL;
+	/* Shapes too large or too numerous to pack are simply not cached */
+	if (slot <= MDICT_CACHE_SLOT_MASK &&
+	    sd->shape->id < ((u_int64_t)1 << (64 - MDICT_CACHE_SLOT_BITS)))
+		__atomic_store_n(&cache->word,
+		    (sd->shape->id << MDICT_CACHE_SLOT_BITS) | slot,
+		    __ATOMIC_RELAXED);
+	return sd->values[slot];
 }
 
 struct mobject *
 mdict_remove(struct mobject *_dict, const struct mobject *key)
 {
 	struct mdict *dict = (struct mdict *)_dict;
-	struct mdict_entry *e;
+	struct mdict_entry *e, **link;
 	struct mobject *ret;
+	u_int32_t hash;
 
-	if (dict->type != TYPE_MDICT || key->type != TYPE_MSTRING)
+	if (dict->type != TYPE_MDICT || mobject_hash(key, &hash) != 0)
 		return NULL;
-	TAILQ_FOREACH(e, &dict->entries, entry) {
-		if (mstring_cmp(e->key, key) == 0) {
-			TAILQ_REMOVE(&dict->entries, e, entry);
-			ret = e->value;
-			mobject_free((struct mobject *)e->key);
-			bzero(e, sizeof(*e));
-			free(e);
-			dict->num_entries--;
-			return ret;
-		}
+	if (dict->repr == REPR_SHAPED && (mdict_item(_dict, key) == NULL ||
+	    mshaped_to_generic(_dict) != 0))
+		return NULL;
+	if (dict->repr == REPR_ORDERED) {
+		if (mdict_item(_dict, key) == NULL)
+			return NULL;
+		return mordered_remove((struct mordered *)dict, key);
 	}
-	return NULL;
+	if (dict->repr != REPR_GENERIC ||
+	    (e = mdict_find(dict, key, hash, &link)) == NULL)
+		return NULL;
+	mdict_unlink(dict, e, link);
+	ret = e->value;
+	mobject_free(e->key);
+	bzero(e, sizeof(*e));
+	free(e);
+	return ret;
 }
 
 int
@@ -699,12 +2598,11 @@ mdict_delete(struct mobject *_dict, const struct mobject *key)
 	struct mdict *dict = (struct mdict *)_dict;
 	struct mobject *o;
 
-	if (dict->type != TYPE_MDICT || key->type != TYPE_MSTRING)
+	if (dict->type != TYPE_MDICT)
 		return -1;
 	if ((o = mdict_remove(_dict, key)) == NULL)
 		return -1;
 	mobject_free(o);
-	dict->num_entries--;
 	return 0;
 }
 
@@ -714,19 +2612,30 @@ mdict_insert(struct mobject *_dict, struct mobject *key,
 {
 	struct mdict *dict = (struct mdict *)_dict;
 	struct mdict_entry *e;
+	u_int32_t hash;
 
-	if (dict->type != TYPE_MDICT || key->type != TYPE_MSTRING)
+	if (dict->type != TYPE_MDICT || mobject_hash(key, &hash) != 0)
 		return -1;
-	TAILQ_FOREACH(e, &dict->entries, entry) {
-		if (mstring_cmp(e->key, key) == 0)
+	if (dict->repr == REPR_SHAPED && (mdict_item(_dict, key) != NULL ||
+	    mshaped_to_generic(_dict) != 0))
+		return -1;
+	if (dict->repr == REPR_ORDERED) {
+		if (mdict_item(_dict, key) != NULL)
 			return -1;
+		return mordered_insert((struct mordered *)dict, key, value);
 	}
+	if (dict->repr != REPR_GENERIC ||
+	    mdict_find(dict, key, hash, NULL) != NULL)
+		return -1;
 	if ((e = calloc(1, sizeof(*e))) == NULL)
 		return -1;
 	e->key = key;
 	e->value = value;
-	TAILQ_INSERT_TAIL(&dict->entries, e, entry);
-	dict->num_entries++;
+	e->hash = hash;
+	if (mdict_link(dict, e) != 0) {
+		free(e);
+		return -1;
+	}
 	return 0;
 }
 
@@ -735,27 +2644,46 @@ mdict_replace(struct mobject *_dict, struct mobject *key,
     struct mobject *value)
 {
 	struct mdict *dict = (struct mdict *)_dict;
-	struct mdict_entry *e;
+	struct mdict_entry *e, **link;
+	u_int32_t hash;
 
-	if (dict->type != TYPE_MDICT || key->type != TYPE_MSTRING)
+	if (dict->type != TYPE_MDICT || mobject_hash(key, &hash) != 0)
 		return -1;
-	TAILQ_FOREACH(e, &dict->entries, entry) {
-		if (mstring_cmp(e->key, key) == 0)
-			break;
+	if (dict->repr == REPR_SHAPED && mshaped_to_generic(_dict) != 0)
+		return -1;
+	if (dict->repr == REPR_ORDERED) {
+		struct mbtree_node *n;
+		u_int i;
+
+		if ((n = mordered_find((struct mordered *)dict, key,
+		    &i)) == NULL)
+			return mordered_insert((struct mordered *)dict, key,
+			    value);
+		/* The keys are equal, so the order is unchanged */
+		mobject_free(n->keys[i]);
+		mobject_free(n->values[i]);
+		n->keys[i] = key;
+		n->values[i] = value;
+		return 0;
 	}
-	if (e != TAILQ_END(&dict->entries)) {
-		TAILQ_REMOVE(&dict->entries, e, entry);
-		mobject_free((struct mobject *)e->key);
+	if (dict->repr != REPR_GENERIC)
+		return -1;
+	if ((e = mdict_find(dict, key, hash, &link)) != NULL) {
+		/* Relinking can't fail as the entry count is unchanged */
+		mdict_unlink(dict, e, link);
+		mobject_free(e->key);
 		mobject_free(e->value);
-		dict->num_entries--;
 	} else {
 		if ((e = calloc(1, sizeof(*e))) == NULL)
 			return -1;
 	}
 	e->key = key;
 	e->value = value;
-	TAILQ_INSERT_TAIL(&dict->entries, e, entry);
-	dict->num_entries++;
+	e->hash = hash;
+	if (mdict_link(dict, e) != 0) {
+		free(e);
+		return -1;
+	}
 	return 0;
 }
 
@@ -766,9 +2694,265 @@ mdict_len(const struct mobject *_dict)
 
 	if (dict->type != TYPE_MDICT)
 		return 0;
+	if (dict->repr == REPR_VIRTUAL)
+		return mvirtual_len((struct mvirtual *)dict);
+	if (dict->repr == REPR_SHAPED)
+		return ((struct mshaped *)dict)->shape->nkeys;
+	if (dict->repr == REPR_ORDERED)
+		return ((struct mordered *)dict)->len;
 	return dict->num_entries;
 }
 
+struct mobject *
+mset_new(void)
+{
+	struct mset *ret;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+	ret->type = TYPE_MSET;
+	return (struct mobject *)ret;
+}
+
+/* Find the index slot holding "member", or -1 if it is absent */
+static ssize_t
+mset_find(const struct mset *set, const struct mobject *member,
+    u_int32_t hash)
+{
+	size_t i, e, mask = set->index_size - 1;
+
+	if (set->index_size == 0)
+		return -1;
+	for (i = hash & mask; (e = set->index[i]) != 0; i = (i + 1) & mask) {
+		if (e == MSET_REMOVED)
+			continue;
+		if (set->entries[e - 1].hash == hash &&
+		    mobject_hash_equal(set->entries[e - 1].member, member))
+			return i;
+	}
+	return -1;
+}
+
+/* Rebuild the index with room for "want" entries, dropping removed ones */
+static int
+mset_rehash(struct mset *set, size_t want)
+{
+	struct mset_entry *tmp;
+	size_t i, j, n, mask, *index;
+
+	for (n = MSET_MIN_INDEX; n < want * 2; n <<= 1) {
+		if (n > MARRAY_MAX)
+			return -1;
+	}
+	if ((index = calloc(n, sizeof(*index))) == NULL)
+		return -1;
+	if (want > set->nalloc) {
+		if ((tmp = realloc(set->entries,
+		    want * sizeof(*tmp))) == NULL) {
+			free(index);
+			return -1;
+		}
+		set->entries = tmp;
+		set->nalloc = want;
+	}
+	mask = n - 1;
+	for (i = j = 0; i < set->nused; i++) {
+		if (set->entries[i].member == NULL)
+			continue;
+		set->entries[j] = set->entries[i];
+		for (n = set->entries[j].hash & mask; index[n] != 0;
+		    n = (n + 1) & mask)
+			;
+		index[n] = ++j;
+	}
+	free(set->index);
+	set->index = index;
+	set->index_size = mask + 1;
+	set->nused = j;
+	return 0;
+}
+
+int
+mset_add(struct mobject *_set, struct mobject *member)
+{
+	struct mset *set = (struct mset *)_set;
+	size_t i, mask;
+	u_int32_t hash;
+
+	if (set->type != TYPE_MSET || mobject_hash(member, &hash) != 0)
+		return -1;
+	if (mset_find(set, member, hash) != -1)
+		return 1;
+	/* Keep the index at most half full, counting removed entries */
+	if (set->nused >= set->nalloc || (set->nused + 1) * 2 > set->index_size) {
+		if (set->len >= MARRAY_MAX ||
+		    mset_rehash(set, MAX(set->len * 2, 8)) != 0)
+			return -1;
+	}
+	mask = set->index_size - 1;
+	for (i = hash & mask; set->index[i] != 0 &&
+	    set->index[i] != MSET_REMOVED; i = (i + 1) & mask)
+		;
+	set->entries[set->nused].member = member;
+	set->entries[set->nused].hash = hash;
+	set->index[i] = ++set->nused;
+	set->len++;
+	return 0;
+}
+
+int
+mset_add_s(struct mobject *set, const char *member)
+{
+	struct mobject *o;
+	int r;
+
+	if ((o = mstring_new(member)) == NULL)
+		return -1;
+	if ((r = mset_add(set, o)) != 0)
+		mobject_free(o);
+	return r;
+}
+
+int
+mset_add_i(struct mobject *set, int64_t member)
+{
+	struct mobject *o;
+	int r;
+
+	if ((o = mint_new(member)) == NULL)
+		return -1;
+	if ((r = mset_add(set, o)) != 0)
+		mobject_free(o);
+	return r;
+}
+
+int
+mset_contains(const struct mobject *_set, const struct mobject *member)
+{
+	const struct mset *set = (const struct mset *)_set;
+	u_int32_t hash;
+
+	if (set->type != TYPE_MSET || mobject_hash(member, &hash) != 0)
+		return 0;
+	return mset_find(set, member, hash) != -1;
+}
+
+int
+mset_contains_s(const struct mobject *set, const char *member)
+{
+	struct mstring s;
+
+	/* Look up using a temporary string that borrows "member" */
+	bzero(&s, sizeof(s));
+	s.type = TYPE_MSTRING;
+	s.value = (u_char *)member;
+	s.len = strlen(member);
+	s.borrowed = 1;
+	return mset_contains(set, (struct mobject *)&s);
+}
+
+int
+mset_remove(struct mobject *_set, const struct mobject *member)
+{
+	struct mset *set = (struct mset *)_set;
+	struct mset_entry *e;
+	u_int32_t hash;
+	ssize_t i;
+
+	if (set->type != TYPE_MSET || mobject_hash(member, &hash) != 0 ||
+	    (i = mset_find(set, member, hash)) == -1)
+		return -1;
+	e = &set->entries[set->index[i] - 1];
+	mobject_free(e->member);
+	e->member = NULL;
+	set->index[i] = MSET_REMOVED;
+	set->len--;
+	return 0;
+}
+
+size_t
+mset_len(const struct mobject *_set)
+{
+	const struct mset *set = (const struct mset *)_set;
+
+	if (set->type != TYPE_MSET)
+		return 0;
+	return set->len;
+}
+
+/*
+ * Copy the members of "a" into "ret". If "b" is not NULL, only those
+ * that are (if "want" is 1) or are not (if "want" is 0) members of "b"
+ * are copied.
+ */
+static int
+mset_copy_filtered(struct mset *ret, const struct mset *a,
+    const struct mobject *b, int want)
+{
+	struct mobject *o;
+	size_t i;
+	int r;
+
+	for (i = 0; i < a->nused; i++) {
+		if (a->entries[i].member == NULL)
+			continue;
+		if (b != NULL &&
+		    mset_contains(b, a->entries[i].member) != want)
+			continue;
+		if ((o = mobject_deepcopy(a->entries[i].member)) == NULL)
+			return -1;
+		if ((r = mset_add((struct mobject *)ret, o)) != 0) {
+			mobject_free(o);
+			if (r == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Perform a set operation: copy the members of "a", filtered against "b"
+ * if "filter" is set (see mset_copy_filtered()), otherwise followed by
+ * those of "b" (which may then be NULL).
+ */
+static struct mobject *
+mset_op(const struct mobject *a, const struct mobject *b, int filter,
+    int want)
+{
+	struct mobject *ret;
+
+	if (a->type != TYPE_MSET || (b == NULL && filter) ||
+	    (b != NULL && b->type != TYPE_MSET) ||
+	    (ret = mset_new()) == NULL)
+		return NULL;
+	if (mset_copy_filtered((struct mset *)ret, (const struct mset *)a,
+	    filter ? b : NULL, want) != 0 || (!filter && b != NULL &&
+	    mset_copy_filtered((struct mset *)ret, (const struct mset *)b,
+	    NULL, 0) != 0)) {
+		mobject_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+struct mobject *
+mset_union(const struct mobject *a, const struct mobject *b)
+{
+	return mset_op(a, b, 0, 0);
+}
+
+struct mobject *
+mset_intersection(const struct mobject *a, const struct mobject *b)
+{
+	return mset_op(a, b, 1, 1);
+}
+
+struct mobject *
+mset_difference(const struct mobject *a, const struct mobject *b)
+{
+	return mset_op(a, b, 1, 0);
+}
+
 struct miterator *
 mobject_getiter(struct mobject *obj)
 {
@@ -777,6 +2961,7 @@ mobject_getiter(struct mobject *obj)
 	switch (obj->type) {
 	case TYPE_MARRAY:
 	case TYPE_MDICT:
+	case TYPE_MSET:
 		break;
 	default:
 		return NULL;
@@ -788,38 +2973,197 @@ mobject_getiter(struct mobject *obj)
 	return ret;
 }
 
-void
-miterator_free(struct miterator *iter)
+static void
+miterator_cleanup(struct miterator *iter)
 {
 	if (iter->started && iter->object &&
-	    iter->object->type == TYPE_MARRAY &&
+	    (iter->object->type == TYPE_MARRAY ||
+	    iter->object->type == TYPE_MSET) &&
 	    iter->array_last_key != NULL)
 		mobject_free(iter->array_last_key);
+	if (iter->virt_key != NULL)
+		mobject_free(iter->virt_key);
+	if (iter->virt_value != NULL)
+		mobject_free(iter->virt_value);
+	if (iter->proxy != NULL)
+		mobject_free(iter->proxy);
+	if (iter->range_lo != NULL)
+		mobject_free(iter->range_lo);
+	if (iter->range_hi != NULL)
+		mobject_free(iter->range_hi);
 	bzero(iter, sizeof(*iter));
+}
+
+int
+miterator_reset(struct miterator *iter, struct mobject *obj)
+{
+	switch (obj->type) {
+	case TYPE_MARRAY:
+	case TYPE_MDICT:
+	case TYPE_MSET:
+		break;
+	default:
+		return -1;
+	}
+	miterator_cleanup(iter);
+	iter->started = 0;
+	iter->object = obj;
+	return 0;
+}
+
+int
+miterator_seek(struct miterator *iter, size_t ndx)
+{
+	if (iter->object->type != TYPE_MARRAY ||
+	    marray_is_stream(iter->object))
+		return -1;
+	if (!iter->started) {
+		iter->array_last_key = NULL;
+		iter->started = 1;
+	}
+	iter->array_ndx = ndx;
+	return 0;
+}
+
+void
+miterator_free(struct miterator *iter)
+{
+	miterator_cleanup(iter);
 	free(iter);
 }
 
+static int
+mvirtual_next(struct mvirtual *v, size_t *pos, struct mobject **keyp,
+    struct mobject **valuep)
+{
+	struct mobject *k = NULL, *val = NULL;
+
+	if (v->ops->next(v->ctx, pos, &k, &val) != 0)
+		return -1;
+	if (keyp != NULL)
+		*keyp = k;
+	else if (k != NULL)
+		mobject_free(k);
+	if (val == NULL || (keyp != NULL && k == NULL)) {
+		if (val != NULL)
+			mobject_free(val);
+		if (keyp != NULL && k != NULL)
+			mobject_free(k);
+		return -1;
+	}
+	*valuep = val;
+	return 0;
+}
+
 static struct miteritem *
 miterator_next_array(struct miterator *iter)
 {
-	struct marray *array = (struct marray *)(iter->object);
-	struct mobject *key;
+	struct mobject *key, *value, *array = iter->object;
+	size_t ndx;
 
 	if (!iter->started) {
 		iter->array_ndx = 0;
 		iter->array_last_key = NULL;
 		iter->started = 1;
 	}
-	if (iter->array_ndx >= array->nused)
+	/* Streams decide where iteration ends */
+	if (!marray_is_stream(iter->object) &&
+	    iter->array_ndx >= marray_len(iter->object))
 		return NULL;
 	bzero(&iter->iteritem, sizeof(iter->iteritem));
-	if ((key = (struct mobject *)mint_new(iter->array_ndx)) == NULL)
+	if (iter->virt_value != NULL) {
+		mobject_free(iter->virt_value);
+		iter->virt_value = NULL;
+	}
+	/* Views present the items of the array they view, by its indices */
+	ndx = iter->array_ndx;
+	if (MCONTAINER_REPR(array) == REPR_SLICE) {
+		ndx += ((struct mslice *)array)->start;
+		array = ((struct mslice *)array)->array;
+	} else if (MCONTAINER_REPR(array) == REPR_SELECT) {
+		ndx = ((struct mselect *)array)->ndx[ndx];
+		array = ((struct mselect *)array)->array;
+	}
+	if (MCONTAINER_REPR(array) == REPR_INT64 ||
+	    MCONTAINER_REPR(array) == REPR_STRINGS) {
+		/* Items of typed arrays are presented via a reused proxy */
+		if ((value = mtyped_make_proxy((struct mtyped *)array,
+		    ndx, iter->proxy)) == NULL)
+			return NULL;
+		iter->proxy = value;
+	} else if (MCONTAINER_REPR(array) == REPR_RANGE) {
+		value = iter->proxy;
+		if (value != NULL)
+			((struct mint *)value)->value = MRANGE_VALUE(
+			    (struct mrange *)array, ndx);
+		else if ((value = mint_new(MRANGE_VALUE(
+		    (struct mrange *)array, ndx))) == NULL)
+			return NULL;
+		iter->proxy = value;
+	} else if (marray_is_stream(array)) {
+		/* Items returned by next() belong to the iterator */
+		if (mvirtual_next((struct mvirtual *)array,
+		    &iter->virt_pos, NULL, &iter->virt_value) != 0)
+			return NULL;
+		value = iter->virt_value;
+	} else if (MCONTAINER_REPR(array) == REPR_VIRTUAL &&
+	    ((struct mvirtual *)array)->ops->next != NULL) {
+		/*
+		 * Other virtual arrays that make items on demand are read
+		 * by index, so that views and seeks find the right item,
+		 * and the item belongs to the iterator as above.
+		 */
+		if ((iter->virt_value = ((struct mvirtual *)array)->ops->
+		    array_item(((struct mvirtual *)array)->ctx, ndx)) == NULL)
+			return NULL;
+		value = iter->virt_value;
+	} else if ((value = marray_item(array, ndx)) == NULL)
+		return NULL;
+	/* The key is owned by the iterator, so reuse it */
+	if ((key = iter->array_last_key) != NULL)
+		((struct mint *)key)->value = ndx;
+	else if ((key = mint_new(ndx)) == NULL)
 		return NULL;
-	if (iter->array_last_key != NULL)
-		mobject_free(iter->array_last_key);
 	iter->array_last_key = key;
 	iter->iteritem.key = key;
-	iter->iteritem.value = array->entries[iter->array_ndx++];
+	iter->iteritem.value = value;
+	iter->array_ndx++;
+	return &iter->iteritem;
+}
+
+static struct miteritem *
+miterator_next_virtual_dict(struct miterator *iter)
+{
+	iter->started = 1;
+	bzero(&iter->iteritem, sizeof(iter->iteritem));
+	if (iter->virt_key != NULL)
+		mobject_free(iter->virt_key);
+	if (iter->virt_value != NULL)
+		mobject_free(iter->virt_value);
+	iter->virt_key = iter->virt_value = NULL;
+	if (mvirtual_next((struct mvirtual *)iter->object, &iter->virt_pos,
+	    &iter->virt_key, &iter->virt_value) != 0)
+		return NULL;
+	iter->iteritem.key = iter->virt_key;
+	iter->iteritem.value = iter->virt_value;
+	return &iter->iteritem;
+}
+
+static struct miteritem *
+miterator_next_shaped_dict(struct miterator *iter)
+{
+	struct mshaped *sd = (struct mshaped *)(iter->object);
+
+	if (!iter->started) {
+		iter->shape_ndx = 0;
+		iter->started = 1;
+	}
+	if (iter->shape_ndx >= sd->shape->nkeys)
+		return NULL;
+	bzero(&iter->iteritem, sizeof(iter->iteritem));
+	iter->iteritem.key = sd->shape->keys[iter->shape_ndx];
+	iter->iteritem.value = sd->values[iter->shape_ndx];
+	iter->shape_ndx++;
 	return &iter->iteritem;
 }
 
@@ -841,6 +3185,95 @@ miterator_next_dict(struct miterator *iter)
 	return &iter->iteritem;
 }
 
+/* Push "n" and the path to its leftmost leaf onto the iterator's path */
+static void
+miterator_tree_descend(struct miterator *iter, struct mbtree_node *n)
+{
+	for (; n != NULL; n = n->leaf ? NULL : MBTREE_CHILD(n)[0]) {
+		iter->tree_node[iter->tree_depth] = n;
+		iter->tree_pos[iter->tree_depth++] = 0;
+	}
+}
+
+/* Push the path to the first key not less than "key" */
+static void
+miterator_tree_seek(struct miterator *iter, struct mbtree_node *n,
+    const struct mobject *key)
+{
+	u_int i;
+	int found;
+
+	for (; n != NULL; n = found || n->leaf ? NULL : MBTREE_CHILD(n)[i]) {
+		found = mbtree_search(n, key, &i);
+		iter->tree_node[iter->tree_depth] = n;
+		iter->tree_pos[iter->tree_depth++] = i;
+	}
+}
+
+static struct miteritem *
+miterator_next_ordered_dict(struct miterator *iter)
+{
+	struct mordered *od = (struct mordered *)(iter->object);
+	struct mbtree_node *n;
+	u_int i;
+
+	if (!iter->started) {
+		iter->tree_depth = 0;
+		iter->started = 1;
+		if (iter->range_lo == NULL)
+			miterator_tree_descend(iter, od->root);
+		else
+			miterator_tree_seek(iter, od->root, iter->range_lo);
+	}
+	while (iter->tree_depth > 0) {
+		n = iter->tree_node[iter->tree_depth - 1];
+		if ((i = iter->tree_pos[iter->tree_depth - 1]) >= n->nkeys) {
+			iter->tree_depth--;
+			continue;
+		}
+		if (iter->range_hi != NULL &&
+		    mobject_cmp(n->keys[i], iter->range_hi) >= 0) {
+			iter->tree_depth = 0;
+			break;
+		}
+		bzero(&iter->iteritem, sizeof(iter->iteritem));
+		iter->iteritem.key = n->keys[i];
+		iter->iteritem.value = n->values[i];
+		iter->tree_pos[iter->tree_depth - 1] = i + 1;
+		if (!n->leaf)
+			miterator_tree_descend(iter, MBTREE_CHILD(n)[i + 1]);
+		return &iter->iteritem;
+	}
+	return NULL;
+}
+
+static struct miteritem *
+miterator_next_set(struct miterator *iter)
+{
+	struct mset *set = (struct mset *)(iter->object);
+	struct mobject *key;
+
+	if (!iter->started) {
+		iter->array_ndx = iter->set_pos = 0;
+		iter->array_last_key = NULL;
+		iter->started = 1;
+	}
+	while (iter->set_pos < set->nused &&
+	    set->entries[iter->set_pos].member == NULL)
+		iter->set_pos++;
+	if (iter->set_pos >= set->nused)
+		return NULL;
+	if ((key = iter->array_last_key) != NULL)
+		((struct mint *)key)->value = iter->array_ndx;
+	else if ((key = mint_new(iter->array_ndx)) == NULL)
+		return NULL;
+	iter->array_last_key = key;
+	bzero(&iter->iteritem, sizeof(iter->iteritem));
+	iter->iteritem.key = key;
+	iter->iteritem.value = set->entries[iter->set_pos++].member;
+	iter->array_ndx++;
+	return &iter->iteritem;
+}
 
 struct miteritem *
 miterator_next(struct miterator *iter)
@@ -848,8 +3281,19 @@ miterator_next(struct miterator *iter)
 	switch (iter->object->type) {
 	case TYPE_MARRAY:
 		return miterator_next_array(iter);
+	case TYPE_MSET:
+		return miterator_next_set(iter);
 	case TYPE_MDICT:
-		return miterator_next_dict(iter);
+		switch (MCONTAINER_REPR(iter->object)) {
+		case REPR_VIRTUAL:
+			return miterator_next_virtual_dict(iter);
+		case REPR_SHAPED:
+			return miterator_next_shaped_dict(iter);
+		case REPR_ORDERED:
+			return miterator_next_ordered_dict(iter);
+		default:
+			return miterator_next_dict(iter);
+		}
 	default:
 		return NULL;
 	}
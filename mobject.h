@@ -30,6 +30,7 @@ enum mobject_type {
 	TYPE_MSTRING,
 	TYPE_MARRAY,
 	TYPE_MDICT,
+	TYPE_MSET,
 };
 
 struct mobject;
@@ -76,6 +77,37 @@ struct mobject *mstring_new2(const u_int8_t *value, size_t len);
  */
 struct mobject *mstring_new(const char *value);
 
+/*
+ * Allocate a new string object that refers to the "len" bytes of memory
+ * at "value" without copying them. This allows data that already resides
+ * in memory (e.g. a mmap(2)ed file or a network buffer) to be used
+ * without a copy.
+ *
+ * The memory must remain valid and unmodified for the lifetime of the
+ * object. When the object is deallocated, "release_cb" (if not NULL) is
+ * called with "value", "len" and "ctx" so the owner may release it.
+ *
+ * NB. unlike strings created with mstring_new2(), the data of a borrowed
+ * string is not nul-terminated.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mstring_new_ref(const u_int8_t *value, size_t len,
+    void (*release_cb)(const u_int8_t *, size_t, void *), void *ctx);
+
+/*
+ * Allocate a new string object that is a view of "len" bytes of the
+ * string "s", starting at "offset". No data is copied.
+ *
+ * NB. the slice borrows the memory of "s", which must not be deallocated
+ * before the slice. The data of a slice is not nul-terminated.
+ *
+ * Returns: pointer to object or NULL on failure or if the requested
+ * range is not within "s"
+ */
+struct mobject *mstring_slice(const struct mobject *s, size_t offset,
+    size_t len);
+
 /*
  * Allocate an empty array object
  *
@@ -84,12 +116,213 @@ struct mobject *mstring_new(const char *value);
 struct mobject *marray_new(void);
 
 /*
- * Allocate an empty dictionary object
+ * Allocate an empty dictionary object. Keys may be strings, integers or
+ * None and are hashed by type and value, so the integer 1 and the
+ * string "1" are different keys.
  *
  * Returns: pointer to object or NULL on failure
  */
 struct mobject *mdict_new(void);
 
+/*
+ * Allocate an empty ordered dictionary. It is used with the usual mdict_*
+ * functions, but is kept sorted by key in mobject_cmp() order (keys of
+ * different types sort by type) in a B-tree, so lookups, insertions and
+ * removals take logarithmic time and iteration visits keys in order.
+ * Iteration between two keys is available with mdict_range().
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mdict_new_ordered(void);
+
+/*
+ * Allocate an empty typed array of integers or strings. Typed arrays
+ * store their values contiguously rather than as separate objects:
+ * integers as an int64_t vector and strings packed together in a single
+ * buffer. Values are added with marray_append_int64() or
+ * marray_append_str() respectively.
+ *
+ * Typed arrays may be read with the usual marray_* functions and
+ * iterators, which present their items as proxy objects. Proxies
+ * returned by marray_item() remain valid for the life of the array;
+ * those returned by an iterator are reused as it advances. Any other
+ * modification of a typed array (e.g. marray_set() or appending an
+ * object with marray_append()) converts it to an ordinary array first.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *marray_new_int64(void);
+struct mobject *marray_new_strings(void);
+
+/*
+ * Allocate a read-only array of the integers from "start" up to, but not
+ * including, "stop" in increments of "step" (which may be negative, but
+ * not zero), e.g. marray_new_range(0, 10, 3) holds 0, 3, 6 and 9. The
+ * integers are computed rather than stored, so iterating over a range
+ * allocates nothing per item; iterators present them through a single
+ * reused integer object. Objects returned by marray_item() are made as
+ * they are asked for and remain valid for the life of the range.
+ * Functions that would modify a range fail.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *marray_new_range(int64_t start, int64_t stop, int64_t step);
+
+/*
+ * Allocate a read-only view of the items of "array" from index "start" up
+ * to, but not including, "end". Nothing is copied: the view reads the
+ * array's items as it is used, clipping the window to the array's length
+ * at that time, and iterating over it yields each item keyed by its index
+ * in "array". A slice of a slice views the original array. The view does
+ * not own "array", which must outlive it. Arrays whose items can only be
+ * read in order (virtual arrays with a next() callback) can't be sliced.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *marray_slice(struct mobject *array, size_t start, size_t end);
+
+/*
+ * Allocate a read-only view of the "n" items of "array" at the indices
+ * "ndx", in that order; the indices are copied. Like a slice, the view
+ * copies no items, does not own "array" and yields each item keyed by its
+ * index in "array". Items at indices past the array's length when the
+ * view is used are missing. Selections from a slice or another selection
+ * view the original array, and must be within the view they are taken
+ * from.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *marray_select(struct mobject *array, const size_t *ndx,
+    size_t n);
+
+struct mshape;
+
+/*
+ * Allocate a shape: an immutable list of "nkeys" distinct dictionary keys
+ * that may be shared by any number of dictionaries created with
+ * mdict_new_shaped(). Such dictionaries store only a vector of values,
+ * one per key, so large numbers of dictionaries with the same keys use
+ * much less memory and key lookups are hashed.
+ *
+ * Returns: pointer to shape or NULL on failure (including duplicate keys)
+ */
+struct mshape *mshape_new(const char * const *keys, size_t nkeys);
+
+/*
+ * Release the caller's reference to a shape. Dictionaries using the shape
+ * keep their own references, so this may be called as soon as the last
+ * dictionary has been created.
+ */
+void mshape_free(struct mshape *shape);
+
+/*
+ * Returns the number of keys in a shape
+ */
+size_t mshape_len(const struct mshape *shape);
+
+/*
+ * Allocate a dictionary with the keys of "shape", in the order that they
+ * were given to mshape_new(). Every value is initially None; values may be
+ * set with mdict_set_slot(). The dictionary may be modified with the
+ * usual mdict_* functions, but doing so converts it to an ordinary
+ * dictionary that no longer shares the shape.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mdict_new_shaped(struct mshape *shape);
+
+/*
+ * Set the value of the key at position "slot" in the shape of the shaped
+ * dictionary "dict" to "value". Any previous value is deallocated. This
+ * transfers ownership of "value" to the dictionary.
+ *
+ * Returns 0 on success or -1 on failure (including if "dict" is not a
+ * shaped dictionary)
+ */
+int mdict_set_slot(struct mobject *dict, size_t slot, struct mobject *value);
+
+/*
+ * Callbacks that supply the contents of a virtual array or dictionary.
+ * All callbacks receive the "ctx" argument that was passed to
+ * mvirtual_new().
+ */
+struct mvirtual_ops {
+	/*
+	 * Return the number of items in the object. Required.
+	 */
+	size_t (*len)(void *ctx);
+
+	/*
+	 * Return the array item at index "ndx", or NULL if it does not
+	 * exist. Required for arrays that do not provide next(); without
+	 * it, marray_item() always fails.
+	 */
+	struct mobject *(*array_item)(void *ctx, size_t ndx);
+
+	/*
+	 * Return the dictionary item referenced by "key", or NULL if it does
+	 * not exist. Required for dictionaries.
+	 */
+	struct mobject *(*dict_item)(void *ctx, const struct mobject *key);
+
+	/*
+	 * Return the next item of an iteration. "pos" is a cursor that is
+	 * zero at the start of an iteration and may be advanced by the
+	 * callback as it sees fit. The item should be returned via "keyp"
+	 * and "valuep" (the key is ignored for arrays and may be left NULL).
+	 * Returns 0 if an item was returned, or -1 at the end of the
+	 * iteration or on error. Required for dictionaries. Arrays are
+	 * iterated with array_item() where it is provided, so that views
+	 * of them may start anywhere; arrays that provide only next() are
+	 * streams (see marray_is_stream()). Iteration of a stream ends when
+	 * next() returns -1 rather than after len() items, so a stream may
+	 * report the number of items produced so far.
+	 */
+	int (*next)(void *ctx, size_t *pos, struct mobject **keyp,
+	    struct mobject **valuep);
+
+	/*
+	 * Called when the virtual object is deallocated. Optional.
+	 */
+	void (*free)(void *ctx);
+
+	/*
+	 * Return a description of the error that ended an iteration early,
+	 * or NULL if there was none. Optional.
+	 */
+	const char *(*error)(void *ctx);
+};
+
+/*
+ * Allocate a virtual object of type "type" (TYPE_MARRAY or TYPE_MDICT),
+ * whose items are fetched on demand using the callbacks in "ops". Virtual
+ * objects report the type they were created with and may be used with the
+ * marray_* or mdict_* functions that read arrays or dictionaries, with
+ * iterators and with the mnamespace functions. They are read-only: any
+ * function that would modify them fails.
+ *
+ * Objects returned by the "array_item" and "dict_item" callbacks become
+ * owned by the virtual object, which will return the same object for
+ * subsequent lookups of that item and deallocates it when the virtual
+ * object itself is deallocated. Objects returned by the "next" callback
+ * become owned by the iterator and are deallocated when the iterator is
+ * advanced or freed.
+ *
+ * "ops" is not copied and must remain valid for the lifetime of the
+ * object.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mvirtual_new(enum mobject_type type,
+    const struct mvirtual_ops *ops, void *ctx);
+
+/*
+ * Returns the error that ended an iteration of the virtual object "o"
+ * early (see the "error" callback above), or NULL if there was none or
+ * "o" is not a virtual object.
+ */
+const char *mvirtual_error(struct mobject *o);
+
 /*
  * Deallocate the object "o" and any objects it references.
  * I.e. if "o" is a dictionary or array, then any objects that it
@@ -117,7 +350,8 @@ size_t mobject_to_string(const struct mobject *o, char *s, size_t len);
 
 /*
  * Makes "deep copy" copy of the specified object, recursively copying
- * arrays, dictionaries and their members.
+ * arrays, dictionaries and their members. Streams (see marray_is_stream())
+ * can't be copied.
  *
  * Returns a copy of the object(s) or NULL on failure
  */
@@ -141,7 +375,9 @@ int mint_add(struct mobject *v, int64_t n);
 size_t mstring_len(const struct mobject *s);
 
 /*
- * Returns a pointer to the data in the string object "s"
+ * Returns a pointer to the data in the string object "s". Strings
+ * created with mstring_new() or mstring_new2() are nul-terminated, those
+ * created with mstring_new_ref() or mstring_slice() are not.
  */
 const u_int8_t *mstring_ptr(const struct mobject *s);
 
@@ -179,6 +415,91 @@ struct mobject *marray_append_d(struct mobject *array);
 struct mobject *marray_append_a(struct mobject *array);
 struct mobject *marray_append_n(struct mobject *array);
 
+/*
+ * Append an integer or a string of "len" bytes to an array. Values are
+ * stored unboxed in typed arrays of the corresponding type (see
+ * marray_new_int64() and marray_new_strings()) and as new objects in
+ * ordinary arrays.
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int marray_append_int64(struct mobject *array, int64_t v);
+int marray_append_str(struct mobject *array, const void *s, size_t len);
+
+/*
+ * Read an integer or string item of an array without going through an
+ * item object, which avoids making proxies for items of typed arrays.
+ * Strings are returned as a pointer to their contents (which need not be
+ * nul-terminated) and a length; the pointer remains valid until the array
+ * is modified.
+ *
+ * Returns 0 on success or -1 if the item does not exist or is not of the
+ * requested type
+ */
+int marray_get_int64(struct mobject *array, size_t ndx, int64_t *vp);
+int marray_get_str(struct mobject *array, size_t ndx, const u_int8_t **sp,
+    size_t *lenp);
+
+/*
+ * Reorder the items of "array" so that item "i" is the item that was
+ * previously at position "perm[i]". "perm" must be a permutation of the
+ * array's indices. Typed arrays keep their representation.
+ *
+ * Returns 0 on success or -1 on failure (including if the array is
+ * read-only or "perm" is not a permutation)
+ */
+int marray_permute(struct mobject *array, const size_t *perm);
+
+/* Flags for marray_sort(), mobject_sort_order() and marray_sort_order() */
+#define MSORT_NUMERIC	0x0001	/* Compare keys as integers */
+#define MSORT_STRING	0x0002	/* Compare keys as strings */
+#define MSORT_REVERSE	0x0004	/* Sort in descending order */
+#define MSORT_KEEP	0x0008	/* Check and reuse a previous order */
+
+/*
+ * Sort "array" in place, stably, by a key of each item. "key_path" finds
+ * the key relative to the item using the namespace syntax (e.g. "name",
+ * "stats.count" or "[0]"), or the item itself is the key if it is NULL.
+ * Items without the key sort as None.
+ *
+ * By default keys are ordered with mobject_cmp(). With MSORT_NUMERIC,
+ * strings are compared by their leading integer (as sort -n does) and
+ * other non-integers as zero; with MSORT_STRING, integers are compared
+ * by their decimal representation and other non-strings as the empty
+ * string. Integer keys are radix sorted and keys that are all strings
+ * are compared directly; large arrays are merge sorted in several
+ * threads.
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int marray_sort(struct mobject *array, const char *key_path, int flags);
+
+/*
+ * Find the stable sorted order of the "n" objects "objs" without moving
+ * them: on return "perm[i]" is the index in "objs" of the i'th object in
+ * order. NULL objects sort as None. Keys are compared as for
+ * marray_sort(), according to "flags".
+ *
+ * With MSORT_KEEP, "perm" must already hold a permutation of the indices
+ * of "objs" (e.g. from an earlier call for the same objects). It is kept
+ * if it is still the sorted order, which is checked in linear time, and
+ * is only sorted again if it is not.
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int mobject_sort_order(struct mobject *const *objs, size_t n, int flags,
+    size_t *perm);
+
+/*
+ * As mobject_sort_order(), but find the sorted order of the items of
+ * "array", which are read directly so that items of typed arrays are not
+ * given proxies. "perm" must have room for marray_len(array) indices.
+ * Streams can't be sorted.
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int marray_sort_order(struct mobject *array, int flags, size_t *perm);
+
 /*
  * Sets entry "ndx" of array "array" to object "object". Any existing object
  * at this location will be deallocated. If the "ndx" refers to a location
@@ -203,6 +524,14 @@ struct mobject *marray_set_n(struct mobject *array, size_t ndx);
  */
 size_t marray_len(struct mobject *array);
 
+/*
+ * Returns non-zero if "array" is a stream: a virtual array that provides
+ * next() but not array_item(), so its items may only be read once, in
+ * order, and its length is not known until it has been read. Virtual
+ * arrays that provide both are not streams.
+ */
+int marray_is_stream(struct mobject *array);
+
 /*
  * Returns the last (highest index) entry in the array "array" or NULL if
  * the array is empty
@@ -262,6 +591,26 @@ struct mobject *marray_item(struct mobject *array, size_t ndx);
 struct mobject *mdict_item(const struct mobject *dict,
     const struct mobject *key);
 struct mobject *mdict_item_s(const struct mobject *dict, const char *key);
+struct mobject *mdict_item_i(const struct mobject *dict, int64_t key);
+
+/*
+ * Lookup cache for mdict_item_cached(). It should be zeroed before first
+ * use and is otherwise opaque. The shape and slot are packed into one
+ * word that is loaded and stored atomically, so a cache may be shared by
+ * several threads looking up the same key.
+ */
+struct mdict_cache {
+	u_int64_t word;
+};
+
+/*
+ * As mdict_item(), but remembers where "key" was found in a shaped
+ * dictionary in "cache". Later lookups of the same key in any dictionary
+ * of the same shape then cost only a comparison and a load. Lookups in
+ * other dictionaries are passed to mdict_item().
+ */
+struct mobject *mdict_item_cached(const struct mobject *dict,
+    const struct mobject *key, struct mdict_cache *cache);
 
 /*
  * Remove and return the dictionary item referenced by the specified "key"
@@ -281,6 +630,7 @@ struct mobject *mdict_remove_s(struct mobject *dict, const char *key);
  */
 int mdict_delete(struct mobject *dict, const struct mobject *key);
 int mdict_delete_s(struct mobject *dict, const char *key);
+int mdict_delete_i(struct mobject *dict, int64_t key);
 
 /*
  * Insert an item identified by "key" of value "value" into
@@ -304,6 +654,8 @@ struct mobject *mdict_insert_si(struct mobject *dict, const char *key,
 struct mobject *mdict_insert_sa(struct mobject *dict, const char *key);
 struct mobject *mdict_insert_sd(struct mobject *dict, const char *key);
 struct mobject *mdict_insert_sn(struct mobject *dict, const char *key);
+struct mobject *mdict_insert_i(struct mobject *dict, int64_t key,
+    struct mobject *value);
 
 /*
  * Insert an item identified by "key" of value "value" into
@@ -328,20 +680,114 @@ struct mobject *mdict_replace_si(struct mobject *dict, const char *key,
 struct mobject *mdict_replace_sa(struct mobject *dict, const char *key);
 struct mobject *mdict_replace_sd(struct mobject *dict, const char *key);
 struct mobject *mdict_replace_sn(struct mobject *dict, const char *key);
+struct mobject *mdict_replace_i(struct mobject *dict, int64_t key,
+    struct mobject *value);
 
 /*
  * Returns the number of items in a dictionary
  */
 size_t mdict_len(const struct mobject *dict);
 
+/*
+ * Allocate an empty set. Sets hold None, integer and string members
+ * without duplicates, using a hash table so that adding a member or
+ * testing for one takes constant time rather than a scan. Iteration over
+ * a set visits its members in the order they were first added, with the
+ * key of each iteration item being its position in that order.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mset_new(void);
+
+/*
+ * Add "member" to "set". Members are equal if they have the same type
+ * and compare equal with mobject_cmp(); thus the integer 1 and the string
+ * "1" are different members.
+ *
+ * NB. adding a new member transfers its ownership to the set. If an equal
+ * member is already present, ownership remains with the caller.
+ *
+ * Returns: 0 if the member was added, 1 if an equal member was already
+ * present or -1 on failure (including if "member" is not of a type that
+ * may be held in a set)
+ */
+int mset_add(struct mobject *set, struct mobject *member);
+int mset_add_s(struct mobject *set, const char *member);
+int mset_add_i(struct mobject *set, int64_t member);
+
+/*
+ * Returns: 1 if "set" holds a member equal to "member", 0 otherwise
+ */
+int mset_contains(const struct mobject *set, const struct mobject *member);
+int mset_contains_s(const struct mobject *set, const char *member);
+
+/*
+ * Remove and deallocate the member of "set" that is equal to "member".
+ *
+ * Returns: 0 on success, -1 if no such member exists
+ */
+int mset_remove(struct mobject *set, const struct mobject *member);
+
+/*
+ * Returns: the number of members in the set "set"
+ */
+size_t mset_len(const struct mobject *set);
+
+/*
+ * Allocate a new set holding copies of the members of "a" and "b" (union),
+ * of those members of "a" that are also in "b" (intersection) or of those
+ * members of "a" that are not in "b" (difference). Members keep their
+ * order from "a", followed for unions by that of "b".
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mset_union(const struct mobject *a, const struct mobject *b);
+struct mobject *mset_intersection(const struct mobject *a,
+    const struct mobject *b);
+struct mobject *mset_difference(const struct mobject *a,
+    const struct mobject *b);
+
 /*
  * Obtains an iterator over the object "obj". Iteration is
- * supported over arrays and dictionaries.
+ * supported over arrays, dictionaries and sets.
  *
  * Returns: pointer to iterator object or NULL on failure
  */
 struct miterator *mobject_getiter(struct mobject *obj);
 
+/*
+ * Obtains an iterator over the items of the ordered dictionary "dict"
+ * whose keys are not less than "lo" and less than "hi", in key order.
+ * Either bound may be NULL to leave that end of the range open. The
+ * bounds are copied. Resetting the iterator with miterator_reset()
+ * discards them.
+ *
+ * Returns: pointer to iterator object or NULL on failure (including if
+ * "dict" is not an ordered dictionary)
+ */
+struct miterator *mdict_range(struct mobject *dict, const struct mobject *lo,
+    const struct mobject *hi);
+
+/*
+ * Restart the iterator "iter" over the object "obj", which need not be the
+ * object it was originally obtained for. This allows an iterator to be
+ * reused without reallocation.
+ *
+ * Returns: 0 on success or -1 if "obj" does not support iteration
+ */
+int miterator_reset(struct miterator *iter, struct mobject *obj);
+
+/*
+ * Position the iterator "iter" over an array so that the next call to
+ * miterator_next() returns the item at index "ndx", allowing the items to
+ * be visited in any order. Items of typed arrays are still presented
+ * through the iterator's single proxy.
+ *
+ * Returns: 0 on success or -1 if "iter" is not over an array, or is over
+ * a stream
+ */
+int miterator_seek(struct miterator *iter, size_t ndx);
+
 /*
  * Free an iterator
  */
@@ -362,10 +808,228 @@ struct miteritem *miterator_next(struct miterator *iter);
  *   Strings are compared with case sensitivity.
  *   Arrays are compared first by the number of elements that they hold, then
  *   elementwise.
- *   Dictionaries are compared by identity (address).
+ *   Dictionaries and sets are compared by identity (address).
  */
 int mobject_cmp(const struct mobject *a, const struct mobject *b);
 
+struct mjson_writer;
+
+/*
+ * Allocate a JSON writer. Serialised output is accumulated in an internal
+ * buffer and passed to "write_cb" in large chunks along with the context
+ * argument "ctx". The callback must return 0 on success; any other value
+ * aborts serialisation.
+ *
+ * A writer may be reused for any number of objects, retaining its buffer
+ * and traversal state between calls.
+ *
+ * Returns: pointer to writer or NULL on failure
+ */
+struct mjson_writer *mjson_writer_new(
+    int (*write_cb)(const void *, size_t, void *), void *ctx);
+
+/*
+ * Free a JSON writer
+ */
+void mjson_writer_free(struct mjson_writer *w);
+
+/*
+ * Serialise the object "o" and everything it references as JSON using the
+ * writer "w". Arrays and sets are written as JSON arrays, dictionaries as
+ * JSON objects and None as null. Strings are written byte-for-byte with the
+ * minimal JSON escaping; they are assumed to be UTF-8.
+ *
+ * The object tree is traversed without recursion, so deeply nested
+ * objects do not consume C stack.
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int mjson_write(struct mjson_writer *w, struct mobject *o);
+
+/*
+ * Convenience function that serialises the object "o" as JSON to the
+ * file descriptor "fd".
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int mjson_write_fd(struct mobject *o, int fd);
+
+/*
+ * Convenience function that serialises the object "o" as JSON to an
+ * automatically allocated, nul-terminated buffer returned via "outp".
+ * If "lenp" is not NULL, the length of the output will be stored there.
+ * It is the caller's responsibility to deallocate the buffer.
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int mjson_write_mbuf(struct mobject *o, char **outp, size_t *lenp);
+
+/*
+ * Parse the "len" bytes at "s" as a single JSON value. Objects become
+ * dictionaries (later duplicate keys replacing earlier ones), arrays
+ * arrays, null None and true and false the integers 1 and 0. Integers
+ * become integer objects; other numbers, having no mobject equivalent,
+ * become strings of their text.
+ *
+ * Returns: pointer to object or NULL on failure, in which case up to
+ * "elen" characters describing the error will be written to "ebuf".
+ */
+struct mobject *mjson_parse(const void *s, size_t len, char *ebuf,
+    size_t elen);
+
+struct mjson_reader;
+
+/*
+ * Allocate a reader of newline-delimited JSON (one value per line) from
+ * the file descriptor "fd", which remains the caller's. Input is read
+ * into a buffer that is reused for each record, so memory use is bounded
+ * by the largest record rather than the size of the input.
+ *
+ * Returns: pointer to reader or NULL on failure
+ */
+struct mjson_reader *mjson_reader_new(int fd);
+
+/*
+ * Free a JSON reader
+ */
+void mjson_reader_free(struct mjson_reader *r);
+
+/*
+ * Read and parse the next record, skipping blank lines. Strings in the
+ * record refer to the reader's buffer rather than being copied, so the
+ * caller must deallocate the record before calling mjson_reader_next()
+ * again or freeing the reader.
+ *
+ * Returns: pointer to object, or NULL at the end of the input or on
+ * failure (see mjson_reader_error())
+ */
+struct mobject *mjson_reader_next(struct mjson_reader *r);
+
+/*
+ * Returns: a description of the error that stopped the reader, or NULL
+ * if none has occurred
+ */
+const char *mjson_reader_error(struct mjson_reader *r);
+
+/*
+ * Allocate a read-only virtual array that reads the records of "r" as it
+ * is iterated over, so that it may be used as the subject of a template
+ * "for" loop. Each record exists only for its iteration step. The
+ * records can only be iterated over once, and as they are not retained
+ * they cannot be fetched by index; the array's length is the number of
+ * records read so far. An iteration ends early if a record can't be
+ * parsed, and mvirtual_error() then returns the reader's error. The
+ * reader must outlive the array.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mjson_reader_records(struct mjson_reader *r);
+
+/* Types of C structure members that may be exposed by mstruct objects */
+enum mstruct_type {
+	MSTRUCT_INT64,		/* int64_t */
+	MSTRUCT_STRING,		/* Pointer to nul-terminated string or NULL */
+	MSTRUCT_STRUCT,		/* Embedded structure, described by "desc" */
+	MSTRUCT_ARRAY		/* Pointer to array of structures described
+				 * by "desc", with a size_t element count
+				 * at "count_offset" */
+};
+
+struct mstruct_desc;
+
+/*
+ * Describes a member of a C structure. "name" is the dictionary key that
+ * it will appear under and "offset" its offsetof() in the structure.
+ */
+struct mstruct_field {
+	const char *name;
+	enum mstruct_type type;
+	size_t offset;
+	const struct mstruct_desc *desc;	/* MSTRUCT_STRUCT, _ARRAY */
+	size_t count_offset;			/* MSTRUCT_ARRAY only */
+};
+
+/*
+ * Describes a C structure of "size" bytes (i.e. sizeof()) in terms of
+ * its "nfields" exposed members.
+ */
+struct mstruct_desc {
+	size_t size;
+	size_t nfields;
+	const struct mstruct_field *fields;
+};
+
+/*
+ * Allocate a read-only dictionary that exposes the C structure at "record"
+ * described by "desc". Keys are the field names, in descriptor order for
+ * iteration. Members are read from the structure memory when they are
+ * looked up: integers are converted to mint objects, strings are borrowed
+ * (see mstring_new_ref()) rather than copied, a NULL string becomes None,
+ * and embedded structures and arrays of structures are exposed as further
+ * mstruct objects.
+ *
+ * The structure memory is not copied. It must remain valid and unmodified
+ * for the lifetime of the returned object and anything obtained from it.
+ * The descriptor must likewise remain valid.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mstruct_new(const struct mstruct_desc *desc,
+    const void *record);
+
+/*
+ * Allocate a read-only array that exposes the "nmemb" C structures
+ * starting at "base" as mstruct_new() dictionaries. The same lifetime
+ * rules apply. Iterating over the array creates each record only for
+ * the duration of its iteration step.
+ *
+ * Returns: pointer to object or NULL on failure
+ */
+struct mobject *mstruct_array_new(const struct mstruct_desc *desc,
+    const void *base, size_t nmemb);
+
+/* Flags for mcsv_parse() and mcsv_load() */
+#define MCSV_TSV	0x0001	/* Tab-separated, no quoting */
+
+/*
+ * Parse "len" bytes of comma-separated (RFC 4180) or, if "flags" include
+ * MCSV_TSV, tab-separated data into columns. The first record names the
+ * columns; every following record must have the same number of fields.
+ *
+ * Returns a dictionary mapping each column name to an array of its values.
+ * A column whose values are all integers (written as "%lld" would print
+ * them) is an unboxed integer array (see marray_new_int64()), any other
+ * column a packed string array (see marray_new_strings()).
+ *
+ * Large inputs are split at record boundaries and parsed by up to
+ * "nthreads" threads; zero means one per online processor.
+ *
+ * Returns: pointer to object or NULL on failure, in which case up to
+ * "elen" characters describing the error will be written to "ebuf".
+ */
+struct mobject *mcsv_parse(const char *data, size_t len, int flags,
+    u_int nthreads, char *ebuf, size_t elen);
+
+/*
+ * As mcsv_parse(), but read the data from the file at "path" ("-" for
+ * standard input). Regular files are mapped rather than read.
+ */
+struct mobject *mcsv_load(const char *path, int flags, u_int nthreads,
+    char *ebuf, size_t elen);
+
+/*
+ * Allocate a read-only array of the rows of a "table" of equal length
+ * columns, such as that returned by mcsv_parse(). Each row is a
+ * dictionary mapping the column names to that row's values, created when
+ * it is looked up or iterated over; string values are borrowed from the
+ * columns rather than copied. The returned array takes ownership of
+ * "table", which must not be modified or deallocated by the caller.
+ *
+ * Returns: pointer to object or NULL on failure, in which case "table"
+ * remains the caller's
+ */
+struct mobject *mcsv_rows(struct mobject *table);
+
 
 /*
  * Look up a name in a dictionary namespace. Names may combine dictionary
@@ -385,6 +1049,21 @@ int mobject_cmp(const struct mobject *a, const struct mobject *b);
 int mnamespace_lookup(struct mobject *ns, char *location, struct mobject **obj,
     char *ebuf, size_t elen);
 
+/*
+ * Resolve the remainder of a namespace name relative to an object that
+ * has already been looked up. "location" is a name using the syntax
+ * described for mnamespace_lookup, "offset" is the position in "location"
+ * of the first dictionary or array accessor that has not yet been
+ * resolved and "base" is the object named by the preceding part of
+ * "location". For example, looking up "a.b[10].c" with offset 3 resolves
+ * "[10].c" relative to "base", which should be the object named "a.b".
+ *
+ * Returns 0 on success, -1 on failure. On failure, up to "elen" characters
+ * will be written into "ebuf" describing the error.
+ */
+int mnamespace_lookup_from(struct mobject *base, char *location,
+    size_t offset, struct mobject **obj, char *ebuf, size_t elen);
+
 /*
  * Sets the "location" in the namespace 'ns' to contain object "obj",
  * using the namespace syntax described for mnamespace_lookup. If no
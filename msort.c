@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2007 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* $Id$ */
+
+/* Sorting of arrays */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mobject.h"
+
+/* Arrays shorter than this are sorted in a single thread */
+#define MSORT_PARALLEL_MIN	(64 * 1024)
+
+/* Upper limit on the number of sorting threads */
+#define MSORT_MAX_THREADS	16
+
+/* Runs this short are insertion sorted */
+#define MSORT_INSERTION_MAX	16
+
+/* Longest decimal integer, for MSORT_STRING */
+#define MSORT_INT_CHARS		21
+
+/* How keys are compared, decided once for the whole array */
+enum msort_class {
+	SORT_INT,	/* Unsigned integers, radix sorted */
+	SORT_STR,	/* Byte strings */
+	SORT_OBJ,	/* Anything else, with mobject_cmp() */
+};
+
+/* Sort key of an item, and the item's position before sorting */
+struct msort_key {
+	union {
+		u_int64_t u;
+		struct {
+			const u_int8_t *p;
+			size_t len;
+		} s;
+		const struct mobject *o;
+	} k;
+	size_t ndx;
+};
+
+struct msort_ctx {
+	enum msort_class cls;
+	int reverse;
+};
+
+/* A run to sort, or two adjacent runs to merge, in a thread */
+struct msort_job {
+	const struct msort_ctx *ctx;
+	struct msort_key *src, *dst;
+	size_t lo, mid, hi;
+};
+
+static int
+key_cmp(const struct msort_ctx *ctx, const struct msort_key *a,
+    const struct msort_key *b)
+{
+	int r;
+
+	if (ctx->reverse) {
+		const struct msort_key *tmp = a;
+
+		a = b;
+		b = tmp;
+	}
+	switch (ctx->cls) {
+	case SORT_INT:
+		return a->k.u < b->k.u ? -1 : a->k.u > b->k.u;
+	case SORT_STR:
+		if ((r = memcmp(a->k.s.p, b->k.s.p,
+		    MIN(a->k.s.len, b->k.s.len))) != 0)
+			return r;
+		return a->k.s.len < b->k.s.len ? -1 :
+		    a->k.s.len > b->k.s.len;
+	default:
+		return mobject_cmp(a->k.o, b->k.o);
+	}
+}
+
+/* Stable merge of the sorted runs src[lo, mid) and src[mid, hi) into dst */
+static void
+merge(const struct msort_ctx *ctx, const struct msort_key *src,
+    struct msort_key *dst, size_t lo, size_t mid, size_t hi)
+{
+	size_t i = lo, j = mid, o = lo;
+
+	while (i < mid && j < hi) {
+		/* Take from the left run on ties to keep the sort stable */
+		if (key_cmp(ctx, &src[j], &src[i]) < 0)
+			dst[o++] = src[j++];
+		else
+			dst[o++] = src[i++];
+	}
+	memcpy(dst + o, src + i, (mid - i) * sizeof(*dst));
+	o += mid - i;
+	memcpy(dst + o, src + j, (hi - j) * sizeof(*dst));
+}
+
+/* Stable sort of keys[0, n), using tmp[0, n) as scratch space */
+static void
+merge_sort(const struct msort_ctx *ctx, struct msort_key *keys,
+    struct msort_key *tmp, size_t n)
+{
+	struct msort_key k;
+	size_t i, j, mid;
+
+	if (n <= MSORT_INSERTION_MAX) {
+		for (i = 1; i < n; i++) {
+			k = keys[i];
+			for (j = i; j > 0 && key_cmp(ctx, &keys[j - 1], &k) > 0;
+			    j--)
+				keys[j] = keys[j - 1];
+			keys[j] = k;
+		}
+		return;
+	}
+	mid = n / 2;
+	merge_sort(ctx, keys, tmp, mid);
+	merge_sort(ctx, keys + mid, tmp + mid, n - mid);
+	/* Already in order: common for data that is nearly sorted */
+	if (key_cmp(ctx, &keys[mid - 1], &keys[mid]) <= 0)
+		return;
+	memcpy(tmp, keys, n * sizeof(*tmp));
+	merge(ctx, tmp, keys, 0, mid, n);
+}
+
+static void *
+sort_job(void *arg)
+{
+	struct msort_job *job = arg;
+
+	merge_sort(job->ctx, job->src + job->lo, job->dst + job->lo,
+	    job->hi - job->lo);
+	return NULL;
+}
+
+static void *
+merge_job(void *arg)
+{
+	struct msort_job *job = arg;
+
+	merge(job->ctx, job->src, job->dst, job->lo, job->mid, job->hi);
+	return NULL;
+}
+
+/* Run jobs in threads, or in this one if threads can't be started */
+static void
+run_jobs(struct msort_job *jobs, size_t njobs, void *(*fn)(void *))
+{
+	pthread_t tids[MSORT_MAX_THREADS];
+	u_int8_t started[MSORT_MAX_THREADS];
+	size_t i;
+
+	for (i = 1; i < njobs; i++)
+		started[i] = pthread_create(&tids[i], NULL, fn, &jobs[i]) == 0;
+	fn(&jobs[0]);
+	for (i = 1; i < njobs; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+		else
+			fn(&jobs[i]);
+	}
+}
+
+/*
+ * Sort keys[0, n) by sorting a run per thread and then merging pairs of
+ * adjacent runs, also in threads, until one is left. Returns whichever
+ * of "keys" or "tmp" holds the result.
+ */
+static struct msort_key *
+parallel_merge_sort(const struct msort_ctx *ctx, struct msort_key *keys,
+    struct msort_key *tmp, size_t n, size_t nthreads)
+{
+	struct msort_job jobs[MSORT_MAX_THREADS];
+	struct msort_key *src = keys, *dst = tmp, *swap;
+	size_t bounds[MSORT_MAX_THREADS + 1];
+	size_t i, nruns = nthreads, njobs;
+
+	for (i = 0; i <= nruns; i++)
+		bounds[i] = n / nruns * i + (i == nruns ? n % nruns : 0);
+	for (i = 0; i < nruns; i++) {
+		jobs[i].ctx = ctx;
+		jobs[i].src = keys;
+		jobs[i].dst = tmp;
+		jobs[i].lo = bounds[i];
+		jobs[i].hi = bounds[i + 1];
+	}
+	run_jobs(jobs, nruns, sort_job);
+
+	while (nruns > 1) {
+		for (i = njobs = 0; i + 1 < nruns; i += 2, njobs++) {
+			jobs[njobs].ctx = ctx;
+			jobs[njobs].src = src;
+			jobs[njobs].dst = dst;
+			jobs[njobs].lo = bounds[i];
+			jobs[njobs].mid = bounds[i + 1];
+			jobs[njobs].hi = bounds[i + 2];
+			bounds[njobs] = bounds[i];
+		}
+		/* An odd run out is carried over to the next round as is */
+		if (i < nruns) {
+			memcpy(dst + bounds[i], src + bounds[i],
+			    (bounds[i + 1] - bounds[i]) * sizeof(*dst));
+			bounds[njobs] = bounds[i];
+			nruns = njobs + 1;
+		} else
+			nruns = njobs;
+		bounds[nruns] = n;
+		run_jobs(jobs, njobs, merge_job);
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	return src;
+}
+
+/*
+ * Stable LSD radix sort of keys[0, n) on k.u, a byte at a time. Bytes
+ * that are the same in every key are skipped. Returns whichever of "keys"
+ * or "tmp" holds the result.
+ */
+static struct msort_key *
+radix_sort(struct msort_key *keys, struct msort_key *tmp, size_t n)
+{
+	size_t counts[8][256];
+	struct msort_key *src = keys, *dst = tmp, *swap;
+	size_t i, b, sum, c;
+	u_int shift;
+
+	bzero(counts, sizeof(counts));
+	for (i = 0; i < n; i++) {
+		for (b = 0; b < 8; b++)
+			counts[b][(keys[i].k.u >> (b * 8)) & 0xff]++;
+	}
+	for (b = 0; b < 8; b++) {
+		shift = b * 8;
+		if (counts[b][(keys[0].k.u >> shift) & 0xff] == n)
+			continue;
+		for (i = sum = 0; i < 256; i++) {
+			c = counts[b][i];
+			counts[b][i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			dst[counts[b][(src[i].k.u >> shift) & 0xff]++] = src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	return src;
+}
+
+/* Leading integer of a string, as sort -n reads it; saturates */
+static int64_t
+parse_numeric(const u_int8_t *p, size_t len)
+{
+	u_int64_t v = 0, lim;
+	size_t i = 0;
+	int neg = 0;
+
+	while (i < len && (p[i] == ' ' || p[i] == '\t'))
+		i++;
+	if (i < len && (p[i] == '-' || p[i] == '+'))
+		neg = p[i++] == '-';
+	lim = neg ? (u_int64_t)INT64_MAX + 1 : (u_int64_t)INT64_MAX;
+	for (; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
+		if (v > (lim - (p[i] - '0')) / 10) {
+			v = lim;
+			break;
+		}
+		v = v * 10 + (p[i] - '0');
+	}
+	return !neg || v == 0 ? (int64_t)v : -(int64_t)(v - 1) - 1;
+}
+
+/* Map an integer to an unsigned one that sorts in the same order */
+static u_int64_t
+int_key(int64_t v, int reverse)
+{
+	u_int64_t u = (u_int64_t)v ^ ((u_int64_t)1 << 63);
+
+	/* Inverting the key reverses the order but keeps the sort stable */
+	return reverse ? ~u : u;
+}
+
+/* Find the sort key of an item, or NULL if it has none */
+static struct mobject *
+item_key(struct mobject *item, const char *key_path, struct mobject *skey,
+    char *loc)
+{
+	struct mobject *o;
+	char ebuf[64];
+
+	if (item == NULL || key_path == NULL)
+		return item;
+	/* Simple keys are looked up without parsing the path */
+	if (skey != NULL) {
+		if (mobject_type(item) != TYPE_MDICT)
+			return NULL;
+		return mdict_item(item, skey);
+	}
+	if (mnamespace_lookup_from(item, loc, 1, &o, ebuf, sizeof(ebuf)) != 0)
+		return NULL;
+	return o;
+}
+
+/*
+ * Record "k" as the sort key "key" in the form that "flags" asks for,
+ * counting integer and string keys. Integers rendered for MSORT_STRING
+ * are written to the key's slot in "ibuf".
+ */
+static void
+object_key(struct msort_key *key, const struct mobject *k, int flags,
+    int reverse, u_int8_t *ibuf, int *nints, int *nstrs)
+{
+	int64_t v;
+
+	if (flags & MSORT_NUMERIC) {
+		if (mobject_type(k) == TYPE_MINT)
+			v = mint_value(k);
+		else if (mobject_type(k) == TYPE_MSTRING)
+			v = parse_numeric(mstring_ptr(k), mstring_len(k));
+		else
+			v = 0;
+		key->k.u = int_key(v, reverse);
+		(*nints)++;
+	} else if (flags & MSORT_STRING) {
+		ibuf += key->ndx * MSORT_INT_CHARS;
+		key->k.s.p = ibuf;
+		key->k.s.len = 0;
+		if (mobject_type(k) == TYPE_MSTRING) {
+			key->k.s.p = mstring_ptr(k);
+			key->k.s.len = mstring_len(k);
+		} else if (mobject_type(k) == TYPE_MINT) {
+			key->k.s.len = snprintf((char *)ibuf, MSORT_INT_CHARS,
+			    "%lld", (long long)mint_value(k));
+		}
+		(*nstrs)++;
+	} else if (mobject_type(k) == TYPE_MINT) {
+		key->k.u = int_key(mint_value(k), reverse);
+		(*nints)++;
+	} else if (mobject_type(k) == TYPE_MSTRING) {
+		key->k.s.p = mstring_ptr(k);
+		key->k.s.len = mstring_len(k);
+		(*nstrs)++;
+	} else
+		key->k.o = k;
+}
+
+/*
+ * Record item "i" of "array" as the sort key "key", as object_key() does.
+ * Integers and strings are read directly rather than through an item
+ * object, so that items of typed arrays are not given proxies.
+ */
+static void
+array_key(struct msort_key *key, struct mobject *array, size_t i,
+    struct mobject *none, int flags, int reverse, u_int8_t *ibuf,
+    int *nints, int *nstrs)
+{
+	struct mobject *o;
+	int64_t v;
+
+	if (marray_get_int64(array, i, &v) == 0) {
+		if (flags & MSORT_STRING) {
+			key->k.s.p = ibuf + key->ndx * MSORT_INT_CHARS;
+			key->k.s.len = snprintf((char *)ibuf +
+			    key->ndx * MSORT_INT_CHARS, MSORT_INT_CHARS,
+			    "%lld", (long long)v);
+			(*nstrs)++;
+		} else {
+			key->k.u = int_key(v, reverse);
+			(*nints)++;
+		}
+		return;
+	}
+	if (marray_get_str(array, i, &key->k.s.p, &key->k.s.len) == 0) {
+		if (flags & MSORT_NUMERIC) {
+			key->k.u = int_key(parse_numeric(key->k.s.p,
+			    key->k.s.len), reverse);
+			(*nints)++;
+		} else
+			(*nstrs)++;
+		return;
+	}
+	o = marray_item(array, i);
+	object_key(key, o == NULL ? none : o, flags, reverse, ibuf,
+	    nints, nstrs);
+}
+
+/*
+ * Use a specialised comparison if every key has the same type. The keys
+ * were recorded in that type's form as they were found; mixed keys must
+ * be found again as objects, and compared with mobject_cmp(). Returns
+ * nonzero if that is needed.
+ */
+static int
+choose_class(struct msort_ctx *ctx, size_t n, int nints, int nstrs)
+{
+	if ((size_t)nints == n)
+		ctx->cls = SORT_INT;
+	else if ((size_t)nstrs == n)
+		ctx->cls = SORT_STR;
+	else
+		ctx->cls = SORT_OBJ;
+	return ctx->cls == SORT_OBJ;
+}
+
+/* Sort keys[0, n) into "perm", by their original positions */
+static void
+sort_keys(const struct msort_ctx *ctx, struct msort_key *keys,
+    struct msort_key *tmp, size_t n, size_t *perm)
+{
+	struct msort_key *sorted;
+	size_t i, nthreads;
+	long ncpu;
+
+	if (ctx->cls == SORT_INT)
+		sorted = radix_sort(keys, tmp, n);
+	else {
+		nthreads = 1;
+		if (n >= MSORT_PARALLEL_MIN) {
+			ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+			nthreads = ncpu < 1 ? 1 : (size_t)ncpu;
+			nthreads = MIN(nthreads, MSORT_MAX_THREADS);
+			nthreads = MIN(nthreads, n / (MSORT_PARALLEL_MIN / 2));
+		}
+		if (nthreads > 1) {
+			sorted = parallel_merge_sort(ctx, keys, tmp, n,
+			    nthreads);
+		} else {
+			merge_sort(ctx, keys, tmp, n);
+			sorted = keys;
+		}
+	}
+	for (i = 0; i < n; i++)
+		perm[i] = sorted[i].ndx;
+}
+
+/* Returns nonzero if "perm" is still the stable sorted order of keys */
+static int
+keys_in_order(const struct msort_ctx *ctx, const struct msort_key *keys,
+    size_t n, const size_t *perm)
+{
+	struct msort_ctx fwd = *ctx;
+	size_t i;
+	int r;
+
+	/* Integer keys were inverted when recorded for a reverse sort */
+	if (fwd.cls == SORT_INT)
+		fwd.reverse = 0;
+	for (i = 0; i < n; i++) {
+		if (perm[i] >= n)
+			return 0;
+	}
+	for (i = 1; i < n; i++) {
+		r = key_cmp(&fwd, &keys[perm[i - 1]], &keys[perm[i]]);
+		if (r > 0 || (r == 0 && perm[i - 1] > perm[i]))
+			return 0;
+	}
+	return 1;
+}
+
+int
+marray_sort(struct mobject *array, const char *key_path, int flags)
+{
+	struct msort_ctx ctx;
+	struct msort_key *keys = NULL, *tmp = NULL;
+	struct mobject *k, *skey = NULL, *none;
+	u_int8_t *ibuf = NULL;
+	char *loc = NULL;
+	size_t i, n, len, *perm = NULL;
+	int ret = -1, nints = 0, nstrs = 0;
+
+	if (mobject_type(array) != TYPE_MARRAY ||
+	    ((flags & MSORT_NUMERIC) && (flags & MSORT_STRING)))
+		return -1;
+	if ((n = marray_len(array)) < 2)
+		return 0;
+	if (key_path != NULL && *key_path == '\0')
+		key_path = NULL;
+	if (key_path != NULL && key_path[strcspn(key_path, ".[")] == '\0') {
+		if ((skey = mstring_new(key_path)) == NULL)
+			return -1;
+	} else if (key_path != NULL) {
+		/* mnamespace_lookup_from() wants a name before the path */
+		len = strlen(key_path) + 3;
+		if ((loc = malloc(len)) == NULL)
+			return -1;
+		snprintf(loc, len, "_%s%s", *key_path == '[' ? "" : ".",
+		    key_path);
+	}
+	if ((none = mnone_new()) == NULL ||
+	    (keys = calloc(n, sizeof(*keys))) == NULL ||
+	    (tmp = calloc(n, sizeof(*tmp))) == NULL ||
+	    (perm = calloc(n, sizeof(*perm))) == NULL)
+		goto out;
+	if (flags & MSORT_STRING &&
+	    (ibuf = malloc(n * MSORT_INT_CHARS)) == NULL)
+		goto out;
+
+	ctx.reverse = (flags & MSORT_REVERSE) != 0;
+	for (i = 0; i < n; i++) {
+		keys[i].ndx = i;
+		if (key_path == NULL) {
+			array_key(&keys[i], array, i, none, flags,
+			    ctx.reverse, ibuf, &nints, &nstrs);
+			continue;
+		}
+		if ((k = item_key(marray_item(array, i), key_path,
+		    skey, loc)) == NULL)
+			k = none;
+		object_key(&keys[i], k, flags, ctx.reverse, ibuf,
+		    &nints, &nstrs);
+	}
+	if (choose_class(&ctx, n, nints, nstrs)) {
+		for (i = 0; i < n; i++) {
+			if ((k = item_key(marray_item(array, i), key_path,
+			    skey, loc)) == NULL)
+				k = none;
+			keys[i].k.o = k;
+		}
+	}
+	sort_keys(&ctx, keys, tmp, n, perm);
+	ret = marray_permute(array, perm);
+ out:
+	if (skey != NULL)
+		mobject_free(skey);
+	free(loc);
+	free(keys);
+	free(tmp);
+	free(perm);
+	free(ibuf);
+	return ret;
+}
+
+/*
+ * Find the sorted order of the "n" objects "objs", or if it is NULL, of
+ * the items of "array".
+ */
+static int
+sort_order(struct mobject *const *objs, struct mobject *array, size_t n,
+    int flags, size_t *perm)
+{
+	struct msort_ctx ctx;
+	struct msort_key *keys = NULL, *tmp = NULL;
+	struct mobject *none, *o;
+	u_int8_t *ibuf = NULL;
+	size_t i;
+	int ret = -1, nints = 0, nstrs = 0;
+
+	if ((flags & MSORT_NUMERIC) && (flags & MSORT_STRING))
+		return -1;
+	if (n == 0)
+		return 0;
+	if ((none = mnone_new()) == NULL ||
+	    (keys = calloc(n, sizeof(*keys))) == NULL)
+		goto out;
+	if (flags & MSORT_STRING &&
+	    (ibuf = malloc(n * MSORT_INT_CHARS)) == NULL)
+		goto out;
+
+	ctx.reverse = (flags & MSORT_REVERSE) != 0;
+	for (i = 0; i < n; i++) {
+		keys[i].ndx = i;
+		if (objs == NULL) {
+			array_key(&keys[i], array, i, none, flags,
+			    ctx.reverse, ibuf, &nints, &nstrs);
+			continue;
+		}
+		object_key(&keys[i], objs[i] == NULL ? none : objs[i], flags,
+		    ctx.reverse, ibuf, &nints, &nstrs);
+	}
+	if (choose_class(&ctx, n, nints, nstrs)) {
+		for (i = 0; i < n; i++) {
+			o = objs != NULL ? objs[i] : marray_item(array, i);
+			keys[i].k.o = o == NULL ? none : o;
+		}
+	}
+	/* Checking an earlier order is linear; sorting again is not */
+	if ((flags & MSORT_KEEP) && keys_in_order(&ctx, keys, n, perm)) {
+		ret = 0;
+		goto out;
+	}
+	if ((tmp = calloc(n, sizeof(*tmp))) == NULL)
+		goto out;
+	sort_keys(&ctx, keys, tmp, n, perm);
+	ret = 0;
+ out:
+	free(keys);
+	free(tmp);
+	free(ibuf);
+	return ret;
+}
+
+int
+mobject_sort_order(struct mobject *const *objs, size_t n, int flags,
+    size_t *perm)
+{
+	return sort_order(objs, NULL, n, flags, perm);
+}
+
+int
+marray_sort_order(struct mobject *array, int flags, size_t *perm)
+{
+	if (mobject_type(array) != TYPE_MARRAY || marray_is_stream(array))
+		return -1;
+	return sort_order(NULL, array, marray_len(array), flags, perm);
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2007 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* $Id$ */
+
+/* Read-only mobject views of C structures, built on virtual objects */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mobject.h"
+
+/* Context of a record dictionary or an array of records */
+struct mstruct_ctx {
+	const struct mstruct_desc *desc;
+	const u_int8_t *base;
+	size_t nmemb;		/* Arrays only */
+};
+
+static size_t
+mstruct_len(void *_ctx)
+{
+	return ((struct mstruct_ctx *)_ctx)->desc->nfields;
+}
+
+static size_t
+mstruct_array_len(void *_ctx)
+{
+	return ((struct mstruct_ctx *)_ctx)->nmemb;
+}
+
+static void
+mstruct_free(void *ctx)
+{
+	free(ctx);
+}
+
+/* Make an object for a structure member */
+static struct mobject *
+mstruct_field_value(const struct mstruct_field *f, const u_int8_t *record)
+{
+	const u_int8_t *p = record + f->offset;
+	const char *s;
+	int64_t v;
+	size_t n;
+
+	switch (f->type) {
+	case MSTRUCT_INT64:
+		/* Structure may be packed, so don't assume alignment */
+		memcpy(&v, p, sizeof(v));
+		return mint_new(v);
+	case MSTRUCT_STRING:
+		memcpy(&s, p, sizeof(s));
+		if (s == NULL)
+			return mnone_new();
+		return mstring_new_ref((const u_int8_t *)s, strlen(s),
+		    NULL, NULL);
+	case MSTRUCT_STRUCT:
+		return mstruct_new(f->desc, p);
+	case MSTRUCT_ARRAY:
+		memcpy(&s, p, sizeof(s));
+		memcpy(&n, record + f->count_offset, sizeof(n));
+		return mstruct_array_new(f->desc, s, n);
+	default:
+		return NULL;
+	}
+}
+
+static struct mobject *
+mstruct_dict_item(void *_ctx, const struct mobject *key)
+{
+	struct mstruct_ctx *ctx = (struct mstruct_ctx *)_ctx;
+	const struct mstruct_field *f;
+	const u_int8_t *k;
+	size_t i, klen;
+
+	if (mobject_type(key) != TYPE_MSTRING)
+		return NULL;
+	k = mstring_ptr(key);
+	klen = mstring_len(key);
+	for (i = 0; i < ctx->desc->nfields; i++) {
+		f = &ctx->desc->fields[i];
+		if (strncmp(f->name, (const char *)k, klen) == 0 &&
+		    f->name[klen] == '\0')
+			return mstruct_field_value(f, ctx->base);
+	}
+	return NULL;
+}
+
+static int
+mstruct_next(void *_ctx, size_t *pos, struct mobject **keyp,
+    struct mobject **valuep)
+{
+	struct mstruct_ctx *ctx = (struct mstruct_ctx *)_ctx;
+	const struct mstruct_field *f;
+
+	if (*pos >= ctx->desc->nfields)
+		return -1;
+	f = &ctx->desc->fields[*pos];
+	if ((*keyp = mstring_new_ref((const u_int8_t *)f->name,
+	    strlen(f->name), NULL, NULL)) == NULL)
+		return -1;
+	if ((*valuep = mstruct_field_value(f, ctx->base)) == NULL) {
+		mobject_free(*keyp);
+		return -1;
+	}
+	(*pos)++;
+	return 0;
+}
+
+static struct mobject *
+mstruct_array_item(void *_ctx, size_t ndx)
+{
+	struct mstruct_ctx *ctx = (struct mstruct_ctx *)_ctx;
+
+	if (ndx >= ctx->nmemb)
+		return NULL;
+	return mstruct_new(ctx->desc, ctx->base + ndx * ctx->desc->size);
+}
+
+static int
+mstruct_array_next(void *_ctx, size_t *pos, struct mobject **keyp,
+    struct mobject **valuep)
+{
+	if ((*valuep = mstruct_array_item(_ctx, *pos)) == NULL)
+		return -1;
+	(*pos)++;
+	return 0;
+}
+
+static const struct mvirtual_ops mstruct_ops = {
+	mstruct_len, NULL, mstruct_dict_item, mstruct_next, mstruct_free
+};
+
+static const struct mvirtual_ops mstruct_array_ops = {
+	mstruct_array_len, mstruct_array_item, NULL, mstruct_array_next,
+	mstruct_free
+};
+
+static struct mobject *
+mstruct_alloc(enum mobject_type type, const struct mvirtual_ops *ops,
+    const struct mstruct_desc *desc, const void *base, size_t nmemb)
+{
+	struct mstruct_ctx *ctx;
+	struct mobject *ret;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+	ctx->desc = desc;
+	ctx->base = base;
+	ctx->nmemb = nmemb;
+	if ((ret = mvirtual_new(type, ops, ctx)) == NULL)
+		free(ctx);
+	return ret;
+}
+
+struct mobject *
+mstruct_new(const struct mstruct_desc *desc, const void *record)
+{
+	if (desc == NULL || record == NULL)
+		return NULL;
+	return mstruct_alloc(TYPE_MDICT, &mstruct_ops, desc, record, 0);
+}
+
+struct mobject *
+mstruct_array_new(const struct mstruct_desc *desc, const void *base,
+    size_t nmemb)
+{
+	if (desc == NULL || (base == NULL && nmemb != 0) ||
+	    (desc->size != 0 && nmemb > SIZE_MAX / desc->size))
+		return NULL;
+	return mstruct_alloc(TYPE_MARRAY, &mstruct_array_ops, desc, base,
+	    nmemb);
+}
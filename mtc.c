@@ -37,48 +37,101 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	    "Usage: xtc [-h] [-D key=value] [-o output-file] template-file\n");
+	    "Usage: xtc [-h] [-D key=value] [-c key=csv-file] "
+	    "[-t key=tsv-file]\n"
+	    "           [-j key=ndjson-file] [-o output-file] template-file\n");
 }
 
-static void
-define(struct mobject *namespace, const char *kv)
+/* Split a "key=value" argument, returning the value */
+static const char *
+split_kv(const char *kv, char *kbuf, size_t klen, const char *what)
 {
 	const char *cp;
-	char kbuf[256], ebuf[512];
-	struct mobject *v;
 
 	if ((cp = strchr(kv, '=')) == NULL || cp == kv || *(cp + 1) == '\0') {
-		warnx("Invalid define");
+		warnx("Invalid %s", what);
 		usage();
 		exit(1);
 	}
-	if ((size_t)(cp - kv) >= sizeof(kbuf))
-		errx(1, "Define key too long");
+	if ((size_t)(cp - kv) >= klen)
+		errx(1, "%s key too long", what);
 	memcpy(kbuf, kv, cp - kv);
 	kbuf[cp - kv] = '\0';
-	if ((v = mstring_new(cp + 1)) == NULL)
+	return cp + 1;
+}
+
+static void
+define(struct mobject *namespace, const char *kv)
+{
+	const char *cp;
+	char kbuf[256], ebuf[512];
+	struct mobject *v;
+
+	cp = split_kv(kv, kbuf, sizeof(kbuf), "define");
+	if ((v = mstring_new(cp)) == NULL)
 		errx(1, "mstring_new failed");
 
 	if (mnamespace_set(namespace, kbuf, v, ebuf, sizeof(ebuf)) != 0)
 		errx(1, "mnamespace_set: %s", ebuf);
 }
 
+/* Load a CSV or TSV file and define its rows */
+static void
+define_table(struct mobject *namespace, const char *kv, int flags)
+{
+	const char *path;
+	char kbuf[256], ebuf[512];
+	struct mobject *table, *rows;
+
+	path = split_kv(kv, kbuf, sizeof(kbuf), "table");
+	if ((table = mcsv_load(path, flags, 0, ebuf, sizeof(ebuf))) == NULL)
+		errx(1, "%s: %s", path, ebuf);
+	if ((rows = mcsv_rows(table)) == NULL)
+		errx(1, "mcsv_rows failed");
+	if (mnamespace_set(namespace, kbuf, rows, ebuf, sizeof(ebuf)) != 0)
+		errx(1, "mnamespace_set: %s", ebuf);
+}
+
+/* Define a stream of records read from a newline-delimited JSON file */
+static struct mjson_reader *
+define_stream(struct mobject *namespace, const char *kv)
+{
+	const char *path;
+	char kbuf[256], ebuf[512];
+	struct mjson_reader *r;
+	struct mobject *records;
+	int fd;
+
+	path = split_kv(kv, kbuf, sizeof(kbuf), "stream");
+	if (strcmp(path, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "open(\"%s\", O_RDONLY)", path);
+	if ((r = mjson_reader_new(fd)) == NULL ||
+	    (records = mjson_reader_records(r)) == NULL)
+		errx(1, "mjson_reader_new failed");
+	if (mnamespace_set(namespace, kbuf, records, ebuf, sizeof(ebuf)) != 0)
+		errx(1, "mnamespace_set: %s", ebuf);
+	return r;
+}
+
 int
 main(int argc, char **argv)
 {
 	extern char *optarg;
 	extern int optind;
-	int len, ch, tfd;
-	char *template, buf[8192];
+	int ch;
+	char buf[8192];
 	const char *out_path = "-";
-	size_t tlen;
 	struct mtemplate *t;
 	struct mobject *namespace;
 	FILE *out;
+	struct mjson_reader *streams[16];
+	u_int i, nstreams = 0;
 
 	if ((namespace = mdict_new()) == NULL)
 		errx(1, "mdict_new failed");
-	while ((ch = getopt(argc, argv, "hD:o:")) != -1) {
+	while ((ch = getopt(argc, argv, "hc:j:t:D:o:")) != -1) {
 		switch (ch) {
 		case 'h':
 			usage();
@@ -86,6 +139,17 @@ main(int argc, char **argv)
 		case 'D':
 			define(namespace, optarg);
 			break;
+		case 'c':
+			define_table(namespace, optarg, 0);
+			break;
+		case 't':
+			define_table(namespace, optarg, MCSV_TSV);
+			break;
+		case 'j':
+			if (nstreams >= sizeof(streams) / sizeof(*streams))
+				errx(1, "Too many streams");
+			streams[nstreams++] = define_stream(namespace, optarg);
+			break;
 		case 'o':
 			out_path = optarg;
 			break;
@@ -105,33 +169,7 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	if (strcmp(argv[0], "-") == 0)
-		tfd = STDIN_FILENO;
-	else if ((tfd = open(argv[0], O_RDONLY)) == -1)
-		err(1, "open(\"%s\", O_RDONLY)", argv[0]);
-
-	template = NULL;
-	tlen = 0;
-	for (;;) {
-		if ((len = read(tfd, buf, sizeof(buf))) == -1) {
-			if (errno == EINTR || errno == EAGAIN)
-				continue;
-			err(1, "read");
-		}
-		if (len == 0)
-			break;
-		if (tlen + len + 1 < tlen)
-			errx(1, "template length exceeds SIZE_T_MAX");
-		if ((template = realloc(template, tlen + len + 1)) == NULL)
-			errx(1, "realloc(template, %zu) failed",
-			    tlen + len + 1);
-		memcpy(template + tlen, buf, len);
-		*(template + tlen + len) = '\0';
-		tlen += len;
-	}
-	close(tfd);
-
-	if ((t = mtemplate_parse(template, buf, sizeof(buf))) == NULL)
+	if ((t = mtemplate_parse_file(argv[0], buf, sizeof(buf))) == NULL)
 		errx(1, "mtemplate_parse: %s", buf);
 
 	if (strcmp(out_path, "-") == 0)
@@ -141,6 +179,10 @@ main(int argc, char **argv)
 
 	if (mtemplate_run_stdio(t, namespace, out, buf, sizeof(buf)) == -1)
 		errx(1, "mtemplate_run: %s", buf);
+	for (i = 0; i < nstreams; i++) {
+		if (mjson_reader_error(streams[i]) != NULL)
+			errx(1, "stream: %s", mjson_reader_error(streams[i]));
+	}
 
 	fclose(out);
 
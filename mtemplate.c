@@ -20,12 +20,23 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <ctype.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "sys-queue.h"
 #include "compat.h"
@@ -65,14 +76,158 @@ struct node_info {
 	{ NODE_NONE, 		NULL,		NODE_NONE,		0 },
 };
 
+/* Escaping filters, e.g. {{a.b:h}}, and the most that may be chained */
+#define ESCAPE_NAMES	"hju"
+#define ESCAPE_MAX	4
+
+/* Longest dictionary key that a compiled reference may contain */
+#define REF_MAX_ID_LENGTH	256
+
+/*
+ * A step of a compiled reference: a dictionary key, an array index or a
+ * subscript that is itself a reference, evaluated as the template runs
+ */
+struct ref_step {
+	struct mobject *key;		/* NULL for array index */
+	size_t ndx;
+	struct mtemplate_ref *sub;	/* Dynamic subscript, or NULL */
+	struct mdict_cache cache;	/* Inline cache for "key" */
+};
+
+/* Members of a "for" loop variable that describe the loop's progress */
+enum loop_meta {
+	META_NONE = -1,
+	META_FIRST = 0,
+	META_LAST = 1,
+	META_INDEX = 2,
+	META_LENGTH = 3,
+};
+#define META_MAX META_LENGTH
+
+static const char *loop_meta_names[] = {
+	"first", "last", "index", "length", NULL
+};
+
+/*
+ * A reference compiled at parse time into a list of lookup steps. It is
+ * rooted either at the namespace or at the key or value of an enclosing
+ * "for" loop variable, or is one of the loop variable's metadata members.
+ */
+struct mtemplate_ref {
+	int loop_depth;			/* Loops to ascend, -1 for namespace */
+	u_int loop_value;		/* Root at item value rather than key */
+	enum loop_meta loop_meta;	/* Metadata member, or META_NONE */
+	u_int dynamic;			/* Has dynamic subscripts */
+	size_t nsteps;
+	struct ref_step steps[];
+};
+
+/* Most arguments that a builtin function takes */
+#define CALL_MAX_ARGS	4
+
+/*
+ * An argument of a builtin function call or a term of a condition: a
+ * reference, a nested call or a string or integer literal. String
+ * literals may also name a field of the items of a container, which is
+ * looked up with "cache" if it is a simple key or through the namespace
+ * syntax, as "loc", otherwise.
+ */
+struct call_arg {
+	char *text;			/* Reference, or NULL */
+	struct mtemplate_ref *ref;	/* Compiled "text", or NULL */
+	u_int in_loop;			/* "text" is rooted at a loop variable */
+	struct mtemplate_call *call;	/* Nested call, or NULL */
+	struct mobject *literal;	/* Literal, or NULL */
+	char *loc;			/* Field path of "literal", or NULL */
+	struct mdict_cache cache;	/* Inline cache for "literal" */
+};
+
+struct mtemplate_call;
+struct mtemplate_run;
+
+/*
+ * A builtin function. It may compute a value with "fn", or write its
+ * result straight to the output of a substitution with "emit", or both.
+ * Functions that set "memoize" are computed once per run of a template
+ * for each object they are applied to, as long as the object is found in
+ * the namespace and all other arguments are literals.
+ */
+struct builtin {
+	const char *name;
+	size_t min_args;
+	size_t max_args;
+	u_int literals;			/* Mask of arguments that are literals */
+	u_int memoize;
+	struct mobject *(*fn)(struct mtemplate_call *, struct mobject **,
+	    const char **);
+	int (*emit)(struct mtemplate_run *, struct mtemplate_call *,
+	    struct mobject **, const char **);
+};
+
+/* A call to a builtin function, compiled at parse time */
+struct mtemplate_call {
+	const struct builtin *fn;
+	size_t nargs;
+	struct call_arg args[];
+};
+
+/* Operators of a compiled condition */
+enum expr_op {
+	EXPR_TEST,		/* Term "a" is true */
+	EXPR_EQ,		/* Comparisons of terms "a" and "b" */
+	EXPR_NE,
+	EXPR_LT,
+	EXPR_LE,
+	EXPR_GT,
+	EXPR_GE,
+	EXPR_IN,		/* Term "a" is in term "b" */
+	EXPR_NOT,		/* Node "a" is false */
+	EXPR_AND,		/* Nodes "a" and "b" */
+	EXPR_OR,
+};
+
+struct expr_node {
+	enum expr_op op;
+	size_t a, b;
+};
+
+/*
+ * A condition compiled at parse time, e.g. {a.n > 2 && !b.c}. Its terms
+ * are compiled like the arguments of a function call, and its operators
+ * form a tree of "nodes" whose root is the last node.
+ */
+struct mtemplate_expr {
+	struct call_arg *terms;
+	size_t nterms;
+	struct expr_node *nodes;
+	size_t nnodes;
+};
+
 struct mtemplate_nodes;
 TAILQ_HEAD(mtemplate_nodes, mtemplate_node);
 
 struct mtemplate_node {
 	enum node_type type;
-	char *text;
+	char *text;		/* Points into the source for text nodes */
+	size_t text_len;	/* Only valid for text nodes */
 	u_int lnum;
 	char *localvar;		/* Used for iteration variable in 'for' */
+	char *member;		/* Used for membership test in 'if' */
+	struct mtemplate_ref *ref; /* Compiled "text", or NULL */
+	struct mtemplate_call *call; /* "text" as a function call, or NULL */
+	struct mtemplate_ref *member_ref; /* Compiled "member", or NULL */
+	struct mtemplate_expr *expr; /* "text" as a condition, or NULL */
+	char *filter;		/* Condition on items of a 'for', or NULL */
+	struct mtemplate_ref *filter_ref; /* Compiled "filter", or NULL */
+	struct mtemplate_expr *filter_expr; /* "filter" as a condition */
+	u_int sliced;		/* 'for' iterates over a slice */
+	size_t slice_start;
+	size_t slice_end;
+	u_int sorted;		/* 'for' iterates in sorted order */
+	u_int sort_keys;	/* Sort by key, the default for dicts */
+	u_int sort_values;	/* Sort by value, the default for arrays */
+	int sort_flags;		/* MSORT_* flags of a sorted 'for' */
+	char escape[ESCAPE_MAX + 1]; /* Escaping filters of a substitution */
 	u_int in_else;		/* Only valid for "if" */
 	struct mtemplate_nodes child_nodes;
 	struct mtemplate_nodes child_nodes_else;
@@ -80,9 +235,18 @@ struct mtemplate_node {
 	TAILQ_ENTRY(mtemplate_node) entry;
 };
 
+/*
+ * A compiled template. Text nodes are not copied but point into the
+ * template's source, which is either its own copy of the text or a
+ * mapping of the file that it was read from.
+ */
 struct mtemplate {
 	struct mtemplate_node root;
+	char *source;
+	size_t source_len;
+	u_int mapped;		/* "source" is mmap(2)ed */
 };
+#define TEMPLATE_MAX_LEN	((size_t)1024 * 1024 * 1024)
 
 /* Callback structure for memory buffer output */
 struct alloc_cb_ctx {
@@ -92,10 +256,119 @@ struct alloc_cb_ctx {
 };
 #define ALLOC_MAX	(64 * 1024 * 1024)
 
+/* Size of the buffer that output is accumulated in before being written */
+#define RUN_BUF_SIZE	(8 * 1024)
+
+/* A memoized result of a builtin function */
+struct memo_entry {
+	const struct mtemplate_call *call;
+	const struct mobject *arg;
+	struct mobject *result;
+	struct memo_entry *next;
+};
+#define MEMO_MIN_SIZE	16
+
+/*
+ * The order a sorted "for" last visited "source" in, which is reused for
+ * as long as "source" is still in that order.
+ */
+struct sort_entry {
+	const struct mtemplate_node *node;
+	struct mobject *source;
+	size_t len;
+	size_t *perm;
+	struct sort_entry *next;
+};
+
+/*
+ * State for a single run of a template. Everything that changes as the
+ * template runs is kept here rather than in the compiled template, so
+ * that several runs of one template may proceed at once.
+ */
+struct mtemplate_run {
+	struct mobject *ns;
+	char *ebuf;
+	size_t elen;
+	int (*sink)(const char *, size_t, void *);
+	void *sink_ctx;
+	struct memo_entry **memo;	/* Hash table of memoized results */
+	size_t memo_size;		/* Power of two */
+	size_t nmemo;
+	struct mobject **temps;		/* Results to free after the node */
+	size_t ntemps;
+	size_t temps_alloc;
+	struct sort_entry *sorts;	/* Orders of sorted loops */
+	const char *escape;		/* Filters of the substitution, or NULL */
+	size_t olen;
+	char obuf[RUN_BUF_SIZE + 1];	/* Extra byte for nul-termination */
+};
+
+/*
+ * A "for" loop variable and its current item, innermost loop first. The
+ * loop's metadata is computed from "index" when it is referenced, into
+ * integers that are allocated on first use and reused for the rest of
+ * the loop.
+ */
+struct loop_scope {
+	const char *localvar;
+	struct miteritem *item;
+	struct loop_scope *up;
+	struct mtemplate_node *node;	/* The "for" node */
+	struct mobject *source;		/* Object iterated over */
+	size_t index;			/* Items the body has run for */
+	size_t length;			/* Only valid if "have_length" */
+	u_int have_length;
+	u_int in_filter;		/* Evaluating the loop's filter */
+	struct mobject *meta[META_MAX + 1];
+};
+
 static int
-mtemplate_run_nodes(struct mtemplate_nodes *nodes, struct mobject *ns,
-    struct mobject *local_ns, char *ebuf, size_t elen,
-    int (*out_cb)(const char *, void *), void *out_ctx);
+mtemplate_run_nodes(struct mtemplate_run *r, struct mtemplate_nodes *nodes,
+    struct loop_scope *scope);
+static struct mobject *loop_meta(struct mtemplate_run *r,
+    struct loop_scope *scope, enum loop_meta which, u_int lnum,
+    const char *directive);
+static int run_flush(struct mtemplate_run *r);
+static int add_temp(struct mtemplate_run *r, struct mobject *o);
+static struct mobject *bi_count(struct mtemplate_call *, struct mobject **,
+    const char **);
+static struct mobject *bi_sum(struct mtemplate_call *, struct mobject **,
+    const char **);
+static struct mobject *bi_min(struct mtemplate_call *, struct mobject **,
+    const char **);
+static struct mobject *bi_max(struct mtemplate_call *, struct mobject **,
+    const char **);
+static struct mobject *bi_groupby(struct mtemplate_call *, struct mobject **,
+    const char **);
+static struct mobject *bi_len(struct mtemplate_call *, struct mobject **,
+    const char **);
+static int emit_len(struct mtemplate_run *, struct mtemplate_call *,
+    struct mobject **, const char **);
+static int emit_join(struct mtemplate_run *, struct mtemplate_call *,
+    struct mobject **, const char **);
+static int emit_upper(struct mtemplate_run *, struct mtemplate_call *,
+    struct mobject **, const char **);
+static int emit_lower(struct mtemplate_run *, struct mtemplate_call *,
+    struct mobject **, const char **);
+static int emit_replace(struct mtemplate_run *, struct mtemplate_call *,
+    struct mobject **, const char **);
+static int emit_pad(struct mtemplate_run *, struct mtemplate_call *,
+    struct mobject **, const char **);
+
+static const struct builtin builtins[] = {
+	{ "count",	1, 2, 0x2, 1, bi_count,		NULL },
+	{ "sum",	1, 2, 0x2, 1, bi_sum,		NULL },
+	{ "min",	1, 2, 0x2, 1, bi_min,		NULL },
+	{ "max",	1, 2, 0x2, 1, bi_max,		NULL },
+	{ "groupby",	2, 2, 0x2, 1, bi_groupby,	NULL },
+	{ "len",	1, 1, 0x0, 0, bi_len,		emit_len },
+	{ "join",	2, 3, 0x4, 0, NULL,		emit_join },
+	{ "upper",	1, 1, 0x0, 0, NULL,		emit_upper },
+	{ "lower",	1, 1, 0x0, 0, NULL,		emit_lower },
+	{ "replace",	3, 3, 0x0, 0, NULL,		emit_replace },
+	{ "pad",	2, 3, 0x6, 0, NULL,		emit_pad },
+	{ NULL,		0, 0, 0x0, 0, NULL,		NULL },
+};
 
 static void
 format_err(int lnum, char *ebuf, size_t elen, const char *fmt, ...)
@@ -130,7 +403,11 @@ alloc_node(const char *p, size_t len, enum node_type type, u_int lnum,
 	TAILQ_INIT(&node->child_nodes);
 	TAILQ_INIT(&node->child_nodes_else);
 	node->parentp = parent;
-	if (p == NULL) {
+	if (type == NODE_TEXT) {
+		/* Text is used in place and is not nul-terminated */
+		node->text = (char *)p;
+		node->text_len = len;
+	} else if (p == NULL) {
 		node->text = NULL;
 	} else {
 		if ((node->text = malloc(len + 1)) == NULL) {
@@ -148,24 +425,225 @@ alloc_node(const char *p, size_t len, enum node_type type, u_int lnum,
 	return node;
 }
 
+/*
+ * Find the length of the function argument at the start of "cp", which
+ * runs up to a comma outside of any brackets or string literal.
+ */
+static size_t
+arg_len(const char *cp)
+{
+	size_t l;
+	int nest = 0, quoted = 0;
+
+	for (l = 0; cp[l] != '\0'; l++) {
+		if (quoted) {
+			if (cp[l] == '\\' && cp[l + 1] != '\0')
+				l++;
+			else if (cp[l] == '"')
+				quoted = 0;
+		} else if (cp[l] == '"')
+			quoted = 1;
+		else if (cp[l] == '(' || cp[l] == '[')
+			nest++;
+		else if (cp[l] == ')' || cp[l] == ']')
+			nest--;
+		else if (cp[l] == ',' && nest == 0)
+			break;
+	}
+	return l;
+}
+
+/* Test whether the "len" bytes at "cp" look like {FUNCTION(...)} */
+static int
+call_syntax(const char *cp, size_t len)
+{
+	size_t l;
+
+	for (l = 0; l < len && (islower((u_char)cp[l]) || cp[l] == '_'); l++)
+		;
+	return l > 0 && l < len && cp[l] == '(' && cp[len - 1] == ')';
+}
+
+/*
+ * Test whether a condition uses operators, e.g. {a > b} or {!a}, rather
+ * than being a single reference, call or membership test.
+ */
+static int
+expr_syntax(const char *cp)
+{
+	int quoted = 0;
+
+	if (*cp == '(')
+		return 1;
+	for (; *cp != '\0'; cp++) {
+		if (quoted) {
+			if (*cp == '\\' && cp[1] != '\0')
+				cp++;
+			else if (*cp == '"')
+				quoted = 0;
+		} else if (*cp == '"')
+			quoted = 1;
+		else if (strchr("=!<>&|", *cp) != NULL)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Parse the flags of a sorted "for", from the text following "sort(":
+ * either {REFERENCE)} or {REFERENCE, "FLAGS")}. The reference is left in
+ * "cp".
+ */
+static int
+parse_sort(struct mtemplate_node *n, char *cp)
+{
+	char *ep;
+	size_t len;
+
+	if ((len = strlen(cp)) == 0 || cp[len - 1] != ')')
+		return -1;
+	cp[len - 1] = '\0';
+	n->sorted = 1;
+	if (cp[(len = arg_len(cp))] == '\0')
+		return 0;
+	ep = cp + len;
+	*ep++ = '\0';
+	while (*ep == ' ')
+		ep++;
+	if ((len = strlen(ep)) < 2 || ep[0] != '"' || ep[len - 1] != '"')
+		return -1;
+	ep[len - 1] = '\0';
+	for (ep++; *ep != '\0'; ep++) {
+		switch (*ep) {
+		case 'N':
+			n->sort_flags |= MSORT_NUMERIC;
+			break;
+		case 'S':
+			n->sort_flags |= MSORT_STRING;
+			break;
+		case 'R':
+			n->sort_flags |= MSORT_REVERSE;
+			break;
+		case 'K':
+			n->sort_keys = 1;
+			break;
+		case 'V':
+			n->sort_values = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if ((n->sort_keys && n->sort_values) ||
+	    ((n->sort_flags & MSORT_NUMERIC) &&
+	    (n->sort_flags & MSORT_STRING)))
+		return -1;
+	return 0;
+}
+
+/*
+ * Parse a slice {[START:END]} at the end of the reference "cp" of a "for",
+ * removing it from the reference. Either index may be omitted. References
+ * that end with anything else are left alone.
+ */
+static int
+parse_slice(struct mtemplate_node *n, char *cp)
+{
+	char *lb, *ep;
+	size_t len = strlen(cp);
+	long lval;
+
+	if (len == 0 || cp[len - 1] != ']' || (lb = strrchr(cp, '[')) == NULL ||
+	    strchr(lb, ':') == NULL)
+		return 0;
+	if (lb == cp)
+		return -1;
+	cp[len - 1] = '\0';
+	*lb++ = '\0';
+	n->sliced = 1;
+	n->slice_start = 0;
+	n->slice_end = SIZE_MAX;
+	if (*lb != ':') {
+		lval = strtol(lb, &ep, 10);
+		if (ep == lb || *ep != ':' || lval < 0 || lval > INT_MAX)
+			return -1;
+		n->slice_start = (size_t)lval;
+		lb = ep;
+	}
+	if (*++lb != '\0') {
+		lval = strtol(lb, &ep, 10);
+		if (ep == lb || *ep != '\0' || lval < 0 || lval > INT_MAX)
+			return -1;
+		n->slice_end = (size_t)lval;
+	}
+	return 0;
+}
+
+/*
+ * Parse a "for" directive. On failure, anything already stored in the
+ * node is freed along with it.
+ */
 static int
 parse_for(struct mtemplate_node *n)
 {
-	char *cp, *tmp;
+	char *cp, *ep, *tmp;
 
 	/* expect {LOCALVAR in REFERENCE} */
 	if ((cp = strstr(n->text, " in ")) == NULL)
 		return -1;
 	*cp = '\0';
 	cp += 4;
+	/* The reference may be followed by {if FILTER} */
+	if ((ep = strstr(cp, " if ")) != NULL) {
+		*ep = '\0';
+		ep += 4;
+		if (*ep == '\0' ||
+		    (!expr_syntax(ep) && strchr(ep, ' ') != NULL) ||
+		    (n->filter = strdup(ep)) == NULL)
+			return -1;
+	}
+	/* and be wrapped as {sort(REFERENCE, "FLAGS")} */
+	if (strncmp(cp, "sort(", 5) == 0) {
+		cp += 5;
+		if (parse_sort(n, cp) == -1)
+			return -1;
+	}
+	/* and end with a slice {[START:END]}, unless it is a function call */
+	if (*cp == '\0' || (!call_syntax(cp, strlen(cp)) &&
+	    (strchr(cp, ' ') != NULL || parse_slice(n, cp) == -1)))
+		return -1;
 	if ((tmp = strdup(cp)) == NULL)
 		return -1;
 	if ((n->localvar = strdup(n->text)) == NULL) {
 		free(tmp);
 		return -1;
 	}
-	if (strchr(tmp, ' ') != NULL) {
-		free(n->localvar);
+	free(n->text);
+	n->text = tmp;
+	return 0;
+}
+
+static int
+parse_if(struct mtemplate_node *n)
+{
+	char *cp, *tmp;
+
+	/*
+	 * Either {REFERENCE} or {MEMBER in REFERENCE}, or a function call,
+	 * or an expression using operators, which is compiled later.
+	 */
+	if (expr_syntax(n->text) || call_syntax(n->text, strlen(n->text)))
+		return 0;
+	if ((cp = strstr(n->text, " in ")) == NULL)
+		return strchr(n->text, ' ') == NULL ? 0 : -1;
+	*cp = '\0';
+	cp += 4;
+	if (*n->text == '\0' || *cp == '\0' || strchr(n->text, ' ') != NULL ||
+	    (!call_syntax(cp, strlen(cp)) && strchr(cp, ' ') != NULL))
+		return -1;
+	if ((tmp = strdup(cp)) == NULL)
+		return -1;
+	if ((n->member = strdup(n->text)) == NULL) {
 		free(tmp);
 		return -1;
 	}
@@ -174,134 +652,812 @@ parse_for(struct mtemplate_node *n)
 	return 0;
 }
 
+/*
+ * Split the escaping filters off the end of a substitution, e.g. the "h"
+ * of {{a.b:h}}, ignoring colons inside brackets and string literals.
+ */
 static int
-classify_node(const char *directive, size_t len, const char **end_p,
-    enum node_type *typep)
+parse_escape(struct mtemplate_node *n)
 {
-	size_t i, dlen;
-
-	if (len < 1)
+	char *cp = NULL;
+	size_t l;
+	int nest = 0, quoted = 0;
+
+	for (l = 0; n->text[l] != '\0'; l++) {
+		if (quoted) {
+			if (n->text[l] == '\\' && n->text[l + 1] != '\0')
+				l++;
+			else if (n->text[l] == '"')
+				quoted = 0;
+		} else if (n->text[l] == '"')
+			quoted = 1;
+		else if (n->text[l] == '(' || n->text[l] == '[')
+			nest++;
+		else if (n->text[l] == ')' || n->text[l] == ']')
+			nest--;
+		else if (n->text[l] == ':' && nest == 0)
+			cp = n->text + l;
+	}
+	if (cp == NULL)
+		return 0;
+	if (cp == n->text || (l = strlen(++cp)) == 0 || l > ESCAPE_MAX ||
+	    strspn(cp, ESCAPE_NAMES) != l)
 		return -1;
+	strlcpy(n->escape, cp, sizeof(n->escape));
+	cp[-1] = '\0';
+	return 0;
+}
 
-	*end_p = NULL;
-	for (i = 0; node_info[i].p != NULL; i++) {
-		dlen = strlen(node_info[i].p);
-		if (len < dlen ||
-		    strncmp(directive, node_info[i].p, dlen) != 0)
-			continue;
-		*typep = node_info[i].n;
-		if (!node_info[i].want_expression)
-			return 0;
-		/* If an expression is required, then make sure it exists */
-		if (len <= dlen + 1 || directive[dlen] != ' ')
-			return -1;
-		*end_p = directive + dlen + 1;
-		return 0;
+/* Find the metadata member named by the text following a loop variable */
+static enum loop_meta
+loop_meta_name(const char *cp)
+{
+	int i;
+
+	if (*cp++ != '.')
+		return META_NONE;
+	for (i = 0; loop_meta_names[i] != NULL; i++) {
+		if (strcmp(cp, loop_meta_names[i]) == 0)
+			return (enum loop_meta)i;
 	}
+	return META_NONE;
+}
 
-	/* Check for {* escape */
-	if (*directive == '{') {
-		for (i = 1; i < len && directive[i] == '{'; i++)
-			;
-		if (i >= len) {
-			*end_p = directive;
-			*typep = NODE_TEXT;
-			return 0;
-		}
+static void
+free_ref(struct mtemplate_ref *ref)
+{
+	size_t i;
+
+	for (i = 0; i < ref->nsteps; i++) {
+		if (ref->steps[i].key != NULL)
+			mobject_free(ref->steps[i].key);
+		if (ref->steps[i].sub != NULL)
+			free_ref(ref->steps[i].sub);
 	}
+	free(ref);
+}
 
-	/* Probably a DIRECTIVE_SUBST, but do a basic sanity check */
-	for (i = 0; i < len; i++) {
-		if (strchr(SUBST_OK, directive[i]) == NULL)
-			return -1;
+/*
+ * Compile a reference, resolving loop variables against "scope" and the
+ * "for" nodes enclosing it, and store it in "refp". References using
+ * syntax that is not understood here are left uncompiled and are looked
+ * up by name when the template is run, which also produces any error
+ * message.
+ *
+ * Returns 0 on success (including when nothing was compiled) or -1 on
+ * allocation failure.
+ */
+static int
+compile_ref(struct mtemplate_node *scope, const char *text,
+    struct mtemplate_ref **refp)
+{
+	struct mtemplate_node *p;
+	struct mtemplate_ref *ref;
+	struct ref_step *step;
+	const char *cp = text;
+	char buf[32], *ep, *sub;
+	size_t hlen, l, nsteps;
+	long lval;
+	int depth, nest, ret;
+
+	hlen = strcspn(cp, ".[");
+	if (hlen == 0 || hlen >= REF_MAX_ID_LENGTH)
+		return 0;
+	for (depth = 0, p = scope; p != NULL; p = p->parentp) {
+		if (p->type != NODE_DIRECTIVE_FOR)
+			continue;
+		if (strlen(p->localvar) == hlen &&
+		    strncmp(p->localvar, cp, hlen) == 0)
+			break;
+		depth++;
 	}
 
-	*end_p = directive;
-	*typep = NODE_DIRECTIVE_SUBST;
+	for (nsteps = 1, l = 0; cp[l] != '\0'; l++) {
+		if (cp[l] == '.' || cp[l] == '[')
+			nsteps++;
+	}
+	if ((ref = calloc(1, sizeof(*ref) + nsteps * sizeof(*step))) == NULL)
+		return -1;
+	ref->loop_meta = META_NONE;
+	step = ref->steps;
+	if (p == NULL) {
+		ref->loop_depth = -1;
+		if ((step->key = mstring_new2((const u_int8_t *)cp,
+		    hlen)) == NULL)
+			goto fail;
+		ref->nsteps++;
+		step++;
+		cp += hlen;
+	} else {
+		ref->loop_depth = depth;
+		cp += hlen;
+		if (strncmp(cp, ".key", 4) == 0)
+			cp += 4;
+		else if (strncmp(cp, ".value", 6) == 0) {
+			ref->loop_value = 1;
+			cp += 6;
+		} else if ((ref->loop_meta = loop_meta_name(cp)) != META_NONE)
+			cp += strlen(cp);
+		else
+			goto uncompiled;
+	}
+	while (*cp != '\0') {
+		if (*cp == '.') {
+			l = strcspn(++cp, ".[");
+			if (l == 0 || l >= REF_MAX_ID_LENGTH)
+				goto uncompiled;
+			if ((step->key = mstring_new2((const u_int8_t *)cp,
+			    l)) == NULL)
+				goto fail;
+		} else if (*cp == '[') {
+			/* Find the matching bracket, as subscripts may nest */
+			for (nest = 1, l = 0, cp++; cp[l] != '\0'; l++) {
+				if (cp[l] == '[')
+					nest++;
+				else if (cp[l] == ']' && --nest == 0)
+					break;
+			}
+			if (l == 0 || cp[l] != ']')
+				goto uncompiled;
+			if (!isdigit((u_char)*cp)) {
+				/* A reference, looked up as the template runs */
+				if ((sub = malloc(l + 1)) == NULL)
+					goto fail;
+				memcpy(sub, cp, l);
+				sub[l] = '\0';
+				ret = compile_ref(scope, sub, &step->sub);
+				free(sub);
+				if (ret == -1)
+					goto fail;
+				if (step->sub == NULL)
+					goto uncompiled;
+				ref->dynamic = 1;
+				l++;
+				goto next;
+			}
+			/* Parse indices the same way as mnamespace_lookup */
+			if (l >= sizeof(buf))
+				goto uncompiled;
+			memcpy(buf, cp, l);
+			buf[l] = '\0';
+			lval = strtol(buf, &ep, 0);
+			if (*ep != '\0' || lval < 0 || lval > INT_MAX)
+				goto uncompiled;
+			step->ndx = (size_t)lval;
+			l++;
+		} else
+			goto uncompiled;
+ next:
+		ref->nsteps++;
+		step++;
+		cp += l;
+	}
+	*refp = ref;
 	return 0;
+ uncompiled:
+	free_ref(ref);
+	return 0;
+ fail:
+	free_ref(ref);
+	return -1;
 }
 
-static const char *
-node_type_ntop(enum node_type n)
+static void free_call(struct mtemplate_call *call);
+
+static void
+free_arg(struct call_arg *arg)
 {
-	if (n <= NODE_NONE || n > NODE_MAX)
-		return "UNKNOWN";		
-	return node_info[n].p;
+	free(arg->text);
+	free(arg->loc);
+	if (arg->ref != NULL)
+		free_ref(arg->ref);
+	if (arg->call != NULL)
+		free_call(arg->call);
+	if (arg->literal != NULL)
+		mobject_free(arg->literal);
 }
 
-static enum node_type
-mtemplate_node_parent(enum node_type n)
+static void
+free_call(struct mtemplate_call *call)
 {
-	if (n <= NODE_NONE || n > NODE_MAX)
-		return NODE_NONE;
-	return node_info[n].parent;
-}
+	size_t i;
 
-/* XXX append-to-template/incremental parse mode (keep state for [/[) */
+	for (i = 0; i < call->nargs; i++)
+		free_arg(&call->args[i]);
+	free(call);
+}
 
-struct mtemplate *
-mtemplate_parse(const char *text, char *ebuf, size_t elen)
+/*
+ * Compile a string literal argument, which may escape quotes and
+ * backslashes with a backslash. A literal that isn't a simple key is also
+ * prepared for use as a path below an item.
+ */
+static int
+compile_literal(struct call_arg *arg, const char *cp, size_t len)
 {
-	size_t o, p, dlen, tlen;
-	int lnum;
-	const char *start_p, *end_p, *cp;
-	struct mtemplate *ret;
-	struct mtemplate_node *node, *parent;
-	struct mtemplate_nodes *activep;
-	enum node_type type, expected;
+	char *buf;
+	size_t i, l, n;
 
-	/* XXX leak on err */
-	if ((ret = calloc(1, sizeof(*ret))) == NULL) {
-		format_err(-1, ebuf, elen, "%s: calloc(mtemplate)", __func__);
-		return NULL;
+	if (len < 2 || cp[len - 1] != '"' || (buf = malloc(len)) == NULL)
+		return -1;
+	for (i = 1, l = 0; i < len - 1; i++) {
+		if (cp[i] == '\\' && i < len - 2)
+			i++;
+		else if (cp[i] == '"' || cp[i] == '\\')
+			goto fail;
+		buf[l++] = cp[i];
 	}
+	buf[l] = '\0';
+	if ((arg->literal = mstring_new2((const u_int8_t *)buf, l)) == NULL)
+		goto fail;
+	if (buf[strcspn(buf, ".[")] != '\0') {
+		/* mnamespace_lookup_from() wants a name before the path */
+		n = l + 3;
+		if ((arg->loc = malloc(n)) == NULL)
+			goto fail;
+		snprintf(arg->loc, n, "_%s%s", *buf == '[' ? "" : ".", buf);
+	}
+	free(buf);
+	return 0;
+ fail:
+	free(buf);
+	return -1;
+}
 
-	/* Root node */
-	ret->root.type = NODE_NONE;
-	TAILQ_INIT(&ret->root.child_nodes);
-	TAILQ_INIT(&ret->root.child_nodes_else); /* Should never be used */
-	ret->root.parentp = NULL;
+static int compile_call(struct mtemplate_node *scope, const char *text,
+    struct mtemplate_call **callp);
 
-	activep = &ret->root.child_nodes;
-	parent = &ret->root;
-	node = NULL;
-	for(p = o = 0, lnum = 1;;) {
-		/* Match newlines and directive starting sequence */
-		start_p = strpbrk(text + o + p, "\n{");
+/*
+ * Compile the "len" bytes at "cp" as a function argument: a string or
+ * integer literal, a nested call or a reference, resolved against "scope"
+ * as compile_ref() does. Returns 0 on success or -1 if the argument is
+ * invalid or on allocation failure.
+ */
+static int
+compile_arg(struct mtemplate_node *scope, struct call_arg *arg,
+    const char *cp, size_t l)
+{
+	struct mtemplate_node *p;
+	char buf[32], *bp;
+	size_t hlen;
+	long long lval;
+
+	if (*cp == '"')
+		return compile_literal(arg, cp, l);
+	if (isdigit((u_char)*cp) || (*cp == '-' && isdigit((u_char)cp[1]))) {
+		if (l >= sizeof(buf))
+			return -1;
+		memcpy(buf, cp, l);
+		buf[l] = '\0';
+		lval = strtoll(buf, &bp, 10);
+		if (*bp != '\0' || (arg->literal = mint_new(lval)) == NULL)
+			return -1;
+		return 0;
+	}
+	if (l == 0 || (arg->text = malloc(l + 1)) == NULL)
+		return -1;
+	memcpy(arg->text, cp, l);
+	arg->text[l] = '\0';
+	if (call_syntax(cp, l)) {
+		/* Nested calls must compute a value */
+		if (compile_call(scope, arg->text, &arg->call) == -1 ||
+		    arg->call->fn->fn == NULL)
+			return -1;
+		free(arg->text);
+		arg->text = NULL;
+		return 0;
+	}
+	if (strspn(arg->text, SUBST_OK) != l ||
+	    compile_ref(scope, arg->text, &arg->ref) == -1)
+		return -1;
+	hlen = strcspn(arg->text, ".[");
+	for (p = scope; p != NULL; p = p->parentp) {
+		if (p->type == NODE_DIRECTIVE_FOR &&
+		    strlen(p->localvar) == hlen &&
+		    strncmp(p->localvar, arg->text, hlen) == 0)
+			arg->in_loop = 1;
+	}
+	return 0;
+}
 
-		/* Append string at end of template */
-		if (start_p == NULL) {
-			p = strlen(text + o);
-			if (p == 0)
-				break;
-			if ((node = alloc_node(text + o, p, NODE_TEXT,
-			    lnum, parent, ebuf, elen)) == NULL) {
- mtemplate_parse_err:
-				mtemplate_free(ret);
-				return NULL;
-			}
-			TAILQ_INSERT_TAIL(activep, node, entry);
+/*
+ * Compile a call {FUNCTION(ARG, ...)} to a builtin function, resolving
+ * references in its arguments against "scope" as compile_ref() does.
+ * Returns 0 on success or -1 if the call is invalid or on allocation
+ * failure.
+ */
+static int
+compile_call(struct mtemplate_node *scope, const char *text,
+    struct mtemplate_call **callp)
+{
+	struct mtemplate_call *call;
+	struct call_arg *arg;
+	const struct builtin *fn;
+	const char *cp, *ep;
+	size_t l, nargs;
+
+	for (fn = builtins, l = strcspn(text, "("); fn->name != NULL; fn++) {
+		if (strlen(fn->name) == l && strncmp(fn->name, text, l) == 0)
+			break;
+	}
+	if (fn->name == NULL)
+		return -1;
+	if ((call = calloc(1, sizeof(*call) +
+	    CALL_MAX_ARGS * sizeof(*arg))) == NULL)
+		return -1;
+	call->fn = fn;
+	/* The argument list runs up to the closing parenthesis */
+	ep = text + strlen(text) - 1;
+	for (cp = text + l + 1, nargs = 0; cp < ep; nargs++) {
+		while (*cp == ' ')
+			cp++;
+		if (nargs >= fn->max_args || (l = arg_len(cp)) == 0 ||
+		    cp + l > ep + 1)
+			goto fail;
+		/* The last argument ends at the closing parenthesis */
+		if (cp + l == ep + 1)
+			l--;
+		while (l > 0 && cp[l - 1] == ' ')
+			l--;
+		arg = &call->args[call->nargs++];
+		if (compile_arg(scope, arg, cp, l) == -1 ||
+		    ((fn->literals & (1 << nargs)) && arg->literal == NULL))
+			goto fail;
+		cp += l;
+		while (*cp == ' ')
+			cp++;
+		if (*cp == ',') {
+			for (cp++; *cp == ' '; cp++)
+				;
+			if (cp >= ep)
+				goto fail;
+		} else if (cp != ep)
+			goto fail;
+	}
+	if (call->nargs < fn->min_args)
+		goto fail;
+	*callp = call;
+	return 0;
+ fail:
+	free_call(call);
+	return -1;
+}
+
+static void
+free_expr(struct mtemplate_expr *expr)
+{
+	size_t i;
+
+	for (i = 0; i < expr->nterms; i++)
+		free_arg(&expr->terms[i]);
+	free(expr->terms);
+	free(expr->nodes);
+	free(expr);
+}
+
+/* State of compile_expr() */
+struct expr_parse {
+	struct mtemplate_node *scope;
+	struct mtemplate_expr *expr;
+	const char *cp;
+	size_t terms_alloc;
+	size_t nodes_alloc;
+};
+
+/* Comparison operators, longest first where one is a prefix of another */
+static const struct {
+	const char *name;
+	enum expr_op op;
+} expr_ops[] = {
+	{ "==",		EXPR_EQ },
+	{ "!=",		EXPR_NE },
+	{ "<=",		EXPR_LE },
+	{ ">=",		EXPR_GE },
+	{ "<",		EXPR_LT },
+	{ ">",		EXPR_GT },
+	{ "in ",	EXPR_IN },
+	{ NULL,		EXPR_TEST },
+};
+
+static int expr_or(struct expr_parse *p, size_t *np);
+
+static void
+expr_skip(struct expr_parse *p)
+{
+	while (*p->cp == ' ')
+		p->cp++;
+}
+
+static int
+expr_add_node(struct expr_parse *p, enum expr_op op, size_t a, size_t b,
+    size_t *np)
+{
+	struct mtemplate_expr *e = p->expr;
+	struct expr_node *tmp;
+	size_t n;
+
+	if (e->nnodes >= p->nodes_alloc) {
+		n = p->nodes_alloc == 0 ? 8 : p->nodes_alloc * 2;
+		if ((tmp = realloc(e->nodes, n * sizeof(*tmp))) == NULL)
+			return -1;
+		e->nodes = tmp;
+		p->nodes_alloc = n;
+	}
+	e->nodes[e->nnodes].op = op;
+	e->nodes[e->nnodes].a = a;
+	e->nodes[e->nnodes].b = b;
+	*np = e->nnodes++;
+	return 0;
+}
+
+/*
+ * Compile the term at the current position, which runs up to a space or
+ * operator outside of any brackets or string literal.
+ */
+static int
+expr_term(struct expr_parse *p, size_t *tp)
+{
+	struct mtemplate_expr *e = p->expr;
+	struct call_arg *tmp;
+	const char *cp;
+	size_t l, n;
+	int nest = 0, quoted = 0;
+
+	expr_skip(p);
+	for (cp = p->cp, l = 0; cp[l] != '\0'; l++) {
+		if (quoted) {
+			if (cp[l] == '\\' && cp[l + 1] != '\0')
+				l++;
+			else if (cp[l] == '"')
+				quoted = 0;
+		} else if (cp[l] == '"')
+			quoted = 1;
+		else if (cp[l] == '(' || cp[l] == '[')
+			nest++;
+		else if (nest > 0 && (cp[l] == ')' || cp[l] == ']'))
+			nest--;
+		else if (nest == 0 && strchr(" =!<>&|)]", cp[l]) != NULL)
+			break;
+	}
+	if (l == 0)
+		return -1;
+	if (e->nterms >= p->terms_alloc) {
+		n = p->terms_alloc == 0 ? 4 : p->terms_alloc * 2;
+		if ((tmp = realloc(e->terms, n * sizeof(*tmp))) == NULL)
+			return -1;
+		e->terms = tmp;
+		p->terms_alloc = n;
+	}
+	bzero(&e->terms[e->nterms], sizeof(*e->terms));
+	*tp = e->nterms++;
+	p->cp += l;
+	return compile_arg(p->scope, &e->terms[*tp], cp, l);
+}
+
+/* {TERM} or {TERM OP TERM} */
+static int
+expr_cmp(struct expr_parse *p, size_t *np)
+{
+	size_t a, b, i;
+
+	if (expr_term(p, &a) == -1)
+		return -1;
+	expr_skip(p);
+	for (i = 0; expr_ops[i].name != NULL; i++) {
+		if (strncmp(p->cp, expr_ops[i].name,
+		    strlen(expr_ops[i].name)) == 0)
 			break;
+	}
+	if (expr_ops[i].name == NULL)
+		return expr_add_node(p, EXPR_TEST, a, 0, np);
+	p->cp += strlen(expr_ops[i].name);
+	if (expr_term(p, &b) == -1)
+		return -1;
+	return expr_add_node(p, expr_ops[i].op, a, b, np);
+}
+
+/* {!NOT}, {(OR)} or a comparison */
+static int
+expr_not(struct expr_parse *p, size_t *np)
+{
+	size_t a;
+
+	expr_skip(p);
+	if (*p->cp == '!') {
+		p->cp++;
+		if (expr_not(p, &a) == -1)
+			return -1;
+		return expr_add_node(p, EXPR_NOT, a, 0, np);
+	}
+	if (*p->cp != '(')
+		return expr_cmp(p, np);
+	p->cp++;
+	if (expr_or(p, np) == -1)
+		return -1;
+	expr_skip(p);
+	if (*p->cp != ')')
+		return -1;
+	p->cp++;
+	return 0;
+}
+
+static int
+expr_and(struct expr_parse *p, size_t *np)
+{
+	size_t a, b;
+
+	if (expr_not(p, &a) == -1)
+		return -1;
+	for (expr_skip(p); strncmp(p->cp, "&&", 2) == 0; expr_skip(p)) {
+		p->cp += 2;
+		if (expr_not(p, &b) == -1 ||
+		    expr_add_node(p, EXPR_AND, a, b, &a) == -1)
+			return -1;
+	}
+	*np = a;
+	return 0;
+}
+
+static int
+expr_or(struct expr_parse *p, size_t *np)
+{
+	size_t a, b;
+
+	if (expr_and(p, &a) == -1)
+		return -1;
+	for (expr_skip(p); strncmp(p->cp, "||", 2) == 0; expr_skip(p)) {
+		p->cp += 2;
+		if (expr_and(p, &b) == -1 ||
+		    expr_add_node(p, EXPR_OR, a, b, &a) == -1)
+			return -1;
+	}
+	*np = a;
+	return 0;
+}
+
+/*
+ * Compile a condition using the operators "!", "&&", "||" (in decreasing
+ * order of precedence), comparisons and parentheses, resolving references
+ * in its terms against "scope" as compile_ref() does. Returns 0 on success
+ * or -1 if the condition is invalid or on allocation failure.
+ */
+static int
+compile_expr(struct mtemplate_node *scope, const char *text,
+    struct mtemplate_expr **exprp)
+{
+	struct expr_parse p;
+	size_t root;
+
+	bzero(&p, sizeof(p));
+	p.scope = scope;
+	p.cp = text;
+	if ((p.expr = calloc(1, sizeof(*p.expr))) == NULL)
+		return -1;
+	if (expr_or(&p, &root) == -1)
+		goto fail;
+	expr_skip(&p);
+	if (*p.cp != '\0')
+		goto fail;
+	*exprp = p.expr;
+	return 0;
+ fail:
+	free_expr(p.expr);
+	return -1;
+}
+
+/*
+ * Find the first of two consecutive "c" bytes between "p" and "ep", e.g.
+ * the start or end of a directive, or NULL if there is none.
+ */
+static const char *
+find_pair(const char *p, const char *ep, int c)
+{
+	for (; (p = memchr(p, c, ep - p)) != NULL; p++) {
+		if (p + 1 < ep && p[1] == c)
+			return p;
+	}
+	return NULL;
+}
+
+/* Count the newlines in the "len" bytes at "p" */
+static u_int
+count_lines(const char *p, size_t len)
+{
+	const char *ep = p + len;
+	u_int n = 0;
+#ifdef __SSE2__
+	__m128i nl = _mm_set1_epi8('\n'), acc, sum = _mm_setzero_si128();
+	size_t i;
+
+	while (ep - p >= 16) {
+		/* Each byte of "acc" counts up to 255 newlines */
+		acc = _mm_setzero_si128();
+		for (i = 0; i < 255 && ep - p >= 16; i++, p += 16) {
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(nl,
+			    _mm_loadu_si128((const __m128i *)p)));
 		}
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(acc,
+		    _mm_setzero_si128()));
+	}
+	n = _mm_cvtsi128_si32(sum) +
+	    _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#endif
+	for (; (p = memchr(p, '\n', ep - p)) != NULL; p++)
+		n++;
+	return n;
+}
 
-		/* Count newlines */
-		if (*start_p == '\n') {
-			lnum++;
-			p = (start_p + 1) - (text + o);
-			continue;
+/*
+ * Directive keywords by a perfect hash of their length and first and last
+ * characters. Keywords must be added to node_info[] too.
+ */
+#define KEYWORD_MIN	2
+#define KEYWORD_MAX	6
+#define KEYWORD_HASH(p, len) \
+	(((len) * 5 + (u_char)(p)[0] + (u_char)(p)[(len) - 1]) & 15)
+static const enum node_type keywords[16] = {
+	NODE_DIRECTIVE_SUBST,	NODE_NONE,		NODE_NONE,
+	NODE_NONE,		NODE_DIRECTIVE_ENDIF,	NODE_DIRECTIVE_ENDFOR,
+	NODE_NONE,		NODE_DIRECTIVE_FOR,	NODE_NONE,
+	NODE_DIRECTIVE_IF,	NODE_NONE,		NODE_NONE,
+	NODE_TEXT,		NODE_NONE,		NODE_DIRECTIVE_ELSE,
+	NODE_NONE,
+};
+
+static int
+classify_node(const char *directive, size_t len, const char **end_p,
+    enum node_type *typep)
+{
+	enum node_type n;
+	size_t i, wlen;
+
+	if (len < 1)
+		return -1;
+
+	*end_p = NULL;
+	/* Look up the first word of the directive */
+	for (wlen = 0; wlen < len && directive[wlen] != ' '; wlen++)
+		;
+	if (wlen >= KEYWORD_MIN && wlen <= KEYWORD_MAX &&
+	    (n = keywords[KEYWORD_HASH(directive, wlen)]) != NODE_NONE &&
+	    strlen(node_info[n].p) == wlen &&
+	    strncmp(directive, node_info[n].p, wlen) == 0) {
+		*typep = n;
+		if (!node_info[n].want_expression)
+			return 0;
+		/* If an expression is required, then make sure it exists */
+		if (len <= wlen + 1)
+			return -1;
+		*end_p = directive + wlen + 1;
+		return 0;
+	}
+
+	/* Check for {* escape */
+	if (*directive == '{') {
+		for (i = 1; i < len && directive[i] == '{'; i++)
+			;
+		if (i >= len) {
+			*end_p = directive;
+			*typep = NODE_TEXT;
+			return 0;
 		}
-		/* Make sure we have a full opening sequence */
-		if (*(start_p + 1) != '{') {
-			p = (start_p + 1) - (text + o);
-			continue;
+	}
+
+	/* Probably a DIRECTIVE_SUBST, maybe with escaping filters */
+	for (i = len; i > 0 && islower((u_char)directive[i - 1]); i--)
+		;
+	if (i > 1 && i < len && directive[i - 1] == ':')
+		len = i - 1;
+	/* Do a basic sanity check; function calls are checked later */
+	for (i = 0; i < len; i++) {
+		if (strchr(SUBST_OK, directive[i]) == NULL)
+			break;
+	}
+	if (i < len && !call_syntax(directive, len))
+		return -1;
+
+	*end_p = directive;
+	*typep = NODE_DIRECTIVE_SUBST;
+	return 0;
+}
+
+static const char *
+node_type_ntop(enum node_type n)
+{
+	if (n <= NODE_NONE || n > NODE_MAX)
+		return "UNKNOWN";		
+	return node_info[n].p;
+}
+
+static enum node_type
+mtemplate_node_parent(enum node_type n)
+{
+	if (n <= NODE_NONE || n > NODE_MAX)
+		return NODE_NONE;
+	return node_info[n].parent;
+}
+
+static void
+free_source(char *source, size_t len, u_int mapped)
+{
+	if (source == NULL)
+		return;
+	if (mapped)
+		munmap(source, len);
+	else {
+		bzero(source, len);
+		free(source);
+	}
+}
+
+/* XXX append-to-template/incremental parse mode (keep state for [/[) */
+
+/*
+ * Parse the "len" bytes of template text at "text", which the template
+ * takes ownership of (and releases if parsing fails).
+ */
+static struct mtemplate *
+parse_source(char *text, size_t len, u_int mapped, char *ebuf, size_t elen)
+{
+	size_t dlen, tlen;
+	int lnum;
+	const char *start_p, *end_p, *cp, *ep, *next;
+	struct mtemplate *ret;
+	struct mtemplate_node *node, *parent;
+	struct mtemplate_nodes *activep;
+	enum node_type type, expected;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+		format_err(-1, ebuf, elen, "%s: calloc(mtemplate)", __func__);
+		free_source(text, len, mapped);
+		return NULL;
+	}
+	ret->source = text;
+	ret->source_len = len;
+	ret->mapped = mapped;
+
+	/* Root node */
+	ret->root.type = NODE_NONE;
+	TAILQ_INIT(&ret->root.child_nodes);
+	TAILQ_INIT(&ret->root.child_nodes_else); /* Should never be used */
+	ret->root.parentp = NULL;
+
+	activep = &ret->root.child_nodes;
+	parent = &ret->root;
+	node = NULL;
+	/*
+	 * The text before each directive is read twice: by find_pair()
+	 * to find the directive, and then by count_lines() to count its
+	 * lines in bulk. Both passes use memchr() or SSE2, so they cost
+	 * little per byte. Text passed as a string has also been read
+	 * beforehand, to find its length and copy it.
+	 */
+	ep = text + len;
+	for (next = text, lnum = 1;;) {
+		/* Find the next directive starting sequence */
+		start_p = find_pair(next, ep, '{');
+		lnum += count_lines(next, (start_p == NULL ? ep : start_p) -
+		    next);
+
+		/* Append string at end of template */
+		if (start_p == NULL) {
+			if (next == ep)
+				break;
+			if ((node = alloc_node(next, ep - next, NODE_TEXT,
+			    lnum, parent, ebuf, elen)) == NULL) {
+ mtemplate_parse_err:
+				mtemplate_free(ret);
+				return NULL;
+			}
+			TAILQ_INSERT_TAIL(activep, node, entry);
+			break;
 		}
 
 		/* We have found a directive */
 
 		/* Append a text node up until the current directive */
-		if (start_p > text + o) {
-			if ((node = alloc_node(text + o,
-			    start_p - (text + o), NODE_TEXT,
+		if (start_p > next) {
+			if ((node = alloc_node(next, start_p - next, NODE_TEXT,
 			    lnum, parent, ebuf, elen)) == NULL)
 				goto mtemplate_parse_err;
 			TAILQ_INSERT_TAIL(activep, node, entry);
@@ -311,12 +1467,12 @@ mtemplate_parse(const char *text, char *ebuf, size_t elen)
 		start_p += 2;
 
 		/* Find end of directive */
-		if ((end_p = strstr(start_p, "}}")) == NULL) {
+		if ((end_p = find_pair(start_p, ep, '}')) == NULL) {
 			format_err(lnum, ebuf, elen, "Unterminated directive");
 			goto mtemplate_parse_err;
 		}
 		/* Disallow newlines inside directive */
-		if ((cp = strchr(start_p, '\n')) != NULL && cp <= end_p) {
+		if (memchr(start_p, '\n', end_p - start_p) != NULL) {
 			format_err(lnum, ebuf, elen, "Newline in directive");
 			goto mtemplate_parse_err;
 		}
@@ -382,14 +1538,63 @@ mtemplate_parse(const char *text, char *ebuf, size_t elen)
 		TAILQ_INSERT_TAIL(activep, node, entry);
 
 		/* Special treatment for 'for', descend for opening blocks */
+		if (type == NODE_DIRECTIVE_FOR && parse_for(node) == -1) {
+			format_err(lnum, ebuf, elen,
+			    "Invalid \"for\" syntax");
+			goto mtemplate_parse_err;
+		}
+		if (type == NODE_DIRECTIVE_IF && parse_if(node) == -1) {
+			format_err(lnum, ebuf, elen,
+			    "Invalid \"if\" syntax");
+			goto mtemplate_parse_err;
+		}
+		if (type == NODE_DIRECTIVE_SUBST && parse_escape(node) == -1) {
+			format_err(lnum, ebuf, elen,
+			    "Invalid escaping filter");
+			goto mtemplate_parse_err;
+		}
+		if (type == NODE_DIRECTIVE_IF && expr_syntax(node->text) &&
+		    compile_expr(parent, node->text, &node->expr) == -1) {
+			format_err(lnum, ebuf, elen,
+			    "Invalid \"if\" expression");
+			goto mtemplate_parse_err;
+		}
+		if (node->filter != NULL && expr_syntax(node->filter) &&
+		    compile_expr(node, node->filter,
+		    &node->filter_expr) == -1) {
+			format_err(lnum, ebuf, elen,
+			    "Invalid \"for\" filter expression");
+			goto mtemplate_parse_err;
+		}
+		if (type != NODE_TEXT && node->expr == NULL &&
+		    call_syntax(node->text, strlen(node->text)) &&
+		    compile_call(parent, node->text, &node->call) == -1) {
+			format_err(lnum, ebuf, elen, "Invalid function call");
+			goto mtemplate_parse_err;
+		}
+		if (node->call != NULL && node->call->fn->fn == NULL &&
+		    type != NODE_DIRECTIVE_SUBST) {
+			format_err(lnum, ebuf, elen, "Function \"%s\" may only "
+			    "be substituted", node->call->fn->name);
+			goto mtemplate_parse_err;
+		}
+		/*
+		 * The reference of a "for" node itself is outside its loop,
+		 * but its filter is inside.
+		 */
+		if (type != NODE_TEXT &&
+		    ((node->call == NULL && node->expr == NULL &&
+		    compile_ref(parent, node->text, &node->ref) == -1) ||
+		    (node->member != NULL && compile_ref(parent, node->member,
+		    &node->member_ref) == -1) ||
+		    (node->filter != NULL && node->filter_expr == NULL &&
+		    compile_ref(node, node->filter, &node->filter_ref) == -1))) {
+			format_err(lnum, ebuf, elen,
+			    "Reference compilation failed");
+			goto mtemplate_parse_err;
+		}
 		switch (type) {
 		case NODE_DIRECTIVE_FOR:
-			if (parse_for(node) == -1) {
-				format_err(lnum, ebuf, elen,
-				    "Invalid \"for\" syntax");
-				goto mtemplate_parse_err;
-			}
-			/* FALLTHROUGH */
 		case NODE_DIRECTIVE_IF:
 			activep = &node->child_nodes;
 			parent = node;
@@ -399,8 +1604,7 @@ mtemplate_parse(const char *text, char *ebuf, size_t elen)
 		}
 
 node_done:
-		p = 0;
-		o = 2 + end_p - text;
+		next = end_p + 2;
 	}
 
 	if (parent != &ret->root) {
@@ -413,286 +1617,2376 @@ node_done:
 	return ret;
 }
 
-static void
-mtemplate_free_nodes(struct mtemplate_nodes *nodes)
+struct mtemplate *
+mtemplate_parse2(const char *text, size_t len, char *ebuf, size_t elen)
 {
-	struct mtemplate_node *n;
+	char *source;
 
-	while ((n = TAILQ_FIRST(nodes)) != NULL) {
-		TAILQ_REMOVE(nodes, n, entry);
-		if (n->text != NULL) {
-			bzero(n->text, strlen(n->text));
-			free(n->text);
-		}
-		if (n->localvar != NULL) {
-			bzero(n->localvar, strlen(n->localvar));
-			free(n->localvar);
-		}
-		mtemplate_free_nodes(&n->child_nodes);
-		mtemplate_free_nodes(&n->child_nodes_else);
-		bzero(n, sizeof(*n));
-		free(n);
+	if (len > TEMPLATE_MAX_LEN) {
+		format_err(-1, ebuf, elen, "Template too large");
+		return NULL;
+	}
+	/* Text nodes point into a single copy of the whole template */
+	if ((source = malloc(len == 0 ? 1 : len)) == NULL) {
+		format_err(-1, ebuf, elen, "%s: malloc(%zu)", __func__, len);
+		return NULL;
 	}
+	memcpy(source, text, len);
+	return parse_source(source, len, 0, ebuf, elen);
 }
 
-void
-mtemplate_free(struct mtemplate *tmpl)
-{
+struct mtemplate *
+mtemplate_parse(const char *text, char *ebuf, size_t elen)
+{
+	return mtemplate_parse2(text, strlen(text), ebuf, elen);
+}
+
+struct mtemplate *
+mtemplate_parse_file(const char *path, char *ebuf, size_t elen)
+{
+	struct stat st;
+	char *data = NULL, *tmp;
+	size_t len = 0, alloc = 0;
+	ssize_t r;
+	int fd;
+
+	if (strcmp(path, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(path, O_RDONLY)) == -1) {
+		format_err(-1, ebuf, elen, "open(\"%s\"): %s",
+		    path, strerror(errno));
+		return NULL;
+	}
+	/* Map regular files; read anything else */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (u_int64_t)st.st_size <= TEMPLATE_MAX_LEN &&
+	    (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+	    fd, 0)) != MAP_FAILED) {
+		if (fd != STDIN_FILENO)
+			close(fd);
+		return parse_source(data, st.st_size, 1, ebuf, elen);
+	}
+	for (data = NULL;;) {
+		if (len + 65536 > alloc) {
+			alloc = (len + 65536) * 2;
+			if (alloc > TEMPLATE_MAX_LEN ||
+			    (tmp = realloc(data, alloc)) == NULL) {
+				format_err(-1, ebuf, elen, "Template too large");
+				goto fail;
+			}
+			data = tmp;
+		}
+		if ((r = read(fd, data + len, alloc - len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			format_err(-1, ebuf, elen, "read: %s", strerror(errno));
+			goto fail;
+		}
+		if (r == 0)
+			break;
+		len += r;
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return parse_source(data, len, 0, ebuf, elen);
+ fail:
+	if (fd != STDIN_FILENO)
+		close(fd);
+	free(data);
+	return NULL;
+}
+
+static void
+mtemplate_free_nodes(struct mtemplate_nodes *nodes)
+{
+	struct mtemplate_node *n;
+
+	while ((n = TAILQ_FIRST(nodes)) != NULL) {
+		TAILQ_REMOVE(nodes, n, entry);
+		/* Text nodes belong to the template's source */
+		if (n->type != NODE_TEXT && n->text != NULL) {
+			bzero(n->text, strlen(n->text));
+			free(n->text);
+		}
+		if (n->localvar != NULL) {
+			bzero(n->localvar, strlen(n->localvar));
+			free(n->localvar);
+		}
+		if (n->member != NULL) {
+			bzero(n->member, strlen(n->member));
+			free(n->member);
+		}
+		if (n->filter != NULL) {
+			bzero(n->filter, strlen(n->filter));
+			free(n->filter);
+		}
+		if (n->ref != NULL)
+			free_ref(n->ref);
+		if (n->call != NULL)
+			free_call(n->call);
+		if (n->member_ref != NULL)
+			free_ref(n->member_ref);
+		if (n->filter_ref != NULL)
+			free_ref(n->filter_ref);
+		if (n->expr != NULL)
+			free_expr(n->expr);
+		if (n->filter_expr != NULL)
+			free_expr(n->filter_expr);
+		mtemplate_free_nodes(&n->child_nodes);
+		mtemplate_free_nodes(&n->child_nodes_else);
+		bzero(n, sizeof(*n));
+		free(n);
+	}
+}
+
+void
+mtemplate_free(struct mtemplate *tmpl)
+{
 	mtemplate_free_nodes(&tmpl->root.child_nodes);
+	free_source(tmpl->source, tmpl->source_len, tmpl->mapped);
 	bzero(tmpl, sizeof(*tmpl));
 	free(tmpl);
 }
 
-/* XXX move this to libmobject */
-static u_int
-mobject_as_boolean(struct mobject *o)
+/* Loop variables visible at a point in the template, innermost first */
+struct ref_scope {
+	const char *localvar;
+	const char *iterable;
+	struct ref_scope *up;
+};
+
+/* A single reference collected by mtemplate_references() */
+struct ref_entry {
+	const char *path;
+	const char *loopvar;		/* NULL for global references */
+	const char *iterable;		/* NULL for global references */
+	char *copy;			/* Allocated subscript path, or NULL */
+	u_int lnum;
+};
+
+struct ref_list {
+	struct ref_entry *refs;
+	size_t nused;
+	size_t nalloc;
+};
+
+static int add_reference(struct ref_list *, const char *, u_int,
+    struct ref_scope *);
+
+/*
+ * Add the references used as subscripts of "path", e.g. "f.value.owner"
+ * in "users[f.value.owner].name". They are resolved in the same scope as
+ * "path" itself, and any subscripts of their own are added in turn.
+ */
+static int
+add_subscript_references(struct ref_list *list, const char *path,
+    u_int lnum, struct ref_scope *scope)
+{
+	const char *cp;
+	char *sub;
+	size_t l, first;
+	int nest;
+
+	for (cp = path; (cp = strchr(cp, '[')) != NULL; cp += l) {
+		for (nest = 1, l = 0, cp++; cp[l] != '\0'; l++) {
+			if (cp[l] == '[')
+				nest++;
+			else if (cp[l] == ']' && --nest == 0)
+				break;
+		}
+		if (l == 0 || isdigit((u_char)*cp))
+			continue;
+		if ((sub = malloc(l + 1)) == NULL)
+			return -1;
+		memcpy(sub, cp, l);
+		sub[l] = '\0';
+		first = list->nused;
+		if (add_reference(list, sub, lnum, scope) != 0) {
+			if (list->nused > first)
+				list->refs[first].copy = sub;
+			else
+				free(sub);
+			return -1;
+		}
+		list->refs[first].copy = sub;
+	}
+	return 0;
+}
+
+static int
+add_reference(struct ref_list *list, const char *path, u_int lnum,
+    struct ref_scope *scope)
+{
+	struct ref_entry *tmp, *r;
+	struct ref_scope *sc;
+	size_t n, hlen;
+
+	if (list->nused >= list->nalloc) {
+		n = list->nalloc == 0 ? 32 : list->nalloc * 2;
+		if (n <= list->nalloc ||
+		    (tmp = realloc(list->refs, n * sizeof(*tmp))) == NULL)
+			return -1;
+		list->refs = tmp;
+		list->nalloc = n;
+	}
+	r = &list->refs[list->nused++];
+	r->path = path;
+	r->lnum = lnum;
+	r->loopvar = r->iterable = NULL;
+	r->copy = NULL;
+
+	/* Loop variables shadow the global namespace, innermost first */
+	hlen = strcspn(path, ".[");
+	for (sc = scope; sc != NULL; sc = sc->up) {
+		if (strlen(sc->localvar) == hlen &&
+		    strncmp(sc->localvar, path, hlen) == 0) {
+			r->loopvar = sc->localvar;
+			r->iterable = sc->iterable;
+			break;
+		}
+	}
+	return add_subscript_references(list, path, lnum, scope);
+}
+
+/* Add the references in the text of a node, or in its call's arguments */
+static int
+add_text_references(struct ref_list *list, const char *text,
+    struct mtemplate_call *call, u_int lnum, struct ref_scope *scope)
+{
+	size_t i;
+
+	if (call == NULL)
+		return add_reference(list, text, lnum, scope);
+	for (i = 0; i < call->nargs; i++) {
+		if (call->args[i].literal == NULL &&
+		    add_text_references(list, call->args[i].text,
+		    call->args[i].call, lnum, scope) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Add the references in the terms of a condition */
+static int
+add_expr_references(struct ref_list *list, struct mtemplate_expr *expr,
+    u_int lnum, struct ref_scope *scope)
+{
+	size_t i;
+
+	for (i = 0; i < expr->nterms; i++) {
+		if (expr->terms[i].literal == NULL &&
+		    add_text_references(list, expr->terms[i].text,
+		    expr->terms[i].call, lnum, scope) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+collect_references(struct mtemplate_nodes *nodes, struct ref_scope *scope,
+    struct ref_list *list)
+{
+	struct mtemplate_node *n;
+	struct ref_scope inner;
+
+	TAILQ_FOREACH(n, nodes, entry) {
+		switch (n->type) {
+		case NODE_DIRECTIVE_IF:
+			if ((n->expr != NULL ? add_expr_references(list,
+			    n->expr, n->lnum, scope) : add_text_references(list,
+			    n->text, n->call, n->lnum, scope)) != 0 ||
+			    (n->member != NULL && add_reference(list,
+			    n->member, n->lnum, scope) != 0) ||
+			    collect_references(&n->child_nodes,
+			    scope, list) != 0 ||
+			    collect_references(&n->child_nodes_else,
+			    scope, list) != 0)
+				return -1;
+			break;
+		case NODE_DIRECTIVE_FOR:
+			/* The iterable is resolved outside the new scope */
+			if (add_text_references(list, n->text, n->call,
+			    n->lnum, scope) != 0)
+				return -1;
+			inner.localvar = n->localvar;
+			inner.iterable = n->text;
+			inner.up = scope;
+			if ((n->filter_expr != NULL && add_expr_references(list,
+			    n->filter_expr, n->lnum, &inner) != 0) ||
+			    (n->filter != NULL && n->filter_expr == NULL &&
+			    add_reference(list, n->filter, n->lnum,
+			    &inner) != 0) ||
+			    collect_references(&n->child_nodes,
+			    &inner, list) != 0)
+				return -1;
+			break;
+		case NODE_DIRECTIVE_SUBST:
+			if (add_text_references(list, n->text, n->call,
+			    n->lnum, scope) != 0)
+				return -1;
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+strcmp_null(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a != NULL) - (b != NULL);
+	return strcmp(a, b);
+}
+
+static int
+ref_entry_cmp(const void *_a, const void *_b)
+{
+	const struct ref_entry *a = (const struct ref_entry *)_a;
+	const struct ref_entry *b = (const struct ref_entry *)_b;
+	int r;
+
+	if ((r = strcmp(a->path, b->path)) != 0 ||
+	    (r = strcmp_null(a->loopvar, b->loopvar)) != 0 ||
+	    (r = strcmp_null(a->iterable, b->iterable)) != 0)
+		return r;
+	if (a->lnum != b->lnum)
+		return a->lnum < b->lnum ? -1 : 1;
+	return 0;
+}
+
+static void
+free_ref_list(struct ref_list *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->nused; i++)
+		free(list->refs[i].copy);
+	free(list->refs);
+}
+
+struct mobject *
+mtemplate_references(struct mtemplate *tmpl)
+{
+	struct ref_list list = { NULL, 0, 0 };
+	struct ref_entry *r, *last;
+	struct mobject *ret, *d;
+	size_t i;
+
+	if ((ret = marray_new()) == NULL)
+		return NULL;
+	if (collect_references(&tmpl->root.child_nodes, NULL, &list) != 0)
+		goto fail;
+	qsort(list.refs, list.nused, sizeof(*list.refs), ref_entry_cmp);
+	for (i = 0, last = NULL; i < list.nused; i++) {
+		r = &list.refs[i];
+		/* Sorting places duplicates together, first use first */
+		if (last != NULL && strcmp(r->path, last->path) == 0 &&
+		    strcmp_null(r->loopvar, last->loopvar) == 0 &&
+		    strcmp_null(r->iterable, last->iterable) == 0)
+			continue;
+		last = r;
+		if ((d = marray_append_d(ret)) == NULL ||
+		    mdict_insert_ss(d, "path", r->path) == NULL ||
+		    mdict_insert_si(d, "line", r->lnum) == NULL)
+			goto fail;
+		if (r->loopvar == NULL) {
+			if (mdict_insert_ss(d, "scope", "global") == NULL)
+				goto fail;
+			continue;
+		}
+		if (mdict_insert_ss(d, "scope", "loop") == NULL ||
+		    mdict_insert_ss(d, "loopvar", r->loopvar) == NULL ||
+		    mdict_insert_ss(d, "iterable", r->iterable) == NULL)
+			goto fail;
+	}
+	free_ref_list(&list);
+	return ret;
+
+ fail:
+	free_ref_list(&list);
+	mobject_free(ret);
+	return NULL;
+}
+
+/* XXX move this to libmobject */
+static u_int
+mobject_as_boolean(struct mobject *o)
+{
+	if (o == NULL)
+		return 0;
+	switch (mobject_type(o)) {
+		case TYPE_MNONE:
+			return 0;
+		case TYPE_MSTRING:
+			return (mstring_len(o) > 0);
+		case TYPE_MINT:
+			return (mint_value(o) != 0);
+		case TYPE_MARRAY:
+			/* The length of a stream isn't known until it's read */
+			return (marray_is_stream(o) || marray_len(o) > 0);
+		case TYPE_MDICT:
+			return (mdict_len(o) > 0);
+		case TYPE_MSET:
+			return (mset_len(o) > 0);
+		default:
+			return 0;
+	}
+}
+
+/* XXX: libmobject should have a non-vis mode */
+#define RENDER_MO_ALLOC 256
+
+/*
+ * Find the text that substituting "o" produces. Strings are used in
+ * place and need not be nul-terminated; other objects are formatted into
+ * "sbuf", or if it is too small into memory returned in "*allocp", which
+ * the caller must free. Returns 0 on success or -1 on allocation failure.
+ */
+static int
+obj_text(struct mobject *o, char *sbuf, size_t slen, const char **pp,
+    size_t *lenp, char **allocp)
+{
+	size_t need;
+
+	*allocp = NULL;
+	if (mobject_type(o) == TYPE_MSTRING) {
+		*pp = (const char *)mstring_ptr(o);
+		*lenp = mstring_len(o);
+		return 0;
+	}
+	need = mobject_to_string(o, sbuf, slen) + 1;
+	if (need > slen) {
+		if ((*allocp = malloc(need)) == NULL)
+			return -1;
+		mobject_to_string(o, *allocp, need);
+		sbuf = *allocp;
+	}
+	*pp = sbuf;
+	*lenp = need - 1;
+	return 0;
+}
+
+/*
+ * Append 'len' bytes to the run's output buffer, flushing it to the
+ * sink as it fills.
+ */
+static int
+run_write(struct mtemplate_run *r, const void *p, size_t len)
+{
+	const char *cp = p;
+	size_t n;
+
+	while (len > 0) {
+		if (r->olen == RUN_BUF_SIZE && run_flush(r) != 0)
+			return -1;
+		n = MIN(len, RUN_BUF_SIZE - r->olen);
+		memcpy(r->obuf + r->olen, cp, n);
+		r->olen += n;
+		cp += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Escaping filters, applied to substitutions in the order given, e.g. the
+ * "hj" of {{a.b:hj}}: HTML, Javascript string and URL (percent) encoding.
+ * Each has a table of the bytes that it must escape. Text is scanned for
+ * them (sixteen bytes at a time where SSE2 is available), runs of bytes
+ * that need no escaping are copied to the output as they are and only
+ * the escaped bytes are rewritten, so nothing is allocated.
+ */
+enum escape_mode {
+	ESCAPE_HTML = 0,
+	ESCAPE_JS = 1,
+	ESCAPE_URL = 2,
+};
+static u_int8_t escape_tab[ESCAPE_URL + 1][256];
+static pthread_once_t escape_tab_once = PTHREAD_ONCE_INIT;
+
+/* Fill escape_tab; called once through escape_init() */
+static void
+escape_fill(void)
+{
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		escape_tab[ESCAPE_HTML][c] = c != 0 &&
+		    strchr("&<>\"'", c) != NULL;
+		/* 0xe2 may start U+2028 or U+2029, which end JS lines */
+		escape_tab[ESCAPE_JS][c] = c < 0x20 || c == 0x7f ||
+		    c == 0xe2 || (c != 0 && strchr("\\\"'<>&", c) != NULL);
+		escape_tab[ESCAPE_URL][c] = !((c >= 'a' && c <= 'z') ||
+		    (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		    (c != 0 && strchr("-_.~", c) != NULL));
+	}
+}
+
+/* Runs may start in several threads at once, so the table is filled once */
+static void
+escape_init(void)
+{
+	pthread_once(&escape_tab_once, escape_fill);
+}
+
+/* Find the length of the run at the start of "p" that needs no escaping */
+static size_t
+clean_len(enum escape_mode mode, const u_int8_t *p, size_t len)
+{
+	const u_int8_t *tab = escape_tab[mode];
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i v, m;
+	int bits;
+
+	/* Most bytes are safe for URLs, so a table is as quick there */
+	for (; mode != ESCAPE_URL && i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		m = _mm_or_si128(_mm_or_si128(
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('<'))), _mm_or_si128(
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('>')), _mm_or_si128(
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')))));
+		if (mode == ESCAPE_JS) {
+			/* Bytes below 0x20 saturate to zero */
+			m = _mm_or_si128(_mm_or_si128(m, _mm_or_si128(
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')),
+			    _mm_cmpeq_epi8(_mm_subs_epu8(v,
+			    _mm_set1_epi8(0x1f)), _mm_setzero_si128()))),
+			    _mm_or_si128(
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)),
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xe2))));
+		}
+		if ((bits = _mm_movemask_epi8(m)) != 0)
+			return i + ffs(bits) - 1;
+	}
+#endif
+	for (; i < len && !tab[p[i]]; i++)
+		;
+	return i;
+}
+
+/*
+ * Write the escaped form of the bytes at "p" that need escaping into
+ * "buf", which must hold at least 8 bytes. Returns the number of bytes
+ * of "p" consumed and stores the length of the result in "*lenp".
+ */
+static size_t
+escape_bytes(enum escape_mode mode, const u_int8_t *p, size_t len,
+    char *buf, size_t *lenp)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const char *rep = NULL;
+	size_t used = 1;
+
+	switch (mode) {
+	case ESCAPE_HTML:
+		switch (*p) {
+		case '&':
+			rep = "&amp;";
+			break;
+		case '<':
+			rep = "&lt;";
+			break;
+		case '>':
+			rep = "&gt;";
+			break;
+		case '"':
+			rep = "&quot;";
+			break;
+		default:
+			rep = "&#39;";
+			break;
+		}
+		break;
+	case ESCAPE_JS:
+		if (*p == 0xe2) {
+			if (len >= 3 && p[1] == 0x80 &&
+			    (p[2] == 0xa8 || p[2] == 0xa9)) {
+				rep = p[2] == 0xa8 ? "\\u2028" : "\\u2029";
+				used = 3;
+				break;
+			}
+			buf[0] = *p;
+			*lenp = 1;
+			return 1;
+		}
+		switch (*p) {
+		case '\\':
+			rep = "\\\\";
+			break;
+		case '"':
+			rep = "\\\"";
+			break;
+		case '\'':
+			rep = "\\'";
+			break;
+		case '\n':
+			rep = "\\n";
+			break;
+		case '\r':
+			rep = "\\r";
+			break;
+		case '\t':
+			rep = "\\t";
+			break;
+		default:
+			/* Including <, > and &, which could end a <script> */
+			memcpy(buf, "\\u00", 4);
+			buf[4] = hex[*p >> 4];
+			buf[5] = hex[*p & 0xf];
+			*lenp = 6;
+			return 1;
+		}
+		break;
+	case ESCAPE_URL:
+		buf[0] = '%';
+		buf[1] = hex[*p >> 4];
+		buf[2] = hex[*p & 0xf];
+		*lenp = 3;
+		return 1;
+	}
+	*lenp = strlen(rep);
+	memcpy(buf, rep, *lenp);
+	return used;
+}
+
+/* Write "len" bytes at "p" through the escaping filters in "chain" */
+static int
+escape_write(struct mtemplate_run *r, const char *chain, const char *p,
+    size_t len)
+{
+	enum escape_mode mode;
+	char buf[8];
+	size_t n, rlen;
+
+	if (*chain == '\0')
+		return run_write(r, p, len);
+	mode = (enum escape_mode)(strchr(ESCAPE_NAMES, *chain) - ESCAPE_NAMES);
+	while (len > 0) {
+		n = clean_len(mode, (const u_int8_t *)p, len);
+		if (n > 0 && escape_write(r, chain + 1, p, n) != 0)
+			return -1;
+		if ((len -= n) == 0)
+			break;
+		p += n;
+		n = escape_bytes(mode, (const u_int8_t *)p, len, buf, &rlen);
+		if (escape_write(r, chain + 1, buf, rlen) != 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Write the result of a substitution, through its escaping filters if it
+ * has any
+ */
+static int
+run_emit(struct mtemplate_run *r, const void *p, size_t len)
+{
+	if (r->escape == NULL)
+		return run_write(r, p, len);
+	return escape_write(r, r->escape, p, len);
+}
+
+/* As run_emit(), but pass each byte through "map", e.g. toupper() */
+static int
+run_write_map(struct mtemplate_run *r, const char *p, size_t len,
+    int (*map)(int))
+{
+	char *dst, buf[RENDER_MO_ALLOC];
+	size_t i, n;
+
+	/* Escaping may lengthen the text, so map it a piece at a time */
+	while (r->escape != NULL && len > 0) {
+		n = MIN(len, sizeof(buf));
+		for (i = 0; i < n; i++)
+			buf[i] = map((u_char)p[i]);
+		if (escape_write(r, r->escape, buf, n) != 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	while (len > 0) {
+		if (r->olen == RUN_BUF_SIZE && run_flush(r) != 0)
+			return -1;
+		n = MIN(len, RUN_BUF_SIZE - r->olen);
+		dst = r->obuf + r->olen;
+		for (i = 0; i < n; i++)
+			dst[i] = map((u_char)p[i]);
+		r->olen += n;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+run_flush(struct mtemplate_run *r)
+{
+	size_t len = r->olen;
+
+	if (len == 0)
+		return 0;
+	r->olen = 0;
+	/* Sinks may treat the buffer as a string */
+	r->obuf[len] = '\0';
+	return r->sink(r->obuf, len, r->sink_ctx) == 0 ? 0 : -1;
+}
+
+/*
+ * Evaluate a compiled reference. Returns NULL if any step fails, leaving
+ * the caller to repeat the lookup by name to find out why.
+ */
+static struct mobject *
+eval_ref(struct mtemplate_run *r, struct mtemplate_ref *ref,
+    struct loop_scope *scope)
+{
+	struct mobject *o, *k;
+	struct ref_step *step, *end = ref->steps + ref->nsteps;
+	int i;
+
+	if (ref->loop_depth < 0)
+		o = r->ns;
+	else {
+		for (i = 0; i < ref->loop_depth; i++)
+			scope = scope->up;
+		if (ref->loop_meta != META_NONE)
+			return loop_meta(r, scope, ref->loop_meta, 0, NULL);
+		o = ref->loop_value ? scope->item->value : scope->item->key;
+	}
+	for (step = ref->steps; step < end && o != NULL; step++) {
+		if (step->key != NULL) {
+			if (mobject_type(o) != TYPE_MDICT)
+				return NULL;
+			o = mdict_item_cached(o, step->key, &step->cache);
+		} else if (step->sub != NULL) {
+			/* Dictionaries are hashed, so joins cost one lookup */
+			if ((k = eval_ref(r, step->sub, scope)) == NULL)
+				return NULL;
+			if (mobject_type(o) == TYPE_MDICT)
+				o = mdict_item(o, k);
+			else if (mobject_type(o) == TYPE_MARRAY &&
+			    mobject_type(k) == TYPE_MINT && mint_value(k) >= 0)
+				o = marray_item(o, (size_t)mint_value(k));
+			else
+				return NULL;
+		} else if (mobject_type(o) == TYPE_MDICT) {
+			/* Subscripted dictionaries are keyed by integer */
+			o = mdict_item_i(o, (int64_t)step->ndx);
+		} else {
+			if (mobject_type(o) != TYPE_MARRAY)
+				return NULL;
+			o = marray_item(o, step->ndx);
+		}
+	}
+	return o;
+}
+
+/*
+ * Make a dictionary of the current item of "scope", for a loop variable
+ * that is used on its own rather than through one of its members. It is
+ * freed when the node being run is finished with it.
+ */
+static struct mobject *
+loop_var(struct mtemplate_run *r, struct loop_scope *scope, u_int lnum,
+    char *directive)
+{
+	struct mobject *d, *o;
+
+	if ((d = mdict_new()) == NULL)
+		goto fail;
+	if (scope->item->key != NULL) {
+		if ((o = mobject_deepcopy(scope->item->key)) == NULL)
+			goto fail;
+		if (mdict_insert_s(d, "key", o) == NULL) {
+			mobject_free(o);
+			goto fail;
+		}
+	}
+	if ((o = mobject_deepcopy(scope->item->value)) == NULL)
+		goto fail;
+	if (mdict_insert_s(d, "value", o) == NULL) {
+		mobject_free(o);
+		goto fail;
+	}
+	if (add_temp(r, d) != 0)
+		goto fail;
+	return d;
+ fail:
+	if (d != NULL)
+		mobject_free(d);
+	format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+	    "could not copy loop variable \"%s\"", directive,
+	    scope->localvar);
+	return NULL;
+}
+
+/*
+ * Look up a reference "name" (compiled as "ref", if not NULL), first
+ * against the enclosing loop variables and then in the user's namespace.
+ * Loop variables are not entered into a namespace but resolved from the
+ * loop's current item, so iterating does not copy anything unless the
+ * variable is used on its own.
+ */
+static struct mobject *
+fetch_ref(struct mtemplate_run *r, char *name, struct mtemplate_ref *ref,
+    u_int lnum, struct loop_scope *scope, char *directive)
+{
+	char buf[1024];
+	struct mobject *o;
+	enum loop_meta meta;
+	size_t hlen, l;
+
+	if (ref != NULL && (o = eval_ref(r, ref, scope)) != NULL)
+		return o;
+	/* The namespace functions don't understand dynamic subscripts */
+	if (ref != NULL && ref->dynamic) {
+		format_err(lnum, r->ebuf, r->elen,
+		    "Error in %s: \"%s\" not found", directive, name);
+		return NULL;
+	}
+
+	hlen = strcspn(name, ".[");
+	for (; scope != NULL; scope = scope->up) {
+		if (strlen(scope->localvar) != hlen ||
+		    strncmp(scope->localvar, name, hlen) != 0)
+			continue;
+		if (strncmp(name + hlen, ".key", 4) == 0) {
+			o = scope->item->key;
+			l = hlen + 4;
+		} else if (strncmp(name + hlen, ".value", 6) == 0) {
+			o = scope->item->value;
+			l = hlen + 6;
+		} else if ((meta = loop_meta_name(name + hlen)) != META_NONE)
+			return loop_meta(r, scope, meta, lnum, directive);
+		else if (name[hlen] == '\0')
+			return loop_var(r, scope, lnum, directive);
+		else
+			l = 0;
+		if (l == 0 || strchr(".[", name[l]) == NULL) {
+			format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+			    "loop variable \"%s\" has only \"key\", "
+			    "\"value\", \"first\", \"last\", \"index\" and "
+			    "\"length\" members", directive, scope->localvar);
+			return NULL;
+		}
+		if (mnamespace_lookup_from(o, name, l, &o,
+		    buf, sizeof(buf)) != 0)
+			goto fail;
+		return o;
+	}
+
+	/* XXX need better mnamespace_lookup return values */
+	if (r->ns != NULL &&
+	    mnamespace_lookup(r->ns, name, &o, buf, sizeof(buf)) == 0)
+		return o;
+	if (r->ns == NULL)
+		strlcpy(buf, "No namespace", sizeof(buf));
+ fail:
+	format_err(lnum, r->ebuf, r->elen, "Error in %s: %s", directive, buf);
+	return NULL;
+}
+
+/*
+ * Find the field named by the literal "arg" in "item", or the item itself
+ * if "arg" is NULL. Returns NULL if the item has no such field.
+ */
+static struct mobject *
+call_field(struct call_arg *arg, struct mobject *item)
+{
+	struct mobject *o;
+	char ebuf[64];
+
+	if (arg == NULL || item == NULL)
+		return item;
+	if (arg->loc == NULL) {
+		if (mobject_type(item) != TYPE_MDICT)
+			return NULL;
+		return mdict_item_cached(item, arg->literal, &arg->cache);
+	}
+	if (mnamespace_lookup_from(item, arg->loc, 1, &o,
+	    ebuf, sizeof(ebuf)) != 0)
+		return NULL;
+	return o;
+}
+
+/*
+ * Test whether the item "it" that iterating over "o" has yielded at
+ * position "pos" stays valid after the iterator moves on. Items of some
+ * virtual containers and of typed arrays belong to the iterator, which
+ * reuses or frees them. The position is used rather than the key, as
+ * views of arrays key their items by index in the whole array.
+ */
+static int
+item_stable(struct mobject *o, struct miteritem *it, size_t pos)
+{
+	switch (mobject_type(o)) {
+	case TYPE_MARRAY:
+		return marray_item(o, pos) == it->value;
+	case TYPE_MDICT:
+		return mdict_item(o, it->key) == it->value;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Start an aggregation over the items of "o", which must be an array,
+ * dictionary or set.
+ */
+static struct miterator *
+agg_start(struct mobject *o, const char **errp)
+{
+	struct miterator *iter;
+
+	switch (mobject_type(o)) {
+	case TYPE_MARRAY:
+	case TYPE_MDICT:
+	case TYPE_MSET:
+		break;
+	default:
+		*errp = "argument is not an array, dictionary or set";
+		return NULL;
+	}
+	if ((iter = mobject_getiter(o)) == NULL)
+		*errp = "could not get iterator";
+	return iter;
+}
+
+/* {count(X)} or {count(X, "FIELD")}, counting items where FIELD is true */
+static struct mobject *
+bi_count(struct mtemplate_call *call, struct mobject **argv,
+    const char **errp)
+{
+	struct miterator *iter;
+	struct miteritem *it;
+	struct mobject *ret;
+	int64_t n = 0;
+
+	if (call->nargs == 1) {
+		switch (mobject_type(argv[0])) {
+		case TYPE_MARRAY:
+			/* Counting a stream would use it up */
+			if (marray_is_stream(argv[0])) {
+				*errp = "argument is a stream, which can't be "
+				    "counted";
+				return NULL;
+			}
+			n = (int64_t)marray_len(argv[0]);
+			break;
+		case TYPE_MDICT:
+			n = (int64_t)mdict_len(argv[0]);
+			break;
+		case TYPE_MSET:
+			n = (int64_t)mset_len(argv[0]);
+			break;
+		default:
+			*errp = "argument is not an array, dictionary or set";
+			return NULL;
+		}
+	} else {
+		if ((iter = agg_start(argv[0], errp)) == NULL)
+			return NULL;
+		while ((it = miterator_next(iter)) != NULL) {
+			if (mobject_as_boolean(call_field(&call->args[1],
+			    it->value)))
+				n++;
+		}
+		miterator_free(iter);
+	}
+	if ((ret = mint_new(n)) == NULL)
+		*errp = "mint_new failed";
+	return ret;
+}
+
+/* {sum(X)} or {sum(X, "FIELD")}; items without the field count as zero */
+static struct mobject *
+bi_sum(struct mtemplate_call *call, struct mobject **argv,
+    const char **errp)
+{
+	struct miterator *iter;
+	struct miteritem *it;
+	struct mobject *o, *ret;
+	int64_t n = 0, v;
+
+	if ((iter = agg_start(argv[0], errp)) == NULL)
+		return NULL;
+	while ((it = miterator_next(iter)) != NULL) {
+		o = call_field(call->nargs > 1 ? &call->args[1] : NULL,
+		    it->value);
+		if (o == NULL || mobject_type(o) == TYPE_MNONE)
+			continue;
+		if (mobject_type(o) != TYPE_MINT) {
+			*errp = "value is not an integer";
+			goto fail;
+		}
+		v = mint_value(o);
+		if ((v > 0 && n > INT64_MAX - v) ||
+		    (v < 0 && n < INT64_MIN - v)) {
+			*errp = "sum overflows";
+			goto fail;
+		}
+		n += v;
+	}
+	miterator_free(iter);
+	if ((ret = mint_new(n)) == NULL)
+		*errp = "mint_new failed";
+	return ret;
+ fail:
+	miterator_free(iter);
+	return NULL;
+}
+
+/*
+ * Find the smallest ("sign" 1) or largest ("sign" -1) item or field of an
+ * item in mobject_cmp() order, ignoring missing fields and None. Returns
+ * a copy of it, or None if there is nothing to compare.
+ */
+static struct mobject *
+extreme(struct mtemplate_call *call, struct mobject **argv, int sign,
+    const char **errp)
+{
+	struct miterator *iter;
+	struct miteritem *it;
+	struct mobject *o, *best = NULL, *copy = NULL;
+	int stable = -1;
+
+	if ((iter = agg_start(argv[0], errp)) == NULL)
+		return NULL;
+	while ((it = miterator_next(iter)) != NULL) {
+		/* Checked on the first item, at position zero */
+		if (stable == -1)
+			stable = item_stable(argv[0], it, 0);
+		o = call_field(call->nargs > 1 ? &call->args[1] : NULL,
+		    it->value);
+		if (o == NULL || mobject_type(o) == TYPE_MNONE ||
+		    (best != NULL && sign * mobject_cmp(o, best) >= 0))
+			continue;
+		best = o;
+		/* Items that the iterator will free are copied as found */
+		if (!stable) {
+			if (copy != NULL)
+				mobject_free(copy);
+			if ((best = copy = mobject_deepcopy(o)) == NULL) {
+				*errp = "mobject_deepcopy failed";
+				miterator_free(iter);
+				return NULL;
+			}
+		}
+	}
+	miterator_free(iter);
+	if (copy != NULL)
+		return copy;
+	if ((o = best == NULL ? mnone_new() : mobject_deepcopy(best)) == NULL)
+		*errp = "mobject_deepcopy failed";
+	return o;
+}
+
+/* {min(X)} or {min(X, "FIELD")} */
+static struct mobject *
+bi_min(struct mtemplate_call *call, struct mobject **argv,
+    const char **errp)
+{
+	return extreme(call, argv, 1, errp);
+}
+
+/* {max(X)} or {max(X, "FIELD")} */
+static struct mobject *
+bi_max(struct mtemplate_call *call, struct mobject **argv,
+    const char **errp)
+{
+	return extreme(call, argv, -1, errp);
+}
+
+/*
+ * {groupby(X, "FIELD")}: a dictionary mapping each value of FIELD among
+ * the items of the array X to a view (see marray_select()) of the items
+ * that have it, in order. Groups are in order of first appearance and
+ * items without the field are grouped under None. Only the group keys
+ * are copied. Group numbers are found in one pass through a hash of the
+ * keys, and then the items are distributed among the groups.
+ */
+static struct mobject *
+bi_groupby(struct mtemplate_call *call, struct mobject **argv,
+    const char **errp)
+{
+	struct mobject *ret = NULL, *o, *g, *k, *view, **keys = NULL, **tmp;
+	size_t i, j, len, ngroups = 0, nalloc = 0, *gid = NULL, *ndx = NULL;
+	size_t *start = NULL, *stmp;
+
+	*errp = "allocation failed";
+	if (mobject_type(argv[0]) != TYPE_MARRAY) {
+		*errp = "argument is not an array";
+		return NULL;
+	}
+	len = marray_len(argv[0]);
+	if ((ret = mdict_new()) == NULL ||
+	    (gid = calloc(MAX(len, 1), sizeof(*gid))) == NULL ||
+	    (ndx = calloc(MAX(len, 1), sizeof(*ndx))) == NULL)
+		goto fail;
+	for (i = 0; i < len; i++) {
+		if ((o = marray_item(argv[0], i)) == NULL) {
+			*errp = "could not fetch item";
+			goto fail;
+		}
+		if ((k = call_field(&call->args[1], o)) == NULL)
+			k = mnone_new();
+		if (mobject_type(k) != TYPE_MSTRING &&
+		    mobject_type(k) != TYPE_MINT &&
+		    mobject_type(k) != TYPE_MNONE) {
+			*errp = "field is not a string or integer";
+			goto fail;
+		}
+		if ((g = mdict_item(ret, k)) != NULL) {
+			gid[i] = (size_t)mint_value(g);
+			continue;
+		}
+		if (ngroups >= nalloc) {
+			nalloc = nalloc == 0 ? 16 : nalloc * 2;
+			if ((tmp = realloc(keys,
+			    nalloc * sizeof(*keys))) == NULL)
+				goto fail;
+			keys = tmp;
+			if ((stmp = realloc(start,
+			    (nalloc + 1) * sizeof(*start))) == NULL)
+				goto fail;
+			start = stmp;
+		}
+		if ((k = mobject_deepcopy(k)) == NULL)
+			goto fail;
+		if ((g = mint_new((int64_t)ngroups)) == NULL ||
+		    mdict_insert(ret, k, g) != 0) {
+			mobject_free(k);
+			if (g != NULL)
+				mobject_free(g);
+			goto fail;
+		}
+		keys[ngroups] = k;
+		gid[i] = ngroups++;
+	}
+	/* Lay the groups' items out one after another */
+	if (ngroups > 0) {
+		for (j = 0; j <= ngroups; j++)
+			start[j] = 0;
+		for (i = 0; i < len; i++)
+			start[gid[i] + 1]++;
+		for (j = 1; j < ngroups; j++)
+			start[j] += start[j - 1];
+		for (i = 0; i < len; i++)
+			ndx[start[gid[i]]++] = i;
+	}
+	/* "start" now holds the end of each group */
+	for (j = 0; j < ngroups; j++) {
+		i = j == 0 ? 0 : start[j - 1];
+		if ((view = marray_select(argv[0], ndx + i,
+		    start[j] - i)) == NULL)
+			goto fail;
+		/* Replacing the group number frees "keys[j]" */
+		if ((k = mobject_deepcopy(keys[j])) == NULL ||
+		    mdict_replace(ret, k, view) != 0) {
+			if (k != NULL)
+				mobject_free(k);
+			mobject_free(view);
+			goto fail;
+		}
+	}
+	free(keys);
+	free(start);
+	free(gid);
+	free(ndx);
+	return ret;
+ fail:
+	if (ret != NULL)
+		mobject_free(ret);
+	free(keys);
+	free(start);
+	free(gid);
+	free(ndx);
+	return NULL;
+}
+
+/* Find the length of a string in bytes, or the number of items in "o" */
+static int
+obj_len(struct mobject *o, int64_t *lenp)
+{
+	switch (mobject_type(o)) {
+	case TYPE_MSTRING:
+		*lenp = (int64_t)mstring_len(o);
+		return 0;
+	case TYPE_MARRAY:
+		/* The length of a stream isn't known until it's read */
+		if (marray_is_stream(o))
+			return -1;
+		*lenp = (int64_t)marray_len(o);
+		return 0;
+	case TYPE_MDICT:
+		*lenp = (int64_t)mdict_len(o);
+		return 0;
+	case TYPE_MSET:
+		*lenp = (int64_t)mset_len(o);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* {len(X)}: the length of a string in bytes, or the number of items */
+static struct mobject *
+bi_len(struct mtemplate_call *call, struct mobject **argv,
+    const char **errp)
+{
+	struct mobject *ret;
+	int64_t len;
+
+	if (obj_len(argv[0], &len) != 0) {
+		*errp = "argument has no length";
+		return NULL;
+	}
+	if ((ret = mint_new(len)) == NULL)
+		*errp = "mint_new failed";
+	return ret;
+}
+
+static int
+emit_len(struct mtemplate_run *r, struct mtemplate_call *call,
+    struct mobject **argv, const char **errp)
+{
+	char buf[32];
+	int64_t len;
+
+	if (obj_len(argv[0], &len) != 0) {
+		*errp = "argument has no length";
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), "%lld", (long long)len);
+	if (run_emit(r, buf, strlen(buf)) != 0) {
+		*errp = "write error";
+		return -1;
+	}
+	return 0;
+}
+
+/* Write the text of "o", as it would be substituted */
+static int
+emit_text(struct mtemplate_run *r, struct mobject *o, int (*map)(int),
+    const char **errp)
+{
+	char sbuf[RENDER_MO_ALLOC], *alloc;
+	const char *p;
+	size_t len;
+	int ret;
+
+	if (obj_text(o, sbuf, sizeof(sbuf), &p, &len, &alloc) != 0) {
+		*errp = "allocation failed";
+		return -1;
+	}
+	ret = map == NULL ? run_emit(r, p, len) :
+	    run_write_map(r, p, len, map);
+	free(alloc);
+	if (ret != 0)
+		*errp = "write error";
+	return ret;
+}
+
+/*
+ * {join(X, SEP)} or {join(X, SEP, "FIELD")}: the items of X, or their
+ * fields, with SEP between them. Items without the field are skipped.
+ */
+static int
+emit_join(struct mtemplate_run *r, struct mtemplate_call *call,
+    struct mobject **argv, const char **errp)
+{
+	struct miterator *iter;
+	struct miteritem *it;
+	struct mobject *o;
+	char sbuf[RENDER_MO_ALLOC], *alloc;
+	const char *sep;
+	size_t seplen;
+	int ret = 0, first = 1;
+
+	if ((iter = agg_start(argv[0], errp)) == NULL)
+		return -1;
+	if (obj_text(argv[1], sbuf, sizeof(sbuf), &sep, &seplen,
+	    &alloc) != 0) {
+		*errp = "allocation failed";
+		miterator_free(iter);
+		return -1;
+	}
+	while ((it = miterator_next(iter)) != NULL) {
+		o = call_field(call->nargs > 2 ? &call->args[2] : NULL,
+		    it->value);
+		if (o == NULL)
+			continue;
+		if (!first && run_emit(r, sep, seplen) != 0) {
+			*errp = "write error";
+			ret = -1;
+			break;
+		}
+		if ((ret = emit_text(r, o, NULL, errp)) != 0)
+			break;
+		first = 0;
+	}
+	free(alloc);
+	miterator_free(iter);
+	return ret;
+}
+
+/* {upper(X)} */
+static int
+emit_upper(struct mtemplate_run *r, struct mtemplate_call *call,
+    struct mobject **argv, const char **errp)
+{
+	return emit_text(r, argv[0], toupper, errp);
+}
+
+/* {lower(X)} */
+static int
+emit_lower(struct mtemplate_run *r, struct mtemplate_call *call,
+    struct mobject **argv, const char **errp)
+{
+	return emit_text(r, argv[0], tolower, errp);
+}
+
+/* Find the first occurrence of "n" in "h", or NULL */
+static const char *
+find_bytes(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+	const char *cp, *end = h + hlen;
+
+	for (cp = h; nlen <= (size_t)(end - cp); cp++) {
+		if ((cp = memchr(cp, *n, end - cp - nlen + 1)) == NULL)
+			return NULL;
+		if (memcmp(cp, n, nlen) == 0)
+			return cp;
+	}
+	return NULL;
+}
+
+/* {replace(X, FROM, TO)}: X with each occurrence of FROM replaced */
+static int
+emit_replace(struct mtemplate_run *r, struct mtemplate_call *call,
+    struct mobject **argv, const char **errp)
+{
+	char sbuf[3][RENDER_MO_ALLOC], *alloc[3] = { NULL, NULL, NULL };
+	const char *p[3], *cp;
+	size_t len[3], i;
+	int ret = -1;
+
+	*errp = "allocation failed";
+	for (i = 0; i < 3; i++) {
+		if (obj_text(argv[i], sbuf[i], sizeof(sbuf[i]), &p[i], &len[i],
+		    &alloc[i]) != 0)
+			goto out;
+	}
+	if (len[1] == 0) {
+		*errp = "nothing to replace";
+		goto out;
+	}
+	*errp = "write error";
+	while ((cp = find_bytes(p[0], len[0], p[1], len[1])) != NULL) {
+		if (run_emit(r, p[0], cp - p[0]) != 0 ||
+		    run_emit(r, p[2], len[2]) != 0)
+			goto out;
+		len[0] -= cp - p[0] + len[1];
+		p[0] = cp + len[1];
+	}
+	if (run_emit(r, p[0], len[0]) != 0)
+		goto out;
+	ret = 0;
+ out:
+	for (i = 0; i < 3; i++)
+		free(alloc[i]);
+	return ret;
+}
+
+/* Widest field that pad() will fill */
+#define PAD_MAX		(64 * 1024)
+
+/*
+ * {pad(X, WIDTH)} or {pad(X, WIDTH, "FILL")}: X, padded with FILL
+ * (default a space) to at least WIDTH bytes. As with printf(3), X is
+ * right-aligned unless WIDTH is negative.
+ */
+static int
+emit_pad(struct mtemplate_run *r, struct mtemplate_call *call,
+    struct mobject **argv, const char **errp)
+{
+	char sbuf[RENDER_MO_ALLOC], *alloc;
+	const char *p, *fill = " ";
+	size_t len, flen = 1, npad = 0, i;
+	int64_t width;
+	int ret = -1;
+
+	if (mobject_type(argv[1]) != TYPE_MINT ||
+	    (width = mint_value(argv[1])) > PAD_MAX || width < -PAD_MAX) {
+		*errp = "width is not an integer within range";
+		return -1;
+	}
+	if (call->nargs > 2) {
+		if (mobject_type(argv[2]) != TYPE_MSTRING ||
+		    (flen = mstring_len(argv[2])) == 0) {
+			*errp = "fill is not a string";
+			return -1;
+		}
+		fill = (const char *)mstring_ptr(argv[2]);
+	}
+	if (obj_text(argv[0], sbuf, sizeof(sbuf), &p, &len, &alloc) != 0) {
+		*errp = "allocation failed";
+		return -1;
+	}
+	if (len < (size_t)(width < 0 ? -width : width))
+		npad = (size_t)(width < 0 ? -width : width) - len;
+	*errp = "write error";
+	if (width < 0 && run_emit(r, p, len) != 0)
+		goto out;
+	for (i = 0; i < npad; i += flen) {
+		if (run_emit(r, fill, MIN(flen, npad - i)) != 0)
+			goto out;
+	}
+	if (width >= 0 && run_emit(r, p, len) != 0)
+		goto out;
+	ret = 0;
+ out:
+	free(alloc);
+	return ret;
+}
+
+static u_int64_t
+memo_hash(const struct mtemplate_call *call, const struct mobject *arg)
+{
+	u_int64_t h = (u_int64_t)(uintptr_t)arg ^
+	    ((u_int64_t)(uintptr_t)call << 17);
+
+	/* Mix the high bits down, as allocations are aligned */
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 32);
+}
+
+/* Find the memoized result of "call" on "arg", if any */
+static struct mobject *
+memo_lookup(struct mtemplate_run *r, const struct mtemplate_call *call,
+    const struct mobject *arg)
+{
+	struct memo_entry *e;
+	u_int64_t h;
+
+	if (r->memo == NULL)
+		return NULL;
+	h = memo_hash(call, arg) & (r->memo_size - 1);
+	for (e = r->memo[h]; e != NULL; e = e->next) {
+		if (e->call == call && e->arg == arg)
+			return e->result;
+	}
+	return NULL;
+}
+
+/* Remember "result" as the result of "call" on "arg" */
+static int
+memo_insert(struct mtemplate_run *r, const struct mtemplate_call *call,
+    const struct mobject *arg, struct mobject *result)
+{
+	struct memo_entry *e, *next, **tmp;
+	size_t i, n, h;
+
+	if (r->nmemo >= r->memo_size) {
+		n = r->memo_size == 0 ? MEMO_MIN_SIZE : r->memo_size * 2;
+		if ((tmp = calloc(n, sizeof(*tmp))) == NULL)
+			return -1;
+		for (i = 0; i < r->memo_size; i++) {
+			for (e = r->memo[i]; e != NULL; e = next) {
+				next = e->next;
+				h = memo_hash(e->call, e->arg) & (n - 1);
+				e->next = tmp[h];
+				tmp[h] = e;
+			}
+		}
+		free(r->memo);
+		r->memo = tmp;
+		r->memo_size = n;
+	}
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return -1;
+	e->call = call;
+	e->arg = arg;
+	e->result = result;
+	h = memo_hash(call, arg) & (r->memo_size - 1);
+	e->next = r->memo[h];
+	r->memo[h] = e;
+	r->nmemo++;
+	return 0;
+}
+
+/* Keep "o" until the node being run is finished with it */
+static int
+add_temp(struct mtemplate_run *r, struct mobject *o)
 {
-	if (o == NULL)
-		return 0;
-	switch (mobject_type(o)) {
-		case TYPE_MNONE:
-			return 0;
-		case TYPE_MSTRING:
-			return (mstring_len(o) > 0);
-		case TYPE_MINT:
-			return (mint_value(o) != 0);
-		case TYPE_MARRAY:
-			return (marray_len(o) > 0);
-		case TYPE_MDICT:
-			return (mdict_len(o) > 0);
-		default:
-			return 0;
+	struct mobject **tmp;
+	size_t n;
+
+	if (r->ntemps >= r->temps_alloc) {
+		n = r->temps_alloc == 0 ? 16 : r->temps_alloc * 2;
+		if ((tmp = realloc(r->temps, n * sizeof(*tmp))) == NULL)
+			return -1;
+		r->temps = tmp;
+		r->temps_alloc = n;
 	}
+	r->temps[r->ntemps++] = o;
+	return 0;
+}
+
+/* Free the results of calls made since there were "mark" of them */
+static void
+release_temps(struct mtemplate_run *r, size_t mark)
+{
+	while (r->ntemps > mark)
+		mobject_free(r->temps[--r->ntemps]);
 }
 
+static struct mobject *eval_call(struct mtemplate_run *r,
+    struct mtemplate_call *call, u_int lnum, struct loop_scope *scope,
+    char *directive, u_int *memoizedp);
+
+/*
+ * Evaluate a function argument or a term of a condition. "*stablep" is
+ * set if the object lasts for the rest of the run: if it is a literal or
+ * a memoized result, or is found from the namespace.
+ */
 static struct mobject *
-fetch_var(char *name, struct mobject *ns, struct mobject *local_ns,
-    u_int lnum, char *directive, char *ebuf, size_t elen)
+eval_arg(struct mtemplate_run *r, struct call_arg *arg, u_int lnum,
+    struct loop_scope *scope, char *directive, u_int *stablep)
 {
-	char buf[1024];
-	struct mobject *o;
+	if (arg->literal != NULL) {
+		*stablep = 1;
+		return arg->literal;
+	}
+	if (arg->call != NULL)
+		return eval_call(r, arg->call, lnum, scope, directive, stablep);
+	/* Objects reached through loop items may not last */
+	*stablep = !arg->in_loop;
+	return fetch_ref(r, arg->text, arg->ref, lnum, scope, directive);
+}
 
-	/* XXX need better mnamespace_lookup return values */
-	/* Look up in local namespace first */
-	if (mnamespace_lookup(local_ns, name, &o, buf, sizeof(buf)) == 0)
-		return o;
-	/* Try user namespace next */
-	if (ns != NULL &&
-	    mnamespace_lookup(ns, name, &o, buf, sizeof(buf)) == 0)
-		return o;
+/*
+ * Evaluate the arguments of a call into "argv", setting "*memoizep" if
+ * the call may be memoized. Returns 0 on success or -1 on error.
+ */
+static int
+eval_args(struct mtemplate_run *r, struct mtemplate_call *call, u_int lnum,
+    struct loop_scope *scope, char *directive, struct mobject **argv,
+    u_int *memoizep)
+{
+	struct call_arg *arg;
+	u_int memoize = call->fn->memoize, m;
+	size_t i;
+
+	for (i = 0; i < call->nargs; i++) {
+		arg = &call->args[i];
+		if ((argv[i] = eval_arg(r, arg, lnum, scope, directive,
+		    &m)) == NULL)
+			return -1;
+		if (arg->literal == NULL)
+			memoize &= i == 0 && m;
+	}
+	*memoizep = memoize;
+	return 0;
+}
 
-	format_err(lnum, ebuf, elen, "Error in %s: %s", directive, buf);
-	return NULL;
+/*
+ * Evaluate a call to a builtin function. The result belongs to the run:
+ * calls that are memoized keep it until the run is over, and other
+ * results are kept until release_temps(). "*memoizedp", if not NULL, is
+ * set if the result was memoized.
+ */
+static struct mobject *
+eval_call(struct mtemplate_run *r, struct mtemplate_call *call, u_int lnum,
+    struct loop_scope *scope, char *directive, u_int *memoizedp)
+{
+	struct mobject *argv[CALL_MAX_ARGS], *ret;
+	const char *err = NULL;
+	u_int memoize;
+
+	if (eval_args(r, call, lnum, scope, directive, argv, &memoize) != 0)
+		return NULL;
+	if (memoizedp != NULL)
+		*memoizedp = memoize;
+	if (memoize && (ret = memo_lookup(r, call, argv[0])) != NULL)
+		return ret;
+	if ((ret = call->fn->fn(call, argv, &err)) == NULL) {
+		format_err(lnum, r->ebuf, r->elen, "Error in %s: %s(): %s",
+		    directive, call->fn->name, err);
+		return NULL;
+	}
+	if ((memoize ? memo_insert(r, call, argv[0], ret) :
+	    add_temp(r, ret)) != 0) {
+		mobject_free(ret);
+		format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+		    "unable to allocate call result", directive);
+		return NULL;
+	}
+	return ret;
 }
 
+/* Substitute a call to a function that writes its result directly */
 static int
-do_loop(struct mtemplate_node *n, struct miteritem *item,
-    struct mobject *ns, struct mobject *frame, char *ebuf, size_t elen,
-    int (*out_cb)(const char *, void *), void *out_ctx)
+emit_call(struct mtemplate_run *r, struct mtemplate_node *n,
+    struct loop_scope *scope)
 {
-	struct mobject *k, *v;
-	struct mobject *loopvar;
-	int r;
+	struct mobject *argv[CALL_MAX_ARGS];
+	const char *err = NULL;
+	u_int memoize;
 
-	if ((loopvar = mdict_item_s(frame, n->localvar)) == NULL) {
-		format_err(n->lnum, ebuf, elen, "Loop variable missing");
+	if (eval_args(r, n->call, n->lnum, scope, "variable substitution",
+	    argv, &memoize) != 0)
+		return -1;
+	if (n->call->fn->emit(r, n->call, argv, &err) != 0) {
+		format_err(n->lnum, r->ebuf, r->elen, "Error in variable "
+		    "substitution: %s(): %s", n->call->fn->name, err);
 		return -1;
 	}
-	/* Enter the name into the local namespace */
-	if ((k = mobject_deepcopy(item->key)) == NULL) {
-		format_err(n->lnum, ebuf, elen, "Loop key copy failed");
+	return 0;
+}
+
+/* Look up the reference or evaluate the function call in a node's text */
+static struct mobject *
+fetch_var(struct mtemplate_run *r, struct mtemplate_node *n,
+    struct loop_scope *scope, char *directive)
+{
+	if (n->call != NULL)
+		return eval_call(r, n->call, n->lnum, scope, directive, NULL);
+	return fetch_ref(r, n->text, n->ref, n->lnum, scope, directive);
+}
+
+/*
+ * Test whether "member" is in "container": a member of a set, a key of
+ * a dictionary or an item of an array. Sets are hashed; arrays are
+ * scanned. Returns 1 or 0, or -1 if "container" can't be tested.
+ */
+static int
+test_membership(struct mobject *member, struct mobject *container)
+{
+	struct mobject *o;
+	const u_int8_t *p;
+	size_t i, len, plen;
+	int64_t v;
+
+	switch (mobject_type(container)) {
+	case TYPE_MSET:
+		return mset_contains(container, member);
+	case TYPE_MDICT:
+		return mdict_item(container, member) != NULL;
+	case TYPE_MARRAY:
+		len = marray_len(container);
+		for (i = 0; i < len; i++) {
+			/* Items of typed arrays are read without proxies */
+			if (mobject_type(member) == TYPE_MINT) {
+				if (marray_get_int64(container, i, &v) == 0 &&
+				    v == mint_value(member))
+					return 1;
+				continue;
+			}
+			if (mobject_type(member) == TYPE_MSTRING) {
+				if (marray_get_str(container, i,
+				    &p, &plen) == 0 &&
+				    plen == mstring_len(member) &&
+				    memcmp(p, mstring_ptr(member), plen) == 0)
+					return 1;
+				continue;
+			}
+			if ((o = marray_item(container, i)) != NULL &&
+			    mobject_type(o) == mobject_type(member) &&
+			    mobject_cmp(o, member) == 0)
+				return 1;
+		}
+		return 0;
+	default:
 		return -1;
 	}
-	if ((v = mobject_deepcopy(item->value)) == NULL) {
-		mobject_free(k);
-		format_err(n->lnum, ebuf, elen, "Loop value copy failed");
+}
+
+/*
+ * Evaluate node "i" of a compiled condition. Terms are found in place and
+ * results are kept on the stack, so nothing is allocated except by any
+ * function calls. Returns 1 if it is true, 0 if not or -1 on error.
+ */
+static int
+eval_expr(struct mtemplate_run *r, struct mtemplate_expr *expr, size_t i,
+    u_int lnum, struct loop_scope *scope, char *directive)
+{
+	struct expr_node *node = &expr->nodes[i];
+	struct mobject *a, *b;
+	u_int stable;
+	int ret;
+
+	switch (node->op) {
+	case EXPR_NOT:
+		ret = eval_expr(r, expr, node->a, lnum, scope, directive);
+		return ret == -1 ? -1 : !ret;
+	case EXPR_AND:
+	case EXPR_OR:
+		ret = eval_expr(r, expr, node->a, lnum, scope, directive);
+		/* Stop early once the result is known */
+		if (ret == -1 || ret == (node->op == EXPR_OR))
+			return ret;
+		return eval_expr(r, expr, node->b, lnum, scope, directive);
+	default:
+		break;
+	}
+	if ((a = eval_arg(r, &expr->terms[node->a], lnum, scope, directive,
+	    &stable)) == NULL)
 		return -1;
+	if (node->op == EXPR_TEST)
+		return mobject_as_boolean(a);
+	if ((b = eval_arg(r, &expr->terms[node->b], lnum, scope, directive,
+	    &stable)) == NULL)
+		return -1;
+	switch (node->op) {
+	case EXPR_EQ:
+		return mobject_cmp(a, b) == 0;
+	case EXPR_NE:
+		return mobject_cmp(a, b) != 0;
+	case EXPR_IN:
+		if ((ret = test_membership(a, b)) == -1) {
+			format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+			    "right of \"in\" is not a set, dictionary or array",
+			    directive);
+		}
+		return ret;
+	default:
+		break;
 	}
-	if (mdict_replace_s(loopvar, "key", k) == NULL) {
-		mobject_free(k);
-		mobject_free(v);
-		format_err(n->lnum, ebuf, elen, "Loop key insert failed");
+	if (mobject_type(a) != mobject_type(b) ||
+	    (mobject_type(a) != TYPE_MINT && mobject_type(a) != TYPE_MSTRING)) {
+		format_err(lnum, r->ebuf, r->elen, "Error in %s: only two "
+		    "integers or two strings may be ordered", directive);
 		return -1;
 	}
-	if (mdict_replace_s(loopvar, "value", v) == NULL) {
-		mobject_free(v);
-		format_err(n->lnum, ebuf, elen, "Loop value insert failed");
+	ret = mobject_cmp(a, b);
+	switch (node->op) {
+	case EXPR_LT:
+		return ret < 0;
+	case EXPR_LE:
+		return ret <= 0;
+	case EXPR_GT:
+		return ret > 0;
+	default:
+		return ret >= 0;
+	}
+}
+
+/*
+ * Evaluate the condition of an "if" node. Returns 1 if it is true, 0 if
+ * not or -1 on error.
+ */
+static int
+run_condition(struct mtemplate_run *r, struct mtemplate_node *n,
+    struct loop_scope *scope)
+{
+	struct mobject *o, *m;
+	int ret;
+
+	if (n->expr != NULL) {
+		return eval_expr(r, n->expr, n->expr->nnodes - 1, n->lnum,
+		    scope, "\"if\" directive");
+	}
+	if ((o = fetch_var(r, n, scope, "\"if\" directive")) == NULL)
+		return -1;
+	if (n->member == NULL)
+		return mobject_as_boolean(o);
+	if ((m = fetch_ref(r, n->member, n->member_ref, n->lnum, scope,
+	    "\"if\" directive")) == NULL)
 		return -1;
+	if ((ret = test_membership(m, o)) == -1) {
+		format_err(n->lnum, r->ebuf, r->elen, "Error in \"if\" "
+		    "directive: %s is not a set, dictionary or array", n->text);
 	}
-	r = mtemplate_run_nodes(&n->child_nodes, ns, frame, ebuf, elen,
-	    out_cb, out_ctx);
-	return r;
+	return ret;
 }
 
-/* XXX: libmobject should have a non-vis mode */
-#define RENDER_MO_ALLOC 256
+/*
+ * Evaluate the filter of a "for" node against the loop's current item.
+ * The results of any calls it makes are freed before returning, as calls
+ * on loop variables are not memoized. Returns 1 if the item is selected,
+ * 0 if not or -1 on error.
+ */
 static int
-render_mobject(struct mobject *o, u_int lnum, char *ebuf, size_t elen,
-    int (*out_cb)(const char *, void *), void *out_ctx)
+run_filter(struct mtemplate_run *r, struct mtemplate_node *n,
+    struct loop_scope *inner)
 {
-	char *buf, *tmp;
-	size_t need;
+	struct mobject *o;
+	size_t mark = r->ntemps;
+	int ret;
+
+	if (n->filter == NULL)
+		return 1;
+	inner->in_filter = 1;
+	if (n->filter_expr != NULL) {
+		ret = eval_expr(r, n->filter_expr, n->filter_expr->nnodes - 1,
+		    n->lnum, inner, "\"for\" filter");
+	} else {
+		o = fetch_ref(r, n->filter, n->filter_ref, n->lnum, inner,
+		    "\"for\" filter");
+		ret = o == NULL ? -1 : (int)mobject_as_boolean(o);
+	}
+	inner->in_filter = 0;
+	release_temps(r, mark);
+	return ret;
+}
 
-	if (mobject_type(o) == TYPE_MSTRING) {
-		if (out_cb((char *)mstring_ptr(o), out_ctx) != 0) {
-			format_err(lnum, ebuf, elen, "write error");
+/* Prepare the scope of a "for" loop over "o" */
+static void
+enter_loop(struct loop_scope *inner, struct mtemplate_node *n,
+    struct mobject *o, struct loop_scope *scope)
+{
+	bzero(inner, sizeof(*inner));
+	inner->localvar = n->localvar;
+	inner->up = scope;
+	inner->node = n;
+	inner->source = o;
+}
+
+static void
+leave_loop(struct loop_scope *inner)
+{
+	int i;
+
+	for (i = 0; i <= META_MAX; i++) {
+		if (inner->meta[i] != NULL)
+			mobject_free(inner->meta[i]);
+	}
+}
+
+/*
+ * Find the number of items a loop will run its body for: the length of
+ * the object, or if the loop has a filter, the number of its items that
+ * the filter selects, which are counted in a separate pass. Streams can
+ * be read only once and their length is not known in advance, so loop_meta()
+ * doesn't call this for them.
+ */
+static int
+loop_length(struct mtemplate_run *r, struct loop_scope *scope)
+{
+	struct miterator *iter;
+	struct miteritem *item;
+	struct loop_scope tmp;
+	int ret = 0;
+
+	if (scope->node->filter == NULL) {
+		switch (mobject_type(scope->source)) {
+		case TYPE_MARRAY:
+			scope->length = marray_len(scope->source);
+			break;
+		case TYPE_MDICT:
+			scope->length = mdict_len(scope->source);
+			break;
+		case TYPE_MSET:
+			scope->length = mset_len(scope->source);
+			break;
+		default:
 			return -1;
 		}
+		scope->have_length = 1;
 		return 0;
 	}
-	if ((buf = malloc(RENDER_MO_ALLOC)) == NULL) {
-		format_err(lnum, ebuf, elen,
-		    "malloc(%zu) failed for substitution", RENDER_MO_ALLOC);
+	if ((iter = mobject_getiter(scope->source)) == NULL)
 		return -1;
+	enter_loop(&tmp, scope->node, scope->source, scope->up);
+	scope->length = 0;
+	while ((item = miterator_next(iter)) != NULL) {
+		tmp.item = item;
+		if ((ret = run_filter(r, scope->node, &tmp)) == -1)
+			break;
+		scope->length += ret;
 	}
-	need = mobject_to_string(o, buf, RENDER_MO_ALLOC) + 1;
-	if (need >= RENDER_MO_ALLOC) {
-		if ((tmp = realloc(buf, need)) == NULL) {
-			format_err(lnum, ebuf, elen,
-			    "realloc(%zu) failed for substitution", need);
-			free(buf);
+	leave_loop(&tmp);
+	miterator_free(iter);
+	if (ret == -1)
+		return -1;
+	scope->have_length = 1;
+	return 0;
+}
+
+/*
+ * Evaluate a metadata member of the loop variable of "scope" for the
+ * current item. Errors are reported only if "directive" is not NULL.
+ */
+static struct mobject *
+loop_meta(struct mtemplate_run *r, struct loop_scope *scope,
+    enum loop_meta which, u_int lnum, const char *directive)
+{
+	int64_t v;
+
+	if (scope->in_filter) {
+		if (directive != NULL)
+			format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+			    "\"%s.%s\" is not available in a loop filter",
+			    directive, scope->localvar,
+			    loop_meta_names[which]);
+		return NULL;
+	}
+	if ((which == META_LAST || which == META_LENGTH) &&
+	    !scope->have_length && mobject_type(scope->source) == TYPE_MARRAY &&
+	    marray_is_stream(scope->source)) {
+		if (directive != NULL)
+			format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+			    "\"%s.%s\" is not available in a loop over a "
+			    "stream", directive, scope->localvar,
+			    loop_meta_names[which]);
+		return NULL;
+	}
+	if ((which == META_LAST || which == META_LENGTH) &&
+	    !scope->have_length && loop_length(r, scope) != 0) {
+		if (directive != NULL && scope->node->filter == NULL)
+			format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+			    "could not find length of loop \"%s\"",
+			    directive, scope->localvar);
+		return NULL;
+	}
+	switch (which) {
+	case META_FIRST:
+		v = scope->index == 0;
+		break;
+	case META_LAST:
+		v = scope->index + 1 == scope->length;
+		break;
+	case META_INDEX:
+		v = (int64_t)scope->index;
+		break;
+	default:
+		v = (int64_t)scope->length;
+		break;
+	}
+	if (scope->meta[which] == NULL) {
+		if ((scope->meta[which] = mint_new(v)) == NULL &&
+		    directive != NULL)
+			format_err(lnum, r->ebuf, r->elen, "Error in %s: "
+			    "mint_new failed", directive);
+		return scope->meta[which];
+	}
+	/* Update the integer in place rather than allocating another */
+	if (mint_add(scope->meta[which],
+	    v - mint_value(scope->meta[which])) != 0)
+		return NULL;
+	return scope->meta[which];
+}
+
+/*
+ * Gather the items of the dictionary "o" for a sorted "for" into "items",
+ * without copying them, and point "objs" at their sort keys. Items of
+ * virtual dictionaries belong to the iterator and are freed as it
+ * advances, so their keys are copied (setting "*copiedp") and their
+ * values looked up again. Returns the number of items or (size_t)-1 on
+ * error.
+ */
+static size_t
+gather_items(struct mtemplate_run *r, struct mtemplate_node *n,
+    struct mobject *o, struct miteritem *items, struct mobject **objs,
+    size_t len, u_int *copiedp)
+{
+	struct miterator *iter;
+	struct miteritem *it;
+	size_t i;
+
+	if ((iter = mobject_getiter(o)) == NULL)
+		goto fail;
+	for (i = 0; i < len && (it = miterator_next(iter)) != NULL; i++) {
+		if (i == 0)
+			*copiedp = mdict_item(o, it->key) != it->value;
+		if (!*copiedp)
+			items[i] = *it;
+		else if ((items[i].key = mobject_deepcopy(it->key)) == NULL ||
+		    (items[i].value = mdict_item(o, items[i].key)) == NULL) {
+			miterator_free(iter);
+			goto fail;
+		}
+		objs[i] = n->sort_values ? items[i].value : items[i].key;
+	}
+	miterator_free(iter);
+	return i;
+ fail:
+	format_err(n->lnum, r->ebuf, r->elen,
+	    "Error in \"for\": could not fetch items of %s", n->text);
+	return (size_t)-1;
+}
+
+/*
+ * Run a "for" loop over the array or dictionary "o" (which may be a slice
+ * of "source") in sorted order. The loop visits the items through a
+ * permutation of their positions, which is kept for the rest of the run
+ * and reused for as long as "source" remains in that order. Array items
+ * are sorted by value unless "K" was given, and are visited by moving an
+ * iterator to each in turn, so they are keyed by their index in "source"
+ * and items of typed arrays are not given proxies of their own. Streams
+ * are not sorted, as that would mean keeping all of their items.
+ */
+static int
+run_sorted_for(struct mtemplate_run *r, struct mtemplate_node *n,
+    struct mobject *o, struct mobject *source, struct loop_scope *scope)
+{
+	struct miteritem *items = NULL, item;
+	struct miterator *iter = NULL;
+	struct mobject **objs = NULL;
+	struct sort_entry *se;
+	struct loop_scope inner;
+	size_t i, len, nitems, *perm, *tmp;
+	u_int copied = 0, is_array = mobject_type(o) == TYPE_MARRAY;
+	int flags = n->sort_flags, ret = -1;
+
+	if (is_array && marray_is_stream(o)) {
+		format_err(n->lnum, r->ebuf, r->elen, "Error in \"for\": "
+		    "%s is a stream and can't be sorted", n->text);
+		return -1;
+	}
+	if (is_array)
+		len = marray_len(o);
+	else if (mobject_type(o) == TYPE_MDICT)
+		len = mdict_len(o);
+	else {
+		format_err(n->lnum, r->ebuf, r->elen, "Error in \"for\": "
+		    "%s is not an array or dictionary", n->text);
+		return -1;
+	}
+	if ((nitems = len) == 0)
+		return 0;
+	if (!is_array) {
+		if ((items = calloc(len, sizeof(*items))) == NULL ||
+		    (objs = calloc(len, sizeof(*objs))) == NULL) {
+			format_err(n->lnum, r->ebuf, r->elen,
+			    "Error in \"for\": "
+			    "Unable to allocate %zu items", len);
+			goto out;
+		}
+		if ((len = gather_items(r, n, o, items, objs, len,
+		    &copied)) == (size_t)-1)
+			goto out;
+	}
+
+	for (se = r->sorts; se != NULL && se->node != n; se = se->next)
+		;
+	if (se == NULL) {
+		if ((se = calloc(1, sizeof(*se))) == NULL) {
+			format_err(n->lnum, r->ebuf, r->elen,
+			    "Error in \"for\": Unable to allocate sort state");
+			goto out;
+		}
+		se->node = n;
+		se->next = r->sorts;
+		r->sorts = se;
+	}
+	if (se->perm != NULL && se->source == source && se->len == len)
+		flags |= MSORT_KEEP;
+	else {
+		se->source = NULL;
+		if (len > se->len || se->perm == NULL) {
+			if ((tmp = realloc(se->perm,
+			    MAX(len, 1) * sizeof(*tmp))) == NULL) {
+				format_err(n->lnum, r->ebuf, r->elen,
+				    "Error in \"for\": "
+				    "Unable to allocate %zu items", len);
+				goto out;
+			}
+			se->perm = tmp;
+		}
+		se->len = len;
+	}
+	perm = se->perm;
+	if (is_array && n->sort_keys) {
+		for (i = 0; i < len; i++)
+			perm[i] = (flags & MSORT_REVERSE) ? len - 1 - i : i;
+	} else if ((is_array ? marray_sort_order(o, flags, perm) :
+	    mobject_sort_order(objs, len, flags, perm)) != 0) {
+		format_err(n->lnum, r->ebuf, r->elen,
+		    "Error in \"for\": could not sort %s", n->text);
+		goto out;
+	}
+	se->source = source;
+
+	if (is_array && (iter = mobject_getiter(o)) == NULL) {
+		format_err(n->lnum, r->ebuf, r->elen, "Error in \"for\": "
+		    "could not get iterator from object %s", n->text);
+		goto out;
+	}
+	enter_loop(&inner, n, o, scope);
+	inner.item = &item;
+	for (ret = 0, i = 0; i < len; i++) {
+		if (!is_array)
+			item = items[perm[i]];
+		else if (miterator_seek(iter, perm[i]) != 0 ||
+		    (inner.item = miterator_next(iter)) == NULL) {
+			format_err(n->lnum, r->ebuf, r->elen,
+			    "Error in \"for\": could not fetch items of %s",
+			    n->text);
+			ret = -1;
+			break;
+		}
+		if ((ret = run_filter(r, n, &inner)) == 1 &&
+		    (ret = mtemplate_run_nodes(r, &n->child_nodes,
+		    &inner)) == 0)
+			inner.index++;
+		if (ret == -1)
+			break;
+	}
+	leave_loop(&inner);
+	ret = ret == -1 ? -1 : 0;
+ out:
+	if (iter != NULL)
+		miterator_free(iter);
+	if (copied && items != NULL) {
+		for (i = 0; i < nitems && items[i].key != NULL; i++)
+			mobject_free(items[i].key);
+	}
+	free(items);
+	free(objs);
+	return ret;
+}
+
+/* Run a "for" loop over "o" */
+static int
+run_for(struct mtemplate_run *r, struct mtemplate_node *n,
+    struct mobject *o, struct loop_scope *scope)
+{
+	struct mobject *view = NULL;
+	struct miterator *iter;
+	struct miteritem *item;
+	struct loop_scope inner;
+	const char *err;
+	int ret = 0;
+
+	if (n->sliced) {
+		if (mobject_type(o) != TYPE_MARRAY || (view = marray_slice(o,
+		    n->slice_start, n->slice_end)) == NULL) {
+			format_err(n->lnum, r->ebuf, r->elen,
+			    "Error in \"for\": could not slice %s", n->text);
 			return -1;
 		}
-		buf = tmp;
-		mobject_to_string(o, buf, need);
 	}
-	if (out_cb(buf, out_ctx) != 0) {
-		format_err(lnum, ebuf, elen, "write error");
+	if (n->sorted) {
+		ret = run_sorted_for(r, n, view != NULL ? view : o, o, scope);
+		goto out;
+	}
+	if ((iter = mobject_getiter(view != NULL ? view : o)) == NULL) {
+		format_err(n->lnum, r->ebuf, r->elen, "Error in \"for\": "
+		    "could not get iterator from object %s", n->text);
+		ret = -1;
+		goto out;
+	}
+	enter_loop(&inner, n, view != NULL ? view : o, scope);
+	while ((item = miterator_next(iter)) != NULL) {
+		inner.item = item;
+		if ((ret = run_filter(r, n, &inner)) == 1 &&
+		    (ret = mtemplate_run_nodes(r, &n->child_nodes,
+		    &inner)) == 0)
+			inner.index++;
+		if (ret == -1)
+			break;
+	}
+	leave_loop(&inner);
+	miterator_free(iter);
+	/* Streams end early if they can't be read */
+	if (ret != -1 && (err = mvirtual_error(o)) != NULL) {
+		format_err(n->lnum, r->ebuf, r->elen, "Error in \"for\": "
+		    "reading %s: %s", n->text, err);
+		ret = -1;
+	}
+ out:
+	if (view != NULL)
+		mobject_free(view);
+	return ret == -1 ? -1 : 0;
+}
+
+static int
+render_mobject(struct mtemplate_run *r, struct mobject *o, u_int lnum)
+{
+	char sbuf[RENDER_MO_ALLOC], *alloc;
+	const char *p;
+	size_t len;
+	int ret;
+
+	if (obj_text(o, sbuf, sizeof(sbuf), &p, &len, &alloc) != 0) {
+		format_err(lnum, r->ebuf, r->elen,
+		    "malloc failed for substitution");
 		return -1;
 	}
-	free(buf);
-	return 0;
+	if ((ret = run_emit(r, p, len)) != 0)
+		format_err(lnum, r->ebuf, r->elen, "write error");
+	free(alloc);
+	return ret;
 }
 
 static int
-mtemplate_run_nodes(struct mtemplate_nodes *nodes, struct mobject *ns,
-    struct mobject *local_ns, char *ebuf, size_t elen,
-    int (*out_cb)(const char *, void *), void *out_ctx)
+mtemplate_run_nodes(struct mtemplate_run *r, struct mtemplate_nodes *nodes,
+    struct loop_scope *scope)
 {
 	struct mtemplate_node *n;
 	struct mobject *o;
-	struct miterator *iter;
-	struct miteritem *item;
-	struct mobject *frame;
-	int r;
+	size_t mark = r->ntemps;
+	int ret;
 
 	TAILQ_FOREACH(n, nodes, entry) {
+		release_temps(r, mark);
 		switch (n->type) {
 		case NODE_TEXT:
-			if (out_cb(n->text, out_ctx) == EOF) {
-				format_err(n->lnum, ebuf, elen, "write error");
+			if (run_write(r, n->text, n->text_len) != 0) {
+				format_err(n->lnum, r->ebuf, r->elen,
+				    "write error");
 				return -1;
 			}
 			break;
 		case NODE_DIRECTIVE_IF:
-			if ((o = fetch_var(n->text, ns, local_ns, n->lnum,
-			    "\"if\" directive", ebuf, elen)) == NULL)
+			if ((ret = run_condition(r, n, scope)) == -1)
 				return -1;
-			if (mobject_as_boolean(o)) {
-				r = mtemplate_run_nodes(&n->child_nodes, ns,
-				    local_ns, ebuf, elen, out_cb, out_ctx);
+			if (ret) {
+				ret = mtemplate_run_nodes(r, &n->child_nodes,
+				    scope);
 			} else {
-				r = mtemplate_run_nodes(&n->child_nodes_else,
-				    ns, local_ns, ebuf, elen, out_cb, out_ctx);
+				ret = mtemplate_run_nodes(r,
+				    &n->child_nodes_else, scope);
 			}
-			if (r != 0)
-				return r;
+			if (ret != 0)
+				return ret;
 			break;
 		case NODE_DIRECTIVE_FOR:
-			if ((o = fetch_var(n->text, ns, local_ns, n->lnum,
-			    "\"for\" directive", ebuf, elen)) == NULL)
-				return -1;
-			if ((iter = mobject_getiter(o)) == NULL) {
-				format_err(n->lnum, ebuf, elen,
-				    "Error in \"for\": "
-				    "could not get iterator from object %s",
-				    n->text);
+			if ((o = fetch_var(r, n, scope,
+			    "\"for\" directive")) == NULL)
 				return -1;
-			}
-			frame = mobject_deepcopy(local_ns);
-			if (frame == NULL) {
-				format_err(n->lnum, ebuf, elen,
-				    "Could not create local namespace");
-				miterator_free(iter);
-				return -1;
-			}
-			/* Create the loop variable in this frame */
-			if (mdict_replace_sd(frame, n->localvar) == NULL) {
-				format_err(n->lnum, ebuf, elen,
-				    "Could not setup loop variable");
-				mobject_free(frame);
-				miterator_free(iter);
+			if (run_for(r, n, o, scope) != 0)
 				return -1;
-			}
-			while ((item = miterator_next(iter)) != NULL) {
-				if (do_loop(n, item, ns, frame,
-				    ebuf, elen, out_cb, out_ctx) == -1) {
-					miterator_free(iter);
-					mobject_free(frame);
-					return -1;
-				}
-			}
-			miterator_free(iter);
-			mobject_free(frame);
 			break;
 		case NODE_DIRECTIVE_SUBST:
-			if ((o = fetch_var(n->text, ns, local_ns, n->lnum,
-			    "variable substitution", ebuf, elen)) == NULL)
+			if (n->call != NULL && n->call->fn->emit != NULL) {
+				r->escape = *n->escape == '\0' ? NULL : n->escape;
+				ret = emit_call(r, n, scope);
+				r->escape = NULL;
+				if (ret != 0)
+					return -1;
+				break;
+			}
+			if ((o = fetch_var(r, n, scope,
+			    "variable substitution")) == NULL)
 				return -1;
-			if (render_mobject(o, n->lnum, ebuf, elen,
-			    out_cb, out_ctx) == -1)
+			r->escape = *n->escape == '\0' ? NULL : n->escape;
+			ret = render_mobject(r, o, n->lnum);
+			r->escape = NULL;
+			if (ret == -1)
 				return -1;
 			break;
 		default:
-			format_err(n->lnum, ebuf, elen,
+			format_err(n->lnum, r->ebuf, r->elen,
 			    "unsupported node type %s (%d)",
 			    node_type_ntop(n->type), n->type);
 			return -1;
 		}
 	}
+	release_temps(r, mark);
 	return 0;
 }
 
+/*
+ * Run a template, passing output to 'sink' in chunks of up to
+ * RUN_BUF_SIZE bytes. Chunks are always nul-terminated.
+ */
+static int
+mtemplate_run_sink(struct mtemplate *tmpl, struct mobject *ns, char *ebuf,
+    size_t elen, int (*sink)(const char *, size_t, void *), void *sink_ctx)
+{
+	struct mtemplate_run *r;
+	struct memo_entry *e;
+	struct sort_entry *se;
+	size_t i;
+	int ret;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL) {
+		format_err(-1, ebuf, elen, "Unable to allocate run state");
+		return -1;
+	}
+	r->ns = ns;
+	r->ebuf = ebuf;
+	r->elen = elen;
+	r->sink = sink;
+	r->sink_ctx = sink_ctx;
+	escape_init();
+	ret = mtemplate_run_nodes(r, &tmpl->root.child_nodes, NULL);
+	/* Output made before an error is written too, as it was unbuffered */
+	if (run_flush(r) != 0 && ret == 0) {
+		format_err(-1, ebuf, elen, "write error");
+		ret = -1;
+	}
+	release_temps(r, 0);
+	free(r->temps);
+	for (i = 0; i < r->memo_size; i++) {
+		while ((e = r->memo[i]) != NULL) {
+			r->memo[i] = e->next;
+			mobject_free(e->result);
+			free(e);
+		}
+	}
+	free(r->memo);
+	while ((se = r->sorts) != NULL) {
+		r->sorts = se->next;
+		free(se->perm);
+		free(se);
+	}
+	free(r);
+	return ret;
+}
+
+/* Context for passing output to a mtemplate_run_cb() callback */
+struct out_cb_ctx {
+	int (*out_cb)(const char *, void *);
+	void *out_ctx;
+};
+
+static int
+out_cb_sink(const char *buf, size_t len, void *_ctx)
+{
+	struct out_cb_ctx *ctx = (struct out_cb_ctx *)_ctx;
+	size_t l;
+
+	/* Callbacks take strings, so embedded nul bytes are dropped */
+	for (;;) {
+		if (ctx->out_cb(buf, ctx->out_ctx) != 0)
+			return -1;
+		if ((l = strlen(buf)) >= len)
+			return 0;
+		buf += l + 1;
+		len -= l + 1;
+	}
+}
+
 int
 mtemplate_run_cb(struct mtemplate *tmpl, struct mobject *ns, char *ebuf,
     size_t elen, int (*out_cb)(const char *, void *), void *out_ctx)
 {
-	struct mobject *local_ns;
-	int r;
+	struct out_cb_ctx ctx = { out_cb, out_ctx };
 
-	if ((local_ns = mdict_new()) == NULL) {
-		format_err(-1, ebuf, elen,
-		    "Unable to allocate local namespace");
-		return -1;
-	}
-	r = mtemplate_run_nodes(&tmpl->root.child_nodes, ns,
-	    local_ns, ebuf, elen, out_cb, out_ctx);
-	mobject_free(local_ns);
-	return r;
+	return mtemplate_run_sink(tmpl, ns, ebuf, elen, out_cb_sink, &ctx);
 }
 
 static int
-out_stdio_cb(const char *buf, void *ctx)
+out_stdio_sink(const char *buf, size_t len, void *ctx)
 {
-	return fputs(buf, (FILE *)ctx) == EOF ? -1 : 0;
+	return fwrite(buf, 1, len, (FILE *)ctx) == len ? 0 : -1;
 }
 
 int
 mtemplate_run_stdio(struct mtemplate *tmpl, struct mobject *ns, FILE *out,
     char *ebuf, size_t elen)
 {
-	return mtemplate_run_cb(tmpl, ns, ebuf, elen, out_stdio_cb, out);
+	return mtemplate_run_sink(tmpl, ns, ebuf, elen, out_stdio_sink, out);
 }
 
 static int
-out_alloc_cb(const char *buf, void *_ctx)
+out_alloc_sink(const char *buf, size_t addlen, void *_ctx)
 {
 	struct alloc_cb_ctx *ctx = (struct alloc_cb_ctx *)_ctx;
-	size_t addlen = strlen(buf);
 	char *tmp;
 
-	if (addlen == 0)
-		return 0;
 	if (addlen >= ALLOC_MAX || ctx->len + addlen >= ALLOC_MAX)
 		goto out_alloc_cb_err;
 	if (ctx->len + addlen + 1 > ctx->alloc) {
@@ -700,8 +3994,8 @@ out_alloc_cb(const char *buf, void *_ctx)
 			ctx->alloc = MAX(addlen + 1, 256);
 		else {
 			ctx->alloc = MIN((ctx->alloc * 2), ALLOC_MAX);
-			if (ctx->alloc < addlen + 1)
-				ctx->alloc = addlen + 1;
+			if (ctx->alloc < ctx->len + addlen + 1)
+				ctx->alloc = ctx->len + addlen + 1;
 		}
 		if ((tmp = realloc(ctx->s, ctx->alloc)) == NULL)
 			goto out_alloc_cb_err;
@@ -727,7 +4021,7 @@ mtemplate_run_mbuf(struct mtemplate *tmpl, struct mobject *ns, char **outp,
 	int r;
 
 	*outp = NULL;
-	r = mtemplate_run_cb(tmpl, ns, ebuf, elen, out_alloc_cb, &ctx);
+	r = mtemplate_run_sink(tmpl, ns, ebuf, elen, out_alloc_sink, &ctx);
 	if (r == 0)
 		*outp = ctx.s;
 	else
@@ -32,11 +32,37 @@ struct mtemplate;
  * Parse the text 'template', returning a compiled representation suitable
  * for later use by mtemplate_run().
  *
+ * References in the template are compiled into lookup steps with inline
+ * caches. The caches are updated atomically and everything else that
+ * changes during a run is kept by the run, so a compiled template may be
+ * run by several threads at once. The namespaces should not be shared
+ * between them, as looking up items of virtual and typed arrays caches
+ * the items in the arrays.
+ *
  * Returns a compiled template on success, or NULL if parsing.failed. On
  * error, up to 'elen' bytes of error message will be written to 'ebuf'.
  */
 struct mtemplate *mtemplate_parse(const char *text, char *ebuf, size_t elen);
 
+/*
+ * As mtemplate_parse(), but parse the 'len' bytes at 'text', which need
+ * not be nul-terminated. The text is copied once, and the plain text of
+ * the template is used in place from that copy.
+ */
+struct mtemplate *mtemplate_parse2(const char *text, size_t len,
+    char *ebuf, size_t elen);
+
+/*
+ * As mtemplate_parse(), but read the template from the file at 'path'
+ * ("-" for standard input). Regular files are mapped rather than read,
+ * and the plain text of the template is used in place from the mapping,
+ * so the file must not be truncated until the template is freed. Nor
+ * should it be rewritten in place: the changes would show through the
+ * mapping, altering the text that the template outputs.
+ */
+struct mtemplate *mtemplate_parse_file(const char *path, char *ebuf,
+    size_t elen);
+
 /*
  * Frees a compiled template.
  */
@@ -44,7 +70,8 @@ void mtemplate_free(struct mtemplate *tmpl);
 
 /*
  * Run the pre-compiled template 'tmpl', with an libmobject dictionary
- * namespace 'ns'. Output will be written to 'out'.
+ * namespace 'ns'. Output will be written to 'out', in hunks of up to a
+ * few kilobytes; output made before an error is still written.
  *
  * Returns a 0 on success, or -1 on failure. On failue, up to 'elen' bytes of
  * error message will be written to 'ebuf'.
@@ -75,6 +102,12 @@ mtemplate_run_mbuf(struct mtemplate *tmpl, struct mobject *ns, char **outp,
  * the callback must return 0. If the callback returns any other value,
  * template generation will be terminated.
  *
+ * Output is collected in hunks of up to a few kilobytes before it is
+ * passed to the callback, so it may be called less often than there are
+ * pieces of text in the template. Output made before an error is still
+ * passed on. As the callback takes strings, any nul bytes in the output
+ * (e.g. from strings in the namespace) are dropped.
+ *
  * Returns a 0 on success, or -1 on failure. On failue, up to 'elen' bytes of
  * error message will be written to 'ebuf'.
  */
@@ -82,4 +115,27 @@ int
 mtemplate_run_cb(struct mtemplate *tmpl, struct mobject *ns, char *ebuf,
     size_t elen, int (*out_cb)(const char *, void *), void *out_ctx);
 
+/*
+ * Returns every namespace reference that the compiled template 'tmpl' may
+ * read when it is run, without running it. The result is an array of
+ * dictionaries, sorted by path, each containing:
+ *
+ *	"path"		The reference as written in the template
+ *	"line"		Line number of the first use of the reference
+ *	"scope"		"global" if the reference is resolved against the
+ *			namespace passed to mtemplate_run_*(), or "loop" if
+ *			it is relative to an enclosing "for" loop variable
+ *	"loopvar"	Name of the loop variable ("loop" scope only)
+ *	"iterable"	Reference that the loop iterates over, as written
+ *			("loop" scope only)
+ *
+ * A reference is only listed once per scope, so the same path used in
+ * several places appears once. References used as subscripts of others,
+ * e.g. "f.value.owner" in "users[f.value.owner].name", are listed too.
+ *
+ * Returns the array on success, or NULL on failure. It is the caller's
+ * responsibility to deallocate it with mobject_free().
+ */
+struct mobject *mtemplate_references(struct mtemplate *tmpl);
+
 #endif /* _MTEMPLATE_H */
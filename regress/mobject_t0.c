@@ -17,6 +17,12 @@
 
 #include "t_macros.h"
 
+static void
+release_cb(const u_int8_t *p, size_t len, void *ctx)
+{
+	*(u_int *)ctx = len;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -449,6 +455,38 @@ main(int argc, char **argv)
 	mobject_free(marray_obj);
 	printf(".");
 
+	/* Case 43: borrowed strings and release callback */
+	n = 0;
+	assert((mstring_obj = mstring_new_ref(bin, sizeof(bin),
+	    release_cb, &n)) != NULL);
+	assert(mstring_ptr(mstring_obj) == bin);
+	assert(mstring_len(mstring_obj) == sizeof(bin));
+	T_XOTS(mstring_obj, "\\000\\001\\377hello\\363\\000");
+	assert((o2 = mobject_deepcopy(mstring_obj)) != NULL);
+	assert(mstring_ptr(o2) != bin);
+	assert(mobject_cmp(o2, mstring_obj) == 0);
+	mobject_free(o2);
+	assert(n == 0);
+	printf(".");
+
+	/* Case 44: string slices */
+	assert((o2 = mstring_slice(mstring_obj, 3, 5)) != NULL);
+	assert(mstring_ptr(o2) == bin + 3);
+	assert(mstring_len(o2) == 5);
+	assert((k = mstring_new("hello")) != NULL);
+	assert(mobject_cmp(o2, k) == 0);
+	mobject_free(k);
+	mobject_free(o2);
+	assert((o2 = mstring_slice(mstring_obj, 10, 0)) != NULL);
+	assert(mstring_len(o2) == 0);
+	mobject_free(o2);
+	assert(mstring_slice(mstring_obj, 10, 1) == NULL);
+	assert(mstring_slice(mstring_obj, 11, 0) == NULL);
+	assert(n == 0);
+	mobject_free(mstring_obj);
+	assert(n == sizeof(bin));
+	printf(".");
+
 	/* XXX check that functions do not accept inappropriate objects */
 	/* XXX concurrent iterations */
 	/* XXX mdict_*_s function */
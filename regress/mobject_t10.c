@@ -0,0 +1,150 @@
+/*
+ * Regress test for sets
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+#define NITEMS	20000
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *s, *s2, *u, *o;
+	struct miterator *iter;
+	struct miteritem *item;
+	char buf[32], *json;
+	size_t i;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t10:");
+
+	/* Case 1: Add and test members */
+	assert((s = mset_new()) != NULL);
+	assert(mobject_type(s) == TYPE_MSET);
+	assert(mset_len(s) == 0);
+	assert(mset_add_s(s, "a") == 0);
+	assert(mset_add_s(s, "a") == 1);
+	assert(mset_add_i(s, 1) == 0);
+	assert(mset_add_s(s, "1") == 0);
+	assert(mset_add_i(s, 1) == 1);
+	assert((o = mnone_new()) != NULL);
+	assert(mset_add(s, o) == 0);
+	assert(mset_len(s) == 4);
+	assert(mset_contains_s(s, "a"));
+	assert(mset_contains_s(s, "1"));
+	assert(!mset_contains_s(s, "b"));
+	assert((o = mint_new(1)) != NULL);
+	assert(mset_contains(s, o));
+	mobject_free(o);
+	assert((o = marray_new()) != NULL);
+	assert(mset_add(s, o) == -1);
+	assert(!mset_contains(s, o));
+	mobject_free(o);
+	printf(".");
+
+	/* Case 2: Iteration is in insertion order */
+	assert(mset_remove(s, mnone_new()) == 0);
+	assert(mset_remove(s, mnone_new()) == -1);
+	assert(mset_add_s(s, "z") == 0);
+	assert(mset_len(s) == 4);
+	assert((iter = mobject_getiter(s)) != NULL);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 0);
+	assert(strcmp((char *)mstring_ptr(item->value), "a") == 0);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 1);
+	assert(mint_value(item->value) == 1);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(strcmp((char *)mstring_ptr(item->value), "1") == 0);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 3);
+	assert(strcmp((char *)mstring_ptr(item->value), "z") == 0);
+	assert(miterator_next(iter) == NULL);
+	miterator_free(iter);
+	assert(mjson_write_mbuf(s, &json, NULL) == 0);
+	assert(strcmp(json, "[\"a\",1,\"1\",\"z\"]") == 0);
+	free(json);
+	printf(".");
+
+	/* Case 3: Many members, with removals */
+	assert((s2 = mset_new()) != NULL);
+	for (i = 0; i < NITEMS; i++) {
+		snprintf(buf, sizeof(buf), "id%zu", i);
+		assert(mset_add_s(s2, buf) == 0);
+		assert(mset_add_s(s2, buf) == 1);
+		if (i % 3 == 0) {
+			assert((o = mstring_new(buf)) != NULL);
+			assert(mset_remove(s2, o) == 0);
+			mobject_free(o);
+		}
+	}
+	assert(mset_len(s2) == NITEMS - (NITEMS + 2) / 3);
+	for (i = 0; i < NITEMS; i++) {
+		snprintf(buf, sizeof(buf), "id%zu", i);
+		assert(mset_contains_s(s2, buf) == (i % 3 != 0));
+	}
+	assert((iter = mobject_getiter(s2)) != NULL);
+	for (i = 1; (item = miterator_next(iter)) != NULL; i++) {
+		if (i % 3 == 0)
+			i++;
+		snprintf(buf, sizeof(buf), "id%zu", i);
+		assert(strcmp((char *)mstring_ptr(item->value), buf) == 0);
+	}
+	miterator_free(iter);
+	printf(".");
+
+	/* Case 4: Set operations */
+	mobject_free(s2);
+	assert((s2 = mset_new()) != NULL);
+	assert(mset_add_s(s2, "z") == 0);
+	assert(mset_add_s(s2, "y") == 0);
+	assert(mset_add_s(s2, "a") == 0);
+	assert((u = mset_union(s, s2)) != NULL);
+	assert(mjson_write_mbuf(u, &json, NULL) == 0);
+	assert(strcmp(json, "[\"a\",1,\"1\",\"z\",\"y\"]") == 0);
+	free(json);
+	mobject_free(u);
+	assert((u = mset_intersection(s, s2)) != NULL);
+	assert(mjson_write_mbuf(u, &json, NULL) == 0);
+	assert(strcmp(json, "[\"a\",\"z\"]") == 0);
+	free(json);
+	mobject_free(u);
+	assert((u = mset_difference(s, s2)) != NULL);
+	assert(mjson_write_mbuf(u, &json, NULL) == 0);
+	assert(strcmp(json, "[1,\"1\"]") == 0);
+	free(json);
+	mobject_free(u);
+	assert(mset_intersection(s, NULL) == NULL);
+	assert(mset_union(s, mnone_new()) == NULL);
+	printf(".");
+
+	/* Case 5: Copies are independent */
+	assert((u = mobject_deepcopy(s)) != NULL);
+	assert(mset_len(u) == mset_len(s));
+	assert(mset_add_s(u, "new") == 0);
+	assert(!mset_contains_s(s, "new"));
+	assert(mobject_cmp(u, s) != 0);
+	mobject_free(u);
+	mobject_free(s2);
+	mobject_free(s);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Regress test for non-string dictionary keys
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+#define NITEMS	20000
+
+int
+main(int argc, char **argv)
+{
+	static const char *keys[] = { "a", "b" };
+	struct mobject *d, *o, *k;
+	struct miterator *iter;
+	struct miteritem *item;
+	struct mshape *shape;
+	char *json, buf[256];
+	size_t i, len;
+	int64_t last;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t11:");
+
+	/* Case 1: Integer, string and None keys are distinct */
+	assert((d = mdict_new()) != NULL);
+	assert(mdict_insert_i(d, 1, mint_new(10)) != NULL);
+	assert(mdict_insert_ss(d, "1", "one") != NULL);
+	assert((k = mnone_new()) != NULL);
+	assert(mdict_insert(d, k, mint_new(0)) == 0);
+	assert(mdict_len(d) == 3);
+	assert((o = mint_new(11)) != NULL);
+	assert(mdict_insert_i(d, 1, o) == NULL);
+	mobject_free(o);
+	assert((o = mdict_item_i(d, 1)) != NULL);
+	assert(mint_value(o) == 10);
+	assert((o = mdict_item_s(d, "1")) != NULL);
+	assert(mobject_type(o) == TYPE_MSTRING);
+	assert(mdict_item_i(d, 2) == NULL);
+	assert((k = mnone_new()) != NULL);
+	assert((o = mdict_item(d, k)) != NULL);
+	assert(mint_value(o) == 0);
+	mobject_free(k);
+	/* Containers are not hashable */
+	assert((k = marray_new()) != NULL);
+	assert((o = mint_new(1)) != NULL);
+	assert(mdict_insert(d, k, o) == -1);
+	assert(mdict_item(d, k) == NULL);
+	mobject_free(k);
+	mobject_free(o);
+	assert(mdict_replace_i(d, 1, mint_new(12)) != NULL);
+	assert(mint_value(mdict_item_i(d, 1)) == 12);
+	assert(mdict_delete_i(d, 1) == 0);
+	assert(mdict_delete_i(d, 1) == -1);
+	assert(mdict_item_s(d, "1") != NULL);
+	assert(mdict_len(d) == 2);
+	mobject_free(d);
+	printf(".");
+
+	/* Case 2: Many keys, removal and iteration order */
+	assert((d = mdict_new()) != NULL);
+	for (i = 0; i < NITEMS; i++)
+		assert(mdict_insert_i(d, (int64_t)i * 7, mint_new(i)) != NULL);
+	assert(mdict_len(d) == NITEMS);
+	for (i = 0; i < NITEMS; i++) {
+		assert((o = mdict_item_i(d, (int64_t)i * 7)) != NULL);
+		assert(mint_value(o) == (int64_t)i);
+		assert(mdict_item_i(d, (int64_t)i * 7 + 1) == NULL);
+	}
+	for (i = 0; i < NITEMS; i += 2) {
+		assert((o = mdict_remove(d, k = mint_new((int64_t)i * 7)))
+		    != NULL);
+		mobject_free(k);
+		mobject_free(o);
+	}
+	assert(mdict_len(d) == NITEMS / 2);
+	/* Replacing an existing key moves it to the end */
+	assert(mdict_replace_i(d, 7, mint_new(-1)) != NULL);
+	assert((iter = mobject_getiter(d)) != NULL);
+	last = -1;
+	for (len = 0; (item = miterator_next(iter)) != NULL; len++) {
+		assert(mobject_type(item->key) == TYPE_MINT);
+		if (len == NITEMS / 2 - 1) {
+			assert(mint_value(item->key) == 7);
+			assert(mint_value(item->value) == -1);
+			continue;
+		}
+		assert(mint_value(item->key) > last);
+		assert(mint_value(item->key) % 14 == 7);
+		last = mint_value(item->key);
+	}
+	assert(len == NITEMS / 2);
+	miterator_free(iter);
+	mobject_free(d);
+	printf(".");
+
+	/* Case 3: Shaped dictionaries become generic for integer keys */
+	assert((shape = mshape_new(keys, 2)) != NULL);
+	assert((d = mdict_new_shaped(shape)) != NULL);
+	mshape_free(shape);
+	assert(mdict_set_slot(d, 1, mint_new(2)) == 0);
+	assert(mdict_item_i(d, 5) == NULL);
+	assert(mdict_insert_i(d, 5, mint_new(5)) != NULL);
+	assert(mdict_len(d) == 3);
+	assert(mint_value(mdict_item_s(d, "b")) == 2);
+	assert(mint_value(mdict_item_i(d, 5)) == 5);
+	assert(mobject_type(mdict_item_s(d, "a")) == TYPE_MNONE);
+	mobject_free(d);
+	printf(".");
+
+	/* Case 4: JSON output quotes integer keys */
+	assert((d = mdict_new()) != NULL);
+	assert(mdict_insert_i(d, -3, mstring_new("x")) != NULL);
+	assert(mdict_insert_si(d, "y", 4) != NULL);
+	assert(mjson_write_mbuf(d, &json, &len) == 0);
+	assert(strcmp(json, "{\"-3\":\"x\",\"y\":4}") == 0);
+	free(json);
+	assert((k = mnone_new()) != NULL);
+	assert(mdict_insert(d, k, mint_new(1)) == 0);
+	assert(mjson_write_mbuf(d, &json, &len) == -1);
+	mobject_free(d);
+	printf(".");
+
+	/* Case 5: Namespace subscripts look up integer keys */
+	assert((d = mdict_new()) != NULL);
+	assert((o = mdict_insert_sd(d, "users")) != NULL);
+	assert((o = mdict_insert_i(o, 1000, mdict_new())) != NULL);
+	assert(mdict_insert_ss(mdict_item_i(mdict_item_s(d, "users"), 1000),
+	    "name", "djm") != NULL);
+	assert(mnamespace_lookup(d, "users[1000].name", &o, buf, sizeof(buf)) == 0);
+	assert(mstring_len(o) == 3 && memcmp(mstring_ptr(o), "djm", 3) == 0);
+	assert(mnamespace_lookup(d, "users[1001].name", &o, buf, sizeof(buf)) == -1);
+	mobject_free(d);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
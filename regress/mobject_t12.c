@@ -0,0 +1,171 @@
+/*
+ * Regress test for ordered dictionaries
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+#define NITEMS	20011	/* Prime, so i * step % NITEMS permutes */
+
+/* Check that iteration visits keys lo, lo + step, ... below hi */
+static void
+check_range(struct miterator *iter, int64_t lo, int64_t hi, int64_t step)
+{
+	struct miteritem *item;
+	int64_t k;
+
+	for (k = lo; k < hi; k += step) {
+		assert((item = miterator_next(iter)) != NULL);
+		assert(mint_value(item->key) == k);
+		assert(mint_value(item->value) == -k);
+	}
+	assert(miterator_next(iter) == NULL);
+	assert(miterator_next(iter) == NULL);
+	miterator_free(iter);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *d, *d2, *o, *k, *k2;
+	struct miterator *iter;
+	struct miteritem *item;
+	char *json;
+	size_t i, len;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t12:");
+
+	/* Case 1: Keys are kept in order */
+	assert((d = mdict_new_ordered()) != NULL);
+	assert(mobject_type(d) == TYPE_MDICT);
+	assert(mdict_len(d) == 0);
+	assert(mdict_insert_ss(d, "b", "2") != NULL);
+	assert(mdict_insert_i(d, 10, mint_new(-10)) != NULL);
+	assert(mdict_insert_ss(d, "a", "1") != NULL);
+	assert(mdict_insert_i(d, -5, mint_new(5)) != NULL);
+	assert((k = mnone_new()) != NULL);
+	assert(mdict_insert(d, k, mstring_new("none")) == 0);
+	assert((o = mstring_new("x")) != NULL);
+	assert(mdict_insert_s(d, "a", o) == NULL);
+	mobject_free(o);
+	assert(mdict_len(d) == 5);
+	assert(mint_value(mdict_item_i(d, 10)) == -10);
+	assert(mdict_item_i(d, 11) == NULL);
+	assert(mdict_item_s(d, "b") != NULL);
+	assert(mdict_replace_ss(d, "b", "3") != NULL);
+	assert(mdict_len(d) == 5);
+	assert(mjson_write_mbuf(d, &json, &len) == -1);
+	assert(mdict_delete(d, k) == 0);
+	assert(mjson_write_mbuf(d, &json, &len) == 0);
+	assert(strcmp(json, "{\"-5\":5,\"10\":-10,\"a\":\"1\",\"b\":\"3\"}")
+	    == 0);
+	free(json);
+	assert((o = mdict_remove_s(d, "a")) != NULL);
+	mobject_free(o);
+	assert(mdict_remove_s(d, "a") == NULL);
+	assert(mdict_len(d) == 3);
+	mobject_free(d);
+	printf(".");
+
+	/* Case 2: Many keys, inserted and removed out of order */
+	assert((d = mdict_new_ordered()) != NULL);
+	for (i = 0; i < NITEMS; i++) {
+		k2 = mint_new((int64_t)(i * 7919 % NITEMS));
+		assert(k2 != NULL);
+		assert(mdict_insert(d, k2, mint_new(-mint_value(k2))) == 0);
+	}
+	assert(mdict_len(d) == NITEMS);
+	assert((iter = mobject_getiter(d)) != NULL);
+	check_range(iter, 0, NITEMS, 1);
+	/* Remove the odd keys */
+	for (i = 0; i < NITEMS; i++) {
+		if ((i * 104729 % NITEMS) % 2 == 0)
+			continue;
+		assert(mdict_delete_i(d, (int64_t)(i * 104729 % NITEMS)) == 0);
+	}
+	assert(mdict_delete_i(d, 1) == -1);
+	assert(mdict_len(d) == NITEMS / 2 + 1);
+	assert((iter = mobject_getiter(d)) != NULL);
+	check_range(iter, 0, NITEMS, 2);
+	for (i = 0; i < NITEMS; i += 2)
+		assert(mdict_delete_i(d, (int64_t)i) == 0);
+	assert(mdict_len(d) == 0);
+	assert((iter = mobject_getiter(d)) != NULL);
+	assert(miterator_next(iter) == NULL);
+	miterator_free(iter);
+	assert(mdict_insert_i(d, 1, mint_new(-1)) != NULL);
+	assert((iter = mobject_getiter(d)) != NULL);
+	check_range(iter, 1, 2, 1);
+	mobject_free(d);
+	printf(".");
+
+	/* Case 3: Range iteration */
+	assert((d = mdict_new_ordered()) != NULL);
+	for (i = 0; i < NITEMS; i++) {
+		k2 = mint_new((int64_t)(i * 7919 % NITEMS) * 3);
+		assert(k2 != NULL);
+		assert(mdict_insert(d, k2, mint_new(-mint_value(k2))) == 0);
+	}
+	assert((k = mint_new(300)) != NULL);
+	assert((k2 = mint_new(601)) != NULL);
+	check_range(mdict_range(d, k, k2), 300, 601, 3);
+	check_range(mdict_range(d, NULL, k), 0, 300, 3);
+	check_range(mdict_range(d, k2, NULL), 603, NITEMS * 3, 3);
+	check_range(mdict_range(d, k, k), 0, 0, 3);
+	check_range(mdict_range(d, k2, k), 0, 0, 3);
+	mobject_free(k);
+	/* Bounds need not be keys, nor integers */
+	assert((k = mint_new(NITEMS * 3 - 4)) != NULL);
+	check_range(mdict_range(d, k, NULL), NITEMS * 3 - 3, NITEMS * 3, 3);
+	mobject_free(k);
+	assert((k = mstring_new("")) != NULL);
+	check_range(mdict_range(d, k2, k), 603, NITEMS * 3, 3);
+	check_range(mdict_range(d, k, NULL), 0, 0, 3);
+	mobject_free(k);
+	mobject_free(k2);
+	/* Resetting an iterator discards its range */
+	assert((iter = mdict_range(d, NULL, NULL)) != NULL);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(miterator_reset(iter, d) == 0);
+	check_range(iter, 0, NITEMS * 3, 3);
+	assert((o = mdict_new()) != NULL);
+	assert(mdict_range(o, NULL, NULL) == NULL);
+	mobject_free(o);
+	printf(".");
+
+	/* Case 4: Copies are ordered too */
+	assert((d2 = mobject_deepcopy(d)) != NULL);
+	mobject_free(d);
+	assert(mdict_len(d2) == NITEMS);
+	assert(mdict_insert_i(d2, 1, mint_new(-1)) != NULL);
+	assert((k = mint_new(1)) != NULL);
+	assert((k2 = mint_new(3)) != NULL);
+	check_range(mdict_range(d2, k, k2), 1, 2, 1);
+	assert((iter = mdict_range(d2, NULL, k2)) != NULL);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 0);
+	check_range(iter, 1, 2, 1);
+	mobject_free(k);
+	mobject_free(k2);
+	mobject_free(d2);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Regress test for array sorting
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+#define NITEMS	200003	/* Prime, so i * step % NITEMS permutes */
+
+/* Check that the string at "ndx" of "a" is "s" */
+static int
+str_at(struct mobject *a, size_t ndx, const char *s)
+{
+	const u_int8_t *p;
+	size_t len;
+
+	if (marray_get_str(a, ndx, &p, &len) != 0)
+		return 0;
+	return len == strlen(s) && memcmp(p, s, len) == 0;
+}
+
+/* Make a dictionary {"name": name, "n": n, "seq": seq} */
+static struct mobject *
+make_rec(const char *name, int64_t n, int64_t seq)
+{
+	struct mobject *d;
+
+	assert((d = mdict_new()) != NULL);
+	if (name != NULL)
+		assert(mdict_insert_ss(d, "name", name) != NULL);
+	assert(mdict_insert_si(d, "n", n) != NULL);
+	assert(mdict_insert_si(d, "seq", seq) != NULL);
+	return d;
+}
+
+static int64_t
+rec_seq(struct mobject *a, size_t ndx)
+{
+	return mint_value(mdict_item_s(marray_item(a, ndx), "seq"));
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *a, *o, *p0, *p1, *objs[4];
+	size_t i, perm[4];
+	int64_t v, last;
+	char buf[32];
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t13:");
+
+	/* Case 1: Integers, forwards and backwards */
+	assert((a = marray_new()) != NULL);
+	assert(marray_sort(a, NULL, 0) == 0);
+	assert(marray_append_i(a, 5) != NULL);
+	assert(marray_append_i(a, -7) != NULL);
+	assert(marray_append_i(a, INT64_MAX) != NULL);
+	assert(marray_append_i(a, 0) != NULL);
+	assert(marray_append_i(a, INT64_MIN) != NULL);
+	assert(marray_sort(a, NULL, 0) == 0);
+	assert(mint_value(marray_item(a, 0)) == INT64_MIN);
+	assert(mint_value(marray_item(a, 1)) == -7);
+	assert(mint_value(marray_item(a, 2)) == 0);
+	assert(mint_value(marray_item(a, 3)) == 5);
+	assert(mint_value(marray_item(a, 4)) == INT64_MAX);
+	assert(marray_sort(a, NULL, MSORT_REVERSE) == 0);
+	assert(mint_value(marray_item(a, 0)) == INT64_MAX);
+	assert(mint_value(marray_item(a, 4)) == INT64_MIN);
+	assert(marray_sort(a, NULL, MSORT_NUMERIC | MSORT_STRING) == -1);
+	/* As strings, "-7" < "-9223372036854775808" < "0" < "5" < "9..." */
+	assert(marray_sort(a, NULL, MSORT_STRING) == 0);
+	assert(mint_value(marray_item(a, 0)) == -7);
+	assert(mint_value(marray_item(a, 1)) == INT64_MIN);
+	assert(mint_value(marray_item(a, 4)) == INT64_MAX);
+	mobject_free(a);
+	printf(".");
+
+	/* Case 2: Strings, mixed types and typed arrays */
+	assert((a = marray_new()) != NULL);
+	assert(marray_append_s(a, "pear") != NULL);
+	assert(marray_append_s(a, "10") != NULL);
+	assert(marray_append_s(a, "apple") != NULL);
+	assert(marray_append_s(a, "9") != NULL);
+	assert(marray_sort(a, NULL, 0) == 0);
+	assert(str_at(a, 0, "10") && str_at(a, 1, "9"));
+	assert(str_at(a, 2, "apple") && str_at(a, 3, "pear"));
+	assert(marray_sort(a, NULL, MSORT_NUMERIC) == 0);
+	/* Non-numeric strings are zero; the sort is stable */
+	assert(str_at(a, 0, "apple") && str_at(a, 1, "pear"));
+	assert(str_at(a, 2, "9") && str_at(a, 3, "10"));
+	assert(marray_append_i(a, 3) != NULL);
+	assert(marray_append_n(a) != NULL);
+	assert(marray_sort(a, NULL, 0) == 0);
+	assert(mobject_type(marray_item(a, 0)) == TYPE_MNONE);
+	assert(mint_value(marray_item(a, 1)) == 3);
+	assert(str_at(a, 2, "10") && str_at(a, 5, "pear"));
+	mobject_free(a);
+	/* Typed arrays stay typed, and their proxies move with the items */
+	assert((a = marray_new_strings()) != NULL);
+	assert(marray_append_str(a, "b", 1) == 0);
+	assert(marray_append_str(a, "c", 1) == 0);
+	assert(marray_append_str(a, "a", 1) == 0);
+	assert((p0 = marray_item(a, 0)) != NULL);
+	assert(marray_sort(a, NULL, MSORT_REVERSE) == 0);
+	assert(str_at(a, 0, "c") && str_at(a, 1, "b") && str_at(a, 2, "a"));
+	assert(marray_item(a, 1) == p0);
+	assert(mstring_len(p0) == 1 && *mstring_ptr(p0) == 'b');
+	mobject_free(a);
+	assert((a = marray_new_int64()) != NULL);
+	for (i = 0; i < 1000; i++)
+		assert(marray_append_int64(a, (int64_t)(i * 7 % 1000) - 500) == 0);
+	assert((p1 = marray_item(a, 1)) != NULL);
+	v = mint_value(p1);
+	assert(marray_sort(a, NULL, 0) == 0);
+	for (i = 0; i < 1000; i++) {
+		assert(marray_get_int64(a, i, &last) == 0);
+		assert(last == (int64_t)i - 500);
+	}
+	assert(mint_value(p1) == v);
+	assert(marray_item(a, (size_t)(v + 500)) == p1);
+	mobject_free(a);
+	printf(".");
+
+	/* Case 3: Sorting by key path */
+	assert((a = marray_new()) != NULL);
+	assert(marray_append(a, make_rec("carol", 2, 0)) == 0);
+	assert(marray_append(a, make_rec("alice", 10, 1)) == 0);
+	assert(marray_append(a, make_rec(NULL, 2, 2)) == 0);
+	assert(marray_append(a, make_rec("bob", 1, 3)) == 0);
+	assert(marray_append(a, make_rec("alice", 2, 4)) == 0);
+	assert(marray_sort(a, "name", 0) == 0);
+	/* Missing keys first; equal keys keep their order */
+	assert(rec_seq(a, 0) == 2 && rec_seq(a, 1) == 1 &&
+	    rec_seq(a, 2) == 4 && rec_seq(a, 3) == 3 && rec_seq(a, 4) == 0);
+	assert(marray_sort(a, "n", MSORT_REVERSE) == 0);
+	assert(rec_seq(a, 0) == 1 && rec_seq(a, 1) == 2 &&
+	    rec_seq(a, 2) == 4 && rec_seq(a, 3) == 0 && rec_seq(a, 4) == 3);
+	assert(marray_sort(a, "n", MSORT_STRING) == 0);
+	assert(rec_seq(a, 0) == 3 && rec_seq(a, 1) == 1 &&
+	    rec_seq(a, 2) == 2 && rec_seq(a, 3) == 4 && rec_seq(a, 4) == 0);
+	mobject_free(a);
+	/* Paths through nested objects */
+	assert((a = marray_new()) != NULL);
+	for (i = 0; i < 3; i++) {
+		assert((o = marray_append_d(a)) != NULL);
+		assert((o = mdict_insert_sa(o, "x")) != NULL);
+		assert(marray_append_i(o, 9) != NULL);
+		assert(marray_append_i(o, (int64_t)(i * 2 % 3)) != NULL);
+	}
+	assert(marray_sort(a, "x[1]", MSORT_REVERSE) == 0);
+	for (i = 0; i < 3; i++) {
+		o = marray_item(mdict_item_s(marray_item(a, i), "x"), 1);
+		assert(mint_value(o) == 2 - (int64_t)i);
+	}
+	mobject_free(a);
+	printf(".");
+
+	/* Case 4: Large arrays */
+	assert((a = marray_new()) != NULL);
+	for (i = 0; i < NITEMS; i++) {
+		snprintf(buf, sizeof(buf), "%08zu", i * 7919 % NITEMS);
+		assert(marray_append_s(a, buf) != NULL);
+	}
+	assert(marray_sort(a, NULL, 0) == 0);
+	for (i = 0; i < NITEMS; i++) {
+		snprintf(buf, sizeof(buf), "%08zu", i);
+		assert(str_at(a, i, buf));
+	}
+	assert(marray_sort(a, NULL, MSORT_REVERSE) == 0);
+	for (i = 0; i < NITEMS; i++) {
+		snprintf(buf, sizeof(buf), "%08zu", NITEMS - 1 - i);
+		assert(str_at(a, i, buf));
+	}
+	mobject_free(a);
+	/* Stability across threads, with many equal keys */
+	assert((a = marray_new()) != NULL);
+	for (i = 0; i < NITEMS; i++) {
+		snprintf(buf, sizeof(buf), "%zu", i * 7919 % 10);
+		assert(marray_append(a, make_rec(buf, 0, (int64_t)i)) == 0);
+	}
+	assert(marray_sort(a, "name", 0) == 0);
+	for (i = 1; i < NITEMS; i++) {
+		o = mdict_item_s(marray_item(a, i), "name");
+		p0 = mdict_item_s(marray_item(a, i - 1), "name");
+		assert(mobject_cmp(p0, o) < 0 ||
+		    (mobject_cmp(p0, o) == 0 && rec_seq(a, i - 1) <
+		    rec_seq(a, i)));
+	}
+	mobject_free(a);
+	assert((a = marray_new_int64()) != NULL);
+	for (i = 0; i < NITEMS; i++) {
+		v = (int64_t)(i * 7919 % NITEMS) * 1000003 - 100000000000LL;
+		assert(marray_append_int64(a, v) == 0);
+	}
+	assert(marray_sort(a, NULL, MSORT_REVERSE) == 0);
+	for (i = 0, last = INT64_MAX; i < NITEMS; i++) {
+		assert(marray_get_int64(a, i, &v) == 0);
+		assert(v < last);
+		last = v;
+	}
+	mobject_free(a);
+	printf(".");
+
+	/* Case 5: Permutations */
+	assert((a = marray_new()) != NULL);
+	assert(marray_append_i(a, 0) != NULL);
+	assert(marray_append_i(a, 1) != NULL);
+	assert(marray_append_i(a, 2) != NULL);
+	perm[0] = 2;
+	perm[1] = 0;
+	perm[2] = 2;
+	assert(marray_permute(a, perm) == -1);
+	perm[2] = 1;
+	assert(marray_permute(a, perm) == 0);
+	assert(mint_value(marray_item(a, 0)) == 2);
+	assert(mint_value(marray_item(a, 1)) == 0);
+	assert(mint_value(marray_item(a, 2)) == 1);
+	perm[0] = 3;
+	assert(marray_permute(a, perm) == -1);
+	mobject_free(a);
+	assert((a = marray_new_range(0, 3, 1)) != NULL);
+	assert(marray_sort(a, NULL, MSORT_REVERSE) == -1);
+	mobject_free(a);
+	printf(".");
+
+	/* Case 6: Sort orders of objects that are not moved */
+	assert((objs[0] = mstring_new("10")) != NULL);
+	assert((objs[1] = mint_new(9)) != NULL);
+	assert((objs[2] = mstring_new("100")) != NULL);
+	objs[3] = NULL;
+	assert(mobject_sort_order(objs, 4, MSORT_NUMERIC, perm) == 0);
+	assert(perm[0] == 3 && perm[1] == 1 && perm[2] == 0 && perm[3] == 2);
+	assert(mobject_sort_order(objs, 3, MSORT_STRING | MSORT_REVERSE,
+	    perm) == 0);
+	assert(perm[0] == 1 && perm[1] == 2 && perm[2] == 0);
+	/* A kept order is checked and replaced if it no longer holds */
+	assert(mobject_sort_order(objs, 3, MSORT_STRING | MSORT_REVERSE |
+	    MSORT_KEEP, perm) == 0);
+	assert(perm[0] == 1 && perm[1] == 2 && perm[2] == 0);
+	mobject_free(objs[1]);
+	assert((objs[1] = mint_new(0)) != NULL);
+	assert(mobject_sort_order(objs, 3, MSORT_STRING | MSORT_REVERSE |
+	    MSORT_KEEP, perm) == 0);
+	assert(perm[0] == 2 && perm[1] == 0 && perm[2] == 1);
+	perm[0] = 7;
+	assert(mobject_sort_order(objs, 3, MSORT_NUMERIC | MSORT_KEEP,
+	    perm) == 0);
+	assert(perm[0] == 1 && perm[1] == 0 && perm[2] == 2);
+	assert(mobject_sort_order(objs, 3, MSORT_NUMERIC | MSORT_STRING,
+	    perm) == -1);
+	for (i = 0; i < 3; i++)
+		mobject_free(objs[i]);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
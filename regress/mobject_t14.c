@@ -0,0 +1,164 @@
+/*
+ * Regress test for array slices and selections
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+/* Check that iterating over "a" yields keys from "first" to "last" */
+static void
+check_keys(struct mobject *a, int64_t first, int64_t last)
+{
+	struct miterator *iter;
+	struct miteritem *item;
+	int64_t k = first;
+
+	assert((iter = mobject_getiter(a)) != NULL);
+	while ((item = miterator_next(iter)) != NULL) {
+		assert(mint_value(item->key) == k);
+		k++;
+	}
+	assert(k == last + 1);
+	miterator_free(iter);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *a, *s, *s2, *o;
+	const u_int8_t *p;
+	size_t len;
+	struct miterator *iter;
+	struct miteritem *item;
+	size_t ndx[] = { 7, 2, 1 };
+	int64_t v;
+	int i;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t14:");
+
+	/* Case 1: Slices of an ordinary array */
+	assert((a = marray_new()) != NULL);
+	for (i = 0; i < 10; i++)
+		assert(marray_append_i(a, i * 10) != NULL);
+	assert((s = marray_slice(a, 3, 6)) != NULL);
+	assert(mobject_type(s) == TYPE_MARRAY);
+	assert(marray_len(s) == 3);
+	assert(marray_item(s, 0) == marray_item(a, 3));
+	X_INT_AT_ARRAY(s, 2, 50);
+	assert(marray_item(s, 3) == NULL);
+	assert(marray_get_int64(s, 1, &v) == 0 && v == 40);
+	check_keys(s, 3, 5);
+	/* Slices are read-only */
+	assert(marray_append_i(s, 1) == NULL);
+	assert(marray_len(a) == 10);
+	/* Copies are ordinary arrays */
+	assert((o = mobject_deepcopy(s)) != NULL);
+	assert(marray_len(o) == 3);
+	assert(mobject_cmp(o, s) == 0);
+	assert(marray_append_i(o, 1) != NULL);
+	mobject_free(o);
+	mobject_free(s);
+	printf(".");
+
+	/* Case 2: Windows are clipped to the array as it is used */
+	assert((s = marray_slice(a, 8, SIZE_MAX)) != NULL);
+	assert(marray_len(s) == 2);
+	check_keys(s, 8, 9);
+	assert(marray_append_i(a, 100) != NULL);
+	assert(marray_len(s) == 3);
+	X_INT_AT_ARRAY(s, 2, 100);
+	assert((s2 = marray_slice(a, 20, 30)) != NULL);
+	assert(marray_len(s2) == 0);
+	assert(marray_item(s2, 0) == NULL);
+	check_keys(s2, 20, 19);
+	mobject_free(s2);
+	assert((s2 = marray_slice(a, 5, 2)) != NULL);
+	assert(marray_len(s2) == 0);
+	mobject_free(s2);
+	/* Slices of slices view the original array */
+	assert((s2 = marray_slice(s, 1, 10)) != NULL);
+	assert(marray_len(s2) == 2);
+	X_INT_AT_ARRAY(s2, 0, 90);
+	check_keys(s2, 9, 10);
+	mobject_free(s2);
+	mobject_free(s);
+	mobject_free(a);
+	printf(".");
+
+	/* Case 3: Slices of typed arrays and ranges */
+	assert((a = marray_new_strings()) != NULL);
+	assert(marray_append_str(a, "zero", 4) == 0);
+	assert(marray_append_str(a, "one", 3) == 0);
+	assert(marray_append_str(a, "two", 3) == 0);
+	assert((s = marray_slice(a, 1, 3)) != NULL);
+	assert(marray_get_str(s, 1, &p, &len) == 0);
+	assert(len == 3 && memcmp(p, "two", 3) == 0);
+	assert((o = marray_item(s, 0)) != NULL);
+	assert(mstring_len(o) == 3 && memcmp(mstring_ptr(o), "one", 3) == 0);
+	check_keys(s, 1, 2);
+	mobject_free(s);
+	mobject_free(a);
+	assert((a = marray_new_range(0, 1000000, 2)) != NULL);
+	assert((s = marray_slice(a, 1000, 1010)) != NULL);
+	assert(marray_len(s) == 10);
+	X_INT_AT_ARRAY(s, 9, 2018);
+	check_keys(s, 1000, 1009);
+	mobject_free(s);
+	mobject_free(a);
+	assert((a = mdict_new()) != NULL);
+	assert(marray_slice(a, 0, 1) == NULL);
+	mobject_free(a);
+	printf(".");
+
+	/* Case 4: Selections */
+	assert((a = marray_new_range(0, 100, 10)) != NULL);
+	assert((s = marray_select(a, ndx, 3)) != NULL);
+	assert(marray_len(s) == 3);
+	X_INT_AT_ARRAY(s, 0, 70);
+	X_INT_AT_ARRAY(s, 2, 10);
+	assert(marray_get_int64(s, 1, &v) == 0 && v == 20);
+	assert((iter = mobject_getiter(s)) != NULL);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 7 && mint_value(item->value) == 70);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 2 && mint_value(item->value) == 20);
+	miterator_free(iter);
+	/* Selections from selections and slices view the original array */
+	assert((s2 = marray_select(s, ndx + 1, 2)) != NULL);
+	X_INT_AT_ARRAY(s2, 0, 10);
+	X_INT_AT_ARRAY(s2, 1, 20);
+	mobject_free(s2);
+	assert(marray_select(s, ndx, 3) == NULL);
+	mobject_free(s);
+	assert((s = marray_slice(a, 5, 10)) != NULL);
+	assert((s2 = marray_select(s, ndx + 1, 2)) != NULL);
+	X_INT_AT_ARRAY(s2, 0, 70);
+	X_INT_AT_ARRAY(s2, 1, 60);
+	mobject_free(s2);
+	assert(marray_select(s, ndx, 1) == NULL);
+	mobject_free(s);
+	assert((s = marray_select(a, NULL, 0)) != NULL);
+	assert(marray_len(s) == 0);
+	mobject_free(s);
+	mobject_free(a);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
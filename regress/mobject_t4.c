@@ -0,0 +1,115 @@
+/*
+ * Regress test for mobject JSON serialisation
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+/* Expect object to serialise to JSON string */
+#define T_JSON(o, s) do { \
+		char *xj; \
+		size_t xl; \
+		assert(mjson_write_mbuf(o, &xj, &xl) == 0); \
+		assert(xl == strlen(s)); \
+		assert(strcmp(xj, s) == 0); \
+		free(xj); \
+	} while (0)
+
+static int
+count_cb(const void *buf, size_t len, void *ctx)
+{
+	*(size_t *)ctx += len;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *o, *a, *d;
+	struct mjson_writer *w;
+	size_t i, n;
+	u_int8_t bin[8] = { 'a', '"', '\\', '\n', 0x01, 0x7f, 0xc3, 0xa9 };
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t4:");
+
+	/* Case 1: scalars */
+	T_JSON(mnone_new(), "null");
+	assert((o = mint_new(-9223372036854775807LL - 1)) != NULL);
+	T_JSON(o, "-9223372036854775808");
+	mobject_free(o);
+	assert((o = mint_new(0)) != NULL);
+	T_JSON(o, "0");
+	mobject_free(o);
+	printf(".");
+
+	/* Case 2: string escaping */
+	assert((o = mstring_new2(bin, sizeof(bin))) != NULL);
+	T_JSON(o, "\"a\\\"\\\\\\n\\u0001\x7f\xc3\xa9\"");
+	mobject_free(o);
+	printf(".");
+
+	/* Case 3: arrays */
+	X_ARRAY_FILL(o);
+	T_JSON(o, "[\"pqr\",4,3,\"klm\",\"abc\",1,null,2,\"def\",\"hij\",null]");
+	mobject_free(o);
+	assert((o = marray_new()) != NULL);
+	T_JSON(o, "[]");
+	mobject_free(o);
+	printf(".");
+
+	/* Case 4: dictionaries */
+	X_DICT_FILL(o);
+	T_JSON(o, "{\"a\":null,\"b\":\"abc\",\"c\":\"def\",\"d\":-64,\"e\":42}");
+	mobject_free(o);
+	assert((o = mdict_new()) != NULL);
+	T_JSON(o, "{}");
+	printf(".");
+
+	/* Case 5: nesting */
+	assert((a = mdict_insert_sa(o, "x")) != NULL);
+	assert((d = marray_append_d(a)) != NULL);
+	assert(marray_append_a(a) != NULL);
+	assert(mdict_insert_sd(d, "y") != NULL);
+	assert(mdict_insert_si(d, "z", 1) != NULL);
+	assert(mdict_insert_sn(o, "w") != NULL);
+	T_JSON(o, "{\"x\":[{\"y\":{},\"z\":1},[]],\"w\":null}");
+	mobject_free(o);
+	printf(".");
+
+	/* Case 6: deep nesting does not recurse */
+	assert((o = marray_new()) != NULL);
+	for (a = o, i = 0; i < 50000; i++)
+		assert((a = marray_append_a(a)) != NULL);
+	n = 0;
+	assert((w = mjson_writer_new(count_cb, &n)) != NULL);
+	assert(mjson_write(w, o) == 0);
+	assert(n == 2 * 50001);
+	printf(".");
+
+	/* Case 7: writer reuse */
+	n = 0;
+	assert(mjson_write(w, o) == 0);
+	assert(n == 2 * 50001);
+	mjson_writer_free(w);
+	mobject_free(o);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * Regress test for virtual mobject arrays and dictionaries
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+/* Provider state: "n" items, with counts of callback invocations */
+struct vctx {
+	size_t n;
+	size_t fetches;
+	size_t freed;
+};
+
+static size_t
+v_len(void *ctx)
+{
+	return ((struct vctx *)ctx)->n;
+}
+
+/* Array of squares */
+static struct mobject *
+v_array_item(void *ctx, size_t ndx)
+{
+	struct vctx *v = (struct vctx *)ctx;
+
+	v->fetches++;
+	return ndx < v->n ? mint_new(ndx * ndx) : NULL;
+}
+
+/* Array whose odd items can't be fetched */
+static struct mobject *
+v_even_item(void *ctx, size_t ndx)
+{
+	return ndx % 2 == 0 ? mint_new(ndx) : NULL;
+}
+
+/* Stream of 0 .. N-1 */
+static int
+v_array_next(void *ctx, size_t *pos, struct mobject **keyp,
+    struct mobject **valuep)
+{
+	if (*pos >= ((struct vctx *)ctx)->n ||
+	    (*valuep = mint_new(*pos)) == NULL)
+		return -1;
+	(*pos)++;
+	return 0;
+}
+
+/* Dictionary of "kN" => N */
+static struct mobject *
+v_dict_item(void *ctx, const struct mobject *key)
+{
+	struct vctx *v = (struct vctx *)ctx;
+	const char *s;
+	char *ep;
+	u_long n;
+
+	v->fetches++;
+	if (mobject_type(key) != TYPE_MSTRING)
+		return NULL;
+	s = (const char *)mstring_ptr(key);
+	if (s[0] != 'k' || s[1] == '\0')
+		return NULL;
+	n = strtoul(s + 1, &ep, 10);
+	if (*ep != '\0' || n >= v->n)
+		return NULL;
+	return mint_new(n);
+}
+
+static int
+v_dict_next(void *ctx, size_t *pos, struct mobject **keyp,
+    struct mobject **valuep)
+{
+	struct vctx *v = (struct vctx *)ctx;
+	char key[32];
+
+	if (*pos >= v->n)
+		return -1;
+	snprintf(key, sizeof(key), "k%zu", *pos);
+	if ((*keyp = mstring_new(key)) == NULL)
+		return -1;
+	if ((*valuep = mint_new(*pos)) == NULL) {
+		mobject_free(*keyp);
+		return -1;
+	}
+	(*pos)++;
+	return 0;
+}
+
+static void
+v_free(void *ctx)
+{
+	((struct vctx *)ctx)->freed++;
+}
+
+static const struct mvirtual_ops array_ops = {
+	v_len, v_array_item, NULL, NULL, v_free
+};
+
+static const struct mvirtual_ops dict_ops = {
+	v_len, NULL, v_dict_item, v_dict_next, v_free
+};
+
+static const struct mvirtual_ops even_ops = {
+	v_len, v_even_item, NULL, NULL, NULL
+};
+
+static const struct mvirtual_ops stream_ops = {
+	v_len, NULL, NULL, v_array_next, NULL
+};
+
+/* C structures exposed via mstruct descriptors */
+struct tag {
+	int64_t id;
+	char *label;
+};
+
+struct user {
+	int64_t uid;
+	char *name;
+	struct tag primary;
+	struct tag *tags;
+	size_t ntags;
+};
+
+static const struct mstruct_field tag_fields[] = {
+	{ "id", MSTRUCT_INT64, offsetof(struct tag, id), NULL, 0 },
+	{ "label", MSTRUCT_STRING, offsetof(struct tag, label), NULL, 0 },
+};
+static const struct mstruct_desc tag_desc = {
+	sizeof(struct tag), 2, tag_fields
+};
+
+static const struct mstruct_field user_fields[] = {
+	{ "uid", MSTRUCT_INT64, offsetof(struct user, uid), NULL, 0 },
+	{ "name", MSTRUCT_STRING, offsetof(struct user, name), NULL, 0 },
+	{ "primary", MSTRUCT_STRUCT, offsetof(struct user, primary),
+	    &tag_desc, 0 },
+	{ "tags", MSTRUCT_ARRAY, offsetof(struct user, tags),
+	    &tag_desc, offsetof(struct user, ntags) },
+};
+static const struct mstruct_desc user_desc = {
+	sizeof(struct user), 4, user_fields
+};
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *o, *a, *d, *ns, *x;
+	struct miterator *iter;
+	struct miteritem *item;
+	struct vctx actx, dctx;
+	struct tag tags[] = { { 10, "a" }, { 11, NULL } };
+	struct user users[] = {
+		{ 1000, "djm", { 1, "one" }, tags, 2 },
+		{ 1001, "bob", { 2, "two" }, NULL, 0 },
+	};
+	char ebuf[256];
+	size_t i;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t5:");
+
+	bzero(&actx, sizeof(actx));
+	bzero(&dctx, sizeof(dctx));
+	actx.n = 1000;
+	dctx.n = 5;
+
+	/* Case 1: Create virtual objects */
+	assert(mvirtual_new(TYPE_MINT, &array_ops, &actx) == NULL);
+	assert(mvirtual_new(TYPE_MDICT, &array_ops, &actx) == NULL);
+	assert((a = mvirtual_new(TYPE_MARRAY, &array_ops, &actx)) != NULL);
+	assert((d = mvirtual_new(TYPE_MDICT, &dict_ops, &dctx)) != NULL);
+	assert(mobject_type(a) == TYPE_MARRAY);
+	assert(mobject_type(d) == TYPE_MDICT);
+	assert(actx.fetches == 0 && dctx.fetches == 0);
+	printf(".");
+
+	/* Case 2: Array access fetches on demand and caches items */
+	assert(marray_len(a) == 1000);
+	assert(actx.fetches == 0);
+	assert((o = marray_item(a, 7)) != NULL);
+	assert(mint_value(o) == 49);
+	assert(actx.fetches == 1);
+	assert(marray_item(a, 7) == o);
+	assert(actx.fetches == 1);
+	assert(marray_item(a, 1000) == NULL);
+	assert(mint_value(marray_first(a)) == 0);
+	assert(mint_value(marray_last(a)) == 999 * 999);
+	printf(".");
+
+	/* Case 3: Dictionary access */
+	assert(mdict_len(d) == 5);
+	assert((o = mdict_item_s(d, "k3")) != NULL);
+	assert(mint_value(o) == 3);
+	i = dctx.fetches;
+	assert(mdict_item_s(d, "k3") == o);
+	assert(dctx.fetches == i);
+	assert(mdict_item_s(d, "k5") == NULL);
+	assert(mdict_item_s(d, "x") == NULL);
+	printf(".");
+
+	/* Case 4: Virtual objects are read-only */
+	assert(marray_append_i(a, 1) == NULL);
+	assert(marray_prepend_i(a, 1) == NULL);
+	assert(marray_len(a) == 1000);
+	assert(mdict_insert_si(d, "k9", 9) == NULL);
+	assert(mdict_replace_si(d, "k1", 9) == NULL);
+	assert(mint_value(mdict_item_s(d, "k1")) == 1);
+	printf(".");
+
+	/* Case 5: Array iteration */
+	assert((iter = mobject_getiter(a)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(mint_value(item->key) == (int64_t)i);
+		assert(mint_value(item->value) == (int64_t)(i * i));
+	}
+	assert(i == 1000);
+	miterator_free(iter);
+	printf(".");
+
+	/* Case 6: Dictionary iteration uses the "next" callback */
+	i = dctx.fetches;
+	assert((iter = mobject_getiter(d)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(mobject_type(item->key) == TYPE_MSTRING);
+		assert(mint_value(item->value) == (int64_t)i);
+	}
+	assert(i == 5);
+	assert(miterator_reset(iter, d) == 0);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(strcmp((char *)mstring_ptr(item->key), "k0") == 0);
+	miterator_free(iter);
+	printf(".");
+
+	/* Case 7: Comparison against generic arrays */
+	actx.n = 3;
+	assert((o = marray_new()) != NULL);
+	assert(marray_append_i(o, 0) != NULL);
+	assert(marray_append_i(o, 1) != NULL);
+	assert(marray_append_i(o, 4) != NULL);
+	assert(mobject_cmp(a, o) == 0);
+	assert(mobject_cmp(o, a) == 0);
+	assert(marray_append_i(o, 9) != NULL);
+	assert(mobject_cmp(a, o) < 0);
+	mobject_free(o);
+	printf(".");
+
+	/* Case 8: Namespace lookup through virtual objects */
+	assert((ns = mdict_new()) != NULL);
+	assert(mdict_insert_s(ns, "a", a) != NULL);
+	assert(mdict_insert_s(ns, "d", d) != NULL);
+	assert(mnamespace_lookup(ns, "a[2]", &x, ebuf, sizeof(ebuf)) == 0);
+	assert(mint_value(x) == 4);
+	assert(mnamespace_lookup(ns, "d.k4", &x, ebuf, sizeof(ebuf)) == 0);
+	assert(mint_value(x) == 4);
+	assert(mnamespace_lookup(ns, "d.k7", &x, ebuf, sizeof(ebuf)) == -1);
+	assert(mnamespace_lookup(ns, "a[3]", &x, ebuf, sizeof(ebuf)) == -1);
+	printf(".");
+
+	/* Case 9: Deallocation calls the free callback */
+	mobject_free(ns);
+	assert(actx.freed == 1);
+	assert(dctx.freed == 1);
+	printf(".");
+
+	/* Case 10: Struct array binding */
+	assert(mstruct_array_new(&user_desc, NULL, 2) == NULL);
+	assert((a = mstruct_array_new(&user_desc, users, 2)) != NULL);
+	assert(mobject_type(a) == TYPE_MARRAY);
+	assert(marray_len(a) == 2);
+	assert((d = marray_item(a, 1)) != NULL);
+	assert(mobject_type(d) == TYPE_MDICT);
+	assert(mdict_len(d) == 4);
+	assert(mint_value(mdict_item_s(d, "uid")) == 1001);
+	assert((o = mdict_item_s(d, "name")) != NULL);
+	assert(mstring_ptr(o) == (u_int8_t *)users[1].name);
+	assert(mdict_item_s(d, "nonexistent") == NULL);
+	assert(mdict_insert_si(d, "uid", 1) == NULL);
+	assert(!marray_is_stream(a));
+	assert((o = marray_slice(a, 1, 2)) != NULL);
+	assert(mint_value(mdict_item_s(marray_item(o, 0), "uid")) == 1001);
+	mobject_free(o);
+	printf(".");
+
+	/* Case 11: Nested structures and arrays via the namespace */
+	assert((ns = mdict_new()) != NULL);
+	assert(mdict_insert_s(ns, "users", a) != NULL);
+	assert(mnamespace_lookup(ns, "users[0].primary.label", &x,
+	    ebuf, sizeof(ebuf)) == 0);
+	assert(strcmp((char *)mstring_ptr(x), "one") == 0);
+	assert(mnamespace_lookup(ns, "users[0].tags[1].id", &x,
+	    ebuf, sizeof(ebuf)) == 0);
+	assert(mint_value(x) == 11);
+	assert(mnamespace_lookup(ns, "users[0].tags[1].label", &x,
+	    ebuf, sizeof(ebuf)) == 0);
+	assert(mobject_type(x) == TYPE_MNONE);
+	assert(mnamespace_lookup(ns, "users[1].tags[0]", &x,
+	    ebuf, sizeof(ebuf)) == -1);
+	printf(".");
+
+	/* Case 12: Iteration makes records per step, not cached ones */
+	assert((iter = mobject_getiter(a)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(mint_value(item->key) == (int64_t)i);
+		assert(item->value != marray_item(a, i));
+		assert(mint_value(mdict_item_s(item->value, "uid")) ==
+		    users[i].uid);
+	}
+	assert(i == 2);
+	miterator_free(iter);
+	printf(".");
+
+	/* Case 13: Record iteration follows descriptor order */
+	assert((iter = mobject_getiter(marray_item(a, 0))) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(strcmp((char *)mstring_ptr(item->key),
+		    user_fields[i].name) == 0);
+	}
+	assert(i == 4);
+	miterator_free(iter);
+	mobject_free(ns);
+	printf(".");
+
+	/* Case 14: Copies of virtual arrays */
+	bzero(&actx, sizeof(actx));
+	actx.n = 4;
+	assert((a = mvirtual_new(TYPE_MARRAY, &even_ops, &actx)) != NULL);
+	assert(!marray_is_stream(a));
+	assert(mobject_deepcopy(a) == NULL);
+	actx.n = 1;
+	assert((o = mobject_deepcopy(a)) != NULL);
+	assert(marray_len(o) == 1);
+	assert(mint_value(marray_item(o, 0)) == 0);
+	mobject_free(o);
+	mobject_free(a);
+	assert((a = mvirtual_new(TYPE_MARRAY, &stream_ops, &actx)) != NULL);
+	assert(marray_is_stream(a));
+	assert(mobject_deepcopy(a) == NULL);
+	mobject_free(a);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
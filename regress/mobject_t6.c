@@ -0,0 +1,187 @@
+/*
+ * Regress test for shaped dictionaries
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+#define NDICTS	1000
+
+int
+main(int argc, char **argv)
+{
+	static const char *keys[] = { "uid", "name", "shell" };
+	static const char *dup_keys[] = { "a", "b", "a" };
+	struct mobject *d, *d2, *o, *a, *ns, *x;
+	struct mshape *shape;
+	struct miterator *iter;
+	struct miteritem *item;
+	char ebuf[256];
+	size_t i;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t6:");
+
+	/* Case 1: Create shape */
+	assert(mshape_new(dup_keys, 3) == NULL);
+	assert((shape = mshape_new(keys, 3)) != NULL);
+	assert(mshape_len(shape) == 3);
+	printf(".");
+
+	/* Case 2: New shaped dictionaries hold None for every key */
+	assert((d = mdict_new_shaped(shape)) != NULL);
+	assert(mobject_type(d) == TYPE_MDICT);
+	assert(mdict_len(d) == 3);
+	for (i = 0; i < 3; i++) {
+		assert((o = mdict_item_s(d, keys[i])) != NULL);
+		assert(mobject_type(o) == TYPE_MNONE);
+	}
+	assert(mdict_item_s(d, "nonexistent") == NULL);
+	printf(".");
+
+	/* Case 3: Set values by slot */
+	assert(mdict_set_slot(d, 0, mint_new(1000)) == 0);
+	assert(mdict_set_slot(d, 1, mstring_new("djm")) == 0);
+	assert(mdict_set_slot(d, 1, mstring_new("root")) == 0);
+	assert(mdict_set_slot(d, 3, mnone_new()) == -1); /* mnone is static */
+	assert(mint_value(mdict_item_s(d, "uid")) == 1000);
+	assert(strcmp((char *)mstring_ptr(mdict_item_s(d, "name")),
+	    "root") == 0);
+	printf(".");
+
+	/* Case 4: Iteration follows shape order */
+	assert((iter = mobject_getiter(d)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(strcmp((char *)mstring_ptr(item->key), keys[i]) == 0);
+		assert(item->value == mdict_item_s(d, keys[i]));
+	}
+	assert(i == 3);
+	miterator_free(iter);
+	printf(".");
+
+	/* Case 5: Copies share the shape, but not values */
+	assert((d2 = mobject_deepcopy(d)) != NULL);
+	assert(mdict_set_slot(d2, 0, mint_new(0)) == 0);
+	assert(mint_value(mdict_item_s(d, "uid")) == 1000);
+	assert(mint_value(mdict_item_s(d2, "uid")) == 0);
+	assert(strcmp((char *)mstring_ptr(mdict_item_s(d2, "name")),
+	    "root") == 0);
+	printf(".");
+
+	/* Case 6: Failed modifications leave the dictionary shaped */
+	assert(mdict_insert_si(d2, "uid", 1) == NULL);
+	assert(mdict_remove_s(d2, "nonexistent") == NULL);
+	assert(mdict_set_slot(d2, 0, mint_new(5)) == 0);
+	printf(".");
+
+	/* Case 7: Modification converts to an ordinary dictionary */
+	assert(mdict_insert_ss(d2, "home", "/root") != NULL);
+	assert(mdict_len(d2) == 4);
+	assert((o = mint_new(6)) != NULL);
+	assert(mdict_set_slot(d2, 0, o) == -1);
+	mobject_free(o);
+	assert(mint_value(mdict_item_s(d2, "uid")) == 5);
+	assert(strcmp((char *)mstring_ptr(mdict_item_s(d2, "home")),
+	    "/root") == 0);
+	assert(mdict_delete_s(d2, "home") == 0);
+	assert(mdict_len(d2) == 3);
+	mobject_free(d2);
+	assert((d2 = mobject_deepcopy(d)) != NULL);
+	assert(mdict_delete_s(d2, "shell") == 0);
+	assert(mdict_len(d2) == 2);
+	assert(mdict_item_s(d2, "shell") == NULL);
+	assert(mint_value(mdict_item_s(d2, "uid")) == 1000);
+	mobject_free(d2);
+	assert((d2 = mobject_deepcopy(d)) != NULL);
+	assert(mdict_replace_si(d2, "uid", 7) != NULL);
+	assert(mdict_len(d2) == 3);
+	assert(mint_value(mdict_item_s(d2, "uid")) == 7);
+	assert(mint_value(mdict_item_s(d, "uid")) == 1000);
+	mobject_free(d2);
+	printf(".");
+
+	/* Case 8: Arrays of shaped dictionaries in a namespace */
+	assert((ns = mdict_new()) != NULL);
+	assert(mdict_insert_sa(ns, "users") != NULL);
+	assert((a = mdict_item_s(ns, "users")) != NULL);
+	for (i = 0; i < NDICTS; i++) {
+		assert((d2 = mdict_new_shaped(shape)) != NULL);
+		assert(mdict_set_slot(d2, 0, mint_new(i)) == 0);
+		assert(marray_append(a, d2) == 0);
+	}
+	mshape_free(shape);
+	assert(mnamespace_lookup(ns, "users[123].uid", &x,
+	    ebuf, sizeof(ebuf)) == 0);
+	assert(mint_value(x) == 123);
+	assert(mnamespace_lookup(ns, "users[123].shell", &x,
+	    ebuf, sizeof(ebuf)) == 0);
+	assert(mobject_type(x) == TYPE_MNONE);
+	assert(mnamespace_lookup(ns, "users[123].nonexistent", &x,
+	    ebuf, sizeof(ebuf)) == -1);
+	assert(mnamespace_set(ns, "users[5].home", mstring_new("/home"),
+	    ebuf, sizeof(ebuf)) == 0);
+	assert(mdict_len(marray_item(a, 5)) == 4);
+	mobject_free(ns);
+	mobject_free(d);
+	printf(".");
+
+	/* Case 9: Cached lookups guard on the shape */
+	{
+		static const char *keys2[] = { "shell", "uid" };
+		struct mdict_cache cache;
+		struct mobject *k, *g;
+		struct mshape *shape2;
+
+		bzero(&cache, sizeof(cache));
+		assert((shape = mshape_new(keys, 3)) != NULL);
+		assert((shape2 = mshape_new(keys2, 2)) != NULL);
+		assert((d = mdict_new_shaped(shape)) != NULL);
+		assert((d2 = mdict_new_shaped(shape2)) != NULL);
+		assert((g = mdict_new()) != NULL);
+		assert(mdict_set_slot(d, 0, mint_new(1)) == 0);
+		assert(mdict_set_slot(d2, 1, mint_new(2)) == 0);
+		assert(mdict_insert_si(g, "uid", 3) != NULL);
+		assert((k = mstring_new("uid")) != NULL);
+		for (i = 0; i < 3; i++) {
+			assert(mint_value(mdict_item_cached(d, k,
+			    &cache)) == 1);
+			assert(mint_value(mdict_item_cached(d, k,
+			    &cache)) == 1);
+			assert(mint_value(mdict_item_cached(g, k,
+			    &cache)) == 3);
+			assert(mint_value(mdict_item_cached(d2, k,
+			    &cache)) == 2);
+		}
+		mobject_free(k);
+		assert((k = mstring_new("name")) != NULL);
+		bzero(&cache, sizeof(cache));
+		assert(mdict_item_cached(d2, k, &cache) == NULL);
+		assert(mobject_type(mdict_item_cached(d, k, &cache)) ==
+		    TYPE_MNONE);
+		mobject_free(k);
+		mobject_free(d);
+		mobject_free(d2);
+		mobject_free(g);
+		mshape_free(shape);
+		mshape_free(shape2);
+	}
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * Regress test for typed arrays and ranges
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+#define NITEMS	10000
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *ia, *sa, *o, *o2, *g, *c;
+	struct miterator *iter;
+	struct miteritem *item;
+	char buf[32], *json;
+	size_t i, perm[3];
+	int64_t v;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t7:");
+
+	/* Case 1: Create typed arrays */
+	assert((ia = marray_new_int64()) != NULL);
+	assert((sa = marray_new_strings()) != NULL);
+	assert(mobject_type(ia) == TYPE_MARRAY);
+	assert(mobject_type(sa) == TYPE_MARRAY);
+	assert(marray_len(ia) == 0);
+	assert(marray_item(sa, 0) == NULL);
+	printf(".");
+
+	/* Case 2: Append values */
+	for (i = 0; i < NITEMS; i++) {
+		snprintf(buf, sizeof(buf), "s%zu", i);
+		assert(marray_append_int64(ia, (int64_t)i * 3 - 5) == 0);
+		assert(marray_append_str(sa, buf, strlen(buf)) == 0);
+	}
+	assert(marray_append_str(sa, "", 0) == 0);
+	assert(marray_len(ia) == NITEMS);
+	assert(marray_len(sa) == NITEMS + 1);
+	printf(".");
+
+	/* Case 3: Item proxies */
+	assert((o = marray_item(ia, 7)) != NULL);
+	assert(mobject_type(o) == TYPE_MINT);
+	assert(mint_value(o) == 16);
+	assert(marray_item(ia, 7) == o);
+	assert(mint_value(marray_first(ia)) == -5);
+	assert(mint_value(marray_last(ia)) == (NITEMS - 1) * 3 - 5);
+	assert((o = marray_item(sa, 12)) != NULL);
+	assert(mobject_type(o) == TYPE_MSTRING);
+	assert(mstring_len(o) == 3);
+	assert(memcmp(mstring_ptr(o), "s12", 3) == 0);
+	assert(mstring_len(marray_last(sa)) == 0);
+	printf(".");
+
+	/* Case 4: Proxies survive further appends */
+	for (i = 0; i < NITEMS; i++)
+		assert(marray_append_str(sa, "xxxxxxxxxxxxxxxx", 16) == 0);
+	assert(memcmp(mstring_ptr(o), "s12", 3) == 0);
+	assert(marray_item(sa, 12) == o);
+	printf(".");
+
+	/* Case 5: Iteration */
+	assert((iter = mobject_getiter(ia)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(mint_value(item->key) == (int64_t)i);
+		assert(mint_value(item->value) == (int64_t)i * 3 - 5);
+	}
+	assert(i == NITEMS);
+	miterator_free(iter);
+	assert((iter = mobject_getiter(sa)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		if (i >= NITEMS)
+			continue;
+		snprintf(buf, sizeof(buf), "s%zu", i);
+		assert(mstring_len(item->value) == strlen(buf));
+		assert(memcmp(mstring_ptr(item->value), buf,
+		    strlen(buf)) == 0);
+	}
+	assert(i == NITEMS * 2 + 1);
+	miterator_free(iter);
+	printf(".");
+
+	/* Case 6: Comparison with typed and ordinary arrays */
+	assert((c = mobject_deepcopy(ia)) != NULL);
+	assert(mobject_cmp(ia, c) == 0);
+	assert((g = marray_new()) != NULL);
+	for (i = 0; i < NITEMS; i++)
+		assert(marray_append_i(g, (int64_t)i * 3 - 5) != NULL);
+	assert(mobject_cmp(ia, g) == 0);
+	assert(mobject_cmp(g, ia) == 0);
+	assert(marray_append_int64(c, 1) == 0);
+	assert(mobject_cmp(ia, c) < 0);
+	mobject_free(c);
+	assert((c = mobject_deepcopy(sa)) != NULL);
+	assert(mobject_cmp(sa, c) == 0);
+	mobject_free(c);
+	assert((c = marray_new_strings()) != NULL);
+	assert(marray_append_str(c, "b", 1) == 0);
+	assert((o2 = marray_new_strings()) != NULL);
+	assert(marray_append_str(o2, "ab", 2) == 0);
+	assert(mobject_cmp(c, o2) > 0);
+	mobject_free(c);
+	mobject_free(o2);
+	printf(".");
+
+	/* Case 7: Appending values to an ordinary array */
+	assert(marray_append_int64(g, 42) == 0);
+	assert(marray_append_str(g, "abc", 3) == 0);
+	assert(mint_value(marray_item(g, NITEMS)) == 42);
+	assert(strcmp((char *)mstring_ptr(marray_last(g)), "abc") == 0);
+	assert(marray_append_str(g, "abc", 3) == 0);
+	mobject_free(g);
+	printf(".");
+
+	/* Case 8: Modification converts to an ordinary array */
+	o = marray_item(sa, 12);
+	assert(marray_append_i(sa, 5) != NULL);
+	assert(marray_len(sa) == NITEMS * 2 + 2);
+	assert(marray_item(sa, 12) == o);
+	assert(strcmp((char *)mstring_ptr(o), "s12") == 0);
+	assert(strcmp((char *)mstring_ptr(marray_item(sa, 13)), "s13") == 0);
+	assert(mint_value(marray_last(sa)) == 5);
+	assert(marray_append_str(sa, "z", 1) == 0);
+	assert(strcmp((char *)mstring_ptr(marray_last(sa)), "z") == 0);
+	o = marray_item(ia, 7);
+	assert((o2 = marray_pop(ia)) != NULL);
+	assert(mint_value(o2) == (NITEMS - 1) * 3 - 5);
+	mobject_free(o2);
+	assert(marray_len(ia) == NITEMS - 1);
+	assert(marray_item(ia, 7) == o);
+	assert(marray_set_i(ia, 0, 99) != NULL);
+	assert(mint_value(marray_first(ia)) == 99);
+	mobject_free(ia);
+	mobject_free(sa);
+	printf(".");
+
+	/* Case 9: Range lengths */
+	assert(marray_new_range(0, 10, 0) == NULL);
+	assert((o = marray_new_range(0, 10, 3)) != NULL);
+	assert(marray_len(o) == 4);
+	mobject_free(o);
+	assert((o = marray_new_range(10, 0, -3)) != NULL);
+	assert(marray_len(o) == 4);
+	assert(mint_value(marray_last(o)) == 1);
+	mobject_free(o);
+	assert((o = marray_new_range(5, 5, 1)) != NULL);
+	assert(marray_len(o) == 0);
+	assert(marray_item(o, 0) == NULL);
+	mobject_free(o);
+	assert((o = marray_new_range(0, -5, 1)) != NULL);
+	assert(marray_len(o) == 0);
+	mobject_free(o);
+	assert((o = marray_new_range(INT64_MIN, INT64_MAX,
+	    INT64_MAX)) != NULL);
+	assert(marray_len(o) == 3);
+	assert(mint_value(marray_item(o, 2)) == INT64_MAX - 1);
+	mobject_free(o);
+	/* Items far into a range are made without those before them */
+	assert((o = marray_new_range(0, 100000000, 1)) != NULL);
+	assert(mint_value(marray_item(o, 99999999)) == 99999999);
+	assert(marray_item(o, 99999999) == marray_item(o, 99999999));
+	mobject_free(o);
+	printf(".");
+
+	/* Case 10: Range items and iteration */
+	assert((ia = marray_new_range(-5, NITEMS * 3 - 5, 3)) != NULL);
+	assert(marray_len(ia) == NITEMS);
+	assert((o = marray_item(ia, 7)) != NULL);
+	assert(mint_value(o) == 16);
+	assert(marray_item(ia, 7) == o);
+	assert(marray_item(ia, NITEMS) == NULL);
+	assert(marray_get_int64(ia, NITEMS - 1, &v) == 0);
+	assert(v == (NITEMS - 1) * 3 - 5);
+	assert((iter = mobject_getiter(ia)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(mint_value(item->key) == (int64_t)i);
+		assert(mint_value(item->value) == (int64_t)i * 3 - 5);
+		/* The value object is reused */
+		if (i == 0)
+			o2 = item->value;
+		assert(item->value == o2);
+	}
+	assert(i == NITEMS);
+	miterator_free(iter);
+	printf(".");
+
+	/* Case 11: Ranges are read-only but may be copied */
+	assert(marray_append_i(ia, 1) == NULL);
+	assert(marray_pop(ia) == NULL);
+	assert(marray_len(ia) == NITEMS);
+	assert((c = mobject_deepcopy(ia)) != NULL);
+	assert(marray_len(c) == NITEMS);
+	assert(mobject_cmp(c, ia) == 0);
+	assert((g = marray_new_range(-5, NITEMS * 3 - 5, 2)) != NULL);
+	assert(mobject_cmp(g, ia) != 0);
+	mobject_free(g);
+	mobject_free(c);
+	mobject_free(ia);
+	printf(".");
+
+	/* Case 12: Sorting, seeking and writing typed arrays */
+	assert((ia = marray_new_int64()) != NULL);
+	assert(marray_append_int64(ia, 5) == 0);
+	assert(marray_append_int64(ia, -1) == 0);
+	assert(marray_append_int64(ia, 10) == 0);
+	assert(marray_sort_order(ia, 0, perm) == 0);
+	assert(perm[0] == 1 && perm[1] == 0 && perm[2] == 2);
+	assert(marray_sort_order(ia, MSORT_STRING, perm) == 0);
+	assert(perm[0] == 1 && perm[1] == 2 && perm[2] == 0);
+	assert(marray_sort_order(ia, MSORT_REVERSE, perm) == 0);
+	assert(perm[0] == 2 && perm[1] == 0 && perm[2] == 1);
+	assert((iter = mobject_getiter(ia)) != NULL);
+	assert(miterator_seek(iter, 2) == 0);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 2 && mint_value(item->value) == 10);
+	o = item->value;
+	assert(miterator_seek(iter, 0) == 0);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 0 && mint_value(item->value) == 5);
+	assert(item->value == o);
+	assert(miterator_seek(iter, 3) == 0);
+	assert(miterator_next(iter) == NULL);
+	miterator_free(iter);
+	assert(mjson_write_mbuf(ia, &json, NULL) == 0);
+	assert(strcmp(json, "[5,-1,10]") == 0);
+	free(json);
+	mobject_free(ia);
+	assert((sa = marray_new_strings()) != NULL);
+	assert(marray_append_str(sa, "b", 1) == 0);
+	assert(marray_append_str(sa, "a\"", 2) == 0);
+	assert(marray_sort_order(sa, 0, perm) == 0);
+	assert(perm[0] == 1 && perm[1] == 0);
+	assert(mjson_write_mbuf(sa, &json, NULL) == 0);
+	assert(strcmp(json, "[\"b\",\"a\\\"\"]") == 0);
+	free(json);
+	mobject_free(sa);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
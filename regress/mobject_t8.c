@@ -0,0 +1,244 @@
+/*
+ * Regress test for CSV and TSV loading
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+/* Enough records that the input is split between threads */
+#define NRECORDS	200000
+
+static const char csv1[] =
+    "id,name,note\r\n"
+    "1,alice,plain\r\n"
+    "-2,\"bob, jr\",\"say \"\"hi\"\"\"\n"
+    "\n"
+    "30,carol,\"two\nlines\"\n"
+    "4,,\"\"";
+
+static const char tsv1[] = "a\tb\n007\t\"x\"\n8\t\n";
+
+static int
+str_equal(struct mobject *o, const char *s)
+{
+	return mobject_type(o) == TYPE_MSTRING &&
+	    mstring_len(o) == strlen(s) &&
+	    memcmp(mstring_ptr(o), s, strlen(s)) == 0;
+}
+
+static char *
+make_big(size_t *lenp)
+{
+	char *ret;
+	size_t i, len = 0, alloc = NRECORDS * 40 + 64;
+
+	assert((ret = malloc(alloc)) != NULL);
+	len += snprintf(ret + len, alloc - len, "n,s,q\n");
+	for (i = 0; i < NRECORDS; i++) {
+		/* Quoted newlines and quotes make boundary finding harder */
+		len += snprintf(ret + len, alloc - len,
+		    i == NRECORDS / 2 ? "%zu,x,abc\n" :
+		    "%zu,s%zu,\"a\"\"\n%zu\"\n", i, i, i % 7);
+	}
+	*lenp = len;
+	return ret;
+}
+
+/* As make_big(), but with stray quotes inside unquoted fields */
+static char *
+make_stray(size_t *lenp)
+{
+	char *ret;
+	size_t i, len = 0, alloc = NRECORDS * 40 + 64;
+
+	assert((ret = malloc(alloc)) != NULL);
+	len += snprintf(ret + len, alloc - len, "n,s,q\n");
+	for (i = 0; i < NRECORDS; i++) {
+		len += snprintf(ret + len, alloc - len,
+		    "%zu,5\" x%zu,\"a\n%zu\"\n", i, i % 7, i % 7);
+	}
+	*lenp = len;
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mobject *tab, *tab2, *rows, *o, *c, *c2;
+	struct miterator *iter;
+	struct miteritem *item;
+	const u_int8_t *s, *s2;
+	char ebuf[256], *big;
+	size_t i, len, len2;
+	int64_t v, v2;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t8:");
+
+	/* Case 1: Parse CSV into columns */
+	tab = mcsv_parse(csv1, strlen(csv1), 0, 1, ebuf, sizeof(ebuf));
+	assert(tab != NULL);
+	assert(mobject_type(tab) == TYPE_MDICT);
+	assert(mdict_len(tab) == 3);
+	assert((c = mdict_item_s(tab, "id")) != NULL);
+	assert(marray_len(c) == 4);
+	assert(marray_get_int64(c, 1, &v) == 0 && v == -2);
+	assert(marray_get_int64(c, 2, &v) == 0 && v == 30);
+	assert(mint_value(marray_item(c, 3)) == 4);
+	printf(".");
+
+	/* Case 2: Quoting and empty fields */
+	assert((c = mdict_item_s(tab, "name")) != NULL);
+	assert(marray_get_int64(c, 0, &v) == -1);
+	assert(str_equal(marray_item(c, 1), "bob, jr"));
+	assert(str_equal(marray_item(c, 3), ""));
+	assert((c = mdict_item_s(tab, "note")) != NULL);
+	assert(str_equal(marray_item(c, 0), "plain"));
+	assert(str_equal(marray_item(c, 1), "say \"hi\""));
+	assert(str_equal(marray_item(c, 2), "two\nlines"));
+	assert(str_equal(marray_item(c, 3), ""));
+	printf(".");
+
+	/* Case 3: Row view */
+	assert((rows = mcsv_rows(tab)) != NULL);
+	assert(mobject_type(rows) == TYPE_MARRAY);
+	assert(marray_len(rows) == 4);
+	assert((o = marray_item(rows, 1)) != NULL);
+	assert(mobject_type(o) == TYPE_MDICT);
+	assert(mint_value(mdict_item_s(o, "id")) == -2);
+	assert(str_equal(mdict_item_s(o, "name"), "bob, jr"));
+	assert(marray_item(rows, 4) == NULL);
+	assert((iter = mobject_getiter(rows)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(mint_value(item->key) == (int64_t)i);
+		assert(mobject_type(item->value) == TYPE_MDICT);
+		assert(mdict_len(item->value) == 3);
+	}
+	assert(i == 4);
+	miterator_free(iter);
+	/* Rows may be read in any order, so the view is not a stream */
+	assert(!marray_is_stream(rows));
+	assert((o = marray_slice(rows, 1, 3)) != NULL);
+	assert(marray_len(o) == 2);
+	assert((iter = mobject_getiter(o)) != NULL);
+	assert((item = miterator_next(iter)) != NULL);
+	assert(mint_value(item->key) == 1);
+	assert(str_equal(mdict_item_s(item->value, "name"), "bob, jr"));
+	miterator_free(iter);
+	mobject_free(o);
+	assert((o = mobject_deepcopy(rows)) != NULL);
+	assert(marray_len(o) == 4);
+	mobject_free(o);
+	mobject_free(rows);
+	printf(".");
+
+	/* Case 4: TSV; numbers not in canonical form stay strings */
+	tab = mcsv_parse(tsv1, strlen(tsv1), MCSV_TSV, 0, ebuf, sizeof(ebuf));
+	assert(tab != NULL);
+	assert((c = mdict_item_s(tab, "a")) != NULL);
+	assert(marray_get_int64(c, 1, &v) == -1);
+	assert(str_equal(marray_item(c, 0), "007"));
+	assert(str_equal(marray_item(c, 1), "8"));
+	assert(str_equal(marray_item(mdict_item_s(tab, "b"), 0), "\"x\""));
+	mobject_free(tab);
+	printf(".");
+
+	/* Case 5: Errors */
+	assert(mcsv_parse("a,b\n1,2\n3\n", 10, 0, 1,
+	    ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Record has 1 fields, expected 2 at record 2") == 0);
+	assert(mcsv_parse("a,a\n1,2\n", 8, 0, 1, ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Duplicate column \"a\"") == 0);
+	assert(mcsv_parse("a\n\"x\n", 5, 0, 1, ebuf, sizeof(ebuf)) == NULL);
+	assert(mcsv_parse("a\n\"x\"y\n", 7, 0, 1, ebuf, sizeof(ebuf)) == NULL);
+	assert(mcsv_parse("", 0, 0, 1, ebuf, sizeof(ebuf)) == NULL);
+	assert(mcsv_load("/nonexistent", 0, 1, ebuf, sizeof(ebuf)) == NULL);
+	printf(".");
+
+	/* Case 6: Integer limits */
+	tab = mcsv_parse("a,b\n9223372036854775807,-9223372036854775808\n"
+	    "0,9223372036854775808\n", 67, 0, 1, ebuf, sizeof(ebuf));
+	assert(tab != NULL);
+	assert(marray_get_int64(mdict_item_s(tab, "a"), 0, &v) == 0);
+	assert(v == INT64_MAX);
+	assert(str_equal(marray_item(mdict_item_s(tab, "b"), 0),
+	    "-9223372036854775808"));
+	assert(str_equal(marray_item(mdict_item_s(tab, "b"), 1),
+	    "9223372036854775808"));
+	mobject_free(tab);
+	printf(".");
+
+	/* Case 7: Threaded parsing gives the same result */
+	big = make_big(&len);
+	assert((tab = mcsv_parse(big, len, 0, 1, ebuf, sizeof(ebuf))) != NULL);
+	assert((tab2 = mcsv_parse(big, len, 0, 4, ebuf, sizeof(ebuf))) != NULL);
+	assert(marray_len(mdict_item_s(tab, "n")) == NRECORDS);
+	assert(mobject_cmp(mdict_item_s(tab, "n"),
+	    mdict_item_s(tab2, "n")) == 0);
+	assert(mobject_cmp(mdict_item_s(tab, "s"),
+	    mdict_item_s(tab2, "s")) == 0);
+	assert(mobject_cmp(mdict_item_s(tab, "q"),
+	    mdict_item_s(tab2, "q")) == 0);
+	c = mdict_item_s(tab2, "n");
+	c2 = mdict_item_s(tab2, "q");
+	for (i = 0; i < NRECORDS; i++) {
+		assert(marray_get_int64(c, i, &v) == 0 && v == (int64_t)i);
+		assert(marray_get_str(c2, i, &s, &len2) == 0);
+		if (i == NRECORDS / 2)
+			assert(len2 == 3 && memcmp(s, "abc", 3) == 0);
+		else {
+			assert(len2 == 4 && s[0] == 'a' && s[1] == '"');
+			assert(s[3] - '0' == (int)(i % 7));
+		}
+	}
+	assert(marray_get_str(mdict_item_s(tab, "s"), 5, &s, &len) == 0);
+	assert(marray_get_str(mdict_item_s(tab2, "s"), 5, &s2, &len2) == 0);
+	assert(len == len2 && memcmp(s, s2, len) == 0);
+	assert(marray_get_int64(mdict_item_s(tab, "n"), NRECORDS - 1,
+	    &v) == 0);
+	assert(marray_get_int64(mdict_item_s(tab2, "n"), NRECORDS - 1,
+	    &v2) == 0);
+	assert(v == v2);
+	mobject_free(tab);
+	mobject_free(tab2);
+	free(big);
+	printf(".");
+
+	/* Case 8: Stray quotes in unquoted fields don't start quoting */
+	big = make_stray(&len);
+	assert((tab = mcsv_parse(big, len, 0, 1, ebuf, sizeof(ebuf))) != NULL);
+	assert((tab2 = mcsv_parse(big, len, 0, 4, ebuf, sizeof(ebuf))) != NULL);
+	assert(marray_len(mdict_item_s(tab2, "n")) == NRECORDS);
+	assert(mobject_cmp(mdict_item_s(tab, "s"),
+	    mdict_item_s(tab2, "s")) == 0);
+	assert(mobject_cmp(mdict_item_s(tab, "q"),
+	    mdict_item_s(tab2, "q")) == 0);
+	c = mdict_item_s(tab2, "s");
+	for (i = 0; i < NRECORDS; i++) {
+		assert(marray_get_str(c, i, &s, &len2) == 0);
+		assert(len2 == 5 && memcmp(s, "5\" x", 4) == 0);
+		assert(s[4] - '0' == (int)(i % 7));
+	}
+	mobject_free(tab);
+	mobject_free(tab2);
+	free(big);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
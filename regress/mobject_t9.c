@@ -0,0 +1,201 @@
+/*
+ * Regress test for JSON parsing and newline-delimited JSON streams
+ * Public domain -- Damien Miller <djm@mindrot.org> 2007-03-27
+ */
+
+/* $Id$ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "mobject.h"
+
+#include "t_macros.h"
+
+#define NRECORDS	100000
+
+/* Check that "s" parses and serialises back to "expect" */
+static void
+roundtrip(const char *s, const char *expect)
+{
+	struct mobject *o;
+	char *out, ebuf[256];
+
+	assert((o = mjson_parse(s, strlen(s), ebuf, sizeof(ebuf))) != NULL);
+	assert(mjson_write_mbuf(o, &out, NULL) == 0);
+	if (strcmp(out, expect) != 0) {
+		fprintf(stderr, "\"%s\" != \"%s\"\n", out, expect);
+		abort();
+	}
+	free(out);
+	mobject_free(o);
+}
+
+static int
+parse_fails(const char *s)
+{
+	struct mobject *o;
+
+	if ((o = mjson_parse(s, strlen(s), NULL, 0)) == NULL)
+		return 1;
+	mobject_free(o);
+	return 0;
+}
+
+/* Return a descriptor from which "len" bytes of "s" may be read */
+static int
+data_fd(const char *s, size_t len)
+{
+	FILE *f;
+	int fd;
+
+	assert((f = tmpfile()) != NULL);
+	assert(fwrite(s, 1, len, f) == len);
+	fflush(f);
+	assert((fd = dup(fileno(f))) != -1);
+	fclose(f);
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	return fd;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mjson_reader *r;
+	struct mobject *o, *recs;
+	struct miterator *iter;
+	struct miteritem *item;
+	char ebuf[256], *big;
+	size_t i, len, alloc;
+	int fd;
+
+	/* Turn on all malloc debugging on OpenBSD */
+	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	printf("mobject_t9:");
+
+	/* Case 1: Scalars */
+	roundtrip(" 1 ", "1");
+	roundtrip("-0", "0");
+	roundtrip("-9223372036854775808", "-9223372036854775808");
+	roundtrip("9223372036854775808", "\"9223372036854775808\"");
+	roundtrip("1.5e3", "\"1.5e3\"");
+	roundtrip("true", "1");
+	roundtrip("false", "0");
+	roundtrip("null", "null");
+	roundtrip("\"a\\\"b\\n\\u00e9\\ud83d\\ude00\\/\"",
+	    "\"a\\\"b\\n\xc3\xa9\xf0\x9f\x98\x80/\"");
+	printf(".");
+
+	/* Case 2: Containers */
+	roundtrip("[]", "[]");
+	roundtrip("{ }", "{}");
+	roundtrip("[1, [2, {\"a\": [], \"b\" : {}}], \"x\"]",
+	    "[1,[2,{\"a\":[],\"b\":{}}],\"x\"]");
+	roundtrip("{\"a\":1,\"b\":2,\"a\":3}", "{\"b\":2,\"a\":3}");
+	printf(".");
+
+	/* Case 3: Errors */
+	assert(parse_fails(""));
+	assert(parse_fails("[1,]"));
+	assert(parse_fails("{\"a\" 1}"));
+	assert(parse_fails("{1:2}"));
+	assert(parse_fails("[1 2]"));
+	assert(parse_fails("01"));
+	assert(parse_fails("1."));
+	assert(parse_fails("\"abc"));
+	assert(parse_fails("\"a\tb\""));
+	assert(parse_fails("\"\\ud800\""));
+	assert(parse_fails("\"\\x\""));
+	assert(parse_fails("nul"));
+	assert(parse_fails("[[[{\"a\":[1,2"));
+	assert(parse_fails("1 2"));
+	assert(mjson_parse("[1,", 3, ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Unexpected end of input at offset 3") == 0);
+	printf(".");
+
+	/* Case 4: Reading records */
+	fd = data_fd("{\"a\":1}\n\n  \r\n[\"x\"]\r\n7", 21);
+	assert((r = mjson_reader_new(fd)) != NULL);
+	assert((o = mjson_reader_next(r)) != NULL);
+	assert(mint_value(mdict_item_s(o, "a")) == 1);
+	mobject_free(o);
+	assert((o = mjson_reader_next(r)) != NULL);
+	assert(mstring_len(marray_item(o, 0)) == 1);
+	assert(*mstring_ptr(marray_item(o, 0)) == 'x');
+	mobject_free(o);
+	assert((o = mjson_reader_next(r)) != NULL);
+	assert(mint_value(o) == 7);
+	mobject_free(o);
+	assert(mjson_reader_next(r) == NULL);
+	assert(mjson_reader_next(r) == NULL);
+	assert(mjson_reader_error(r) == NULL);
+	mjson_reader_free(r);
+	close(fd);
+	printf(".");
+
+	/* Case 5: Errors are reported with their line */
+	fd = data_fd("1\n2\n{\n", 6);
+	assert((r = mjson_reader_new(fd)) != NULL);
+	assert((o = mjson_reader_next(r)) != NULL);
+	mobject_free(o);
+	assert((o = mjson_reader_next(r)) != NULL);
+	mobject_free(o);
+	assert(mjson_reader_next(r) == NULL);
+	assert(mjson_reader_error(r) != NULL);
+	assert(strcmp(mjson_reader_error(r),
+	    "line 3: Expected dictionary key at offset 1") == 0);
+	mjson_reader_free(r);
+	close(fd);
+	printf(".");
+
+	/* Case 6: Iterating over a large stream, with a long record */
+	alloc = NRECORDS * 64 + 300000;
+	assert((big = malloc(alloc)) != NULL);
+	for (len = i = 0; i < NRECORDS; i++) {
+		len += snprintf(big + len, alloc - len,
+		    "{\"n\": %zu, \"s\": \"r%zu\"}\n", i, i);
+		if (i == 10) {
+			big[len++] = '"';
+			memset(big + len, 'z', 200000);
+			len += 200000;
+			big[len++] = '"';
+			big[len++] = '\n';
+		}
+	}
+	fd = data_fd(big, len);
+	free(big);
+	assert((r = mjson_reader_new(fd)) != NULL);
+	assert((recs = mjson_reader_records(r)) != NULL);
+	assert(mobject_type(recs) == TYPE_MARRAY);
+	assert(marray_len(recs) == 0);
+	assert((iter = mobject_getiter(recs)) != NULL);
+	for (i = 0; (item = miterator_next(iter)) != NULL; i++) {
+		assert(mint_value(item->key) == (int64_t)i);
+		if (i == 11) {
+			assert(mstring_len(item->value) == 200000);
+			continue;
+		}
+		o = mdict_item_s(item->value, "n");
+		assert(mint_value(o) == (int64_t)(i > 11 ? i - 1 : i));
+	}
+	assert(i == NRECORDS + 1);
+	assert(marray_len(recs) == NRECORDS + 1);
+	assert(marray_item(recs, 0) == NULL);
+	miterator_free(iter);
+	assert(mjson_reader_error(r) == NULL);
+	mobject_free(recs);
+	mjson_reader_free(r);
+	close(fd);
+	printf(".");
+
+	printf("\n");
+	return 0;
+}
@@ -7,22 +7,64 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "mobject.h"
 #include "mtemplate.h"
 
+/* Expect reference at position in mtemplate_references() output */
+#define X_REF_AT(a, loc, path, line, scope) do { \
+		struct mobject *xv; \
+		assert((xr = marray_item(a, loc)) != NULL); \
+		assert((xv = mdict_item_s(xr, "path")) != NULL); \
+		assert(strcmp((char *)mstring_ptr(xv), path) == 0); \
+		assert((xv = mdict_item_s(xr, "line")) != NULL); \
+		assert(mint_value(xv) == line); \
+		assert((xv = mdict_item_s(xr, "scope")) != NULL); \
+		assert(strcmp((char *)mstring_ptr(xv), scope) == 0); \
+	} while (0)
+#define X_GLOBAL_REF_AT(a, loc, path, line) do { \
+		struct mobject *xr; \
+		X_REF_AT(a, loc, path, line, "global"); \
+		assert(mdict_item_s(xr, "loopvar") == NULL); \
+	} while (0)
+#define X_LOOP_REF_AT(a, loc, path, line, loopvar, iterable) do { \
+		struct mobject *xr, *xl; \
+		X_REF_AT(a, loc, path, line, "loop"); \
+		assert((xl = mdict_item_s(xr, "loopvar")) != NULL); \
+		assert(strcmp((char *)mstring_ptr(xl), loopvar) == 0); \
+		assert((xl = mdict_item_s(xr, "iterable")) != NULL); \
+		assert(strcmp((char *)mstring_ptr(xl), iterable) == 0); \
+	} while (0)
+
+static const char json_feed[] =
+    "{\"id\": 7, \"tags\": [\"a\", \"b\"]}\n"
+    "{\"id\": 8, \"tags\": []}\n";
+
+/* Append template output to the buffer "ctx" of 64 bytes */
+static int
+append_cb(const char *s, void *ctx)
+{
+	strncat((char *)ctx, s, 63 - strlen((char *)ctx));
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct mobject *namespace;
 	struct mtemplate *t;
-	struct mobject *obj;
-	char *o;
+	struct mobject *obj, *o2;
+	struct mjson_reader *r;
+	char *o, *big, ebuf[256], path[] = "/tmp/mtemplate_t0.XXXXXXXX";
+	size_t line;
+	int pfd[2];
 
 	/* Turn on all malloc debugging on OpenBSD */
 	setenv("MALLOC_OPTIONS", "AFGJPRX", 1);
@@ -184,6 +226,889 @@ main(int argc, char **argv)
 	assert(t == NULL);
 	printf(".");
 
+	/* Case 24: Static reference extraction */
+	t = mtemplate_parse("{{if a.b}}{{for x in a.c}}{{x.value.d}}"
+	    "{{for y in x.value.e}}{{y.key}}{{a.b}}{{endfor}}{{endfor}}"
+	    "{{else}}{{a.b}}{{endif}}{{x.key}}", NULL, 0);
+	assert(t != NULL);
+	assert((obj = mtemplate_references(t)) != NULL);
+	assert(marray_len(obj) == 6);
+	X_GLOBAL_REF_AT(obj, 0, "a.b", 1);
+	X_GLOBAL_REF_AT(obj, 1, "a.c", 1);
+	X_GLOBAL_REF_AT(obj, 2, "x.key", 1);
+	X_LOOP_REF_AT(obj, 3, "x.value.d", 1, "x", "a.c");
+	X_LOOP_REF_AT(obj, 4, "x.value.e", 1, "x", "a.c");
+	X_LOOP_REF_AT(obj, 5, "y.key", 1, "y", "x.value.e");
+	mobject_free(obj);
+	mtemplate_free(t);
+	printf(".");
+
+	/* Case 25: Substitution of strings that are not nul-terminated */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mstring_new_ref((u_int8_t *)"abcdef", 3,
+	    NULL, NULL)) != NULL);
+	assert(mdict_insert_s(namespace, "s", obj) != NULL);
+	t = mtemplate_parse("[{{s}}]", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "[abc]") == 0);
+	free(o);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 26: Nested loops resolve enclosing loop variables */
+	assert((namespace = mdict_new()) != NULL);
+	assert(mdict_insert_sa(namespace, "a") != NULL);
+	assert((obj = mdict_item_s(namespace, "a")) != NULL);
+	assert(marray_append_s(obj, "p") != NULL);
+	assert(marray_append_s(obj, "q") != NULL);
+	assert(mdict_insert_ss(namespace, "x", "global") != NULL);
+	t = mtemplate_parse("{{for x in a}}{{for y in a}}{{x.value}}{{y.value}} "
+	    "{{endfor}}{{endfor}}{{for x in a}}{{for x in a}}{{x.key}}"
+	    "{{endfor}}{{endfor}}{{x}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "pp pq qp qq 0101global") == 0);
+	free(o);
+	mtemplate_free(t);
+	printf(".");
+
+	/* Case 27: Loop variables only have "key" and "value" members */
+	t = mtemplate_parse("{{for x in a}}{{x.other}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 28: Iteration over bound C structures */
+	{
+		struct rec {
+			int64_t n;
+			char *s;
+		} recs[] = { { 1, "x" }, { 2, "y" }, { 3, "z" } };
+		struct mstruct_field fields[] = {
+			{ "n", MSTRUCT_INT64, offsetof(struct rec, n),
+			    NULL, 0 },
+			{ "s", MSTRUCT_STRING, offsetof(struct rec, s),
+			    NULL, 0 },
+		};
+		struct mstruct_desc desc = { sizeof(struct rec), 2, fields };
+
+		assert((namespace = mdict_new()) != NULL);
+		assert((obj = mstruct_array_new(&desc, recs, 3)) != NULL);
+		assert(mdict_insert_s(namespace, "recs", obj) != NULL);
+		t = mtemplate_parse("{{for r in recs}}{{r.value.s}}="
+		    "{{r.value.n}};{{endfor}}{{recs[1].s}}", NULL, 0);
+		assert(t != NULL);
+		assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+		assert(strcmp(o, "x=1;y=2;z=3;y") == 0);
+		free(o);
+		mtemplate_free(t);
+		/* Views of structures are not streams */
+		t = mtemplate_parse("{{for r in recs[1:]}}{{r.key}}"
+		    "{{r.value.s}}{{if r.last}}.{{endif}}{{endfor}}|"
+		    "{{for r in sort(recs, \"KR\")}}{{r.value.n}}{{endfor}}|"
+		    "{{if recs}}{{count(recs)}}{{endif}}", NULL, 0);
+		assert(t != NULL);
+		assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+		assert(strcmp(o, "1y2z.|321|3") == 0);
+		free(o);
+		mtemplate_free(t);
+		mobject_free(namespace);
+	}
+	printf(".");
+
+	/* Case 29: Cached lookups across records of differing shapes */
+	{
+		static const char *k1[] = { "a", "b" };
+		static const char *k2[] = { "b", "c", "a" };
+		struct mshape *s1, *s2;
+		struct mobject *d;
+		int i;
+
+		assert((namespace = mdict_new()) != NULL);
+		assert(mdict_insert_sa(namespace, "rows") != NULL);
+		assert((obj = mdict_item_s(namespace, "rows")) != NULL);
+		assert((s1 = mshape_new(k1, 2)) != NULL);
+		assert((s2 = mshape_new(k2, 3)) != NULL);
+		for (i = 0; i < 6; i++) {
+			if (i == 4) {
+				/* An ordinary dictionary */
+				assert((d = mdict_new()) != NULL);
+				assert(mdict_insert_si(d, "a", i) != NULL);
+				assert(mdict_insert_si(d, "b", -i) != NULL);
+			} else if (i % 2 == 0) {
+				assert((d = mdict_new_shaped(s1)) != NULL);
+				assert(mdict_set_slot(d, 0, mint_new(i)) == 0);
+				assert(mdict_set_slot(d, 1, mint_new(-i)) == 0);
+			} else {
+				assert((d = mdict_new_shaped(s2)) != NULL);
+				assert(mdict_set_slot(d, 0, mint_new(-i)) == 0);
+				assert(mdict_set_slot(d, 2, mint_new(i)) == 0);
+			}
+			assert(marray_append(obj, d) == 0);
+		}
+		mshape_free(s1);
+		mshape_free(s2);
+		t = mtemplate_parse("{{for r in rows}}{{if r.value.a}}"
+		    "{{r.value.a}}/{{r.value.b}} {{endif}}{{endfor}}"
+		    "{{rows[3].a}}", NULL, 0);
+		assert(t != NULL);
+		assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+		assert(strcmp(o, "1/-1 2/-2 3/-3 4/-4 5/-5 3") == 0);
+		free(o);
+		assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+		assert(strcmp(o, "1/-1 2/-2 3/-3 4/-4 5/-5 3") == 0);
+		free(o);
+		/* Not all records have all keys */
+		assert(mdict_replace_si(marray_item(obj, 2), "c", 1) != NULL);
+		assert(mdict_delete_s(marray_item(obj, 2), "b") == 0);
+		assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+		mtemplate_free(t);
+		mobject_free(namespace);
+	}
+	printf(".");
+
+	/* Case 30: Iteration over typed arrays */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = marray_new_int64()) != NULL);
+	assert(marray_append_int64(obj, 10) == 0);
+	assert(marray_append_int64(obj, -20) == 0);
+	assert(mdict_insert_s(namespace, "ints", obj) != NULL);
+	assert((obj = marray_new_strings()) != NULL);
+	assert(marray_append_str(obj, "ab", 2) == 0);
+	assert(marray_append_str(obj, "cdef", 2) == 0);
+	assert(mdict_insert_s(namespace, "strs", obj) != NULL);
+	t = mtemplate_parse("{{for i in ints}}{{i.key}}={{i.value}} {{endfor}}"
+	    "{{for s in strs}}[{{s.value}}]{{endfor}}{{strs[1]}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "0=10 1=-20 [ab][cd]cd") == 0);
+	free(o);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 31: Iteration over the rows of a CSV table */
+	assert((namespace = mdict_new()) != NULL);
+	obj = mcsv_parse("name,n\nab,1\n\"c,d\",2\n", 20, 0, 1, NULL, 0);
+	assert(obj != NULL);
+	assert((obj = mcsv_rows(obj)) != NULL);
+	assert(mdict_insert_s(namespace, "rows", obj) != NULL);
+	t = mtemplate_parse("{{for r in rows}}{{r.key}}:{{r.value.name}}="
+	    "{{r.value.n}} {{endfor}}{{rows[1].name}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "0:ab=1 1:c,d=2 c,d") == 0);
+	free(o);
+	mtemplate_free(t);
+	/* Row views may be sliced and sorted, and know their length */
+	t = mtemplate_parse("{{for r in rows[0:1]}}{{r.value.name}}"
+	    "{{if r.last}}.{{endif}}{{endfor}}|"
+	    "{{for r in sort(rows, \"KR\")}}{{r.key}}{{r.value.n}}"
+	    "{{if r.last}}.{{endif}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "ab.|1201.") == 0);
+	free(o);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 32: Iteration over a stream of JSON records */
+	assert(pipe(pfd) == 0);
+	assert(write(pfd[1], json_feed, sizeof(json_feed) - 1) ==
+	    sizeof(json_feed) - 1);
+	close(pfd[1]);
+	assert((r = mjson_reader_new(pfd[0])) != NULL);
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mjson_reader_records(r)) != NULL);
+	assert(mdict_insert_s(namespace, "feed", obj) != NULL);
+	t = mtemplate_parse("{{for r in feed}}{{r.key}}:{{r.value.id}}"
+	    "{{for t in r.value.tags}},{{t.value}}{{endfor}} {{endfor}}",
+	    NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "0:7,a,b 1:8 ") == 0);
+	assert(mjson_reader_error(r) == NULL);
+	free(o);
+	mtemplate_free(t);
+	/* Records that have been read can't be found by index */
+	t = mtemplate_parse("{{feed[0].id}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, ebuf, sizeof(ebuf)) == -1);
+	assert(strcmp(ebuf, "Error in variable substitution: Name \"feed\" "
+	    "is a stream and can't be indexed at \"feed[0]\" at line 1") == 0);
+	mtemplate_free(t);
+	assert(mnamespace_lookup(namespace, "feed[0].id", &o2,
+	    ebuf, sizeof(ebuf)) == -1);
+	mobject_free(namespace);
+	mjson_reader_free(r);
+	close(pfd[0]);
+	/* Streams are read once, so their length is not known in advance */
+	assert(pipe(pfd) == 0);
+	assert(write(pfd[1], json_feed, sizeof(json_feed) - 1) ==
+	    sizeof(json_feed) - 1);
+	close(pfd[1]);
+	assert((r = mjson_reader_new(pfd[0])) != NULL);
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mjson_reader_records(r)) != NULL);
+	assert(mdict_insert_s(namespace, "feed", obj) != NULL);
+	t = mtemplate_parse("{{for r in feed}}{{r.index}}{{if r.first}}f"
+	    "{{endif}}{{if r.last}}.{{endif}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, ebuf, sizeof(ebuf)) == -1);
+	assert(strcmp(ebuf, "Error in \"if\" directive: \"r.last\" is not "
+	    "available in a loop over a stream at line 1") == 0);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{for r in sort(feed)}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, ebuf, sizeof(ebuf)) == -1);
+	assert(strcmp(ebuf, "Error in \"for\": feed is a stream and can't "
+	    "be sorted at line 1") == 0);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{count(feed)}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, ebuf, sizeof(ebuf)) == -1);
+	assert(strcmp(ebuf, "Error in variable substitution: count(): "
+	    "argument is a stream, which can't be counted at line 1") == 0);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{if len(feed)}}{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, ebuf, sizeof(ebuf)) == -1);
+	assert(strcmp(ebuf, "Error in \"if\" directive: len(): "
+	    "argument has no length at line 1") == 0);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	mjson_reader_free(r);
+	close(pfd[0]);
+	/* Unread streams are true, and read errors fail the loop */
+	assert(pipe(pfd) == 0);
+	assert(write(pfd[1], "{\"id\": 1}\n{\"id\": 2}\n{\n", 22) == 22);
+	close(pfd[1]);
+	assert((r = mjson_reader_new(pfd[0])) != NULL);
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mjson_reader_records(r)) != NULL);
+	assert(mdict_insert_s(namespace, "feed", obj) != NULL);
+	t = mtemplate_parse("{{if feed}}y{{endif}}"
+	    "{{for r in feed}}{{r.value.id}},{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, ebuf, sizeof(ebuf)) == -1);
+	assert(strcmp(ebuf, "Error in \"for\": reading feed: line 3: "
+	    "Expected dictionary key at offset 1 at line 1") == 0);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	mjson_reader_free(r);
+	close(pfd[0]);
+	printf(".");
+
+	/* Case 33: Iteration over and indexing of ranges */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = marray_new_range(1, 10, 4)) != NULL);
+	assert(mdict_insert_s(namespace, "pages", obj) != NULL);
+	t = mtemplate_parse("{{for p in pages}}{{p.key}}={{p.value}} {{endfor}}"
+	    "{{pages[2]}}{{if pages}}!{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "0=1 1=5 2=9 9!") == 0);
+	free(o);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 34: Membership tests */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mset_new()) != NULL);
+	assert(mset_add_s(obj, "b") == 0);
+	assert(mset_add_i(obj, 3) == 0);
+	assert(mdict_insert_s(namespace, "allowed", obj) != NULL);
+	assert((obj = marray_append_a(mdict_insert_sa(namespace, "x"))) != NULL);
+	assert(mdict_insert_ss(namespace, "k", "b") != NULL);
+	assert((obj = mdict_insert_sa(namespace, "users")) != NULL);
+	assert(marray_append_s(obj, "a") != NULL);
+	assert(marray_append_s(obj, "b") != NULL);
+	assert(marray_append_i(obj, 3) != NULL);
+	t = mtemplate_parse("{{for u in users}}{{if u.value in allowed}}"
+	    "+{{else}}-{{endif}}{{endfor}} {{if k in allowed}}y{{endif}}"
+	    "{{if k in users}}y{{endif}}{{if k in namespace_is_dict}}y{{endif}}",
+	    NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	assert(mdict_insert_sd(namespace, "namespace_is_dict") != NULL);
+	assert(mdict_insert_sn(mdict_item_s(namespace,
+	    "namespace_is_dict"), "b") != NULL);
+	t = mtemplate_parse("{{for u in users}}{{if u.value in allowed}}"
+	    "+{{else}}-{{endif}}{{endfor}} {{if k in allowed}}y{{endif}}"
+	    "{{if k in users}}y{{endif}}{{if k in namespace_is_dict}}y{{endif}}"
+	    "{{if x in users}}n{{endif}}",
+	    NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "-++ yyy") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{if users in k}}y{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{if a in}}y{{endif}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{if a b}}y{{endif}}", NULL, 0) == NULL);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 35: Integer dictionary keys */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_insert_sd(namespace, "users")) != NULL);
+	assert(mdict_insert_i(obj, 7, mstring_new("seven")) != NULL);
+	assert(mdict_insert_i(obj, 9, mstring_new("nine")) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "ids")) != NULL);
+	assert(marray_append_i(obj, 9) != NULL);
+	assert(marray_append_i(obj, 8) != NULL);
+	assert(marray_append_s(obj, "7") != NULL);
+	t = mtemplate_parse("{{users[7]}} {{for i in ids}}"
+	    "{{if i.value in users}}+{{else}}-{{endif}}{{endfor}} "
+	    "{{for u in users}}{{u.key}}={{u.value}};{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "seven +-- 7=seven;9=nine;") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{users[8]}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 36: Ordered dictionaries iterate in key order */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_new_ordered()) != NULL);
+	assert(mdict_insert_s(namespace, "d", obj) != NULL);
+	assert(mdict_insert_ss(obj, "pear", "3") != NULL);
+	assert(mdict_insert_ss(obj, "apple", "1") != NULL);
+	assert(mdict_insert_ss(obj, "fig", "2") != NULL);
+	t = mtemplate_parse("{{for v in d}}{{v.key}}={{v.value}};{{endfor}}"
+	    "{{d.fig}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "apple=1;fig=2;pear=3;2") == 0);
+	free(o);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 37: Sorted iteration */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_insert_sd(namespace, "d")) != NULL);
+	assert(mdict_insert_ss(obj, "pear", "10") != NULL);
+	assert(mdict_insert_ss(obj, "apple", "9") != NULL);
+	assert(mdict_insert_ss(obj, "fig", "100") != NULL);
+	assert((obj = mdict_insert_sa(namespace, "a")) != NULL);
+	assert(marray_append_i(obj, 3) != NULL);
+	assert(marray_append_i(obj, 1) != NULL);
+	assert(marray_append_i(obj, 2) != NULL);
+	t = mtemplate_parse("{{for v in sort(d)}}{{v.key}};{{endfor}} "
+	    "{{for v in sort(d, \"NVR\")}}{{v.value}};{{endfor}} "
+	    "{{for v in sort(d, \"V\")}}{{v.value}};{{endfor}} "
+	    "{{for v in sort(a,\"V\")}}{{v.key}}={{v.value}};{{endfor}} "
+	    "{{for v in sort(a)}}{{v.value}};{{endfor}} "
+	    "{{for v in sort(a, \"KR\")}}{{v.value}};{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "apple;fig;pear; 100;10;9; 10;100;9; "
+	    "1=1;2=2;0=3; 1;2;3; 2;1;3;") == 0);
+	free(o);
+	/* The cached order must follow changes to the objects */
+	assert(marray_set_i(obj, 0, 0) != NULL);
+	assert(mdict_replace_ss(mdict_item_s(namespace, "d"),
+	    "apple", "99") != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "apple;fig;pear; 100;99;10; 10;100;99; "
+	    "0=0;1=1;2=2; 0;1;2; 2;1;0;") == 0);
+	free(o);
+	mtemplate_free(t);
+	/* Typed arrays are sorted and searched without item objects */
+	assert((obj = marray_new_int64()) != NULL);
+	assert(mdict_insert_s(namespace, "ti", obj) != NULL);
+	assert(marray_append_int64(obj, 30) == 0);
+	assert(marray_append_int64(obj, 10) == 0);
+	assert(marray_append_int64(obj, 20) == 0);
+	assert(mdict_insert_si(namespace, "ten", 10) != NULL);
+	assert(mdict_insert_ss(namespace, "sten", "10") != NULL);
+	t = mtemplate_parse("{{for v in sort(ti[1:], \"R\")}}{{v.key}}="
+	    "{{v.value}};{{endfor}}{{if ten in ti}}y{{endif}}"
+	    "{{if sten in ti}}n{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "2=20;1=10;y") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{for v in sort(k)}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mdict_insert_ss(namespace, "k", "x") != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{for v in sort(d, \"NS\")}}{{endfor}}",
+	    NULL, 0) == NULL);
+	assert(mtemplate_parse("{{for v in sort(d, \"X\")}}{{endfor}}",
+	    NULL, 0) == NULL);
+	assert(mtemplate_parse("{{for v in sort(d, N)}}{{endfor}}",
+	    NULL, 0) == NULL);
+	assert(mtemplate_parse("{{for v in sort(d}}{{endfor}}",
+	    NULL, 0) == NULL);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 38: Filtered iteration */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "users")) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "djm") != NULL);
+	assert(mdict_insert_si(o2, "admin", 1) != NULL);
+	assert(mdict_insert_si(o2, "uid", 1000) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "bob") != NULL);
+	assert(mdict_insert_si(o2, "admin", 0) != NULL);
+	assert(mdict_insert_si(o2, "uid", 20) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "al") != NULL);
+	assert(mdict_insert_si(o2, "admin", 1) != NULL);
+	assert(mdict_insert_si(o2, "uid", 5) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "names")) != NULL);
+	assert(marray_append_s(obj, "djm") != NULL);
+	assert(marray_append_s(obj, "bob") != NULL);
+	assert(marray_append_s(obj, "al") != NULL);
+	t = mtemplate_parse("{{for u in users if u.value.admin}}"
+	    "{{u.key}}:{{u.value.name}};{{endfor}} "
+	    "{{for u in sort(users, \"KR\") if u.value.admin}}"
+	    "{{u.value.name}};{{endfor}} "
+	    "{{for u in users if u.key}}{{u.value.name}};{{endfor}} "
+	    "{{for u in sort(names, \"V\") if u.key}}{{u.value}};{{endfor}}",
+	    NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "0:djm;2:al; al;djm; bob;al; al;bob;") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{for u in users if u.value.missing}}"
+	    "{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{for u in users if}}{{endfor}}",
+	    NULL, 0) == NULL);
+	assert(mtemplate_parse("{{for u in users if a b}}{{endfor}}",
+	    NULL, 0) == NULL);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 39: Sliced iteration */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "rows")) != NULL);
+	assert(marray_append_i(obj, 5) != NULL);
+	assert(marray_append_i(obj, 1) != NULL);
+	assert(marray_append_i(obj, 4) != NULL);
+	assert(marray_append_i(obj, 2) != NULL);
+	assert(marray_append_i(obj, 3) != NULL);
+	assert(mdict_insert_sd(namespace, "d") != NULL);
+	t = mtemplate_parse("{{for r in rows[1:3]}}{{r.key}}={{r.value}};"
+	    "{{endfor}} {{for r in rows[3:]}}{{r.value}};{{endfor}} "
+	    "{{for r in rows[:2]}}{{r.value}};{{endfor}} "
+	    "{{for r in rows[4:100]}}{{r.key}};{{endfor}} "
+	    "{{for r in rows[9:10]}}{{r.key}};{{endfor}} "
+	    "{{for r in sort(rows[1:4], \"VR\")}}{{r.key}}={{r.value}};"
+	    "{{endfor}} {{for r in rows[0:4] if r.key}}{{r.value}};{{endfor}}",
+	    NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "1=1;2=4; 2;3; 5;1; 4;  2=4;3=2;1=1; 1;4;2;") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{for r in d[0:1]}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{for r in rows[a:1]}}{{endfor}}",
+	    NULL, 0) == NULL);
+	assert(mtemplate_parse("{{for r in rows[1:2x]}}{{endfor}}",
+	    NULL, 0) == NULL);
+	assert(mtemplate_parse("{{for r in [1:2]}}{{endfor}}",
+	    NULL, 0) == NULL);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 40: Loop metadata */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "a")) != NULL);
+	assert(marray_append_s(obj, "x") != NULL);
+	assert(marray_append_s(obj, "y") != NULL);
+	assert(marray_append_s(obj, "z") != NULL);
+	assert(mdict_insert_sa(namespace, "e") != NULL);
+	t = mtemplate_parse("{{for v in a}}{{if v.first}}[{{endif}}"
+	    "{{v.index}}/{{v.length}}:{{v.value}}{{if v.last}}]{{else}},"
+	    "{{endif}}{{endfor}} "
+	    "{{for v in a if v.key}}{{v.index}}{{v.value}}"
+	    "{{if v.last}}.{{endif}}{{endfor}} "
+	    "{{for v in sort(a[1:], \"VR\")}}{{v.key}}{{v.index}}{{endfor}} "
+	    "{{for v in a}}{{for w in a[:2]}}{{v.index}}{{w.index}}"
+	    "{{if w.last}} {{endif}}{{endfor}}{{endfor}}"
+	    "{{for v in e}}{{v.first}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "[0/3:x,1/3:y,2/3:z] 0y1z. 2011 0001 1011 2021 ")
+	    == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{for v in a if v.first}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{for v in a}}{{v.size}}{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	/* Used on its own, the loop variable is a dictionary of the item */
+	t = mtemplate_parse("{{for v in a if v}}{{if v}}T{{endif}}{{count(v)}}"
+	    "{{endfor}} {{for v in e}}{{endfor}}{{for v in a[:1]}}{{v}}"
+	    "{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strncmp(o, "T2T2T2 mdict(", 13) == 0);
+	free(o);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 41: Dynamic subscripts */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_insert_sd(namespace, "users")) != NULL);
+	assert((o2 = mdict_insert_sd(obj, "djm")) != NULL);
+	assert(mdict_insert_ss(o2, "name", "Damien") != NULL);
+	assert((o2 = mdict_new()) != NULL);
+	assert(mdict_insert_ss(o2, "name", "Root") != NULL);
+	assert(mdict_insert_i(obj, 0, o2) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "files")) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "path", "/etc") != NULL);
+	assert(mdict_insert_si(o2, "owner", 0) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "path", "/home/djm") != NULL);
+	assert(mdict_insert_ss(o2, "owner", "djm") != NULL);
+	assert((obj = mdict_insert_sa(namespace, "order")) != NULL);
+	assert(marray_append_i(obj, 1) != NULL);
+	assert(marray_append_i(obj, 0) != NULL);
+	assert(mdict_insert_ss(namespace, "who", "djm") != NULL);
+	t = mtemplate_parse("{{for f in files}}{{f.value.path}}="
+	    "{{users[f.value.owner].name}};{{endfor}} "
+	    "{{for i in order}}{{files[i.value].path}}"
+	    "{{files[order[i.key]].owner}};{{endfor}} {{users[who].name}}"
+	    "{{if users[who]}}!{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "/etc=Root;/home/djm=Damien; "
+	    "/home/djmdjm;/etc0; Damien!") == 0);
+	free(o);
+	/* References used as subscripts are listed in their own scope */
+	assert((obj = mtemplate_references(t)) != NULL);
+	assert(marray_len(obj) == 13);
+	X_LOOP_REF_AT(obj, 0, "f.value.owner", 1, "f", "files");
+	X_LOOP_REF_AT(obj, 1, "f.value.path", 1, "f", "files");
+	X_GLOBAL_REF_AT(obj, 2, "files", 1);
+	X_GLOBAL_REF_AT(obj, 3, "files[i.value].path", 1);
+	X_GLOBAL_REF_AT(obj, 4, "files[order[i.key]].owner", 1);
+	X_LOOP_REF_AT(obj, 5, "i.key", 1, "i", "order");
+	X_LOOP_REF_AT(obj, 6, "i.value", 1, "i", "order");
+	X_GLOBAL_REF_AT(obj, 7, "order", 1);
+	X_GLOBAL_REF_AT(obj, 8, "order[i.key]", 1);
+	X_GLOBAL_REF_AT(obj, 9, "users[f.value.owner].name", 1);
+	X_GLOBAL_REF_AT(obj, 10, "users[who]", 1);
+	X_GLOBAL_REF_AT(obj, 11, "users[who].name", 1);
+	X_GLOBAL_REF_AT(obj, 12, "who", 1);
+	mobject_free(obj);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{for f in files}}{{users[f.value.path]}}"
+	    "{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{files[who]}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 42: Aggregation builtins */
+	assert((namespace = mdict_new()) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "staff")) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "djm") != NULL);
+	assert(mdict_insert_ss(o2, "dept", "dev") != NULL);
+	assert(mdict_insert_si(o2, "pay", 10) != NULL);
+	assert(mdict_insert_si(o2, "admin", 1) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "bob") != NULL);
+	assert(mdict_insert_ss(o2, "dept", "ops") != NULL);
+	assert(mdict_insert_si(o2, "pay", 7) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "eve") != NULL);
+	assert(mdict_insert_ss(o2, "dept", "dev") != NULL);
+	assert(mdict_insert_si(o2, "pay", 12) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "tim") != NULL);
+	assert((obj = mdict_insert_sa(namespace, "n")) != NULL);
+	assert(marray_append_i(obj, 3) != NULL);
+	assert(marray_append_i(obj, -5) != NULL);
+	t = mtemplate_parse("{{count(staff)}} {{count(staff, \"admin\")}} "
+	    "{{sum(staff, \"pay\")}} {{min(staff,\"pay\")}} "
+	    "{{max( staff , \"name\" )}} {{sum(n)}} {{min(n)}} "
+	    "{{count(groupby(staff, \"dept\"))}} "
+	    "{{for g in groupby(staff, \"dept\")}}{{g.key}}:"
+	    "{{count(g.value)}}/{{sum(g.value, \"pay\")}}"
+	    "{{for s in g.value}},{{s.key}}{{s.value.name}}{{endfor}};"
+	    "{{endfor}} "
+	    "{{for g in sort(groupby(staff, \"dept\"), \"R\") if g.key}}"
+	    "{{g.key}}{{endfor}}"
+	    "{{if count(n)}}!{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "4 1 29 7 tim -2 -5 3 "
+	    "dev:2/22,0djm,2eve;ops:1/7,1bob;None:1/0,3tim; opsdev!") == 0);
+	free(o);
+	/* References in arguments are listed */
+	assert((obj = mtemplate_references(t)) != NULL);
+	assert(marray_len(obj) == 6);
+	mobject_free(obj);
+	mtemplate_free(t);
+	/* Groups are views, whose keys are indices in the whole array */
+	t = mtemplate_parse("{{for g in groupby(staff, \"dept\")}}"
+	    "{{min(g.value, \"pay\")}}-{{max(g.value, \"name\")}};"
+	    "{{endfor}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "10-eve;7-bob;None-tim;") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{sum(staff, \"name\")}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{nosuch(staff)}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{count(staff, name)}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{count(staff,)}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{groupby(staff)}}", NULL, 0) == NULL);
+	printf(".");
+
+	/* Case 43: String builtins */
+	assert(mdict_insert_ss(namespace, "sep", " & ") != NULL);
+	assert(mdict_insert_ss(namespace, "s", "Hello, World") != NULL);
+	t = mtemplate_parse("{{join(staff, \", \", \"name\")}}|"
+	    "{{join(n, sep)}}|{{join(staff, \"\", \"pay\")}}|"
+	    "{{len(s)}} {{len(staff)}}|{{upper(s)}} {{lower(s)}}|"
+	    "{{replace(s, \"l\", \"L\")}} {{replace(s, s, \"\")}}|"
+	    "{{pad(s, 14)}}|{{pad(len(s), -4, \".\")}}|{{pad(s, 2, \"-\")}}|"
+	    "{{for v in staff}}{{pad(v.value.name, 5, \"-=\")}}{{endfor}}|"
+	    "{{if len(s)}}{{upper(\"a\\\"b\")}}{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "djm, bob, eve, tim|3 & -5|10712|12 4|"
+	    "HELLO, WORLD hello, world|HeLLo, WorLd |  Hello, World|12..|"
+	    "Hello, World|-=djm-=bob-=eve-=tim|A\"B") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{replace(s, \"\", \"x\")}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{if upper(s)}}{{endif}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{len(upper(s))}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{pad(s, sep)}}", NULL, 0) == NULL);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 44: Escaping filters */
+	assert((namespace = mdict_new()) != NULL);
+	assert(mdict_insert_ss(namespace, "a",
+	    "<a href=\"x?y=1&z='2'\">Tom & Jerry's</a>") != NULL);
+	assert(mdict_insert_ss(namespace, "b", "a b/c~d\xe2\x80\xa8\n") != NULL);
+	assert(mdict_insert_ss(namespace, "c",
+	    "a fairly long string without anything to escape") != NULL);
+	assert((obj = mdict_insert_sa(namespace, "l")) != NULL);
+	assert(marray_append_s(obj, "<b>") != NULL);
+	assert(marray_append_s(obj, "&") != NULL);
+	t = mtemplate_parse("{{a:h}}|{{b:u}}|{{b:j}}|{{a:j}}|{{c:hju}}|"
+	    "{{a:hj}}|{{join(l, \", \"):h}}|{{upper(l[0]):h}}|"
+	    "{{replace(c, \"a\", \"<\"):u}}|{{pad(l[1], 3, \"'\"):h}}",
+	    NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "&lt;a href=&quot;x?y=1&amp;z=&#39;2&#39;&quot;&gt;"
+	    "Tom &amp; Jerry&#39;s&lt;/a&gt;|"
+	    "a%20b%2Fc~d%E2%80%A8%0A|"
+	    "a b/c~d\\u2028\\n|"
+	    "\\u003Ca href=\\\"x?y=1\\u0026z=\\'2\\'\\\"\\u003E"
+	    "Tom \\u0026 Jerry\\'s\\u003C/a\\u003E|"
+	    "a%20fairly%20long%20string%20without%20anything%20to%20escape|"
+	    "\\u0026lt;a href=\\u0026quot;x?y=1\\u0026amp;z=\\u0026#39;2"
+	    "\\u0026#39;\\u0026quot;\\u0026gt;Tom \\u0026amp; Jerry\\u0026#39;s"
+	    "\\u0026lt;/a\\u0026gt;|"
+	    "&lt;b&gt;, &amp;|&lt;B&gt;|"
+	    "%3C%20f%3Cirly%20long%20string%20without%20%3Cnything%20to%20"
+	    "esc%3Cpe|&#39;&#39;&amp;") == 0);
+	free(o);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{a:x}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{a:hjuhj}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{:h}}", NULL, 0) == NULL);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 45: Conditional expressions */
+	assert((namespace = mdict_new()) != NULL);
+	assert(mdict_insert_si(namespace, "n", 5) != NULL);
+	assert(mdict_insert_ss(namespace, "s", "foo") != NULL);
+	assert(mdict_insert_ss(namespace, "e", "") != NULL);
+	assert((obj = mdict_insert_sa(namespace, "l")) != NULL);
+	assert(marray_append_s(obj, "bar") != NULL);
+	assert((obj = mdict_insert_sa(namespace, "u")) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "djm") != NULL);
+	assert(mdict_insert_si(o2, "age", 40) != NULL);
+	assert(mdict_insert_si(o2, "admin", 1) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "bob") != NULL);
+	assert(mdict_insert_si(o2, "age", 35) != NULL);
+	assert(mdict_insert_si(o2, "admin", 0) != NULL);
+	assert((o2 = marray_append_d(obj)) != NULL);
+	assert(mdict_insert_ss(o2, "name", "eve") != NULL);
+	assert(mdict_insert_si(o2, "age", 25) != NULL);
+	assert(mdict_insert_si(o2, "admin", 0) != NULL);
+	t = mtemplate_parse("{{if n > 3 && s == \"foo\"}}A{{else}}a{{endif}}|"
+	    "{{if !(n < 3 || s != \"foo\")}}B{{endif}}|{{if !e}}C{{endif}}|"
+	    "{{if \"bar\" in l && n>=5 && n<=5}}D{{endif}}|"
+	    "{{if count(u, \"admin\") == 1}}E{{endif}}|"
+	    "{{for x in u if x.value.age > 30 && !x.value.admin}}"
+	    "{{x.value.name}}{{endfor}}|"
+	    "{{if s < \"fop\"}}F{{endif}}|{{if n == \"5\"}}G{{else}}g{{endif}}|"
+	    "{{if u[0].age != u[1].age}}H{{endif}}|{{if -1 < n}}I{{endif}}|"
+	    "{{if n < 0 && missing.x > 1}}{{else}}J{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "A|B|C|D|E|bob|F|g|H|I|J") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{if s > n}}{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	mtemplate_free(t);
+	t = mtemplate_parse("{{if n in s || u[9].x}}{{endif}}", NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == -1);
+	assert((obj = mtemplate_references(t)) != NULL);
+	assert(marray_len(obj) == 3);
+	mobject_free(obj);
+	mtemplate_free(t);
+	assert(mtemplate_parse("{{if n >}}{{endif}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{if (n > 1}}{{endif}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{if n > 1)}}{{endif}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{if n = 1}}{{endif}}", NULL, 0) == NULL);
+	assert(mtemplate_parse("{{if n && upper(s)}}{{endif}}", NULL, 0) == NULL);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 46: Scanning of text, directives and line numbers */
+	assert((namespace = mdict_new()) != NULL);
+	assert(mdict_insert_si(namespace, "iffy", 1) != NULL);
+	assert(mdict_insert_ss(namespace, "formats", "f") != NULL);
+	assert(mdict_insert_ss(namespace, "else_x", "e") != NULL);
+	t = mtemplate_parse("{x}{{iffy}}{ {{formats}}}{{else_x}}{{{{}}}\n{",
+	    NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "{x}1{ f}e{{}\n{") == 0);
+	free(o);
+	mtemplate_free(t);
+	mobject_free(namespace);
+	/* Enough lines to need several passes of any vectorised count */
+	assert((big = malloc(10000 * 6 + 32)) != NULL);
+	for (line = 0; line < 10000; line++)
+		memcpy(big + line * 6, "a{b}\n\n", 6);
+	memcpy(big + line * 6, "{{x}}\n{{(}}", 12);
+	assert(mtemplate_parse(big, ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Invalid directive at line 20002") == 0);
+	free(big);
+	assert(mtemplate_parse("x\n\n{{a\n}}", ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Newline in directive at line 3") == 0);
+	assert(mtemplate_parse("{{a}\n}}", ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Newline in directive at line 1") == 0);
+	assert(mtemplate_parse("x\n{{a}", ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Unterminated directive at line 2") == 0);
+	printf(".");
+
+	/* Case 47: Parsing of counted text and files */
+	assert((namespace = mdict_new()) != NULL);
+	assert(mdict_insert_si(namespace, "x", 1) != NULL);
+	assert((obj = mdict_insert_sa(namespace, "l")) != NULL);
+	assert(marray_append_s(obj, "a") != NULL);
+	assert(marray_append_s(obj, "b") != NULL);
+	t = mtemplate_parse2("ab{{x}}c{{x}}", 8, NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "ab1c") == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse2("a\0b{{x}}", 8, NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(memcmp(o, "a\0b1", 5) == 0);
+	free(o);
+	mtemplate_free(t);
+	t = mtemplate_parse2("", 0, NULL, 0);
+	assert(t != NULL);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(o == NULL);
+	mtemplate_free(t);
+	assert(mtemplate_parse2("{{x", 3, ebuf, sizeof(ebuf)) == NULL);
+	assert(strcmp(ebuf, "Unterminated directive at line 1") == 0);
+	assert((pfd[0] = mkstemp(path)) != -1);
+	assert(write(pfd[0], "{{for v in l}}{{v.value}}\n{{endfor}}", 36) == 36);
+	close(pfd[0]);
+	t = mtemplate_parse_file(path, NULL, 0);
+	assert(t != NULL);
+	assert(unlink(path) == 0);
+	assert(mtemplate_run_mbuf(t, namespace, &o, NULL, 0) == 0);
+	assert(strcmp(o, "a\nb\n") == 0);
+	free(o);
+	mtemplate_free(t);
+	assert(mtemplate_parse_file(path, ebuf, sizeof(ebuf)) == NULL);
+	assert(strncmp(ebuf, "open(", 5) == 0);
+	mobject_free(namespace);
+	printf(".");
+
+	/* Case 48: Output made before an error is still passed on */
+	{
+		char cbuf[64] = "";
+		FILE *f;
+
+		assert((namespace = mdict_new()) != NULL);
+		assert(mdict_insert_ss(namespace, "a", "x") != NULL);
+		t = mtemplate_parse("{{a}}-{{nosuch}}", NULL, 0);
+		assert(t != NULL);
+		assert(mtemplate_run_cb(t, namespace, NULL, 0, append_cb,
+		    cbuf) == -1);
+		assert(strcmp(cbuf, "x-") == 0);
+		assert((f = tmpfile()) != NULL);
+		assert(mtemplate_run_stdio(t, namespace, f, NULL, 0) == -1);
+		assert(ftell(f) == 2);
+		fclose(f);
+		mtemplate_free(t);
+		mobject_free(namespace);
+	}
+	printf(".");
+
 	/* test complex and deep template */
 	/* test error messages */
 	/* test line numbers in error */